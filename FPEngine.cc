@@ -129,6 +129,7 @@
 #include "FingerPrintResults.h"
 #include "NmapOps.h"
 #include "nmap_error.h"
+#include "output.h"
 #include "osscan.h"
 #include "linear.h"
 #include "FPModel.h"
@@ -884,13 +885,14 @@ static int vectorize_icmpv6_code(const PacketElement *pe) {
   return icmpv6->getCode();
 }
 
-static struct feature_node *vectorize(const FingerPrintResultsIPv6 *FPR) {
+/* Fill features, an array of get_nr_feature(&FPModel) values, with the
+   unscaled feature vector of FPR. Missing features are -1. */
+static void vectorize(const FingerPrintResultsIPv6 *FPR, double *features) {
   const char * const IPV6_PROBE_NAMES[] = {"S1", "S2", "S3", "S4", "S5", "S6", "IE1", "IE2", "NS", "U1", "TECN", "T2", "T3", "T4", "T5", "T6", "T7"};
   const char * const TCP_PROBE_NAMES[] = {"S1", "S2", "S3", "S4", "S5", "S6", "TECN", "T2", "T3", "T4", "T5", "T6", "T7"};
   const char * const ICMPV6_PROBE_NAMES[] = {"IE1", "IE2", "NS"};
 
   unsigned int nr_feature, i, idx;
-  struct feature_node *features;
   std::map<std::string, FPPacket> resps;
 
   for (i = 0; i < NUM_FP_PROBES_IPv6; i++) {
@@ -905,24 +907,20 @@ static struct feature_node *vectorize(const FingerPrintResultsIPv6 *FPR) {
   }
 
   nr_feature = get_nr_feature(&FPModel);
-  features = new feature_node[nr_feature + 1];
-  for (i = 0; i < nr_feature; i++) {
-    features[i].index = i + 1;
-    features[i].value = -1;
-  }
-  features[i].index = -1;
+  for (i = 0; i < nr_feature; i++)
+    features[i] = -1;
 
   idx = 0;
   for (i = 0; i < NELEMS(IPV6_PROBE_NAMES); i++) {
     const char *probe_name;
 
     probe_name = IPV6_PROBE_NAMES[i];
-    features[idx++].value = vectorize_plen(resps[probe_name].getPacket());
-    features[idx++].value = vectorize_tc(resps[probe_name].getPacket());
-    features[idx++].value = vectorize_hlim(resps[probe_name].getPacket(), FPR->distance, FPR->distance_calculation_method);
+    features[idx++] = vectorize_plen(resps[probe_name].getPacket());
+    features[idx++] = vectorize_tc(resps[probe_name].getPacket());
+    features[idx++] = vectorize_hlim(resps[probe_name].getPacket(), FPR->distance, FPR->distance_calculation_method);
   }
   /* TCP features */
-  features[idx++].value = vectorize_isr(resps);
+  features[idx++] = vectorize_isr(resps);
   for (i = 0; i < NELEMS(TCP_PROBE_NAMES); i++) {
     const char *probe_name;
     const TCPHeader *tcp;
@@ -945,17 +943,17 @@ static struct feature_node *vectorize(const FingerPrintResultsIPv6 *FPR) {
       idx += 49;
       continue;
     }
-    features[idx++].value = tcp->getWindow();
+    features[idx++] = tcp->getWindow();
     flags = tcp->getFlags16();
     for (mask = 0x001; mask <= 0x800; mask <<= 1)
-      features[idx++].value = (flags & mask) != 0;
+      features[idx++] = (flags & mask) != 0;
 
     for (j = 0; j < 16; j++) {
       nping_tcp_opt_t opt;
       opt = tcp->getOption(j);
       if (opt.value == NULL)
         break;
-      features[idx++].value = opt.type;
+      features[idx++] = opt.type;
       /* opt.len includes the two (type, len) bytes. */
       if (opt.type == TCPOPT_MSS && opt.len == 4 && mss == -1)
         mss = ntohs(*(u16 *) opt.value);
@@ -972,50 +970,51 @@ static struct feature_node *vectorize(const FingerPrintResultsIPv6 *FPR) {
       opt = tcp->getOption(j);
       if (opt.value == NULL)
         break;
-      features[idx++].value = opt.len;
+      features[idx++] = opt.len;
     }
     for (; j < 16; j++)
       idx++;
 
-    features[idx++].value = mss;
-    features[idx++].value = sackok;
-    features[idx++].value = wscale;
+    features[idx++] = mss;
+    features[idx++] = sackok;
+    features[idx++] = wscale;
     if (mss != 0 && mss != -1)
-      features[idx++].value = (float)tcp->getWindow() / mss;
+      features[idx++] = (float)tcp->getWindow() / mss;
     else
-      features[idx++].value = -1;
+      features[idx++] = -1;
   }
   /* ICMPv6 features */
   for (i = 0; i < NELEMS(ICMPV6_PROBE_NAMES); i++) {
     const char *probe_name;
 
     probe_name = ICMPV6_PROBE_NAMES[i];
-    features[idx++].value = vectorize_icmpv6_type(resps[probe_name].getPacket());
-    features[idx++].value = vectorize_icmpv6_code(resps[probe_name].getPacket());
+    features[idx++] = vectorize_icmpv6_type(resps[probe_name].getPacket());
+    features[idx++] = vectorize_icmpv6_code(resps[probe_name].getPacket());
   }
 
   assert(idx == nr_feature);
 
   if (o.debugging > 2) {
+    /* Keep the vector on one line while the pipeline thread logs too. */
+    log_lock();
     log_write(LOG_PLAIN, "v = {");
     for (i = 0; i < nr_feature; i++)
-      log_write(LOG_PLAIN, "%.16g, ", features[i].value);
+      log_write(LOG_PLAIN, "%.16g, ", features[i]);
     log_write(LOG_PLAIN, "};\n");
+    log_unlock();
   }
-
-  return features;
 }
 
-static void apply_scale(struct feature_node *features, unsigned int num_features,
+static void apply_scale(double *features, unsigned int num_features,
   const double (*scale)[2]) {
   unsigned int i;
 
   for (i = 0; i < num_features; i++) {
-    double val = features[i].value;
+    double val = features[i];
     if (val < 0)
       continue;
     val = (val + scale[i][0]) * scale[i][1];
-    features[i].value = val;
+    features[i] = val;
   }
 }
 
@@ -1040,8 +1039,22 @@ int label_prob_cmp(const void *a, const void *b) {
     return 0;
 }
 
-/* Return a measure of how much the given feature vector differs from the other
-   members of the class given by label.
+/* Hosts and features per block in fp6_evaluate_model. A block of the weight
+   matrix (FP6_FEATURE_BLOCK rows of nr_class doubles) and the decision values
+   of a block of hosts both stay in cache while the block is multiplied. */
+#define FP6_HOST_BLOCK 16
+#define FP6_FEATURE_BLOCK 32
+
+/* Evaluate the IPv6 OS model on n scaled feature vectors X, stored as n rows of
+   get_nr_feature(&FPModel) values. dec_values and novelty receive n rows of
+   get_nr_class(&FPModel) values each.
+
+   dec_values is X times the model's weight matrix. Each sum is accumulated in
+   feature order, so the results are bit-for-bit those of liblinear's
+   predict_values on the same vectors.
+
+   novelty is a measure of how much each feature vector differs from the
+   members of each class.
 
    This can be thought of as the distance from the given feature vector to the
    mean of the class in multidimensional space, after scaling. Each dimension is
@@ -1062,52 +1075,106 @@ int label_prob_cmp(const void *a, const void *b) {
    tend to make small differences count a lot (because we probably want this
    fingerprint in order to expand the class), while still allowing near-perfect
    matches to match. */
-static double novelty_of(const struct feature_node *features, int label) {
-  const double *means, *variances;
-  int i, nr_feature;
-  double sum;
+void fp6_evaluate_model(const double *X, unsigned int n, double *dec_values,
+  double *novelty) {
+  unsigned int nr_feature, nr_class;
+  unsigned int h0, h1, k0, k1, h, k, c;
+  const double *w;
 
   nr_feature = get_nr_feature(&FPModel);
-  assert(0 <= label);
-  assert(label < nr_feature);
-
-  means = FPmean[label];
-  variances = FPvariance[label];
+  nr_class = get_nr_class(&FPModel);
+  w = FPModel.w;
+  /* One weight per class and no bias term, as predict_values assumes for
+     this model. */
+  assert(nr_class > 2);
+  assert(FPModel.bias < 0);
+
+  for (h0 = 0; h0 < n; h0 += FP6_HOST_BLOCK) {
+    h1 = MIN(n, h0 + FP6_HOST_BLOCK);
+
+    for (h = h0; h < h1; h++) {
+      for (c = 0; c < nr_class; c++)
+        dec_values[h * nr_class + c] = 0.0;
+    }
+    for (k0 = 0; k0 < nr_feature; k0 += FP6_FEATURE_BLOCK) {
+      k1 = MIN(nr_feature, k0 + FP6_FEATURE_BLOCK);
+      for (h = h0; h < h1; h++) {
+        const double *x = X + h * nr_feature;
+        double *d = dec_values + h * nr_class;
+
+        for (k = k0; k < k1; k++) {
+          const double *wk = w + k * nr_class;
+          double xk = x[k];
+
+          for (c = 0; c < nr_class; c++)
+            d[c] += wk[c] * xk;
+        }
+      }
+    }
 
-  sum = 0.0;
-  for (i = 0; i < nr_feature; i++) {
-    double d, v;
-
-    assert(i + 1 == features[i].index);
-    d = features[i].value - means[i];
-    v = variances[i];
-    if (v == 0.0) {
-      /* No variance? It means that samples were identical. Substitute a default
-         variance. This will tend to make novelty large in these cases, which
-         will hopefully encourage for submissions for this class. */
-      v = 0.01;
+    for (c = 0; c < nr_class; c++) {
+      const double *means, *variances;
+
+      means = FPmean[c];
+      variances = FPvariance[c];
+      for (h = h0; h < h1; h++) {
+        const double *x = X + h * nr_feature;
+        double sum;
+
+        sum = 0.0;
+        for (k = 0; k < nr_feature; k++) {
+          double d, v;
+
+          d = x[k] - means[k];
+          v = variances[k];
+          if (v == 0.0) {
+            /* No variance? It means that samples were identical. Substitute a
+               default variance. This will tend to make novelty large in these
+               cases, which will hopefully encourage for submissions for this
+               class. */
+            v = 0.01;
+          }
+          sum += d * d / v;
+        }
+        novelty[h * nr_class + c] = sqrt(sum);
+      }
     }
-    sum += d * d / v;
   }
-
-  return sqrt(sum);
 }
 
-static void classify(FingerPrintResultsIPv6 *FPR) {
-  int nr_class, i;
-  struct feature_node *features;
-  double *values;
-  struct label_prob *labels;
+/* Hosts of an os_scan being classified. features, dec_values, and novelty hold
+   one row per target, laid out as fp6_evaluate_model expects. */
+struct FP6Batch {
+  unsigned int n;
+  double *features;
+  double *dec_values;
+  double *novelty;
+};
 
+/* osscan_parallel_for callback: evaluates the b'th block of FP6_HOST_BLOCK
+   rows of an FP6Batch. Blocks write disjoint rows and only read the features
+   and the model, so they can be evaluated concurrently. */
+static void evaluate_block(void *arg, unsigned int b) {
+  struct FP6Batch *batch = (struct FP6Batch *) arg;
+  unsigned int nr_feature, nr_class, h0, h1;
+
+  nr_feature = get_nr_feature(&FPModel);
   nr_class = get_nr_class(&FPModel);
+  h0 = b * FP6_HOST_BLOCK;
+  h1 = MIN(batch->n, h0 + FP6_HOST_BLOCK);
 
-  features = vectorize(FPR);
-  values = new double[nr_class];
-  labels = new struct label_prob[nr_class];
+  fp6_evaluate_model(batch->features + h0 * nr_feature, h1 - h0,
+    batch->dec_values + h0 * nr_class, batch->novelty + h0 * nr_class);
+}
+
+/* Fill in FPR's matches from its decision values and novelty, as computed by
+   fp6_evaluate_model. labels is scratch space for nr_class entries. */
+static void classify(FingerPrintResultsIPv6 *FPR, const double *values,
+  const double *novelty, struct label_prob *labels) {
+  int nr_class, i;
 
-  apply_scale(features, get_nr_feature(&FPModel), FPscale);
+  nr_class = get_nr_class(&FPModel);
 
-  predict_values(&FPModel, features, values);
   for (i = 0; i < nr_class; i++) {
     labels[i].label = i;
     labels[i].prob = 1.0 / (1.0 + exp(-values[i]));
@@ -1121,24 +1188,21 @@ static void classify(FingerPrintResultsIPv6 *FPR) {
       FPR->num_perfect_matches = i + 1;
     if (o.debugging > 2) {
       printf("%7.4f %7.4f %3u %s\n", FPR->accuracy[i] * 100,
-        novelty_of(features, labels[i].label), labels[i].label, FPR->matches[i]->OS_name);
+        novelty[labels[i].label], labels[i].label, FPR->matches[i]->OS_name);
     }
   }
   if (FPR->num_perfect_matches == 0) {
     FPR->overall_results = OSSCAN_NOMATCHES;
   } else if (FPR->num_perfect_matches == 1) {
-    double novelty;
-
-    novelty = novelty_of(features, labels[0].label);
     if (o.debugging > 1)
-      log_write(LOG_PLAIN, "Novelty of closest match is %.3f.\n", novelty);
+      log_write(LOG_PLAIN, "Novelty of closest match is %.3f.\n", novelty[labels[0].label]);
 
-    if (novelty < FP_NOVELTY_THRESHOLD) {
+    if (novelty[labels[0].label] < FP_NOVELTY_THRESHOLD) {
       FPR->overall_results = OSSCAN_SUCCESS;
     } else {
       if (o.debugging > 0) {
         log_write(LOG_PLAIN, "Novelty of closest match is %.3f > %.3f; ignoring.\n",
-          novelty, FP_NOVELTY_THRESHOLD);
+          novelty[labels[0].label], FP_NOVELTY_THRESHOLD);
       }
       FPR->overall_results = OSSCAN_NOMATCHES;
       FPR->num_perfect_matches = 0;
@@ -1147,9 +1211,42 @@ static void classify(FingerPrintResultsIPv6 *FPR) {
     FPR->overall_results = OSSCAN_NOMATCHES;
     FPR->num_perfect_matches = 0;
   }
+}
+
+/* Classify the first n Targets, whose FPRs have been filled in. All the feature
+   vectors are packed into one matrix on this thread, since vectorizing parses
+   the responses; only the model evaluation is split into blocks across the
+   matching threads. The results are then ranked one target at a time. */
+static void classify_targets(std::vector<Target *> &Targets, unsigned int n) {
+  struct FP6Batch batch;
+  struct label_prob *labels;
+  unsigned int nr_feature, nr_class, i;
+  double *x;
+
+  nr_feature = get_nr_feature(&FPModel);
+  nr_class = get_nr_class(&FPModel);
+
+  batch.n = n;
+  batch.features = new double[n * nr_feature];
+  batch.dec_values = new double[n * nr_class];
+  batch.novelty = new double[n * nr_class];
+  labels = new struct label_prob[nr_class];
+
+  for (i = 0; i < n; i++) {
+    x = batch.features + i * nr_feature;
+    vectorize((FingerPrintResultsIPv6 *) Targets[i]->FPR, x);
+    apply_scale(x, nr_feature, FPscale);
+  }
+  osscan_parallel_for(evaluate_block, &batch,
+    (n + FP6_HOST_BLOCK - 1) / FP6_HOST_BLOCK);
+  for (i = 0; i < n; i++) {
+    classify((FingerPrintResultsIPv6 *) Targets[i]->FPR,
+      batch.dec_values + i * nr_class, batch.novelty + i * nr_class, labels);
+  }
 
-  delete[] features;
-  delete[] values;
+  delete[] batch.features;
+  delete[] batch.dec_values;
+  delete[] batch.novelty;
   delete[] labels;
 }
 
@@ -1258,8 +1355,9 @@ int FPEngine6::os_scan(std::vector<Target *> &Targets) {
     fphosts[i]->finish();
 
     fphosts[i]->fill_FPR((FingerPrintResultsIPv6 *) Targets[i]->FPR);
-    classify((FingerPrintResultsIPv6 *) Targets[i]->FPR);
   }
+  if (!this->fphosts.empty())
+    classify_targets(Targets, this->fphosts.size());
 
   /* Cleanup and return */
   while (this->fphosts.size() > 0) {
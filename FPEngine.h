@@ -470,6 +470,10 @@ void response_reception_handler_wrapper(nsock_pool nsp, nsock_event nse, void *a
 
 std::vector<FingerMatch> load_fp_matches();
 
+/* Evaluate the IPv6 OS model on n scaled feature vectors at once. */
+void fp6_evaluate_model(const double *X, unsigned int n, double *dec_values,
+  double *novelty);
+
 
 #endif /* __FPENGINE_H__ */
 
@@ -155,6 +155,14 @@ NmapOps::~NmapOps() {
     free(dns_servers);
     dns_servers = NULL;
   }
+  if (dns_cache) {
+    free(dns_cache);
+    dns_cache = NULL;
+  }
+  if (version_cache) {
+    free(version_cache);
+    version_cache = NULL;
+  }
   if (extra_payload) {
     free(extra_payload);
     extra_payload = NULL;
@@ -326,12 +334,17 @@ void NmapOps::Initialize() {
   resume_ip.s_addr = 0;
   osscan_limit = 0;
   osscan_guess = 0;
+  osscan_threads = 0;
   numdecoys = 0;
   decoyturn = -1;
   osscan = 0;
   servicescan = 0;
   override_excludeports = 0;
   version_intensity = 7;
+  version_threads = 0;
+  version_cache = NULL;
+  version_shards = 1;
+  pipeline_groups = 0;
   pingtype = PINGTYPE_UNKNOWN;
   listscan = allowall = ackscan = bouncescan = connectscan = 0;
   nullscan = xmasscan = fragscan = synscan = windowscan = 0;
@@ -358,6 +371,8 @@ void NmapOps::Initialize() {
   deprecated_xml_osclass = false;
   resolve_all = 0;
   dns_servers = NULL;
+  dns_cache = NULL;
+  system_dns_threads = 0;
   implicitARPPing = true;
   numhosts_scanned = 0;
   numhosts_up = 0;
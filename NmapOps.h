@@ -312,10 +312,15 @@ class NmapOps {
   // Version Detection Options
   int override_excludeports;
   int version_intensity;
+  int version_threads; /* Threads matching service responses; 0 for none */
+  char *version_cache; /* File of parsed nmap-service-probes kept between runs */
+  int version_shards; /* Nsock pools (each on its own thread) for version detection */
+  int pipeline_groups; /* Host groups finishing while the next is port scanned; 0 for none */
 
   struct in_addr decoys[MAX_DECOYS];
   int osscan_limit; /* Skip OS Scan if no open or no closed TCP ports */
   int osscan_guess;   /* Be more aggressive in guessing OS type */
+  int osscan_threads; /* Threads matching OS fingerprints; 0 for none */
   int numdecoys;
   int decoyturn;
   int osscan;
@@ -358,6 +363,8 @@ class NmapOps {
   bool mass_dns;
   int resolve_all;
   char *dns_servers;
+  char *dns_cache; /* File of reverse DNS answers kept between runs */
+  int system_dns_threads; /* Parallel --system-dns lookups; 0 for one at a time */
 
   /* Do IPv4 ARP or IPv6 ND scan of directly connected Ethernet hosts, even if
      non-ARP host discovery options are used? This is normally more efficient,
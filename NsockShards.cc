@@ -0,0 +1,270 @@
+/***************************************************************************
+ * NsockShards.cc -- Runs several nsock pools, each on its own thread,     *
+ * with a thread-safe queue of work for each.                              *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2016 Insecure.Com LLC. Nmap is    *
+ * also a registered trademark of Insecure.Com LLC.  This program is free  *
+ * software; you may redistribute and/or modify it under the terms of the  *
+ * GNU General Public License as published by the Free Software            *
+ * Foundation; Version 2 ("GPL"), BUT ONLY WITH ALL OF THE CLARIFICATIONS  *
+ * AND EXCEPTIONS DESCRIBED HEREIN.  This guarantees your right to use,    *
+ * modify, and redistribute this software under certain conditions.  If    *
+ * you wish to embed Nmap technology into proprietary software, we sell    *
+ * alternative licenses (contact sales@nmap.com).  Dozens of software      *
+ * vendors already license Nmap technology such as host discovery, port    *
+ * scanning, OS detection, version detection, and the Nmap Scripting       *
+ * Engine.                                                                 *
+ *                                                                         *
+ * Note that the GPL places important restrictions on "derivative works",  *
+ * yet it does not provide a detailed definition of that term.  To avoid   *
+ * misunderstandings, we interpret that term as broadly as copyright law   *
+ * allows.  For example, we consider an application to constitute a        *
+ * derivative work for the purpose of this license if it does any of the   *
+ * following with any software or content covered by this license          *
+ * ("Covered Software"):                                                   *
+ *                                                                         *
+ * o Integrates source code from Covered Software.                         *
+ *                                                                         *
+ * o Reads or includes copyrighted data files, such as Nmap's nmap-os-db   *
+ * or nmap-service-probes.                                                 *
+ *                                                                         *
+ * o Is designed specifically to execute Covered Software and parse the    *
+ * results (as opposed to typical shell or execution-menu apps, which will *
+ * execute anything you tell them to).                                     *
+ *                                                                         *
+ * o Includes Covered Software in a proprietary executable installer.  The *
+ * installers produced by InstallShield are an example of this.  Including *
+ * Nmap with other software in compressed or archival form does not        *
+ * trigger this provision, provided appropriate open source decompression  *
+ * or de-archiving software is widely available for no charge.  For the    *
+ * purposes of this license, an installer is considered to include Covered *
+ * Software even if it actually retrieves a copy of Covered Software from  *
+ * another source during runtime (such as by downloading it from the       *
+ * Internet).                                                              *
+ *                                                                         *
+ * o Links (statically or dynamically) to a library which does any of the  *
+ * above.                                                                  *
+ *                                                                         *
+ * o Executes a helper program, module, or script to do any of the above.  *
+ *                                                                         *
+ * This list is not exclusive, but is meant to clarify our interpretation  *
+ * of derived works with some common examples.  Other people may interpret *
+ * the plain GPL differently, so we consider this a special exception to   *
+ * the GPL that we apply to Covered Software.  Works which meet any of     *
+ * these conditions must conform to all of the terms of this license,      *
+ * particularly including the GPL Section 3 requirements of providing      *
+ * source code and allowing free redistribution of the work as a whole.    *
+ *                                                                         *
+ * As another special exception to the GPL terms, Insecure.Com LLC grants  *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two.                                  *
+ *                                                                         *
+ * Any redistribution of Covered Software, including any derived works,    *
+ * must obey and carry forward all of the terms of this license, including *
+ * obeying all GPL rules and restrictions.  For example, source code of    *
+ * the whole work must be provided and free redistribution must be         *
+ * allowed.  All GPL references to "this License", are to be treated as    *
+ * including the terms and conditions of this license text as well.        *
+ *                                                                         *
+ * Because this license imposes special exceptions to the GPL, Covered     *
+ * Work may not be combined (even as part of a larger work) with plain GPL *
+ * software.  The terms, conditions, and exceptions of this license must   *
+ * be included as well.  This license is incompatible with some other open *
+ * source licenses as well.  In some cases we can relicense portions of    *
+ * Nmap or grant special permissions to use it in other open source        *
+ * software.  Please contact fyodor@nmap.org with any such requests.       *
+ * Similarly, we don't incorporate incompatible open source software into  *
+ * Covered Software without special permission from the copyright holders. *
+ *                                                                         *
+ * If you have any questions about the licensing restrictions on using     *
+ * Nmap in other works, are happy to help.  As mentioned above, we also    *
+ * offer alternative license to integrate Nmap into proprietary            *
+ * applications and appliances.  These contracts have been sold to dozens  *
+ * of software vendors, and generally include a perpetual license as well  *
+ * as providing for priority support and updates.  They also fund the      *
+ * continued development of Nmap.  Please email sales@nmap.com for further *
+ * information.                                                            *
+ *                                                                         *
+ * If you have received a written license agreement or contract for        *
+ * Covered Software stating terms other than these, you may choose to use  *
+ * and redistribute Covered Software under those terms instead of these.   *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the Nmap      *
+ * license file for more details (it's in a COPYING file included with     *
+ * Nmap, and also available from https://svn.nmap.org/nmap/COPYING)        *
+ *                                                                         *
+ ***************************************************************************/
+
+/* $Id$ */
+
+#include "NsockShards.h"
+
+#ifdef HAVE_PTHREAD
+
+#include "nmap_error.h"
+
+#include <errno.h>
+
+NsockShards::NsockShards() {
+  running = 0;
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&cond, NULL);
+}
+
+NsockShards::~NsockShards() {
+  unsigned int i;
+
+  for (i = 0; i < shards.size(); i++) {
+    nsock_iod_delete(shards[i]->wake_iod, NSOCK_PENDING_SILENT);
+    close(shards[i]->wake_fds[0]);
+    close(shards[i]->wake_fds[1]);
+    delete shards[i];
+  }
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&lock);
+}
+
+int NsockShards::add(nsock_pool nsp) {
+  Shard *shard = new Shard;
+
+  shard->owner = this;
+  shard->nsp = nsp;
+  shard->stopped = false;
+  if (pipe(shard->wake_fds) == -1)
+    pfatal("%s: pipe() failed", __func__);
+  // A full pipe already guarantees a wakeup, so post() never blocks on it.
+  unblock_socket(shard->wake_fds[1]);
+  shard->wake_iod = nsock_iod_new2(nsp, shard->wake_fds[0], shard);
+  if (shard->wake_iod == NULL)
+    fatal("Failed to allocate nsock iod in %s", __func__);
+  // Always keep a read pending, so that the loop notices new jobs whatever
+  // else it is waiting for. This also means the loop never runs out of
+  // events: shards end with stop().
+  nsock_read(nsp, shard->wake_iod, wake_handler, -1, shard);
+
+  shards.push_back(shard);
+  return shards.size() - 1;
+}
+
+void NsockShards::post(int shard, Job job, void *arg) {
+  Shard *s = shards[shard];
+  char c = 0;
+
+  pthread_mutex_lock(&lock);
+  s->jobs.push_back(std::make_pair(job, arg));
+  pthread_mutex_unlock(&lock);
+  if (write(s->wake_fds[1], &c, 1) == -1 && errno != EAGAIN)
+    pfatal("%s: write() failed", __func__);
+}
+
+void NsockShards::stop(int shard) {
+  Shard *s = shards[shard];
+
+  s->stopped = true;
+  nsock_loop_quit(s->nsp);
+}
+
+void NsockShards::run(void (*tick)(void *arg), void *arg, int tick_msecs) {
+  struct timeval now;
+  struct timespec deadline;
+  unsigned int i;
+
+  pthread_mutex_lock(&lock);
+  running = shards.size();
+  pthread_mutex_unlock(&lock);
+
+  for (i = 0; i < shards.size(); i++) {
+    if (pthread_create(&shards[i]->thread, NULL, loop, shards[i]) != 0)
+      fatal("%s: failed to create nsock shard thread", __func__);
+  }
+
+  pthread_mutex_lock(&lock);
+  while (running > 0) {
+    gettimeofday(&now, NULL);
+    TIMEVAL_MSEC_ADD(now, now, tick_msecs);
+    deadline.tv_sec = now.tv_sec;
+    deadline.tv_nsec = now.tv_usec * 1000;
+    pthread_cond_timedwait(&cond, &lock, &deadline);
+    if (running > 0 && tick != NULL) {
+      pthread_mutex_unlock(&lock);
+      tick(arg);
+      pthread_mutex_lock(&lock);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+
+  for (i = 0; i < shards.size(); i++)
+    pthread_join(shards[i]->thread, NULL);
+}
+
+void *NsockShards::loop(void *arg) {
+  Shard *shard = (Shard *) arg;
+  NsockShards *owner = shard->owner;
+  enum nsock_loopstatus looprc;
+
+  while (!shard->stopped) {
+    looprc = nsock_loop(shard->nsp, -1);
+    if (looprc == NSOCK_LOOP_ERROR) {
+      int err = nsock_pool_get_error(shard->nsp);
+      fatal("Unexpected nsock_loop error.  Error code %d (%s)", err, socket_strerror(err));
+    }
+    // Can't happen while the wakeup read is pending, but don't spin if it does.
+    if (looprc == NSOCK_LOOP_NOEVENTS)
+      break;
+  }
+
+  pthread_mutex_lock(&owner->lock);
+  owner->running--;
+  pthread_cond_signal(&owner->cond);
+  pthread_mutex_unlock(&owner->lock);
+
+  return NULL;
+}
+
+void NsockShards::wake_handler(nsock_pool nsp, nsock_event nse, void *mydata) {
+  Shard *shard = (Shard *) mydata;
+  NsockShards *owner = shard->owner;
+  std::list<std::pair<Job, void *> > jobs;
+  std::list<std::pair<Job, void *> >::iterator it;
+
+  if (nse_status(nse) == NSE_STATUS_KILL || nse_status(nse) == NSE_STATUS_CANCELLED)
+    return;
+  if (nse_status(nse) != NSE_STATUS_SUCCESS)
+    fatal("Unexpected status (%s) reading from nsock shard queue", nse_status2str(nse_status(nse)));
+
+  nsock_read(nsp, shard->wake_iod, wake_handler, -1, shard);
+
+  pthread_mutex_lock(&owner->lock);
+  jobs.swap(shard->jobs);
+  pthread_mutex_unlock(&owner->lock);
+
+  for (it = jobs.begin(); it != jobs.end(); it++)
+    it->first(nsp, it->second);
+}
+
+#endif /* HAVE_PTHREAD */
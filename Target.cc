@@ -520,6 +520,17 @@ bool Target::timedOut(const struct timeval *now) {
   return (used > o.host_timeout);
 }
 
+bool Target::timeOutDeadline(struct timeval *deadline) {
+  unsigned long left;
+
+  if (!o.host_timeout || !htn.toclock_running)
+    return false;
+  left = htn.msecs_used < o.host_timeout ? o.host_timeout - htn.msecs_used : 0;
+  /* timedOut() wants strictly more than host_timeout msecs. */
+  TIMEVAL_MSEC_ADD(*deadline, htn.toclock_start, left + 1);
+  return true;
+}
+
 
 /* Returns zero if MAC address set successfully */
 int Target::setMACAddress(const u8 *addy) {
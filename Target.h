@@ -281,6 +281,10 @@ class Target {
      current time handy.  You might as well also pass NULL if the
      clock is not running, as the func won't need the time. */
   bool timedOut(const struct timeval *now);
+  /* If a host timeout is set and the timeout clock is running, stores in
+     deadline the time when timedOut() will start returning true and returns
+     true. Otherwise returns false. */
+  bool timeOutDeadline(struct timeval *deadline);
   /* Return time_t for the start and end time of this host */
   time_t StartTime() { return htn.host_start; }
   time_t EndTime() { return htn.host_end; }
@@ -135,6 +135,10 @@
 #include <sstream>
 #include <errno.h>
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 #define BITVECTOR_BITS (sizeof(bitvector_t) * CHAR_BIT)
 #define BIT_SET(v, n) ((v)[(n) / BITVECTOR_BITS] |= 1UL << ((n) % BITVECTOR_BITS))
 #define BIT_IS_SET(v, n) (((v)[(n) / BITVECTOR_BITS] & 1UL << ((n) % BITVECTOR_BITS)) != 0)
@@ -143,6 +147,17 @@ extern NmapOps o;
 
 NewTargets *NewTargets::new_targets;
 
+#ifdef HAVE_PTHREAD
+/* With --pipeline-groups, scripts add targets on one thread while the main
+   thread reads them for the next host groups. */
+static pthread_mutex_t new_targets_lock = PTHREAD_MUTEX_INITIALIZER;
+#define NEW_TARGETS_LOCK() pthread_mutex_lock(&new_targets_lock)
+#define NEW_TARGETS_UNLOCK() pthread_mutex_unlock(&new_targets_lock)
+#else
+#define NEW_TARGETS_LOCK()
+#define NEW_TARGETS_UNLOCK()
+#endif
+
 /* Return a newly allocated string containing the part of expr up to the last
    '/' (or a copy of the whole string if there is no slash). *bits will contain
    the number after the slash, or -1 if there was no slash. In case of error
@@ -769,29 +784,51 @@ unsigned long NewTargets::push (const char *target) {
 std::string NewTargets::read (void) {
   std::string str;
 
+  NEW_TARGETS_LOCK();
   /* check to see it there are targets in the queue */
   if (!new_targets->queue.empty()) {
     str = new_targets->queue.front();
     new_targets->queue.pop();
   }
+  NEW_TARGETS_UNLOCK();
 
   return str;
 }
 
 void NewTargets::clear (void) {
+  NEW_TARGETS_LOCK();
   new_targets->history.clear();
+  NEW_TARGETS_UNLOCK();
 }
 
 unsigned long NewTargets::get_number (void) {
-  return new_targets->history.size();
+  unsigned long n;
+
+  NEW_TARGETS_LOCK();
+  n = new_targets->history.size();
+  NEW_TARGETS_UNLOCK();
+
+  return n;
 }
 
 unsigned long NewTargets::get_scanned (void) {
-  return new_targets->history.size() - new_targets->queue.size();
+  unsigned long n;
+
+  NEW_TARGETS_LOCK();
+  n = new_targets->history.size() - new_targets->queue.size();
+  NEW_TARGETS_UNLOCK();
+
+  return n;
 }
 
 unsigned long NewTargets::get_queued (void) {
-  return new_targets->queue.size();
+  unsigned long n;
+
+  NEW_TARGETS_LOCK();
+  n = new_targets->queue.size();
+  NEW_TARGETS_UNLOCK();
+
+  return n;
 }
 
 /* This is the function that is used by nse_nmaplib.cc to add
@@ -799,6 +836,8 @@ unsigned long NewTargets::get_queued (void) {
  * Returns the number of targets in the queue on success, or 0 on
  * failures or when the queue is empty. */
 unsigned long NewTargets::insert (const char *target) {
+  unsigned long n;
+
   if (*target) {
     if (new_targets == NULL) {
       error("ERROR: to add targets run with -sC or --script options.");
@@ -814,5 +853,9 @@ unsigned long NewTargets::insert (const char *target) {
     }
   }
 
-  return new_targets->push(target);
+  NEW_TARGETS_LOCK();
+  n = new_targets->push(target);
+  NEW_TARGETS_UNLOCK();
+
+  return n;
 }
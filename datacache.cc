@@ -0,0 +1,392 @@
+/***************************************************************************
+ * datacache.cc -- Versioned binary caches of parsed data files, so that   *
+ * Nmap can map them at startup instead of parsing the text files again.   *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2016 Insecure.Com LLC. Nmap is    *
+ * also a registered trademark of Insecure.Com LLC.  This program is free  *
+ * software; you may redistribute and/or modify it under the terms of the  *
+ * GNU General Public License as published by the Free Software            *
+ * Foundation; Version 2 ("GPL"), BUT ONLY WITH ALL OF THE CLARIFICATIONS  *
+ * AND EXCEPTIONS DESCRIBED HEREIN.  This guarantees your right to use,    *
+ * modify, and redistribute this software under certain conditions.  If    *
+ * you wish to embed Nmap technology into proprietary software, we sell    *
+ * alternative licenses (contact sales@nmap.com).  Dozens of software      *
+ * vendors already license Nmap technology such as host discovery, port    *
+ * scanning, OS detection, version detection, and the Nmap Scripting       *
+ * Engine.                                                                 *
+ *                                                                         *
+ * Note that the GPL places important restrictions on "derivative works",  *
+ * yet it does not provide a detailed definition of that term.  To avoid   *
+ * misunderstandings, we interpret that term as broadly as copyright law   *
+ * allows.  For example, we consider an application to constitute a        *
+ * derivative work for the purpose of this license if it does any of the   *
+ * following with any software or content covered by this license          *
+ * ("Covered Software"):                                                   *
+ *                                                                         *
+ * o Integrates source code from Covered Software.                         *
+ *                                                                         *
+ * o Reads or includes copyrighted data files, such as Nmap's nmap-os-db   *
+ * or nmap-service-probes.                                                 *
+ *                                                                         *
+ * o Is designed specifically to execute Covered Software and parse the    *
+ * results (as opposed to typical shell or execution-menu apps, which will *
+ * execute anything you tell them to).                                     *
+ *                                                                         *
+ * o Includes Covered Software in a proprietary executable installer.  The *
+ * installers produced by InstallShield are an example of this.  Including *
+ * Nmap with other software in compressed or archival form does not        *
+ * trigger this provision, provided appropriate open source decompression  *
+ * or de-archiving software is widely available for no charge.  For the    *
+ * purposes of this license, an installer is considered to include Covered *
+ * Software even if it actually retrieves a copy of Covered Software from  *
+ * another source during runtime (such as by downloading it from the       *
+ * Internet).                                                              *
+ *                                                                         *
+ * o Links (statically or dynamically) to a library which does any of the  *
+ * above.                                                                  *
+ *                                                                         *
+ * o Executes a helper program, module, or script to do any of the above.  *
+ *                                                                         *
+ * This list is not exclusive, but is meant to clarify our interpretation  *
+ * of derived works with some common examples.  Other people may interpret *
+ * the plain GPL differently, so we consider this a special exception to   *
+ * the GPL that we apply to Covered Software.  Works which meet any of     *
+ * these conditions must conform to all of the terms of this license,      *
+ * particularly including the GPL Section 3 requirements of providing      *
+ * source code and allowing free redistribution of the work as a whole.    *
+ *                                                                         *
+ * As another special exception to the GPL terms, Insecure.Com LLC grants  *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two.                                  *
+ *                                                                         *
+ * Any redistribution of Covered Software, including any derived works,    *
+ * must obey and carry forward all of the terms of this license, including *
+ * obeying all GPL rules and restrictions.  For example, source code of    *
+ * the whole work must be provided and free redistribution must be         *
+ * allowed.  All GPL references to "this License", are to be treated as    *
+ * including the terms and conditions of this license text as well.        *
+ *                                                                         *
+ * Because this license imposes special exceptions to the GPL, Covered     *
+ * Work may not be combined (even as part of a larger work) with plain GPL *
+ * software.  The terms, conditions, and exceptions of this license must   *
+ * be included as well.  This license is incompatible with some other open *
+ * source licenses as well.  In some cases we can relicense portions of    *
+ * Nmap or grant special permissions to use it in other open source        *
+ * software.  Please contact fyodor@nmap.org with any such requests.       *
+ * Similarly, we don't incorporate incompatible open source software into  *
+ * Covered Software without special permission from the copyright holders. *
+ *                                                                         *
+ * If you have any questions about the licensing restrictions on using     *
+ * Nmap in other works, are happy to help.  As mentioned above, we also    *
+ * offer alternative license to integrate Nmap into proprietary            *
+ * applications and appliances.  These contracts have been sold to dozens  *
+ * of software vendors, and generally include a perpetual license as well  *
+ * as providing for priority support and updates.  They also fund the      *
+ * continued development of Nmap.  Please email sales@nmap.com for further *
+ * information.                                                            *
+ *                                                                         *
+ * If you have received a written license agreement or contract for        *
+ * Covered Software stating terms other than these, you may choose to use  *
+ * and redistribute Covered Software under those terms instead of these.   *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the Nmap      *
+ * license file for more details (it's in a COPYING file included with     *
+ * Nmap, and also available from https://svn.nmap.org/nmap/COPYING)        *
+ *                                                                         *
+ ***************************************************************************/
+
+/* $Id$ */
+
+#include "nmap.h"
+#include "datacache.h"
+#include "nmap_error.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+
+#define DATACACHE_MAGIC "NMAPDC\r\n"
+#define DATACACHE_BYTEORDER 0x01020304
+
+/* Comes first in every cache file. */
+struct datacache_header {
+  char magic[8];   /* DATACACHE_MAGIC */
+  u32 byteorder;   /* DATACACHE_BYTEORDER, in the writer's byte order */
+  u32 format;      /* DATACACHE_FORMAT */
+  char tag[96];    /* See CacheWriter::save */
+  u32 srclen;      /* Length and checksum of the source data file */
+  u32 srcsum;
+  u32 datalen;     /* Length and checksum of the data following the header */
+  u32 datasum;
+};
+
+void CacheWriter::putU32(u32 val) {
+  data.append((const char *) &val, sizeof(val));
+}
+
+void CacheWriter::putBytes(const void *buf, u32 len) {
+  data.append((const char *) buf, len);
+}
+
+void CacheWriter::putString(const char *str) {
+  if (str == NULL) {
+    putU32(0);
+  } else {
+    putU32(strlen(str) + 1);
+    putBytes(str, strlen(str) + 1);
+  }
+}
+
+/* A Fletcher-style checksum taken a 32-bit word at a time.  Caches are
+   several megabytes and are checked on every start, where CRC-32 would
+   cost more than the rest of loading.  This only has to catch stale and
+   damaged files, not deliberate tampering. */
+static u32 checksum(const u8 *buf, u32 len) {
+  u64 a = 0, b = 0;
+  u32 w, i;
+
+  for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+    memcpy(&w, buf + i, sizeof(w));
+    a += w;
+    b += a;
+  }
+  for (; i < len; i++) {
+    a += buf[i];
+    b += a;
+  }
+
+  return (u32) (a ^ (a >> 32) ^ b ^ (b >> 32));
+}
+
+#ifndef WIN32
+/* Finds the length and checksum of the contents of filename. */
+static bool file_checksum(const char *filename, u32 *len, u32 *sum) {
+  struct stat st;
+  u8 *buf;
+  FILE *fp;
+  bool ok;
+
+  fp = fopen(filename, "rb");
+  if (fp == NULL)
+    return false;
+  if (fstat(fileno(fp), &st) != 0 || st.st_size > 0x7fffffff) {
+    fclose(fp);
+    return false;
+  }
+  buf = (u8 *) safe_malloc(st.st_size + 1);
+  ok = (fread(buf, 1, st.st_size, fp) == (size_t) st.st_size);
+  if (ok) {
+    *len = st.st_size;
+    *sum = checksum(buf, st.st_size);
+  }
+  free(buf);
+  fclose(fp);
+
+  return ok;
+}
+
+static bool write_all(int fd, const void *buf, size_t len) {
+  const char *p = (const char *) buf;
+  ssize_t n;
+
+  while (len > 0) {
+    n = write(fd, p, len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+
+  return true;
+}
+#endif
+
+bool CacheWriter::save(const char *cachefile, const char *srcfile, const char *tag) {
+#ifdef WIN32
+  return false;
+#else
+  struct datacache_header hdr;
+  char tmpname[1024];
+  bool ok;
+  int fd;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, DATACACHE_MAGIC, sizeof(hdr.magic));
+  hdr.byteorder = DATACACHE_BYTEORDER;
+  hdr.format = DATACACHE_FORMAT;
+  Strncpy(hdr.tag, tag, sizeof(hdr.tag));
+  if (!file_checksum(srcfile, &hdr.srclen, &hdr.srcsum))
+    return false;
+  hdr.datalen = data.size();
+  hdr.datasum = checksum((const u8 *) data.data(), data.size());
+
+  /* Write to a temporary file and rename it, so that another Nmap never
+     sees a partial cache. */
+  if (Snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", cachefile) >= (int) sizeof(tmpname))
+    return false;
+  fd = mkstemp(tmpname);
+  if (fd == -1)
+    return false;
+  ok = write_all(fd, &hdr, sizeof(hdr)) && write_all(fd, data.data(), data.size());
+  if (close(fd) != 0)
+    ok = false;
+  if (ok && rename(tmpname, cachefile) != 0)
+    ok = false;
+  if (!ok)
+    unlink(tmpname);
+
+  return ok;
+#endif
+}
+
+CacheReader::CacheReader() {
+  map = NULL;
+  maplen = 0;
+  data = NULL;
+  datalen = pos = 0;
+  error = true;
+}
+
+CacheReader::~CacheReader() {
+  close();
+}
+
+void CacheReader::close() {
+#ifndef WIN32
+  if (map != NULL)
+    munmap(map, maplen);
+#endif
+  map = NULL;
+  maplen = 0;
+  data = NULL;
+  datalen = pos = 0;
+  error = true;
+}
+
+bool CacheReader::open(const char *cachefile, const char *srcfile, const char *tag) {
+#ifdef WIN32
+  return false;
+#else
+  const struct datacache_header *hdr;
+  char tagbuf[sizeof(hdr->tag)];
+  struct stat st;
+  u32 srclen, srcsum;
+  void *p;
+  int fd;
+
+  close();
+  fd = ::open(cachefile, O_RDONLY);
+  if (fd == -1)
+    return false;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(*hdr)
+      || st.st_size > 0x7fffffff) {
+    ::close(fd);
+    return false;
+  }
+  p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED)
+    return false;
+  map = (u8 *) p;
+  maplen = st.st_size;
+
+  hdr = (const struct datacache_header *) map;
+  Strncpy(tagbuf, tag, sizeof(tagbuf));
+  if (memcmp(hdr->magic, DATACACHE_MAGIC, sizeof(hdr->magic)) != 0
+      || hdr->byteorder != DATACACHE_BYTEORDER
+      || hdr->format != DATACACHE_FORMAT
+      || strncmp(hdr->tag, tagbuf, sizeof(tagbuf)) != 0
+      || hdr->datalen != maplen - sizeof(*hdr)) {
+    close();
+    return false;
+  }
+  data = map + sizeof(*hdr);
+  datalen = hdr->datalen;
+  if (checksum(data, datalen) != hdr->datasum) {
+    close();
+    return false;
+  }
+  if (!file_checksum(srcfile, &srclen, &srcsum)
+      || srclen != hdr->srclen || srcsum != hdr->srcsum) {
+    close();
+    return false;
+  }
+
+  pos = 0;
+  error = false;
+  return true;
+#endif
+}
+
+u32 CacheReader::getU32() {
+  const u8 *p = getBytes(sizeof(u32));
+  u32 val;
+
+  if (p == NULL)
+    return 0;
+  memcpy(&val, p, sizeof(val));
+  return val;
+}
+
+const u8 *CacheReader::getBytes(u32 len) {
+  const u8 *p;
+
+  if (error || len > datalen - pos) {
+    error = true;
+    return NULL;
+  }
+  p = data + pos;
+  pos += len;
+
+  return p;
+}
+
+char *CacheReader::getString() {
+  const u8 *p;
+  u32 len;
+
+  len = getU32();
+  if (len == 0)
+    return NULL;
+  p = getBytes(len);
+  if (p == NULL || p[len - 1] != '\0') {
+    error = true;
+    return NULL;
+  }
+
+  return strdup((const char *) p);
+}
@@ -0,0 +1,488 @@
+/***************************************************************************
+ * dnscache.cc -- A persistent, memory-mapped cache of reverse DNS answers *
+ * shared between Nmap runs.                                               *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2016 Insecure.Com LLC. Nmap is    *
+ * also a registered trademark of Insecure.Com LLC.  This program is free  *
+ * software; you may redistribute and/or modify it under the terms of the  *
+ * GNU General Public License as published by the Free Software            *
+ * Foundation; Version 2 ("GPL"), BUT ONLY WITH ALL OF THE CLARIFICATIONS  *
+ * AND EXCEPTIONS DESCRIBED HEREIN.  This guarantees your right to use,    *
+ * modify, and redistribute this software under certain conditions.  If    *
+ * you wish to embed Nmap technology into proprietary software, we sell    *
+ * alternative licenses (contact sales@nmap.com).  Dozens of software      *
+ * vendors already license Nmap technology such as host discovery, port    *
+ * scanning, OS detection, version detection, and the Nmap Scripting       *
+ * Engine.                                                                 *
+ *                                                                         *
+ * Note that the GPL places important restrictions on "derivative works",  *
+ * yet it does not provide a detailed definition of that term.  To avoid   *
+ * misunderstandings, we interpret that term as broadly as copyright law   *
+ * allows.  For example, we consider an application to constitute a        *
+ * derivative work for the purpose of this license if it does any of the   *
+ * following with any software or content covered by this license          *
+ * ("Covered Software"):                                                   *
+ *                                                                         *
+ * o Integrates source code from Covered Software.                         *
+ *                                                                         *
+ * o Reads or includes copyrighted data files, such as Nmap's nmap-os-db   *
+ * or nmap-service-probes.                                                 *
+ *                                                                         *
+ * o Is designed specifically to execute Covered Software and parse the    *
+ * results (as opposed to typical shell or execution-menu apps, which will *
+ * execute anything you tell them to).                                     *
+ *                                                                         *
+ * o Includes Covered Software in a proprietary executable installer.  The *
+ * installers produced by InstallShield are an example of this.  Including *
+ * Nmap with other software in compressed or archival form does not        *
+ * trigger this provision, provided appropriate open source decompression  *
+ * or de-archiving software is widely available for no charge.  For the    *
+ * purposes of this license, an installer is considered to include Covered *
+ * Software even if it actually retrieves a copy of Covered Software from  *
+ * another source during runtime (such as by downloading it from the       *
+ * Internet).                                                              *
+ *                                                                         *
+ * o Links (statically or dynamically) to a library which does any of the  *
+ * above.                                                                  *
+ *                                                                         *
+ * o Executes a helper program, module, or script to do any of the above.  *
+ *                                                                         *
+ * This list is not exclusive, but is meant to clarify our interpretation  *
+ * of derived works with some common examples.  Other people may interpret *
+ * the plain GPL differently, so we consider this a special exception to   *
+ * the GPL that we apply to Covered Software.  Works which meet any of     *
+ * these conditions must conform to all of the terms of this license,      *
+ * particularly including the GPL Section 3 requirements of providing      *
+ * source code and allowing free redistribution of the work as a whole.    *
+ *                                                                         *
+ * As another special exception to the GPL terms, Insecure.Com LLC grants  *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two.                                  *
+ *                                                                         *
+ * Any redistribution of Covered Software, including any derived works,    *
+ * must obey and carry forward all of the terms of this license, including *
+ * obeying all GPL rules and restrictions.  For example, source code of    *
+ * the whole work must be provided and free redistribution must be         *
+ * allowed.  All GPL references to "this License", are to be treated as    *
+ * including the terms and conditions of this license text as well.        *
+ *                                                                         *
+ * Because this license imposes special exceptions to the GPL, Covered     *
+ * Work may not be combined (even as part of a larger work) with plain GPL *
+ * software.  The terms, conditions, and exceptions of this license must   *
+ * be included as well.  This license is incompatible with some other open *
+ * source licenses as well.  In some cases we can relicense portions of    *
+ * Nmap or grant special permissions to use it in other open source        *
+ * software.  Please contact fyodor@nmap.org with any such requests.       *
+ * Similarly, we don't incorporate incompatible open source software into  *
+ * Covered Software without special permission from the copyright holders. *
+ *                                                                         *
+ * If you have any questions about the licensing restrictions on using     *
+ * Nmap in other works, are happy to help.  As mentioned above, we also    *
+ * offer alternative license to integrate Nmap into proprietary            *
+ * applications and appliances.  These contracts have been sold to dozens  *
+ * of software vendors, and generally include a perpetual license as well  *
+ * as providing for priority support and updates.  They also fund the      *
+ * continued development of Nmap.  Please email sales@nmap.com for further *
+ * information.                                                            *
+ *                                                                         *
+ * If you have received a written license agreement or contract for        *
+ * Covered Software stating terms other than these, you may choose to use  *
+ * and redistribute Covered Software under those terms instead of these.   *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the Nmap      *
+ * license file for more details (it's in a COPYING file included with     *
+ * Nmap, and also available from https://svn.nmap.org/nmap/COPYING)        *
+ *                                                                         *
+ ***************************************************************************/
+
+/* $Id$ */
+
+#include "nmap.h"
+#include "dnscache.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#endif
+
+#define DNSCACHE_MAGIC "NMAPRDC\n"
+#define DNSCACHE_BYTEORDER 0x01020304
+/* Bump this whenever the layout of the file changes. */
+#define DNSCACHE_FORMAT 1
+
+/* Smallest table and name heap a cache file is created with. The table is
+   kept at most half full and doubles as needed. */
+#define DNSCACHE_MIN_SLOTS 65536
+#define DNSCACHE_MIN_HEAP (1024 * 1024)
+/* Answers are not trusted for longer than this, whatever their TTL. */
+#define DNSCACHE_MAX_TTL (7 * 24 * 60 * 60)
+
+struct dnscache_header {
+  char magic[8];   /* DNSCACHE_MAGIC */
+  u32 byteorder;   /* DNSCACHE_BYTEORDER, in the writer's byte order */
+  u32 format;      /* DNSCACHE_FORMAT */
+  u32 nslots;      /* Size of the slot table; a power of two */
+  u32 used;        /* Slots holding an entry, live or expired */
+  u32 heaplen;     /* Bytes of the name heap in use */
+  u32 heapsize;    /* Bytes in the name heap, which follows the slots */
+};
+
+struct dnscache_slot {
+  u8 addr[16];     /* IPv4 addresses use the first four bytes */
+  u32 expires;     /* time() after which the entry is stale */
+  u32 name_off;    /* Offset of the name in the heap */
+  u8 af;           /* 4 or 6; 0 for an empty slot */
+  u8 name_len;     /* 0 for an NXDOMAIN answer */
+  u16 reserved;
+};
+
+/* Fills in the key used in the table for ip. Returns 4 or 6 for the address
+   family, or 0 for anything else. */
+static u8 make_key(const struct sockaddr_storage &ip, u8 *key) {
+  memset(key, 0, 16);
+  if (ip.ss_family == AF_INET) {
+    memcpy(key, &((const struct sockaddr_in *) &ip)->sin_addr, 4);
+    return 4;
+  }
+#if HAVE_IPV6
+  if (ip.ss_family == AF_INET6) {
+    memcpy(key, &((const struct sockaddr_in6 *) &ip)->sin6_addr, 16);
+    return 6;
+  }
+#endif
+  return 0;
+}
+
+/* The hash is part of the file format, so it must not depend on anything
+   that changes from run to run. */
+static u32 key_hash(const u8 *key, u8 af) {
+  u32 w[4], h;
+  int i;
+
+  memcpy(w, key, sizeof(w));
+  h = af;
+  for (i = 0; i < 4; i++)
+    h = (h ^ w[i]) * 0x9e3779b1;
+  h ^= h >> 15;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+
+  return h;
+}
+
+static size_t file_size(u32 nslots, u32 heapsize) {
+  return sizeof(struct dnscache_header)
+    + (size_t) nslots * sizeof(struct dnscache_slot) + heapsize;
+}
+
+DNSCacheFile::DNSCacheFile() {
+  fd = -1;
+  map = NULL;
+  maplen = 0;
+}
+
+DNSCacheFile::~DNSCacheFile() {
+  close();
+}
+
+void DNSCacheFile::close() {
+#ifndef WIN32
+  if (map != NULL)
+    munmap(map, maplen);
+  /* Closing the descriptor also releases the lock. */
+  if (fd != -1)
+    ::close(fd);
+#endif
+  fd = -1;
+  map = NULL;
+  maplen = 0;
+}
+
+struct dnscache_slot *DNSCacheFile::slots() const {
+  return (struct dnscache_slot *) (map + sizeof(struct dnscache_header));
+}
+
+char *DNSCacheFile::heap() const {
+  const struct dnscache_header *hdr = (const struct dnscache_header *) map;
+
+  return (char *) (slots() + hdr->nslots);
+}
+
+bool DNSCacheFile::mapFile(size_t len) {
+#ifdef WIN32
+  return false;
+#else
+  void *p;
+
+  if (map != NULL)
+    munmap(map, maplen);
+  map = NULL;
+  maplen = 0;
+  p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    return false;
+  map = (u8 *) p;
+  maplen = len;
+
+  return true;
+#endif
+}
+
+/* Truncates the file and lays out an empty table. */
+bool DNSCacheFile::create(u32 nslots, u32 heapsize) {
+#ifdef WIN32
+  return false;
+#else
+  struct dnscache_header *hdr;
+  size_t len = file_size(nslots, heapsize);
+
+  if (ftruncate(fd, 0) != 0 || ftruncate(fd, len) != 0 || !mapFile(len))
+    return false;
+  hdr = (struct dnscache_header *) map;
+  hdr->byteorder = DNSCACHE_BYTEORDER;
+  hdr->format = DNSCACHE_FORMAT;
+  hdr->nslots = nslots;
+  hdr->used = 0;
+  hdr->heaplen = 0;
+  hdr->heapsize = heapsize;
+  /* Written last, so that a file cut short here is not mistaken for a good
+     one next time. */
+  memcpy(hdr->magic, DNSCACHE_MAGIC, sizeof(hdr->magic));
+
+  return true;
+#endif
+}
+
+bool DNSCacheFile::open(const char *filename) {
+#ifdef WIN32
+  return false;
+#else
+  struct dnscache_header hdr;
+  struct stat st;
+
+  close();
+  fd = ::open(filename, O_RDWR | O_CREAT, 0600);
+  if (fd == -1)
+    return false;
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0) {
+    close();
+    return false;
+  }
+
+  if ((size_t) st.st_size >= sizeof(hdr)
+      && pread(fd, &hdr, sizeof(hdr), 0) == (ssize_t) sizeof(hdr)
+      && memcmp(hdr.magic, DNSCACHE_MAGIC, sizeof(hdr.magic)) == 0
+      && hdr.byteorder == DNSCACHE_BYTEORDER
+      && hdr.format == DNSCACHE_FORMAT
+      && hdr.nslots >= DNSCACHE_MIN_SLOTS
+      && (hdr.nslots & (hdr.nslots - 1)) == 0
+      && hdr.used < hdr.nslots
+      && hdr.heaplen <= hdr.heapsize
+      && (size_t) st.st_size == file_size(hdr.nslots, hdr.heapsize)) {
+    if (mapFile(st.st_size))
+      return true;
+  } else if (create(DNSCACHE_MIN_SLOTS, DNSCACHE_MIN_HEAP)) {
+    return true;
+  }
+
+  close();
+  return false;
+#endif
+}
+
+/* Returns the slot holding key, or the empty slot where it would go. The
+   table is never more than half full, so there is always an empty slot
+   unless the file is damaged (open checks only the header); then NULL is
+   returned after every slot has been tried. */
+struct dnscache_slot *DNSCacheFile::findSlot(const u8 *key, u8 af) const {
+  const struct dnscache_header *hdr = (const struct dnscache_header *) map;
+  struct dnscache_slot *table = slots();
+  u32 mask = hdr->nslots - 1;
+  u32 i, n;
+
+  i = key_hash(key, af) & mask;
+  for (n = 0; n < hdr->nslots; n++) {
+    if (table[i].af == 0)
+      return &table[i];
+    if (table[i].af == af && memcmp(table[i].addr, key, sizeof(table[i].addr)) == 0)
+      return &table[i];
+    i = (i + 1) & mask;
+  }
+
+  return NULL;
+}
+
+/* Throws away the contents of a damaged file and starts it over empty. The
+   cache is closed if that fails. */
+void DNSCacheFile::discard() {
+  if (!create(DNSCACHE_MIN_SLOTS, DNSCACHE_MIN_HEAP))
+    close();
+}
+
+int DNSCacheFile::lookup(const struct sockaddr_storage &ip, std::string &name) {
+  const struct dnscache_header *hdr;
+  const struct dnscache_slot *slot;
+  u8 key[16];
+  u8 af;
+
+  if (map == NULL || (af = make_key(ip, key)) == 0)
+    return DNSCACHE_MISS;
+  hdr = (const struct dnscache_header *) map;
+  slot = findSlot(key, af);
+  if (slot == NULL) {
+    discard();
+    return DNSCACHE_MISS;
+  }
+  if (slot->af == 0)
+    return DNSCACHE_MISS;
+  if (slot->expires <= (u32) time(NULL))
+    return DNSCACHE_EXPIRED;
+  if (slot->name_len == 0)
+    return DNSCACHE_NXDOMAIN;
+  if (slot->name_off > hdr->heaplen || slot->name_len > hdr->heaplen - slot->name_off)
+    return DNSCACHE_MISS;
+  name.assign(heap() + slot->name_off, slot->name_len);
+
+  return DNSCACHE_HIT;
+}
+
+/* Starts the file over with room for need_heap more bytes of names, keeping
+   only the entries that have not expired. */
+bool DNSCacheFile::rebuild(u32 need_heap) {
+  struct entry {
+    u8 addr[16];
+    u8 af;
+    u32 expires;
+    std::string name;
+  };
+  const struct dnscache_header *hdr = (const struct dnscache_header *) map;
+  std::vector<entry> live;
+  struct dnscache_header *newhdr;
+  struct dnscache_slot *slot;
+  u32 now = (u32) time(NULL);
+  u32 i, nslots, heapsize;
+  size_t heapneed = need_heap;
+
+  for (i = 0; i < hdr->nslots; i++) {
+    slot = &slots()[i];
+    if (slot->af == 0 || slot->expires <= now)
+      continue;
+    if (slot->name_off > hdr->heaplen || slot->name_len > hdr->heaplen - slot->name_off)
+      continue;
+    live.push_back(entry());
+    memcpy(live.back().addr, slot->addr, sizeof(slot->addr));
+    live.back().af = slot->af;
+    live.back().expires = slot->expires;
+    live.back().name.assign(heap() + slot->name_off, slot->name_len);
+    heapneed += slot->name_len;
+  }
+
+  nslots = DNSCACHE_MIN_SLOTS;
+  while (nslots < 0x80000000U && nslots / 4 < live.size() + 1)
+    nslots <<= 1;
+  heapneed *= 2;
+  if (heapneed > 0x7fffffff)
+    return false;
+  heapsize = MAX(DNSCACHE_MIN_HEAP, (u32) heapneed);
+  if (!create(nslots, heapsize))
+    return false;
+
+  newhdr = (struct dnscache_header *) map;
+  for (i = 0; i < live.size(); i++) {
+    slot = findSlot(live[i].addr, live[i].af);
+    assert(slot != NULL);
+    memcpy(heap() + newhdr->heaplen, live[i].name.data(), live[i].name.size());
+    memcpy(slot->addr, live[i].addr, sizeof(slot->addr));
+    slot->expires = live[i].expires;
+    slot->name_off = newhdr->heaplen;
+    slot->name_len = live[i].name.size();
+    slot->af = live[i].af;
+    newhdr->heaplen += live[i].name.size();
+    newhdr->used++;
+  }
+
+  return true;
+}
+
+void DNSCacheFile::add(const struct sockaddr_storage &ip, const std::string &name, u32 ttl) {
+  struct dnscache_header *hdr;
+  struct dnscache_slot *slot;
+  u8 key[16];
+  u8 af;
+
+  if (map == NULL || name.size() > 255 || (af = make_key(ip, key)) == 0)
+    return;
+  slot = findSlot(key, af);
+  if (slot == NULL) {
+    discard();
+    if (map == NULL)
+      return;
+    slot = findSlot(key, af);
+  }
+  hdr = (struct dnscache_header *) map;
+
+  /* A name that hasn't changed stays where it is. */
+  if (slot->af != 0 && slot->name_len == name.size()
+      && slot->name_off <= hdr->heaplen && name.size() <= hdr->heaplen - slot->name_off
+      && memcmp(heap() + slot->name_off, name.data(), name.size()) == 0) {
+    slot->expires = (u32) time(NULL) + MIN(ttl, DNSCACHE_MAX_TTL);
+    return;
+  }
+
+  if ((slot->af == 0 && (hdr->used + 1) * 2 > hdr->nslots)
+      || name.size() > hdr->heapsize - hdr->heaplen) {
+    if (!rebuild(name.size())) {
+      close();
+      return;
+    }
+    hdr = (struct dnscache_header *) map;
+    slot = findSlot(key, af);
+  }
+
+  /* The name goes in before the slot points at it, so that an interrupted
+     run leaves nothing worse than some unused heap. */
+  memcpy(heap() + hdr->heaplen, name.data(), name.size());
+  slot->name_off = hdr->heaplen;
+  hdr->heaplen += name.size();
+  slot->name_len = name.size();
+  slot->expires = (u32) time(NULL) + MIN(ttl, DNSCACHE_MAX_TTL);
+  if (slot->af == 0) {
+    memcpy(slot->addr, key, sizeof(slot->addr));
+    slot->af = af;
+    hdr->used++;
+  }
+}
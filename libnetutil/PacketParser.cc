@@ -183,10 +183,12 @@ const char *PacketParser::header_type2string(int val){
 
 
 
-#define MAX_HEADERS_IN_PACKET 32
-pkt_type_t *PacketParser::parse_packet(const u8 *pkt, size_t pktlen, bool eth_included){
+/* Fills this_packet, which must hold MAX_HEADERS_IN_PACKET+1 entries, with
+ * the type and length of each header in pkt, and returns it. The caller
+ * supplies the array so that packets can be parsed from several threads. */
+pkt_type_t *PacketParser::parse_packet(const u8 *pkt, size_t pktlen, bool eth_included,
+                                       pkt_type_t *this_packet){
   if(PKTPARSERDEBUG)printf("%s(%p, %lu)\n", __func__, pkt, (long unsigned)pktlen);
-  static pkt_type_t this_packet[MAX_HEADERS_IN_PACKET+1]; /* Packet structure array   */
   u8 current_header=0;             /* Current array position of "this_packet" */
   const u8 *curr_pkt=pkt;          /* Pointer to current part of the packet   */
   size_t curr_pktlen=pktlen;       /* Remaining packet length                 */
@@ -210,7 +212,7 @@ pkt_type_t *PacketParser::parse_packet(const u8 *pkt, size_t pktlen, bool eth_in
   HopByHopHeader ext_hopt;
   RoutingHeader ext_routing;
   ARPHeader arp;
-  memset(this_packet, 0, sizeof(this_packet));
+  memset(this_packet, 0, (MAX_HEADERS_IN_PACKET+1)*sizeof(pkt_type_t));
 
   /* Decide which layer we have to start from */
   if( eth_included ){
@@ -670,7 +672,8 @@ pkt_type_t *PacketParser::parse_packet(const u8 *pkt, size_t pktlen, bool eth_in
 
 /* TODO: remove */
 int PacketParser::dummy_print_packet_type(const u8 *pkt, size_t pktlen, bool eth_included){
-  pkt_type_t *packetheaders=PacketParser::parse_packet(pkt, pktlen, eth_included);
+  pkt_type_t headers[MAX_HEADERS_IN_PACKET+1];
+  pkt_type_t *packetheaders=PacketParser::parse_packet(pkt, pktlen, eth_included, headers);
   for(int i=0; packetheaders[i].length!=0; i++){
     printf("%s:", header_type2string(packetheaders[i].type));
   }
@@ -757,6 +760,7 @@ PacketElement *PacketParser::split(const u8 *pkt, size_t pktlen){
 
 
 PacketElement *PacketParser::split(const u8 *pkt, size_t pktlen, bool eth_included){
+  pkt_type_t headers[MAX_HEADERS_IN_PACKET+1];
   pkt_type_t *packetheaders=NULL;
   const u8 *curr_pkt=pkt;
   PacketElement *first=NULL;
@@ -776,7 +780,7 @@ PacketElement *PacketParser::split(const u8 *pkt, size_t pktlen, bool eth_includ
   RawData *raw=NULL;
 
   /* Analyze the packet. This returns a list of header types and lengths */
-  if((packetheaders=PacketParser::parse_packet(pkt, pktlen, eth_included))==NULL)
+  if((packetheaders=PacketParser::parse_packet(pkt, pktlen, eth_included, headers))==NULL)
     return NULL;
 
   /* Store each header in its own PacketHeader object type */
@@ -167,6 +167,8 @@ typedef struct packet_type{
     u32 length;
 }pkt_type_t;
 
+#define MAX_HEADERS_IN_PACKET 32
+
 
 class PacketParser {
 
@@ -180,7 +182,7 @@ class PacketParser {
     void reset();
 
     static const char *header_type2string(int val);
-    static pkt_type_t *parse_packet(const u8 *pkt, size_t pktlen, bool eth_included);
+    static pkt_type_t *parse_packet(const u8 *pkt, size_t pktlen, bool eth_included, pkt_type_t *this_packet);
     static int dummy_print_packet_type(const u8 *pkt, size_t pktlen, bool eth_included); /* TODO: remove */
     static int dummy_print_packet(const u8 *pkt, size_t pktlen, bool eth_included); /* TODO: remove */
     static int payload_offset(const u8 *pkt, size_t pktlen, bool link_included);
@@ -173,6 +173,8 @@
 #endif
 #ifdef HAVE_LINUX_RTNETLINK_H
 #include <linux/rtnetlink.h>
+#include <linux/fib_rules.h>
+#include <linux/neighbour.h>
 #endif
 
 #ifndef NETINET_IN_SYSTM_H  /* This guarding is needed for at least some versions of OpenBSD */
@@ -193,6 +195,7 @@
 #define NETINET_IP_H
 #endif
 #include <net/if_arp.h>
+#include <time.h>
 
 #if HAVE_SYS_RESOURCE_H
 #include <sys/resource.h>
@@ -534,75 +537,178 @@ int ip_is_reserved(struct in_addr *ip)
   return 0;
 }
 
-/* A trivial functon that maintains a cache of IP to MAC Address
-   entries.  If the command is MACCACHE_GET, this func looks for the
-   IPv4 address in ss and fills in the 'mac' parameter and returns
-   true if it is found.  Otherwise (not found), the function returns
-   false.  If the command is MACCACHE_SET, the function adds an entry
-   with the given ip (ss) and mac address.  An existing entry for the
-   IP ss will be overwritten with the new MAC address.  true is always
-   returned for the set command. */
-#define MACCACHE_GET 1
-#define MACCACHE_SET 2
-static int do_mac_cache(int command, const struct sockaddr_storage *ss, u8 *mac) {
-  struct MacCache {
-    struct sockaddr_storage ip;
-    u8 mac[6];
-  };
-  static struct MacCache *Cache = NULL;
-  static int MacCapacity = 0;
-  static int MacCacheSz = 0;
-  int i;
-
-  if (command == MACCACHE_GET) {
-    for (i = 0; i < MacCacheSz; i++) {
-      if (sockaddr_storage_cmp(&Cache[i].ip, ss) == 0) {
-        memcpy(mac, Cache[i].mac, 6);
-        return 1;
-      }
-    }
+/* The cache of IP to MAC address entries behind mac_cache_get and
+   mac_cache_set. It is an open-addressing hash table, since ARP and ND
+   discovery of a large local network looks up and adds an entry for every
+   host. It holds at most MAC_CACHE_MAX entries; when it is full it is
+   emptied and starts over rather than growing without bound. */
+#define MAC_CACHE_MAX 262144
+
+struct mac_cache_entry {
+  unsigned int hash;
+  u8 af;              /* 4 or 6, or 0 for an empty slot */
+  u8 addr[16];
+  u8 mac[6];
+};
+
+static struct mac_cache_entry *mac_cache = NULL;
+static unsigned int mac_cache_size = 0; /* A power of two */
+static unsigned int mac_cache_count = 0;
+
+/* Extracts the cache key of ss. Returns 0 if ss is not IPv4 or IPv6. */
+static int mac_cache_key(const struct sockaddr_storage *ss, u8 *af, u8 *addr) {
+  memset(addr, 0, 16);
+  if (ss->ss_family == AF_INET) {
+    *af = 4;
+    memcpy(addr, &((const struct sockaddr_in *) ss)->sin_addr, 4);
+  } else if (ss->ss_family == AF_INET6) {
+    *af = 6;
+    memcpy(addr, ((const struct sockaddr_in6 *) ss)->sin6_addr.s6_addr, 16);
+  } else {
     return 0;
   }
-  assert(command == MACCACHE_SET);
-  if (MacCacheSz == MacCapacity) {
-    if (MacCapacity == 0)
-      MacCapacity = 32;
-    else
-      MacCapacity <<= 2;
-    Cache = (struct MacCache *) safe_realloc(Cache, MacCapacity * sizeof(struct MacCache));
+
+  return 1;
+}
+
+/* Returns the slot holding the key, or the empty slot where it belongs. */
+static struct mac_cache_entry *mac_cache_slot(unsigned int hash, u8 af, const u8 *addr) {
+  unsigned int i;
+
+  for (i = hash & (mac_cache_size - 1); mac_cache[i].af != 0; i = (i + 1) & (mac_cache_size - 1)) {
+    if (mac_cache[i].hash == hash && mac_cache[i].af == af
+        && memcmp(mac_cache[i].addr, addr, 16) == 0)
+      break;
   }
 
-  /* Ensure that it isn't already there ... */
-  for (i = 0; i < MacCacheSz; i++) {
-    if (sockaddr_storage_cmp(&Cache[i].ip, ss) == 0) {
-      memcpy(Cache[i].mac, mac, 6);
+  return &mac_cache[i];
+}
+
+static void mac_cache_resize(unsigned int size) {
+  struct mac_cache_entry *old = mac_cache;
+  unsigned int i, oldsize = mac_cache_size;
+
+  mac_cache = (struct mac_cache_entry *) safe_zalloc(size * sizeof(*mac_cache));
+  mac_cache_size = size;
+  for (i = 0; i < oldsize; i++) {
+    if (old[i].af != 0)
+      *mac_cache_slot(old[i].hash, old[i].af, old[i].addr) = old[i];
+  }
+  free(old);
+}
+
+/* Looks for the IPv4 or IPv6 address in ss and fills in the 'mac'
+   parameter and returns true if it is found.  Otherwise (not found), the
+   function returns false. */
+int mac_cache_get(const struct sockaddr_storage *ss, u8 *mac) {
+  struct mac_cache_entry *e;
+  u8 af, addr[16];
+
+  if (mac_cache_count == 0 || !mac_cache_key(ss, &af, addr))
+    return 0;
+  e = mac_cache_slot(sockaddr_storage_hash(ss), af, addr);
+  if (e->af == 0)
+    return 0;
+  memcpy(mac, e->mac, 6);
+
+  return 1;
+}
+
+/* Adds an entry with the given ip (ss) and mac address.  An existing entry
+   for the IP ss will be overwritten with the new MAC address.  Returns
+   false only if ss is not an IPv4 or IPv6 address. */
+int mac_cache_set(const struct sockaddr_storage *ss, u8 *mac) {
+  struct mac_cache_entry *e;
+  unsigned int hash;
+  u8 af, addr[16];
+
+  if (!mac_cache_key(ss, &af, addr))
+    return 0;
+  hash = sockaddr_storage_hash(ss);
+
+  if (mac_cache_size > 0) {
+    e = mac_cache_slot(hash, af, addr);
+    if (e->af != 0) {
+      memcpy(e->mac, mac, 6);
       return 1;
     }
   }
 
-  /* Add it to the end of the list */
-  memcpy(&Cache[i].ip, ss, sizeof(struct sockaddr_storage));
-  memcpy(Cache[i].mac, mac, 6);
-  MacCacheSz++;
+  /* Keep the table at most half full. */
+  if (mac_cache_count >= MAC_CACHE_MAX) {
+    memset(mac_cache, 0, mac_cache_size * sizeof(*mac_cache));
+    mac_cache_count = 0;
+  } else if ((mac_cache_count + 1) * 2 > mac_cache_size) {
+    mac_cache_resize(mac_cache_size == 0 ? 64 : mac_cache_size * 2);
+  }
+
+  e = mac_cache_slot(hash, af, addr);
+  e->hash = hash;
+  e->af = af;
+  memcpy(e->addr, addr, 16);
+  memcpy(e->mac, mac, 6);
+  mac_cache_count++;
+
   return 1;
 }
 
-/* A couple of trivial functions that maintain a cache of IP to MAC
- * Address entries. Function mac_cache_get() looks for the IPv4 address
- * in ss and fills in the 'mac' parameter and returns true if it is
- * found.  Otherwise (not found), the function returns false.
- * Function mac_cache_set() adds an entry with the given ip (ss) and
- * mac address.  An existing entry for the IP ss will be overwritten
- * with the new MAC address.  mac_cache_set() always returns true.
- * WARNING: The caller must ensure that the supplied "ss" is of family
- * AF_INET. Otherwise the function will return 0 and there would be
- * no way for the caller to tell tell the difference between an error
- * or a cache miss.*/
-int mac_cache_get(const struct sockaddr_storage *ss, u8 *mac){
-    return do_mac_cache(MACCACHE_GET, ss, mac);
+#ifdef HAVE_LINUX_RTNETLINK_H
+static int mac_cache_load_netlink(void);
+#endif
+
+/* Reads the IPv4 neighbors from /proc/net/arp. Returns the number of
+   entries added, or -1 if the file can't be read. */
+static int mac_cache_load_proc(void) {
+  char line[256], ipstr[64], macstr[64];
+  struct sockaddr_storage ss;
+  unsigned int flags, m[6];
+  size_t sslen;
+  u8 mac[6];
+  FILE *fp;
+  int i, n;
+
+  fp = fopen("/proc/net/arp", "r");
+  if (fp == NULL)
+    return -1;
+  n = 0;
+  /* Skip the header line. */
+  if (fgets(line, sizeof(line), fp) != NULL) {
+    while (fgets(line, sizeof(line), fp) != NULL) {
+      /* IP address, HW type, Flags, HW address, Mask, Device */
+      if (sscanf(line, "%63s %*x %x %63s", ipstr, &flags, macstr) != 3)
+        continue;
+      /* ATF_COM: the entry is complete. */
+      if (!(flags & 0x02))
+        continue;
+      if (sscanf(macstr, "%x:%x:%x:%x:%x:%x", &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]) != 6)
+        continue;
+      if (resolve_numeric(ipstr, 0, &ss, &sslen, AF_INET) != 0)
+        continue;
+      for (i = 0; i < 6; i++)
+        mac[i] = m[i];
+      mac_cache_set(&ss, mac);
+      n++;
+    }
+  }
+  fclose(fp);
+
+  return n;
 }
-int mac_cache_set(const struct sockaddr_storage *ss, u8 *mac){
-    return do_mac_cache(MACCACHE_SET, ss, mac);
+
+/* Adds the system's neighbor (ARP and ND) table to the cache, so that
+   neighbors the system already knows don't have to be asked again. Uses
+   rtnetlink on Linux, falling back to /proc/net/arp. Returns the number of
+   entries added, or -1 if there is no way to read the table. */
+int mac_cache_load_system(void) {
+  int n = -1;
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+  n = mac_cache_load_netlink();
+#endif
+  if (n == -1)
+    n = mac_cache_load_proc();
+
+  return n;
 }
 
 /* Standard BSD internet checksum routine. Uses libdnet helper functions. */
@@ -3135,6 +3241,116 @@ static void add_rtattr_addr(struct nlmsghdr *nlmsg,
   }
 }
 
+/* Opens and binds a NETLINK_ROUTE socket. Returns -1 on error. */
+static int netlink_open(void) {
+  struct sockaddr_nl snl;
+  int fd;
+
+  fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+  if (fd == -1)
+    return -1;
+  memset(&snl, 0, sizeof(snl));
+  snl.nl_family = AF_NETLINK;
+  if (bind(fd, (struct sockaddr *) &snl, sizeof(snl)) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/* Asks for a dump of type (e.g. RTM_GETROUTE) for address family af, which
+   may be AF_UNSPEC, and passes each message of the reply to handler.
+   Returns -1 on error or if handler returned -1 for any message. */
+static int netlink_dump(int fd, int type, int af,
+                        int (*handler)(struct nlmsghdr *, void *), void *data) {
+  struct {
+    struct nlmsghdr nlmsg;
+    struct rtmsg rtmsg;
+  } req;
+  struct nlmsghdr *nlmsg;
+  static char buf[32768];
+  int len, ok;
+
+  memset(&req, 0, sizeof(req));
+  req.nlmsg.nlmsg_len = NLMSG_LENGTH(sizeof(req.rtmsg));
+  req.nlmsg.nlmsg_type = type;
+  req.nlmsg.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  req.nlmsg.nlmsg_seq = type;
+  /* The headers of rule and neighbor messages start with the family just
+     like struct rtmsg, and that's all a dump request looks at. */
+  req.rtmsg.rtm_family = af;
+  if (send(fd, &req, req.nlmsg.nlmsg_len, 0) != (ssize_t) req.nlmsg.nlmsg_len)
+    return -1;
+
+  ok = 0;
+  for (;;) {
+    len = recv(fd, buf, sizeof(buf), 0);
+    if (len <= 0)
+      return -1;
+    for (nlmsg = (struct nlmsghdr *) buf; NLMSG_OK(nlmsg, (unsigned int) len);
+         nlmsg = NLMSG_NEXT(nlmsg, len)) {
+      if (nlmsg->nlmsg_type == NLMSG_DONE)
+        return ok;
+      if (nlmsg->nlmsg_type == NLMSG_ERROR)
+        return -1;
+      if (handler(nlmsg, data) == -1)
+        ok = -1;
+    }
+  }
+}
+
+/* netlink_dump handler that adds a neighbor to the MAC cache. */
+static int mac_cache_add_neigh(struct nlmsghdr *nlmsg, void *data) {
+  struct ndmsg *ndmsg = (struct ndmsg *) NLMSG_DATA(nlmsg);
+  struct sockaddr_storage ss;
+  struct rtattr *rtattr;
+  const void *dst = NULL;
+  const u8 *mac = NULL;
+  int attrlen;
+
+  if (nlmsg->nlmsg_type != RTM_NEWNEIGH
+      || (ndmsg->ndm_family != AF_INET && ndmsg->ndm_family != AF_INET6))
+    return 0;
+  /* Incomplete and failed entries have no usable address. */
+  if (!(ndmsg->ndm_state & (NUD_REACHABLE | NUD_STALE | NUD_DELAY | NUD_PROBE | NUD_PERMANENT)))
+    return 0;
+
+  attrlen = nlmsg->nlmsg_len - NLMSG_LENGTH(sizeof(*ndmsg));
+  for (rtattr = (struct rtattr *) ((char *) ndmsg + NLMSG_ALIGN(sizeof(*ndmsg)));
+       RTA_OK(rtattr, attrlen); rtattr = RTA_NEXT(rtattr, attrlen)) {
+    if (rtattr->rta_type == NDA_DST)
+      dst = RTA_DATA(rtattr);
+    else if (rtattr->rta_type == NDA_LLADDR && RTA_PAYLOAD(rtattr) == 6)
+      mac = (const u8 *) RTA_DATA(rtattr);
+  }
+  if (dst == NULL || mac == NULL)
+    return 0;
+
+  memset(&ss, 0, sizeof(ss));
+  set_sockaddr(&ss, ndmsg->ndm_family, (void *) dst);
+  mac_cache_set(&ss, (u8 *) mac);
+  (*(int *) data)++;
+
+  return 0;
+}
+
+/* Adds the kernel's neighbor table to the MAC cache. Returns the number of
+   entries added, or -1 on error. */
+static int mac_cache_load_netlink(void) {
+  int fd, n;
+
+  fd = netlink_open();
+  if (fd == -1)
+    return -1;
+  n = 0;
+  if (netlink_dump(fd, RTM_GETNEIGH, AF_UNSPEC, mac_cache_add_neigh, &n) == -1)
+    n = -1;
+  close(fd);
+
+  return n;
+}
+
 /* Does route_dst using the Linux-specific rtnetlink interface. See rtnetlink(3)
    and rtnetlink(7). */
 static int route_dst_netlink(const struct sockaddr_storage *dst,
@@ -3265,6 +3481,338 @@ static int route_dst_netlink(const struct sockaddr_storage *dst,
   }
 }
 
+/* route_dst is called for every target of a raw scan, and each
+   route_dst_netlink is a netlink socket and a round trip to the kernel. So
+   the answers are cached by destination block. The routes (and policy rule
+   destinations) of all tables are dumped once, and each answer is stored
+   for the largest block around the destination that no route or rule
+   prefix splits, which every address in the block therefore routes the
+   same way. Multipath routes pick a next hop per destination, so their
+   presence turns the cache off. The dump is refreshed every
+   ROUTE_CACHE_TIMEOUT seconds so that routing changes are noticed. */
+
+#define ROUTE_CACHE_TIMEOUT 10
+
+struct route_prefix {
+  u8 addr[16];
+  int len;
+};
+
+struct route_cache_entry {
+  u8 addr[16];                  /* Destination block, masked to len bits */
+  int len;
+  int routable;                 /* route_dst_netlink's return value */
+  struct route_nfo rnfo;
+  struct route_cache_entry *next;
+};
+
+struct route_cache {
+  int af;
+  int state;                    /* 0: not loaded, 1: usable, -1: unusable */
+  time_t loaded;
+  struct route_prefix *prefixes;
+  int num_prefixes, max_prefixes;
+  struct route_cache_entry **buckets;
+  unsigned int num_buckets, num_entries;
+  unsigned char lens[129];      /* Nonzero for lengths that have entries */
+  /* The arguments the entries were looked up with. */
+  char device[64];
+  struct sockaddr_storage spoofss;
+  int spoofed;
+};
+
+static struct route_cache route_caches[2]; /* IPv4, IPv6 */
+static unsigned long route_cache_hits, route_cache_misses;
+
+static int route_cache_bits(int af) {
+  return (af == AF_INET) ? 32 : 128;
+}
+
+static const u8 *route_cache_addr(const struct sockaddr_storage *ss) {
+  if (ss->ss_family == AF_INET)
+    return (const u8 *) &((const struct sockaddr_in *) ss)->sin_addr;
+  else
+    return ((const struct sockaddr_in6 *) ss)->sin6_addr.s6_addr;
+}
+
+/* Copies the first len bits of src to dst and zeroes the rest. */
+static void route_cache_mask(u8 *dst, const u8 *src, int len, int bits) {
+  int i;
+
+  for (i = 0; i < bits / 8; i++) {
+    if (len >= 8)
+      dst[i] = src[i];
+    else if (len > 0)
+      dst[i] = src[i] & (0xFF << (8 - len));
+    else
+      dst[i] = 0;
+    len -= 8;
+  }
+}
+
+/* Returns the number of leading bits that a and b have in common. */
+static int route_cache_common_bits(const u8 *a, const u8 *b, int bits) {
+  int i, n;
+  u8 x;
+
+  for (i = 0; i < bits / 8 && a[i] == b[i]; i++)
+    ;
+  n = i * 8;
+  if (i < bits / 8) {
+    for (x = a[i] ^ b[i]; !(x & 0x80); x <<= 1)
+      n++;
+  }
+
+  return n;
+}
+
+/* Entries are hashed on all 16 bytes of their addr; IPv4 ones are zero
+   after the first four. */
+static unsigned int route_cache_hash(const u8 *addr, int len) {
+  unsigned int h = 2166136261U;
+  int i;
+
+  for (i = 0; i < 16; i++)
+    h = (h ^ addr[i]) * 16777619U;
+
+  return (h ^ len) * 16777619U;
+}
+
+static void route_cache_flush(struct route_cache *rc) {
+  struct route_cache_entry *e, *next;
+  unsigned int i;
+
+  for (i = 0; i < rc->num_buckets; i++) {
+    for (e = rc->buckets[i]; e != NULL; e = next) {
+      next = e->next;
+      free(e);
+    }
+    rc->buckets[i] = NULL;
+  }
+  rc->num_entries = 0;
+  memset(rc->lens, 0, sizeof(rc->lens));
+}
+
+static void route_cache_add_prefix(struct route_cache *rc, int af,
+                                   const void *addr, int len) {
+  struct route_prefix *p;
+  int bits = route_cache_bits(af);
+
+  if (len < 0 || len > bits)
+    return;
+  if (rc->num_prefixes == rc->max_prefixes) {
+    rc->max_prefixes = (rc->max_prefixes == 0) ? 64 : rc->max_prefixes * 2;
+    rc->prefixes = (struct route_prefix *) safe_realloc(rc->prefixes,
+      rc->max_prefixes * sizeof(*rc->prefixes));
+  }
+  p = &rc->prefixes[rc->num_prefixes++];
+  memset(p->addr, 0, sizeof(p->addr));
+  if (addr != NULL)
+    route_cache_mask(p->addr, (const u8 *) addr, len, bits);
+  p->len = len;
+}
+
+/* netlink_dump handler that adds the destination prefix of a route or rule
+   to a route_cache. Returns -1 if the cache can't be used with it. */
+static int route_cache_add_msg(struct nlmsghdr *nlmsg, void *data) {
+  struct route_cache *rc = (struct route_cache *) data;
+  struct rtattr *rtattr;
+  const void *dst = NULL;
+  int af = rc->af;
+  int len, dst_len, attrlen;
+
+  if (nlmsg->nlmsg_type == RTM_NEWROUTE) {
+    struct rtmsg *rtmsg = (struct rtmsg *) NLMSG_DATA(nlmsg);
+
+    if (rtmsg->rtm_family != af)
+      return 0;
+    dst_len = rtmsg->rtm_dst_len;
+    rtattr = RTM_RTA(rtmsg);
+    attrlen = RTM_PAYLOAD(nlmsg);
+  } else if (nlmsg->nlmsg_type == RTM_NEWRULE) {
+    struct fib_rule_hdr *frh = (struct fib_rule_hdr *) NLMSG_DATA(nlmsg);
+
+    if (frh->family != af || frh->dst_len == 0)
+      return 0;
+    dst_len = frh->dst_len;
+    rtattr = (struct rtattr *) ((char *) frh + NLMSG_ALIGN(sizeof(*frh)));
+    attrlen = nlmsg->nlmsg_len - NLMSG_LENGTH(sizeof(*frh));
+  } else {
+    return 0;
+  }
+
+  len = route_cache_bits(af) / 8;
+  for (; RTA_OK(rtattr, attrlen); rtattr = RTA_NEXT(rtattr, attrlen)) {
+    if (rtattr->rta_type == RTA_MULTIPATH && nlmsg->nlmsg_type == RTM_NEWROUTE)
+      return -1;
+    /* RTA_DST and FRA_DST are the same attribute number. */
+    if (rtattr->rta_type == RTA_DST && RTA_PAYLOAD(rtattr) >= (unsigned int) len)
+      dst = RTA_DATA(rtattr);
+  }
+  route_cache_add_prefix(rc, af, dst, dst_len);
+
+  return 0;
+}
+
+/* Loads the prefixes that decide routing for af. Sets rc->state. */
+static void route_cache_load(struct route_cache *rc, int af) {
+  int fd;
+
+  route_cache_flush(rc);
+  rc->af = af;
+  rc->num_prefixes = 0;
+  rc->state = -1;
+  rc->loaded = time(NULL);
+
+  fd = netlink_open();
+  if (fd == -1)
+    return;
+  if (netlink_dump(fd, RTM_GETROUTE, af, route_cache_add_msg, rc) == 0
+      && netlink_dump(fd, RTM_GETRULE, af, route_cache_add_msg, rc) == 0)
+    rc->state = 1;
+  close(fd);
+
+  /* The kernel handles some addresses specially without any route saying
+     so. Keep them in blocks of their own. */
+  if (af == AF_INET) {
+    static const u8 zero[4] = { 0, 0, 0, 0 };
+    static const u8 multicast[4] = { 224, 0, 0, 0 };
+    static const u8 broadcast[4] = { 255, 255, 255, 255 };
+
+    route_cache_add_prefix(rc, af, zero, 32);
+    route_cache_add_prefix(rc, af, zero, 8);
+    route_cache_add_prefix(rc, af, multicast, 4);
+    route_cache_add_prefix(rc, af, broadcast, 32);
+  } else {
+    static const u8 zero[16] = { 0 };
+    static const u8 multicast[16] = { 0xff };
+    static const u8 linklocal[16] = { 0xfe, 0x80 };
+    static const u8 mapped[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+    route_cache_add_prefix(rc, af, zero, 128);
+    route_cache_add_prefix(rc, af, multicast, 8);
+    route_cache_add_prefix(rc, af, linklocal, 10);
+    route_cache_add_prefix(rc, af, mapped, 96);
+  }
+
+  if (rc->buckets == NULL) {
+    rc->num_buckets = 256;
+    rc->buckets = (struct route_cache_entry **) safe_zalloc(rc->num_buckets * sizeof(*rc->buckets));
+  }
+}
+
+static void route_cache_insert(struct route_cache *rc, struct route_cache_entry *e) {
+  unsigned int i, h;
+
+  if (rc->num_entries >= rc->num_buckets) {
+    struct route_cache_entry **old = rc->buckets, *o, *next;
+    unsigned int num_old = rc->num_buckets;
+
+    rc->num_buckets *= 2;
+    rc->buckets = (struct route_cache_entry **) safe_zalloc(rc->num_buckets * sizeof(*rc->buckets));
+    for (i = 0; i < num_old; i++) {
+      for (o = old[i]; o != NULL; o = next) {
+        next = o->next;
+        h = route_cache_hash(o->addr, o->len) & (rc->num_buckets - 1);
+        o->next = rc->buckets[h];
+        rc->buckets[h] = o;
+      }
+    }
+    free(old);
+  }
+  h = route_cache_hash(e->addr, e->len) & (rc->num_buckets - 1);
+  e->next = rc->buckets[h];
+  rc->buckets[h] = e;
+  rc->num_entries++;
+  rc->lens[e->len] = 1;
+}
+
+static int route_dst_cached(const struct sockaddr_storage *dst,
+                            struct route_nfo *rnfo, const char *device,
+                            const struct sockaddr_storage *spoofss) {
+  struct route_cache *rc;
+  struct route_cache_entry *e;
+  const u8 *addr;
+  u8 key[16];
+  int bits, len, i;
+
+  if (dst->ss_family == AF_INET)
+    rc = &route_caches[0];
+  else if (dst->ss_family == AF_INET6
+           && ((const struct sockaddr_in6 *) dst)->sin6_scope_id == 0)
+    rc = &route_caches[1];
+  else
+    return route_dst_netlink(dst, rnfo, device, spoofss);
+
+  if (rc->state == 0 || time(NULL) - rc->loaded >= ROUTE_CACHE_TIMEOUT)
+    route_cache_load(rc, dst->ss_family);
+  if (rc->state != 1)
+    return route_dst_netlink(dst, rnfo, device, spoofss);
+
+  /* The entries are only good for the same device and source address. */
+  if (device == NULL)
+    device = "";
+  if (strcmp(rc->device, device) != 0 || rc->spoofed != (spoofss != NULL)
+      || (spoofss != NULL && !sockaddr_storage_equal(&rc->spoofss, spoofss))) {
+    route_cache_flush(rc);
+    Strncpy(rc->device, device, sizeof(rc->device));
+    rc->spoofed = (spoofss != NULL);
+    if (spoofss != NULL)
+      rc->spoofss = *spoofss;
+  }
+
+  bits = route_cache_bits(dst->ss_family);
+  addr = route_cache_addr(dst);
+  memset(key, 0, sizeof(key));
+  for (len = bits; len >= 0; len--) {
+    if (!rc->lens[len])
+      continue;
+    route_cache_mask(key, addr, len, bits);
+    i = route_cache_hash(key, len) & (rc->num_buckets - 1);
+    for (e = rc->buckets[i]; e != NULL; e = e->next) {
+      if (e->len == len && memcmp(e->addr, key, sizeof(key)) == 0)
+        break;
+    }
+    if (e == NULL)
+      continue;
+
+    route_cache_hits++;
+    if (!e->routable)
+      return 0;
+    *rnfo = e->rnfo;
+    /* As in route_dst_netlink, the target is directly connected unless
+       there is a gateway other than the target itself. */
+    rnfo->direct_connect = rnfo->nexthop.ss_family == AF_UNSPEC
+      || sockaddr_storage_equal(dst, &rnfo->nexthop);
+    return 1;
+  }
+
+  /* Find the block around dst that no prefix splits: it has to be at
+     least as long as every prefix containing dst, and long enough to
+     exclude every prefix that doesn't. */
+  route_cache_misses++;
+  e = (struct route_cache_entry *) safe_zalloc(sizeof(*e));
+  e->len = 0;
+  for (i = 0; i < rc->num_prefixes; i++) {
+    const struct route_prefix *p = &rc->prefixes[i];
+    int common = route_cache_common_bits(p->addr, addr, bits);
+
+    if (common >= p->len)
+      len = p->len;
+    else
+      len = common + 1;
+    if (len > e->len)
+      e->len = len;
+  }
+  route_cache_mask(e->addr, addr, e->len, bits);
+  e->routable = route_dst_netlink(dst, &e->rnfo, device, spoofss);
+  if (e->routable)
+    *rnfo = e->rnfo;
+  route_cache_insert(rc, e);
+
+  return e->routable;
+}
+
 #else
 
 static struct interface_info *find_loopback_iface(struct interface_info *ifaces,
@@ -3497,12 +4045,23 @@ static int route_dst_generic(const struct sockaddr_storage *dst,
 int route_dst(const struct sockaddr_storage *dst, struct route_nfo *rnfo,
               const char *device, const struct sockaddr_storage *spoofss) {
 #ifdef HAVE_LINUX_RTNETLINK_H
-  return route_dst_netlink(dst, rnfo, device, spoofss);
+  return route_dst_cached(dst, rnfo, device, spoofss);
 #else
   return route_dst_generic(dst, rnfo, device, spoofss);
 #endif
 }
 
+/* Returns how many route_dst calls were answered from its cache and how many
+   had to ask the kernel. Both are zero where there is no cache. */
+void route_dst_cache_stats(unsigned long *hits, unsigned long *misses) {
+#ifdef HAVE_LINUX_RTNETLINK_H
+  *hits = route_cache_hits;
+  *misses = route_cache_misses;
+#else
+  *hits = *misses = 0;
+#endif
+}
+
 /* Wrapper for system function sendto(), which retries a few times when
  * the call fails. It also prints informational messages about the
  * errors encountered. It returns the number of bytes sent or -1 in
@@ -3577,30 +4136,38 @@ int send_ip_packet_eth(const struct eth_nfo *eth, const u8 *packet, unsigned int
 
 
 /* Send an IP packet over a raw socket. */
-int send_ip_packet_sd(int sd, const struct sockaddr_in *dst,
+/* It is bogus that I need the address and port info when sending a RAW IP
+   packet, but it doesn't seem to work w/o them */
+static void set_raw_dst_port(struct sockaddr_in *sock,
   const u8 *packet, unsigned int packetlen) {
-  struct sockaddr_in sock;
-  struct ip *ip = (struct ip *) packet;
-  struct tcp_hdr *tcp;
-  struct udp_hdr *udp;
-  int res;
-
-  assert(sd >= 0);
-  sock = *dst;
+  const struct ip *ip = (const struct ip *) packet;
+  const struct tcp_hdr *tcp;
+  const struct udp_hdr *udp;
 
-  /* It is bogus that I need the address and port info when sending a RAW IP 
-     packet, but it doesn't seem to work w/o them */
   if (packetlen >= 20) {
     if (ip->ip_p == IPPROTO_TCP
         && packetlen >= (unsigned int) ip->ip_hl * 4 + 20) {
-      tcp = (struct tcp_hdr *) ((u8 *) ip + ip->ip_hl * 4);
-      sock.sin_port = tcp->th_dport;
+      tcp = (const struct tcp_hdr *) ((const u8 *) ip + ip->ip_hl * 4);
+      sock->sin_port = tcp->th_dport;
     } else if (ip->ip_p == IPPROTO_UDP
                && packetlen >= (unsigned int) ip->ip_hl * 4 + 8) {
-      udp = (struct udp_hdr *) ((u8 *) ip + ip->ip_hl * 4);
-      sock.sin_port = udp->uh_dport;
+      udp = (const struct udp_hdr *) ((const u8 *) ip + ip->ip_hl * 4);
+      sock->sin_port = udp->uh_dport;
     }
   }
+}
+
+int send_ip_packet_sd(int sd, const struct sockaddr_in *dst,
+  const u8 *packet, unsigned int packetlen) {
+  struct sockaddr_in sock;
+#if (defined(FREEBSD) && (__FreeBSD_version < 1100030)) || BSDI || NETBSD || DEC || MACOSX
+  struct ip *ip = (struct ip *) packet;
+#endif
+  int res;
+
+  assert(sd >= 0);
+  sock = *dst;
+  set_raw_dst_port(&sock, packet, packetlen);
 
   /* Equally bogus is that the IP total len and IP fragment offset
      fields need to be in host byte order on certain BSD variants.  I
@@ -3627,6 +4194,61 @@ int send_ip_packet_sd(int sd, const struct sockaddr_in *dst,
 
 
 
+/* Send several IP packets over a raw socket. Where sendmmsg() is available
+ * they are handed to the kernel SEND_IP_PACKETS_CHUNK at a time; otherwise,
+ * and for any packet the kernel refuses, send_ip_packet_sd() is used so that
+ * errors are reported and retried the usual way. Returns the number of
+ * packets that were sent successfully. */
+int send_ip_packets_sd(int sd, const struct sockaddr_in *dsts,
+  const u8 *const *packets, const unsigned int *packetlens, int count) {
+  int i, nsent;
+
+  assert(sd >= 0);
+  nsent = 0;
+  i = 0;
+#ifdef HAVE_SENDMMSG
+  while (i < count) {
+    struct sockaddr_in socks[SEND_IP_PACKETS_CHUNK];
+    struct iovec iovs[SEND_IP_PACKETS_CHUNK];
+    struct mmsghdr msgs[SEND_IP_PACKETS_CHUNK];
+    int j, n, res;
+
+    n = MIN(count - i, SEND_IP_PACKETS_CHUNK);
+    memset(msgs, 0, n * sizeof(*msgs));
+    for (j = 0; j < n; j++) {
+      socks[j] = dsts[i + j];
+      set_raw_dst_port(&socks[j], packets[i + j], packetlens[i + j]);
+      iovs[j].iov_base = (void *) packets[i + j];
+      iovs[j].iov_len = packetlens[i + j];
+      msgs[j].msg_hdr.msg_name = &socks[j];
+      msgs[j].msg_hdr.msg_namelen = sizeof(socks[j]);
+      msgs[j].msg_hdr.msg_iov = &iovs[j];
+      msgs[j].msg_hdr.msg_iovlen = 1;
+    }
+    res = sendmmsg(sd, msgs, n, 0);
+    if (res > 0) {
+      i += res;
+      nsent += res;
+      continue;
+    }
+    /* The first packet of the chunk was refused. Let the single-packet path
+       report the error and apply its retry policy, then carry on batching. */
+    if (send_ip_packet_sd(sd, &dsts[i], packets[i], packetlens[i]) != -1)
+      nsent++;
+    i++;
+  }
+#else
+  for (; i < count; i++) {
+    if (send_ip_packet_sd(sd, &dsts[i], packets[i], packetlens[i]) != -1)
+      nsent++;
+  }
+#endif
+
+  return nsent;
+}
+
+
+
 /* Sends the supplied pre-built IPv4 packet. The packet is sent through
  * the raw socket "sd" if "eth" is NULL. Otherwise, it gets sent at raw
  * ethernet level. */
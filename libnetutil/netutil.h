@@ -231,16 +231,22 @@ int resolve_numeric(const char *ip, unsigned short port,
 int ip_is_reserved(struct in_addr *ip);
 
 
-/* A couple of trivial functions that maintain a cache of IP to MAC
- * Address entries. Function mac_cache_get() looks for the IPv4 address
+/* A couple of functions that maintain a cache of IP to MAC Address
+ * entries. Function mac_cache_get() looks for the IPv4 or IPv6 address
  * in ss and fills in the 'mac' parameter and returns true if it is
  * found.  Otherwise (not found), the function returns false.
  * Function mac_cache_set() adds an entry with the given ip (ss) and
  * mac address.  An existing entry for the IP ss will be overwritten
- * with the new MAC address.  mac_cache_set() always returns true. */
+ * with the new MAC address.  mac_cache_set() returns true unless ss is
+ * not an IPv4 or IPv6 address. */
 int mac_cache_get(const struct sockaddr_storage *ss, u8 *mac);
 int mac_cache_set(const struct sockaddr_storage *ss, u8 *mac);
 
+/* Adds the entries of the system's ARP and neighbor tables to the MAC
+ * cache. Returns the number of entries added, or -1 if the tables can't
+ * be read on this platform. */
+int mac_cache_load_system(void);
+
 const void *ip_get_data(const void *packet, unsigned int *len,
   struct abstract_ip_hdr *hdr);
 const void *ip_get_data_any(const void *packet, unsigned int *len,
@@ -486,9 +492,19 @@ const char *ippackethdrinfo(const u8 *packet, u32 len, int detail);
 int route_dst(const struct sockaddr_storage *dst, struct route_nfo *rnfo,
               const char *device, const struct sockaddr_storage *spoofss);
 
+/* Returns how many route_dst calls were answered from its cache and how many
+   had to ask the kernel. Both are zero where there is no cache. */
+void route_dst_cache_stats(unsigned long *hits, unsigned long *misses);
+
 /* Send an IP packet over a raw socket. */
 int send_ip_packet_sd(int sd, const struct sockaddr_in *dst, const u8 *packet, unsigned int packetlen);
 
+/* Send several IP packets over a raw socket, using sendmmsg() where the
+ * platform has it. Returns the number of packets sent successfully. */
+#define SEND_IP_PACKETS_CHUNK 64
+int send_ip_packets_sd(int sd, const struct sockaddr_in *dsts,
+  const u8 *const *packets, const unsigned int *packetlens, int count);
+
 /* Send an IP packet over an ethernet handle. */
 int send_ip_packet_eth(const struct eth_nfo *eth, const u8 *packet, unsigned int packetlen);
 
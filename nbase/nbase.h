@@ -561,11 +561,15 @@ char *executable_path(const char *argv0);
 /* addrset management functions and definitions */
 /* A set of addresses. Used to match against allow/deny lists. */
 struct addrset_elem;
+struct addrset_index;
 
 /* A set of addresses. Used to match against allow/deny lists. */
 struct addrset {
     /* Linked list of struct addset_elem. */
     struct addrset_elem *head;
+    /* Sorted lookup tables built from head the first time addrset_contains
+       is called, and thrown away whenever a spec is added. */
+    struct addrset_index *index;
 };
 
 void nbase_set_log(void (*log_user_func)(const char *, ...),void (*log_debug_func)(const char *, ...));
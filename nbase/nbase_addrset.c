@@ -149,9 +149,12 @@ void nbase_set_log(void (*log_user_func)(const char *, ...),void (*log_debug_fun
         log_debug = log_debug_func;
 }
 
+static void addrset_clear_index(struct addrset *set);
+
 void addrset_init(struct addrset *set)
 {
     set->head = NULL;
+    set->index = NULL;
 }
 
 void addrset_free(struct addrset *set)
@@ -162,6 +165,7 @@ void addrset_free(struct addrset *set)
         next = elem->next;
         free(elem);
     }
+    addrset_clear_index(set);
 }
 
 /* A debugging function to print out the contents of an addrset_elem. For IPv4
@@ -270,6 +274,9 @@ int addrset_add_spec(struct addrset *set, const char *spec, int af, int dns)
     struct addrset_elem *elem;
     int rc;
 
+    /* The lookup tables are rebuilt once all the specs are in. */
+    addrset_clear_index(set);
+
     /* Make a copy of the spec to mess with. */
     local_spec = strdup(spec);
     if (local_spec == NULL)
@@ -637,12 +644,346 @@ static int addrset_elem_match(const struct addrset_elem *elem, const struct sock
     return 0;
 }
 
-int addrset_contains(const struct addrset *set, const struct sockaddr *sa)
+/* Exclude and allow lists can have hundreds of thousands of entries, and
+   walking the list of elements for every address gets slow. So the first
+   addrset_contains after a change flattens the elements into sorted,
+   disjoint address ranges, which are binary searched. A CIDR block is a
+   single range, and so is an IPv4 element whose octet ranges end in full
+   octets (10.1-5.*.*). Other IPv4 elements become one range per
+   combination of leading octets, up to ADDRSET_MAX_EXPAND; anything bigger,
+   like 1-100.1-100.1-100.1,3, stays on a short list tested one by one. */
+
+#define ADDRSET_MAX_EXPAND 4096
+
+/* An inclusive range of IPv4 addresses in host byte order. */
+struct addrset_ipv4_range {
+    u32 lo, hi;
+};
+
+#ifdef HAVE_IPV6
+/* An inclusive range of IPv6 addresses. */
+struct addrset_ipv6_range {
+    uint8_t lo[16], hi[16];
+};
+#endif
+
+struct addrset_index {
+    struct addrset_ipv4_range *ipv4;
+    size_t num_ipv4, max_ipv4;
+#ifdef HAVE_IPV6
+    struct addrset_ipv6_range *ipv6;
+    size_t num_ipv6, max_ipv6;
+#endif
+    const struct addrset_elem **other;
+    size_t num_other, max_other;
+};
+
+static void addrset_clear_index(struct addrset *set)
 {
-    struct addrset_elem *elem;
+    if (set->index == NULL)
+        return;
+    free(set->index->ipv4);
+#ifdef HAVE_IPV6
+    free(set->index->ipv6);
+#endif
+    free(set->index->other);
+    free(set->index);
+    set->index = NULL;
+}
+
+/* Makes room for one more entry in an array of *max entries of size bytes
+   that has n in use. */
+static void *grow_array(void *array, size_t n, size_t *max, size_t size)
+{
+    if (n < *max)
+        return array;
+    *max = (*max == 0) ? 64 : *max * 2;
+
+    return safe_realloc(array, *max * size);
+}
+
+static void index_add_ipv4_range(struct addrset_index *index, u32 lo, u32 hi)
+{
+    index->ipv4 = (struct addrset_ipv4_range *) grow_array(index->ipv4,
+        index->num_ipv4, &index->max_ipv4, sizeof(*index->ipv4));
+    index->ipv4[index->num_ipv4].lo = lo;
+    index->ipv4[index->num_ipv4].hi = hi;
+    index->num_ipv4++;
+}
+
+static int octet_is_full(const octet_bitvector bits)
+{
+    const size_t num_bitvector = sizeof(octet_bitvector) / sizeof(bitvector_t);
+    size_t i;
+
+    for (i = 0; i < num_bitvector; i++) {
+        if (bits[i] != ~(bitvector_t) 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Returns the first value in bits that is at least from, or 256 if there is
+   none. Whole words are skipped at a time, since most octets of most
+   elements have a single value. */
+static int octet_next(const octet_bitvector bits, int from)
+{
+    while (from < 256) {
+        if (bits[from / BITVECTOR_BITS] >> (from % BITVECTOR_BITS) == 0)
+            from = (from / BITVECTOR_BITS + 1) * BITVECTOR_BITS;
+        else if (BIT_IS_SET(bits, from))
+            return from;
+        else
+            from++;
+    }
+
+    return 256;
+}
+
+/* Counts the values in bits, or the runs of consecutive values if runs is
+   true. */
+static size_t octet_count(const octet_bitvector bits, int runs)
+{
+    size_t n;
+    int v;
+
+    n = 0;
+    for (v = octet_next(bits, 0); v < 256; v = octet_next(bits, v + 1)) {
+        if (!runs || v == 0 || !BIT_IS_SET(bits, v - 1))
+            n++;
+    }
+
+    return n;
+}
+
+/* Adds the ranges of an IPv4 element whose octets after last are all full,
+   fixing octets before last one value at a time. */
+static void index_expand_ipv4(struct addrset_index *index,
+    const octet_bitvector bits[4], int last, int i, u32 prefix)
+{
+    int shift = 8 * (3 - i);
+    u32 low = ((u32) 1 << shift) - 1;
+    int v, start;
+
+    if (i < last) {
+        for (v = octet_next(bits[i], 0); v < 256; v = octet_next(bits[i], v + 1))
+            index_expand_ipv4(index, bits, last, i + 1, prefix | (u32) v << shift);
+        return;
+    }
+
+    for (v = octet_next(bits[i], 0); v < 256; v = octet_next(bits[i], v + 1)) {
+        for (start = v; v + 1 < 256 && BIT_IS_SET(bits[i], v + 1); v++)
+            ;
+        index_add_ipv4_range(index, prefix | (u32) start << shift,
+            prefix | (u32) v << shift | low);
+    }
+}
+
+/* Adds an IPv4 element to the ranges. Returns 0 if it would take too many. */
+static int index_add_ipv4_elem(struct addrset_index *index,
+    const struct addrset_elem *elem)
+{
+    const octet_bitvector *bits = elem->u.ipv4.bits;
+    size_t count;
+    int last, i;
+
+    for (last = 3; last >= 0 && octet_is_full(bits[last]); last--)
+        ;
+    if (last < 0) {
+        index_add_ipv4_range(index, 0, 0xFFFFFFFF);
+        return 1;
+    }
+
+    count = octet_count(bits[last], 1);
+    for (i = 0; i < last; i++)
+        count *= octet_count(bits[i], 0);
+    if (count > ADDRSET_MAX_EXPAND)
+        return 0;
+    index_expand_ipv4(index, bits, last, 0, 0);
+
+    return 1;
+}
+
+static int ipv4_range_cmp(const void *a, const void *b)
+{
+    const struct addrset_ipv4_range *ra = (const struct addrset_ipv4_range *) a;
+    const struct addrset_ipv4_range *rb = (const struct addrset_ipv4_range *) b;
+
+    if (ra->lo < rb->lo)
+        return -1;
+    else if (ra->lo > rb->lo)
+        return 1;
+    return 0;
+}
 
+/* Sorts the ranges and merges the ones that overlap or touch. */
+static void index_merge_ipv4(struct addrset_index *index)
+{
+    struct addrset_ipv4_range *r = index->ipv4;
+    size_t i, n;
+
+    if (index->num_ipv4 == 0)
+        return;
+    qsort(r, index->num_ipv4, sizeof(*r), ipv4_range_cmp);
+    n = 0;
+    for (i = 1; i < index->num_ipv4; i++) {
+        if (r[n].hi == 0xFFFFFFFF || r[i].lo <= r[n].hi + 1) {
+            if (r[i].hi > r[n].hi)
+                r[n].hi = r[i].hi;
+        } else {
+            r[++n] = r[i];
+        }
+    }
+    index->num_ipv4 = n + 1;
+}
+
+static int index_match_ipv4(const struct addrset_index *index, const struct sockaddr *sa)
+{
+    u32 addr = ntohl(((const struct sockaddr_in *) sa)->sin_addr.s_addr);
+    size_t lo, hi, mid;
+
+    /* Find the last range that starts at or before addr. */
+    lo = 0;
+    hi = index->num_ipv4;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (index->ipv4[mid].lo <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo > 0 && addr <= index->ipv4[lo - 1].hi;
+}
+
+#ifdef HAVE_IPV6
+/* Adds an IPv6 element to the ranges. Returns 0 if its netmask is not a
+   prefix. */
+static int index_add_ipv6_elem(struct addrset_index *index,
+    const struct addrset_elem *elem)
+{
+    const uint8_t *a = elem->u.ipv6.addr.s6_addr;
+    const uint8_t *m = elem->u.ipv6.mask.s6_addr;
+    struct addrset_ipv6_range *r;
+    int i;
+
+    for (i = 0; i < 16 && m[i] == 0xFF; i++)
+        ;
+    if (i < 16 && (uint8_t) (m[i] | (m[i] - 1)) != 0xFF)
+        return 0;
+    for (i++; i < 16; i++) {
+        if (m[i] != 0)
+            return 0;
+    }
+
+    index->ipv6 = (struct addrset_ipv6_range *) grow_array(index->ipv6,
+        index->num_ipv6, &index->max_ipv6, sizeof(*index->ipv6));
+    r = &index->ipv6[index->num_ipv6++];
+    for (i = 0; i < 16; i++) {
+        r->lo[i] = a[i] & m[i];
+        r->hi[i] = a[i] | (uint8_t) ~m[i];
+    }
+
+    return 1;
+}
+
+static int ipv6_range_cmp(const void *a, const void *b)
+{
+    return memcmp(((const struct addrset_ipv6_range *) a)->lo,
+        ((const struct addrset_ipv6_range *) b)->lo, 16);
+}
+
+/* Sorts the ranges and merges the ones that overlap. */
+static void index_merge_ipv6(struct addrset_index *index)
+{
+    struct addrset_ipv6_range *r = index->ipv6;
+    size_t i, n;
+
+    if (index->num_ipv6 == 0)
+        return;
+    qsort(r, index->num_ipv6, sizeof(*r), ipv6_range_cmp);
+    n = 0;
+    for (i = 1; i < index->num_ipv6; i++) {
+        if (memcmp(r[i].lo, r[n].hi, 16) <= 0) {
+            if (memcmp(r[i].hi, r[n].hi, 16) > 0)
+                memcpy(r[n].hi, r[i].hi, 16);
+        } else {
+            r[++n] = r[i];
+        }
+    }
+    index->num_ipv6 = n + 1;
+}
+
+static int index_match_ipv6(const struct addrset_index *index, const struct sockaddr *sa)
+{
+    const uint8_t *addr = ((const struct sockaddr_in6 *) sa)->sin6_addr.s6_addr;
+    size_t lo, hi, mid;
+
+    lo = 0;
+    hi = index->num_ipv6;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (memcmp(index->ipv6[mid].lo, addr, 16) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo > 0 && memcmp(addr, index->ipv6[lo - 1].hi, 16) <= 0;
+}
+#endif
+
+static struct addrset_index *addrset_build_index(const struct addrset *set)
+{
+    struct addrset_index *index;
+    const struct addrset_elem *elem;
+    int ok;
+
+    index = (struct addrset_index *) safe_zalloc(sizeof(*index));
     for (elem = set->head; elem != NULL; elem = elem->next) {
-        if (addrset_elem_match(elem, sa))
+        ok = 0;
+        if (elem->type == ADDRSET_TYPE_IPV4_BITVECTOR)
+            ok = index_add_ipv4_elem(index, elem);
+#ifdef HAVE_IPV6
+        else if (elem->type == ADDRSET_TYPE_IPV6_NETMASK)
+            ok = index_add_ipv6_elem(index, elem);
+#endif
+        if (!ok) {
+            index->other = (const struct addrset_elem **) grow_array(index->other,
+                index->num_other, &index->max_other, sizeof(*index->other));
+            index->other[index->num_other++] = elem;
+        }
+    }
+    index_merge_ipv4(index);
+#ifdef HAVE_IPV6
+    index_merge_ipv6(index);
+#endif
+    log_debug("Indexed addrset: %lu IPv4 ranges, %lu elements unindexed.\n",
+        (unsigned long) index->num_ipv4, (unsigned long) index->num_other);
+
+    return index;
+}
+
+int addrset_contains(const struct addrset *set, const struct sockaddr *sa)
+{
+    const struct addrset_index *index;
+    size_t i;
+
+    /* The index is a cache of the element list, so building it doesn't
+       change the set as far as callers can tell. */
+    if (set->index == NULL)
+        ((struct addrset *) set)->index = addrset_build_index(set);
+    index = set->index;
+
+    if (sa->sa_family == AF_INET && index_match_ipv4(index, sa))
+        return 1;
+#ifdef HAVE_IPV6
+    if (sa->sa_family == AF_INET6 && index_match_ipv6(index, sa))
+        return 1;
+#endif
+    for (i = 0; i < index->num_other; i++) {
+        if (addrset_elem_match(index->other[i], sa))
             return 1;
     }
 
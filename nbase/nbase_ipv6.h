@@ -195,6 +195,12 @@ int sockaddr_storage_cmp(const struct sockaddr_storage *a,
 int sockaddr_storage_equal(const struct sockaddr_storage *a,
   const struct sockaddr_storage *b);
 
+/* Returns a hash of the address in a sockaddr_storage, suitable for indexing
+   a hash table by masking off the low bits. Only the family and address are
+   used, so addresses that are equal according to sockaddr_storage_cmp hash to
+   the same value. */
+unsigned int sockaddr_storage_hash(const struct sockaddr_storage *ss);
+
 /* This function is an easier version of inet_ntop because you don't
    need to pass a dest buffer.  Instead, it returns a static buffer that
    you can use until the function is called again (by the same or another
@@ -218,6 +218,36 @@ int sockaddr_storage_equal(const struct sockaddr_storage *a,
   return sockaddr_storage_cmp(a, b) == 0;
 }
 
+/* Mixes the bits of a 32-bit value so that addresses differing only in a few
+   bits (e.g. consecutive hosts in a subnet) spread across the whole range. */
+static unsigned int hash_mix32(u32 x) {
+  x ^= x >> 16;
+  x *= 0x7feb352dU;
+  x ^= x >> 15;
+  x *= 0x846ca68bU;
+  x ^= x >> 16;
+  return x;
+}
+
+/* Returns a hash of the address in a sockaddr_storage, suitable for indexing
+   a hash table by masking off the low bits. Only the family and address are
+   used, so addresses that are equal according to sockaddr_storage_cmp hash to
+   the same value. */
+unsigned int sockaddr_storage_hash(const struct sockaddr_storage *ss) {
+  if (ss->ss_family == AF_INET) {
+    const struct sockaddr_in *sin = (const struct sockaddr_in *) ss;
+    return hash_mix32(ntohl(sin->sin_addr.s_addr));
+  } else if (ss->ss_family == AF_INET6) {
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) ss;
+    u32 w[4];
+    memcpy(w, sin6->sin6_addr.s6_addr, sizeof(w));
+    return hash_mix32(w[0] ^ hash_mix32(w[1] ^ hash_mix32(w[2] ^ hash_mix32(w[3]))));
+  } else {
+    assert(0);
+  }
+  return 0; /* Not reached */
+}
+
 /* This function is an easier version of inet_ntop because you don't
    need to pass a dest buffer.  Instead, it returns a static buffer that
    you can use until the function is called again (by the same or another
@@ -227,6 +227,49 @@ test_addrset "1:2::0003/0" "1:2::3 1:2::0 1:2::ff 1:2::1ff 1:3::3 ff::00" <<EOF
 ff::00
 EOF
 
+# Overlapping and adjacent IPv4 specifications, which are merged.
+test_addrset "10.0.0.0/24 10.0.0.128/25 10.0.1.0/24 10.0.3.5-10 0-9.*.*.*" "10.0.0.0 10.0.0.255 10.0.1.255 10.0.3.5 10.0.3.10 9.255.255.255 0.0.0.0" <<EOF
+10.0.0.0
+10.0.0.255
+10.0.1.255
+10.0.2.0
+10.0.3.4
+10.0.3.5
+10.0.3.10
+10.0.3.11
+9.255.255.255
+255.255.255.255
+0.0.0.0
+EOF
+
+# Ranges that aren't contiguous blocks of addresses.
+test_addrset "1-100.1-100.1-100.1,3 1,3.*.*.7" "1.1.1.1 100.100.100.3 1.0.0.7 3.255.0.7" <<EOF
+1.1.1.1
+1.1.1.2
+100.100.100.3
+101.100.100.3
+1.0.0.7
+2.0.0.7
+3.255.0.7
+3.255.0.8
+EOF
+
+# The last address.
+test_addrset "255.255.255.255 255.255.255.254" "255.255.255.255 255.255.255.254" <<EOF
+255.255.255.255
+255.255.255.254
+255.255.255.253
+EOF
+
+# Overlapping IPv6 netmasks.
+test_addrset "1:2::/64 1:2::5/128 1:2:0:1::/64 ffff::/16" "1:2::ffff 1:2:0:1::1 ffff:1::" <<EOF
+1:2::ffff
+1:2:0:1::1
+1:2:0:2::1
+ffff:1::
+fffe::
+EOF
+
 # Name lookup.
 test_addrset "scanme.nmap.org" "scanme.nmap.org" <<EOF
 1:2::3:4
@@ -142,6 +142,7 @@
 #include "TargetGroup.h"
 #include "Target.h"
 #include "service_scan.h"
+#include "HostGroupPipeline.h"
 #include "charpool.h"
 #include "nmap_error.h"
 #include "utils.h"
@@ -258,7 +259,9 @@ static void printusage() {
          "  -PO[protocol list]: IP Protocol Ping\n"
          "  -n/-R: Never do DNS resolution/Always resolve [default: sometimes]\n"
          "  --dns-servers <serv1[,serv2],...>: Specify custom DNS servers\n"
+         "  --dns-cache <file>: Keep reverse DNS answers in <file> between runs\n"
          "  --system-dns: Use OS's DNS resolver\n"
+         "  --system-dns-threads <num>: Resolve <num> hosts at a time with --system-dns\n"
          "  --traceroute: Trace hop path to each host\n"
          "SCAN TECHNIQUES:\n"
          "  -sS/sT/sA/sW/sM: TCP SYN/Connect()/ACK/Window/Maimon scans\n"
@@ -282,6 +285,9 @@ static void printusage() {
          "  --version-intensity <level>: Set from 0 (light) to 9 (try all probes)\n"
          "  --version-light: Limit to most likely probes (intensity 2)\n"
          "  --version-all: Try every single probe (intensity 9)\n"
+         "  --version-threads <num>: Match responses in <num> background threads\n"
+         "  --version-shards <num>: Split version detection across <num> threads\n"
+         "  --version-cache <file>: Keep parsed nmap-service-probes in <file>\n"
          "  --version-trace: Show detailed version scan activity (for debugging)\n"
 #ifndef NOLUA
          "SCRIPT SCAN:\n"
@@ -300,11 +306,13 @@ static void printusage() {
          "  -O: Enable OS detection\n"
          "  --osscan-limit: Limit OS detection to promising targets\n"
          "  --osscan-guess: Guess OS more aggressively\n"
+         "  --osscan-threads <num>: Match OS fingerprints of <num> hosts at a time\n"
          "TIMING AND PERFORMANCE:\n"
          "  Options which take <time> are in seconds, or append 'ms' (milliseconds),\n"
          "  's' (seconds), 'm' (minutes), or 'h' (hours) to the value (e.g. 30m).\n"
          "  -T<0-5>: Set timing template (higher is faster)\n"
          "  --min-hostgroup/max-hostgroup <size>: Parallel host scan group sizes\n"
+         "  --pipeline-groups <num>: Port scan ahead while <num> groups finish\n"
          "  --min-parallelism/max-parallelism <numprobes>: Probe parallelization\n"
          "  --min-rtt-timeout/max-rtt-timeout/initial-rtt-timeout <time>: Specifies\n"
          "      probe round trip time.\n"
@@ -581,6 +589,8 @@ void parse_options(int argc, char **argv) {
     {"max-hostgroup", required_argument, 0, 0},
     {"min_hostgroup", required_argument, 0, 0},
     {"min-hostgroup", required_argument, 0, 0},
+    {"pipeline_groups", required_argument, 0, 0},
+    {"pipeline-groups", required_argument, 0, 0},
     {"open", no_argument, 0, 0},
     {"scanflags", required_argument, 0, 0},
     {"defeat_rst_ratelimit", no_argument, 0, 0},
@@ -616,6 +626,8 @@ void parse_options(int argc, char **argv) {
     {"osscan_guess", no_argument, 0, 0}, /* More guessing flexibility */
     {"osscan-guess", no_argument, 0, 0}, /* More guessing flexibility */
     {"fuzzy", no_argument, 0, 0}, /* Alias for osscan_guess */
+    {"osscan_threads", required_argument, 0, 0},
+    {"osscan-threads", required_argument, 0, 0},
     {"packet_trace", no_argument, 0, 0}, /* Display all packets sent/rcv */
     {"packet-trace", no_argument, 0, 0}, /* Display all packets sent/rcv */
     {"version_trace", no_argument, 0, 0}, /* Display -sV related activity */
@@ -656,14 +668,24 @@ void parse_options(int argc, char **argv) {
     {"version-light", no_argument, 0, 0},
     {"version_all", no_argument, 0, 0},
     {"version-all", no_argument, 0, 0},
+    {"version_threads", required_argument, 0, 0},
+    {"version-threads", required_argument, 0, 0},
+    {"version_shards", required_argument, 0, 0},
+    {"version-shards", required_argument, 0, 0},
+    {"version_cache", required_argument, 0, 0},
+    {"version-cache", required_argument, 0, 0},
     {"system_dns", no_argument, 0, 0},
     {"system-dns", no_argument, 0, 0},
+    {"system_dns_threads", required_argument, 0, 0},
+    {"system-dns-threads", required_argument, 0, 0},
     {"log_errors", no_argument, 0, 0},
     {"log-errors", no_argument, 0, 0},
     {"deprecated_xml_osclass", no_argument, 0, 0},
     {"deprecated-xml-osclass", no_argument, 0, 0},
     {"dns_servers", required_argument, 0, 0},
     {"dns-servers", required_argument, 0, 0},
+    {"dns_cache", required_argument, 0, 0},
+    {"dns-cache", required_argument, 0, 0},
     {"port-ratio", required_argument, 0, 0},
     {"port_ratio", required_argument, 0, 0},
     {"exclude-ports", required_argument, 0, 0},
@@ -760,6 +782,14 @@ void parse_options(int argc, char **argv) {
           o.setMinHostGroupSz(atoi(optarg));
           if (atoi(optarg) > 100)
             error("Warning: You specified a highly aggressive --min-hostgroup.");
+        } else if (optcmp(long_options[option_index].name, "pipeline-groups") == 0) {
+          o.pipeline_groups = atoi(optarg);
+          if (o.pipeline_groups < 0 || o.pipeline_groups > 16)
+            fatal("pipeline-groups must be between 0 and 16");
+#ifndef HAVE_PTHREAD
+          if (o.pipeline_groups > 0)
+            fatal("--pipeline-groups is not supported on this platform");
+#endif
         } else if (strcmp(long_options[option_index].name, "open") == 0) {
           o.setOpenOnly(true);
         } else if (strcmp(long_options[option_index].name, "scanflags") == 0) {
@@ -817,6 +847,24 @@ void parse_options(int argc, char **argv) {
           o.version_intensity = 2;
         } else if (optcmp(long_options[option_index].name, "version-all") == 0) {
           o.version_intensity = 9;
+        } else if (optcmp(long_options[option_index].name, "version-threads") == 0) {
+          o.version_threads = atoi(optarg);
+          if (o.version_threads < 0 || o.version_threads > 64)
+            fatal("version-threads must be between 0 and 64");
+#ifndef HAVE_PTHREAD
+          if (o.version_threads > 0)
+            fatal("--version-threads is not supported on this platform");
+#endif
+        } else if (optcmp(long_options[option_index].name, "version-shards") == 0) {
+          o.version_shards = atoi(optarg);
+          if (o.version_shards < 1 || o.version_shards > 64)
+            fatal("version-shards must be between 1 and 64");
+#ifndef HAVE_PTHREAD
+          if (o.version_shards > 1)
+            fatal("--version-shards is not supported on this platform");
+#endif
+        } else if (optcmp(long_options[option_index].name, "version-cache") == 0) {
+          o.version_cache = strdup(optarg);
         } else if (optcmp(long_options[option_index].name, "scan-delay") == 0) {
           l = tval2msecs(optarg);
           if (l < 0)
@@ -852,6 +900,14 @@ void parse_options(int argc, char **argv) {
         } else if (optcmp(long_options[option_index].name, "osscan-guess")  == 0
                    || strcmp(long_options[option_index].name, "fuzzy") == 0) {
           o.osscan_guess = 1;
+        } else if (optcmp(long_options[option_index].name, "osscan-threads") == 0) {
+          o.osscan_threads = atoi(optarg);
+          if (o.osscan_threads < 0 || o.osscan_threads > 64)
+            fatal("osscan-threads must be between 0 and 64");
+#ifndef HAVE_PTHREAD
+          if (o.osscan_threads > 0)
+            fatal("--osscan-threads is not supported on this platform");
+#endif
         } else if (optcmp(long_options[option_index].name, "packet-trace") == 0) {
           o.setPacketTrace(true);
 #ifndef NOLUA
@@ -903,8 +959,18 @@ void parse_options(int argc, char **argv) {
           o.setXSLStyleSheet(NULL);
         } else if (optcmp(long_options[option_index].name, "system-dns") == 0) {
           o.mass_dns = false;
+        } else if (optcmp(long_options[option_index].name, "system-dns-threads") == 0) {
+          o.system_dns_threads = atoi(optarg);
+          if (o.system_dns_threads < 0 || o.system_dns_threads > 256)
+            fatal("system-dns-threads must be between 0 and 256");
+#ifndef HAVE_PTHREAD
+          if (o.system_dns_threads > 0)
+            fatal("--system-dns-threads is not supported on this platform");
+#endif
         } else if (optcmp(long_options[option_index].name, "dns-servers") == 0) {
           o.dns_servers = strdup(optarg);
+        } else if (optcmp(long_options[option_index].name, "dns-cache") == 0) {
+          o.dns_cache = strdup(optarg);
         } else if (optcmp(long_options[option_index].name, "log-errors") == 0) {
           /*Nmap Log errors is deprecated and is now always enabled by default.
           This option is left in so as to not break anybody's scanning scripts.
@@ -1724,6 +1790,83 @@ void  apply_delayed_options() {
 
 }
 
+/* Prints the results of every host of a finished host group. */
+static void print_hostgroup(std::vector<Target *> &Targets) {
+  Target *currenths;
+  unsigned int targetno;
+  char hostname[MAXHOSTNAMELEN + 1] = "";
+
+  /* Keep the report of the group together even if another thread logs. */
+  log_lock();
+  for (targetno = 0; targetno < Targets.size(); targetno++) {
+    currenths = Targets[targetno];
+    /* Now I can do the output and such for each host */
+    if (currenths->timedOut(NULL)) {
+      xml_open_start_tag("host");
+      xml_attribute("starttime", "%lu", (unsigned long) currenths->StartTime());
+      xml_attribute("endtime", "%lu", (unsigned long) currenths->EndTime());
+      xml_close_start_tag();
+      write_host_header(currenths);
+      xml_end_tag(); /* host */
+      xml_newline();
+      log_write(LOG_PLAIN, "Skipping host %s due to host timeout\n",
+                currenths->NameIP(hostname, sizeof(hostname)));
+      log_write(LOG_MACHINE, "Host: %s (%s)\tStatus: Timeout\n",
+                currenths->targetipstr(), currenths->HostName());
+    } else {
+      /* --open means don't show any hosts without open ports. */
+      if (o.openOnly() && !currenths->ports.hasOpenPorts())
+        continue;
+
+      xml_open_start_tag("host");
+      xml_attribute("starttime", "%lu", (unsigned long) currenths->StartTime());
+      xml_attribute("endtime", "%lu", (unsigned long) currenths->EndTime());
+      xml_close_start_tag();
+      write_host_header(currenths);
+      printportoutput(currenths, &currenths->ports);
+      printmacinfo(currenths);
+      printosscanoutput(currenths);
+      printserviceinfooutput(currenths);
+#ifndef NOLUA
+      printhostscriptresults(currenths);
+#endif
+      if (o.traceroute)
+        printtraceroute(currenths);
+      printtimes(currenths);
+      log_write(LOG_PLAIN | LOG_MACHINE, "\n");
+      xml_end_tag(); /* host */
+      xml_newline();
+    }
+  }
+  log_flush_all();
+  log_unlock();
+}
+
+static void free_hostgroup(std::vector<Target *> &Targets) {
+  while (!Targets.empty()) {
+    delete Targets.back();
+    Targets.pop_back();
+  }
+}
+
+#ifdef HAVE_PTHREAD
+/* Runs the phases of a host group that come after the ones sending raw
+   packets, then prints and frees the group. This is what the HostGroupPipeline
+   thread does with each group when --pipeline-groups is given. */
+static void finish_hostgroup(std::vector<Target *> *Targets) {
+  if (!o.noportscan && o.servicescan)
+    service_scan(*Targets);
+
+#ifndef NOLUA
+  if (o.script || o.scriptversion)
+    script_scan(*Targets, SCRIPT_SCAN);
+#endif
+
+  print_hostgroup(*Targets);
+  free_hostgroup(*Targets);
+}
+#endif
+
 int nmap_main(int argc, char *argv[]) {
   int i;
   std::vector<Target *> Targets;
@@ -1744,9 +1887,12 @@ int nmap_main(int argc, char *argv[]) {
   int sourceaddrwarning = 0; /* Have we warned them yet about unguessable
                                 source addresses? */
   unsigned int targetno;
-  char hostname[MAXHOSTNAMELEN + 1] = "";
   struct sockaddr_storage ss;
   size_t sslen;
+  bool pipelined = false;
+#ifdef HAVE_PTHREAD
+  HostGroupPipeline *pipeline = NULL;
+#endif
 
   now = time(NULL);
   local_time = localtime(&now);
@@ -1972,6 +2118,17 @@ int nmap_main(int argc, char *argv[]) {
 
   HostGroupState hstate(o.ping_group_sz, o.randomize_hosts, argc, (const char **) argv);
 
+#ifdef HAVE_PTHREAD
+  if (o.pipeline_groups > 0) {
+    /* These tables are loaded on first use, which must not happen on two
+       threads at once. */
+    nmap_getservbyport(0, "tcp");
+    nmap_getprotbynum(0);
+    pipeline = new HostGroupPipeline(finish_hostgroup, o.pipeline_groups);
+    pipelined = true;
+  }
+#endif
+
   do {
     ideal_scan_group_sz = determineScanGroupSize(o.numhosts_scanned, &ports);
     while (Targets.size() < ideal_scan_group_sz) {
@@ -2060,8 +2217,16 @@ int nmap_main(int argc, char *argv[]) {
       Targets.push_back(currenths);
     }
 
-    if (Targets.size() == 0)
+    if (Targets.size() == 0) {
+#ifdef HAVE_PTHREAD
+      /* Scripts still running on earlier groups may add targets. */
+      if (pipelined && pipeline->busy()) {
+        pipeline->drain();
+        continue;
+      }
+#endif
       break; /* Couldn't find any more targets */
+    }
 
     // Set the variable for status printing
     o.numhosts_scanning = Targets.size();
@@ -2131,7 +2296,7 @@ int nmap_main(int argc, char *argv[]) {
         }
       }
 
-      if (o.servicescan) {
+      if (o.servicescan && !pipelined) {
         o.current_scantype = SERVICE_SCAN;
         service_scan(Targets);
       }
@@ -2145,65 +2310,38 @@ int nmap_main(int argc, char *argv[]) {
     if (o.traceroute)
       traceroute(Targets);
 
+#ifdef HAVE_PTHREAD
+    /* Version detection, scripts and output happen on the pipeline's thread,
+       while this one goes on with the next group. */
+    if (pipelined) {
+      o.numhosts_scanned += Targets.size();
+      pipeline->push(new std::vector<Target *>(Targets));
+      Targets.clear();
+      o.numhosts_scanning = 0;
+      continue;
+    }
+#endif
+
 #ifndef NOLUA
     if (o.script || o.scriptversion) {
       script_scan(Targets, SCRIPT_SCAN);
     }
 #endif
 
-    for (targetno = 0; targetno < Targets.size(); targetno++) {
-      currenths = Targets[targetno];
-      /* Now I can do the output and such for each host */
-      if (currenths->timedOut(NULL)) {
-        xml_open_start_tag("host");
-        xml_attribute("starttime", "%lu", (unsigned long) currenths->StartTime());
-        xml_attribute("endtime", "%lu", (unsigned long) currenths->EndTime());
-        xml_close_start_tag();
-        write_host_header(currenths);
-        xml_end_tag(); /* host */
-        xml_newline();
-        log_write(LOG_PLAIN, "Skipping host %s due to host timeout\n",
-                  currenths->NameIP(hostname, sizeof(hostname)));
-        log_write(LOG_MACHINE, "Host: %s (%s)\tStatus: Timeout\n",
-                  currenths->targetipstr(), currenths->HostName());
-      } else {
-        /* --open means don't show any hosts without open ports. */
-        if (o.openOnly() && !currenths->ports.hasOpenPorts())
-          continue;
-
-        xml_open_start_tag("host");
-        xml_attribute("starttime", "%lu", (unsigned long) currenths->StartTime());
-        xml_attribute("endtime", "%lu", (unsigned long) currenths->EndTime());
-        xml_close_start_tag();
-        write_host_header(currenths);
-        printportoutput(currenths, &currenths->ports);
-        printmacinfo(currenths);
-        printosscanoutput(currenths);
-        printserviceinfooutput(currenths);
-#ifndef NOLUA
-        printhostscriptresults(currenths);
-#endif
-        if (o.traceroute)
-          printtraceroute(currenths);
-        printtimes(currenths);
-        log_write(LOG_PLAIN | LOG_MACHINE, "\n");
-        xml_end_tag(); /* host */
-        xml_newline();
-      }
-    }
-    log_flush_all();
+    print_hostgroup(Targets);
 
     o.numhosts_scanned += Targets.size();
 
     /* Free all of the Targets */
-    while (!Targets.empty()) {
-      currenths = Targets.back();
-      delete currenths;
-      Targets.pop_back();
-    }
+    free_hostgroup(Targets);
     o.numhosts_scanning = 0;
   } while (!o.max_ips_to_scan || o.max_ips_to_scan > o.numhosts_scanned);
 
+#ifdef HAVE_PTHREAD
+  /* Waits for the groups still in the pipeline */
+  delete pipeline;
+#endif
+
 #ifndef NOLUA
   if (o.script) {
     script_scan(Targets, SCRIPT_POST_SCAN);
@@ -186,12 +186,17 @@
 #include "nmap_tty.h"
 #include "timing.h"
 #include "Target.h"
+#include "dnscache.h"
 
 #include <stdlib.h>
 #include <limits.h>
 #include <list>
 #include <vector>
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 extern NmapOps o;
 
 
@@ -257,6 +262,16 @@ static int read_timeouts[][4] = {
 // retransmission. This should almost never happen. (in milliseconds)
 #define WRITE_TIMEOUT 100
 
+// Number of buckets in the table of in-flight requests, which is indexed
+// by DNS id. Must be a power of two. Ids are handed out sequentially, so
+// requests on the wire at the same time rarely share a bucket.
+#define INFLIGHT_BUCKETS 4096
+
+// How long (in seconds) an NXDOMAIN answer is kept in the --dns-cache file.
+// We don't parse the SOA record that says how long it may be cached, so
+// use the three hour limit RFC 2308 recommends.
+#define NXDOMAIN_CACHE_TTL (3 * 60 * 60)
+
 
 //------------------- Internal Structures ---------------------
 
@@ -264,6 +279,16 @@ struct dns_server;
 struct request;
 typedef struct sockaddr_storage sockaddr_storage;
 
+// An intrusive doubly-linked list of requests, linked through
+// request::prev and request::next. A request is on at most one queue at a
+// time, so it can be unlinked in constant time from wherever it is.
+struct request_queue {
+  request *head;
+  request *tail;
+
+  request_queue() : head(NULL), tail(NULL) {}
+};
+
 struct dns_server {
   std::string hostname;
   sockaddr_storage addr;
@@ -273,8 +298,8 @@ struct dns_server {
   int reqs_on_wire;
   int capacity;
   int write_busy;
-  std::list<request *> to_process;
-  std::list<request *> in_process;
+  request_queue to_process;
+  request_queue in_process;
 };
 
 struct request {
@@ -285,6 +310,11 @@ struct request {
   dns_server *first_server;
   dns_server *curr_server;
   u16 id;
+  // Links for the server queue this request is on
+  request *prev;
+  request *next;
+  // Next request in the same in-flight bucket
+  request *bucket_next;
 };
 
 class HostElem
@@ -423,10 +453,16 @@ static std::list<request *> cname_reqs;
 static int total_reqs;
 static nsock_pool dnspool=NULL;
 
+/* Requests in some server's in_process queue, hashed by DNS id. */
+static request *inflight[INFLIGHT_BUCKETS];
+
 /* The DNS cache, not just for entries from /etc/hosts. */
 static HostCache host_cache;
+/* Answers kept between runs with --dns-cache. */
+static DNSCacheFile dns_cache_file;
 
 static int stat_actual, stat_ok, stat_nx, stat_sf, stat_trans, stat_dropped, stat_cname;
+static int stat_cache_hit, stat_cache_miss, stat_cache_expired;
 static struct timeval starttv;
 static int read_timeout_index;
 
@@ -442,6 +478,88 @@ static void put_dns_packet_on_wire(request *req);
 #define ACTION_CNAME_LIST 1
 #define ACTION_TIMEOUT 2
 
+//------------------- Request queues ---------------------
+
+static void queue_push_back(request_queue *q, request *req) {
+  req->next = NULL;
+  req->prev = q->tail;
+  if (q->tail)
+    q->tail->next = req;
+  else
+    q->head = req;
+  q->tail = req;
+}
+
+static void queue_push_front(request_queue *q, request *req) {
+  req->prev = NULL;
+  req->next = q->head;
+  if (q->head)
+    q->head->prev = req;
+  else
+    q->tail = req;
+  q->head = req;
+}
+
+static void queue_remove(request_queue *q, request *req) {
+  if (req->prev)
+    req->prev->next = req->next;
+  else
+    q->head = req->next;
+  if (req->next)
+    req->next->prev = req->prev;
+  else
+    q->tail = req->prev;
+  req->prev = req->next = NULL;
+}
+
+static request *queue_pop_front(request_queue *q) {
+  request *req = q->head;
+
+  if (req)
+    queue_remove(q, req);
+  return req;
+}
+
+// Marks a request as waiting for an answer from its current server.
+static void inflight_add(request *req) {
+  request **bucket = &inflight[req->id & (INFLIGHT_BUCKETS - 1)];
+
+  req->bucket_next = *bucket;
+  *bucket = req;
+  queue_push_front(&req->curr_server->in_process, req);
+}
+
+// Forgets an in-flight request, whether it was answered or timed out.
+static void inflight_remove(request *req) {
+  request **pp;
+
+  for (pp = &inflight[req->id & (INFLIGHT_BUCKETS - 1)]; *pp != NULL; pp = &(*pp)->bucket_next) {
+    if (*pp == req) {
+      *pp = req->bucket_next;
+      break;
+    }
+  }
+  req->bucket_next = NULL;
+  queue_remove(&req->curr_server->in_process, req);
+}
+
+// Finds the in-flight request for an answer with the given id received from
+// server. If the answer names an address (ip is non-NULL), it has to match
+// the request's target as well, because ids wrap around.
+static request *inflight_find(const dns_server *server, u16 id, const sockaddr_storage *ip) {
+  request *req;
+
+  for (req = inflight[id & (INFLIGHT_BUCKETS - 1)]; req != NULL; req = req->bucket_next) {
+    if (req->id != id || req->curr_server != server)
+      continue;
+    if (ip != NULL && !sockaddr_storage_equal(ip, req->targ->TargetSockAddr()))
+      continue;
+    return req;
+  }
+
+  return NULL;
+}
+
 //------------------- Misc code ---------------------
 
 static void output_summary() {
@@ -450,11 +568,15 @@ static void output_summary() {
 
   memcpy(&now, nsock_gettimeofday(), sizeof(struct timeval));
 
-  if (o.debugging && (tp%SUMMARY_DELAY == 0))
+  if (o.debugging && (tp%SUMMARY_DELAY == 0)) {
     log_write(LOG_STDOUT, "mass_rdns: %.2fs %d/%d [#: %lu, OK: %d, NX: %d, DR: %d, SF: %d, TR: %d]\n",
                     TIMEVAL_MSEC_SUBTRACT(now, starttv) / 1000.0,
                     tp, stat_actual,
                     (unsigned long) servs.size(), stat_ok, stat_nx, stat_dropped, stat_sf, stat_trans);
+    if (dns_cache_file.isOpen())
+      log_write(LOG_STDOUT, "mass_rdns: cache [HIT: %d, MISS: %d, EXP: %d]\n",
+                stat_cache_hit, stat_cache_miss, stat_cache_expired);
+  }
 }
 
 static void check_capacities(dns_server *tpserv) {
@@ -471,8 +593,9 @@ static void close_dns_servers() {
     if (serverI->connected) {
       nsock_iod_delete(serverI->nsd, NSOCK_PENDING_SILENT);
       serverI->connected = 0;
-      serverI->to_process.clear();
-      serverI->in_process.clear();
+      while (serverI->in_process.head != NULL)
+        inflight_remove(serverI->in_process.head);
+      serverI->to_process = request_queue();
     }
   }
 }
@@ -485,11 +608,8 @@ static void do_possible_writes() {
 
   for(servI = servs.begin(); servI != servs.end(); servI++) {
     if (servI->write_busy == 0 && servI->reqs_on_wire < servI->capacity) {
-      tpreq = NULL;
-      if (!servI->to_process.empty()) {
-        tpreq = servI->to_process.front();
-        servI->to_process.pop_front();
-      } else if (!new_reqs.empty()) {
+      tpreq = queue_pop_front(&servI->to_process);
+      if (tpreq == NULL && !new_reqs.empty()) {
         tpreq = new_reqs.front();
         tpreq->first_server = tpreq->curr_server = &*servI;
         new_reqs.pop_front();
@@ -510,7 +630,7 @@ static void write_evt_handler(nsock_pool nsp, nsock_event evt, void *req_v) {
   request *req = (request *) req_v;
 
   req->curr_server->write_busy = 0;
-  req->curr_server->in_process.push_front(req);
+  inflight_add(req);
 
   do_possible_writes();
 }
@@ -545,9 +665,7 @@ static void put_dns_packet_on_wire(request *req) {
 static int deal_with_timedout_reads() {
   std::list<dns_server>::iterator servI;
   std::list<dns_server>::iterator servItemp;
-  std::list<request *>::iterator reqI;
-  std::list<request *>::iterator nextI;
-  request *tpreq;
+  request *tpreq, *nextreq;
   struct timeval now;
   int tp, min_timeout = INT_MAX;
 
@@ -557,12 +675,8 @@ static int deal_with_timedout_reads() {
     SPM->printStats((double) (stat_ok + stat_nx + stat_dropped) / stat_actual, &now);
 
   for(servI = servs.begin(); servI != servs.end(); servI++) {
-    nextI = servI->in_process.begin();
-    if (nextI == servI->in_process.end()) continue;
-
-    do {
-      reqI = nextI++;
-      tpreq = *reqI;
+    for (tpreq = servI->in_process.head; tpreq != NULL; tpreq = nextreq) {
+      nextreq = tpreq->next;
 
       tp = TIMEVAL_MSEC_SUBTRACT(tpreq->timeout, now);
       if (tp > 0 && tp < min_timeout) min_timeout = tp;
@@ -570,7 +684,7 @@ static int deal_with_timedout_reads() {
       if (tp <= 0) {
         servI->capacity = (int) (servI->capacity * CAPACITY_MINOR_DOWN_SCALE);
         check_capacities(&*servI);
-        servI->in_process.erase(reqI);
+        inflight_remove(tpreq);
         servI->reqs_on_wire--;
 
         // If we've tried this server enough times, move to the next one
@@ -602,18 +716,17 @@ static int deal_with_timedout_reads() {
             delete tpreq;
 
             // **** OR We start at the back of this server's queue
-            //servItemp->to_process.push_back(tpreq);
+            //queue_push_back(&servItemp->to_process, tpreq);
           } else {
-            servItemp->to_process.push_back(tpreq);
+            queue_push_back(&servItemp->to_process, tpreq);
           }
         } else {
-          servI->to_process.push_back(tpreq);
+          queue_push_back(&servI->to_process, tpreq);
         }
 
+      }
     }
 
-    } while (nextI != servI->in_process.end());
-
   }
 
   if (min_timeout > 500) return 500;
@@ -621,72 +734,57 @@ static int deal_with_timedout_reads() {
 
 }
 
-// After processing a DNS response, we search through the IPs we're
-// looking for and update their results as necessary.
+// After processing a DNS response from server, we look up the request it
+// answers and update its results as necessary.
 // Returns non-zero if this matches a query we're looking for
-static int process_result(const sockaddr_storage &ip, const std::string &result, int action, u16 id)
+static int process_result(dns_server *server, const sockaddr_storage &ip, const std::string &result, int action, u16 id, u32 ttl = 0)
 {
-  std::list<dns_server>::iterator servI;
-  std::list<request *>::iterator reqI;
   request *tpreq;
 
-  for(servI = servs.begin(); servI != servs.end(); servI++)
-  {
-    /* TODO: This is higly inefficent we do on average
-     * (0.5 * servs.size() * in_process.size())
-     * iterations to find a a request, we should use a map
-     * to do this efficiently
-     */
-    for(reqI = servI->in_process.begin(); reqI != servI->in_process.end(); reqI++)
-    {
-      tpreq = *reqI;
-      if (id == tpreq->id)
-      {
-        if(!result.empty() && (!sockaddr_storage_equal(&ip, tpreq->targ->TargetSockAddr())))
-          continue;
-
-        if (action == ACTION_CNAME_LIST || action == ACTION_FINISHED)
-        {
-          servI->capacity += CAPACITY_UP_STEP;
-          check_capacities(&*servI);
+  tpreq = inflight_find(server, id, result.empty() ? NULL : &ip);
+  if (tpreq == NULL)
+    return 0;
 
-          if(!result.empty())
-          {
-            tpreq->targ->setHostName(result.c_str());
-            host_cache.add(* tpreq->targ->TargetSockAddr(), result);
-          }
-
-          servI->in_process.remove(tpreq);
-          servI->reqs_on_wire--;
+  if (action == ACTION_CNAME_LIST || action == ACTION_FINISHED)
+  {
+    server->capacity += CAPACITY_UP_STEP;
+    check_capacities(server);
 
-          total_reqs--;
+    if(!result.empty())
+    {
+      tpreq->targ->setHostName(result.c_str());
+      host_cache.add(* tpreq->targ->TargetSockAddr(), result);
+    }
+    if (action == ACTION_FINISHED)
+      dns_cache_file.add(*tpreq->targ->TargetSockAddr(), result, ttl);
 
-          if (action == ACTION_CNAME_LIST) cname_reqs.push_back(tpreq);
-          if (action == ACTION_FINISHED) delete tpreq;
-        }
-        else
-        {
-          memcpy(&tpreq->timeout, nsock_gettimeofday(), sizeof(struct timeval));
-          deal_with_timedout_reads();
-        }
+    inflight_remove(tpreq);
+    server->reqs_on_wire--;
 
-        do_possible_writes();
+    total_reqs--;
 
-        // Close DNS servers if we're all done so that we kill
-        // all events and return from nsock_loop immediateley
-        if (total_reqs == 0)
-          close_dns_servers();
-        return 1;
-      }
-    }
+    if (action == ACTION_CNAME_LIST) cname_reqs.push_back(tpreq);
+    if (action == ACTION_FINISHED) delete tpreq;
+  }
+  else
+  {
+    memcpy(&tpreq->timeout, nsock_gettimeofday(), sizeof(struct timeval));
+    deal_with_timedout_reads();
   }
 
-  return 0;
+  do_possible_writes();
+
+  // Close DNS servers if we're all done so that we kill
+  // all events and return from nsock_loop immediateley
+  if (total_reqs == 0)
+    close_dns_servers();
+  return 1;
 }
 
 // Nsock read handler. One nsock read for each DNS server exists at each
 // time. This function uses various helper functions as defined above.
 static void read_evt_handler(nsock_pool nsp, nsock_event evt, void *) {
+  dns_server *server = (dns_server *) nsock_iod_get_udata(nse_iod(evt));
   u8 *buf;
   int buflen;
 
@@ -718,7 +816,7 @@ static void read_evt_handler(nsock_pool nsp, nsock_event evt, void *) {
   if (DNS_HAS_ERR(f, DNS::ERR_NAME))
   {
     sockaddr_storage discard;
-    if(process_result(discard, "", ACTION_FINISHED, p.id))
+    if(process_result(server, discard, "", ACTION_FINISHED, p.id, NXDOMAIN_CACHE_TTL))
     {
       if (o.debugging >= TRACE_DEBUG_LEVEL)
         log_write(LOG_STDOUT, "mass_rdns: NXDOMAIN <id = %d>\n", p.id);
@@ -732,7 +830,7 @@ static void read_evt_handler(nsock_pool nsp, nsock_event evt, void *) {
   if (DNS_HAS_ERR(f, DNS::ERR_SERVFAIL))
   {
     sockaddr_storage discard;
-    if (process_result(discard, "", ACTION_TIMEOUT, p.id))
+    if (process_result(server, discard, "", ACTION_TIMEOUT, p.id))
     {
       if (o.debugging >= TRACE_DEBUG_LEVEL)
         log_write(LOG_STDOUT, "mass_rdns: SERVFAIL <id = %d>\n", p.id);
@@ -759,7 +857,7 @@ static void read_evt_handler(nsock_pool nsp, nsock_event evt, void *) {
 
           sockaddr_storage ip;
           if(DNS::Factory::ptrToIp(a.name, ip))
-            if (process_result(ip, ptr->value, ACTION_FINISHED, p.id))
+            if (process_result(server, ip, ptr->value, ACTION_FINISHED, p.id, a.ttl))
             {
               if (o.debugging >= TRACE_DEBUG_LEVEL)
               {
@@ -785,7 +883,7 @@ static void read_evt_handler(nsock_pool nsp, nsock_event evt, void *) {
               sockaddr_storage_iptop(&ip, ipstr);
               log_write(LOG_STDOUT, "mass_rdns: CNAME found for <%s>\n", ipstr);
             }
-            process_result(ip, "", ACTION_CNAME_LIST, p.id);
+            process_result(server, ip, "", ACTION_CNAME_LIST, p.id);
           }
           break;
         }
@@ -841,7 +939,7 @@ static void add_dns_server(char *ipaddrs) {
 static void connect_dns_servers() {
   std::list<dns_server>::iterator serverI;
   for(serverI = servs.begin(); serverI != servs.end(); serverI++) {
-    serverI->nsd = nsock_iod_new(dnspool, NULL);
+    serverI->nsd = nsock_iod_new(dnspool, &*serverI);
     if (o.spoofsource) {
       struct sockaddr_storage ss;
       size_t sslen;
@@ -1072,6 +1170,25 @@ static void init_servs(void) {
   }
 }
 
+/* Opens the --dns-cache file the first time it is needed. */
+static void init_dns_cache(void) {
+  static bool initialized = false;
+
+  if (initialized)
+    return;
+
+  initialized = true;
+
+  if (o.dns_cache == NULL)
+    return;
+
+  if (!dns_cache_file.open(o.dns_cache))
+    error("mass_dns: warning: Unable to use DNS cache file %s: %s",
+          o.dns_cache, errno == EWOULDBLOCK ? "in use by another Nmap" : strerror(errno));
+  else if (o.debugging)
+    log_write(LOG_STDOUT, "mass_rdns: Using DNS cache file %s\n", o.dns_cache);
+}
+
 //------------------- Main loops ---------------------
 
 
@@ -1088,6 +1205,7 @@ static void nmap_mass_rdns_core(Target **targets, int num_targets) {
 
   // If necessary, set up the dns server list
   init_servs();
+  init_dns_cache();
 
   if (servs.size() == 0 && firstrun) error("mass_dns: warning: Unable to "
                                            "determine any DNS servers. Reverse"
@@ -1115,10 +1233,31 @@ static void nmap_mass_rdns_core(Target **targets, int num_targets) {
       continue;
     }
 
+    // Or known from an earlier run
+    if (dns_cache_file.isOpen()) {
+      switch (dns_cache_file.lookup(*(*hostI)->TargetSockAddr(), res)) {
+        case DNSCACHE_HIT:
+          (*hostI)->setHostName(res.c_str());
+          host_cache.add(*(*hostI)->TargetSockAddr(), res);
+          stat_cache_hit++;
+          continue;
+        case DNSCACHE_NXDOMAIN:
+          stat_cache_hit++;
+          continue;
+        case DNSCACHE_EXPIRED:
+          stat_cache_expired++;
+          break;
+        default:
+          stat_cache_miss++;
+          break;
+      }
+    }
+
     tpreq = new request;
     tpreq->targ = *hostI;
     tpreq->tries = 0;
     tpreq->servers_tried = 0;
+    tpreq->prev = tpreq->next = tpreq->bucket_next = NULL;
 
     new_reqs.push_back(tpreq);
 
@@ -1209,6 +1348,121 @@ static void nmap_mass_rdns_core(Target **targets, int num_targets) {
 
 }
 
+#ifdef HAVE_PTHREAD
+// One getnameinfo() call made by a --system-dns-threads worker.
+struct SystemDNSJob {
+  Target *target;
+  struct sockaddr_storage ss;
+  size_t sslen;
+  char hostname[MAXHOSTNAMELEN + 1]; // Empty if there is no name
+};
+
+// Workers claim jobs in order and put their indexes on done once
+// getnameinfo() returns. Only the main thread looks at the Targets, the
+// stats and the progress meter.
+struct SystemDNSPool {
+  std::vector<SystemDNSJob> jobs;
+  size_t next; // Next job to hand out
+  std::vector<size_t> done; // Finished jobs the main thread hasn't seen
+  pthread_mutex_t lock; // Protects next and done
+  pthread_cond_t cond; // Signaled when done grows
+};
+
+static void *system_dns_worker(void *arg) {
+  SystemDNSPool *pool = (SystemDNSPool *) arg;
+  SystemDNSJob *job;
+  size_t i;
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->next < pool->jobs.size()) {
+    i = pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+
+    job = &pool->jobs[i];
+    if (getnameinfo((struct sockaddr *) &job->ss, job->sslen, job->hostname,
+                    sizeof(job->hostname), NULL, 0, NI_NAMEREQD) != 0)
+      job->hostname[0] = '\0';
+
+    pthread_mutex_lock(&pool->lock);
+    pool->done.push_back(i);
+    pthread_cond_signal(&pool->cond);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+// Resolves the hosts with up to o.system_dns_threads getnameinfo() calls at
+// a time.
+static void system_rdns_threaded(Target **targets, int num_targets) {
+  SystemDNSPool pool;
+  std::vector<pthread_t> threads;
+  std::vector<size_t> finished;
+  Target **hostI;
+  SystemDNSJob job;
+  pthread_t thread;
+  struct timeval now;
+  struct timespec until;
+  size_t i, completed = 0;
+
+  for (hostI = targets; hostI < targets+num_targets; hostI++) {
+    if (!(((*hostI)->flags & HOST_UP) || o.resolve_all) || o.noresolve)
+      continue;
+    job.target = *hostI;
+    if (job.target->TargetSockAddr(&job.ss, &job.sslen) != 0)
+      fatal("Failed to get target socket address.");
+    job.hostname[0] = '\0';
+    pool.jobs.push_back(job);
+  }
+  if (pool.jobs.empty())
+    return;
+
+  pool.next = 0;
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.cond, NULL);
+  for (i = 0; i < (size_t) o.system_dns_threads && i < pool.jobs.size(); i++) {
+    if (pthread_create(&thread, NULL, system_dns_worker, &pool) != 0)
+      fatal("%s: failed to create DNS resolution thread", __func__);
+    threads.push_back(thread);
+  }
+
+  pthread_mutex_lock(&pool.lock);
+  while (completed < pool.jobs.size()) {
+    if (pool.done.empty()) {
+      // Wake up now and then to answer keypresses.
+      gettimeofday(&now, NULL);
+      TIMEVAL_MSEC_ADD(now, now, 200);
+      until.tv_sec = now.tv_sec;
+      until.tv_nsec = now.tv_usec * 1000;
+      pthread_cond_timedwait(&pool.cond, &pool.lock, &until);
+    }
+    finished.swap(pool.done);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (i = 0; i < finished.size(); i++) {
+      SystemDNSJob *done = &pool.jobs[finished[i]];
+      if (done->hostname[0] != '\0') {
+        stat_ok++;
+        done->target->setHostName(done->hostname);
+      }
+    }
+    completed += finished.size();
+    finished.clear();
+
+    if (keyWasPressed())
+      SPM->printStats((double) completed / stat_actual, NULL);
+
+    pthread_mutex_lock(&pool.lock);
+  }
+  pthread_mutex_unlock(&pool.lock);
+
+  for (i = 0; i < threads.size(); i++)
+    pthread_join(threads[i], NULL);
+  pthread_cond_destroy(&pool.cond);
+  pthread_mutex_destroy(&pool.lock);
+}
+#endif
+
 static void nmap_system_rdns_core(Target **targets, int num_targets) {
   Target **hostI;
   Target *currenths;
@@ -1227,6 +1481,15 @@ static void nmap_system_rdns_core(Target **targets, int num_targets) {
   Snprintf(spmobuf, sizeof(spmobuf), "System DNS resolution of %d host%s.", num_targets, num_targets-1 ? "s" : "");
   SPM = new ScanProgressMeter(spmobuf);
 
+#ifdef HAVE_PTHREAD
+  if (o.system_dns_threads > 0) {
+    system_rdns_threaded(targets, num_targets);
+    SPM->endTask(NULL, NULL);
+    delete SPM;
+    return;
+  }
+#endif
+
   for(i=0, hostI = targets; hostI < targets+num_targets; hostI++, i++) {
     currenths = *hostI;
 
@@ -1258,6 +1521,7 @@ void nmap_mass_rdns(Target **targets, int num_targets) {
   gettimeofday(&starttv, NULL);
 
   stat_actual = stat_ok = stat_nx = stat_sf = stat_trans = stat_dropped = stat_cname = 0;
+  stat_cache_hit = stat_cache_miss = stat_cache_expired = 0;
 
   if (o.mass_dns)
     nmap_mass_rdns_core(targets, num_targets);
@@ -1286,6 +1550,13 @@ void nmap_mass_rdns(Target **targets, int num_targets) {
     }
   }
 
+  // HIT:  Addresses answered from the --dns-cache file, with or without a name
+  // MISS: Addresses not in the file
+  // EXP:  Addresses whose answer in the file had expired
+  if (dns_cache_file.isOpen() && (o.debugging || o.verbose >= 3))
+    log_write(LOG_STDOUT, "DNS cache %s: [HIT: %d, MISS: %d, EXP: %d]\n",
+              o.dns_cache, stat_cache_hit, stat_cache_miss, stat_cache_expired);
+
   firstrun=0;
 }
 
@@ -23,6 +23,10 @@
 
 #include <math.h>
 
+#include <queue>
+#include <set>
+#include <vector>
+
 #define NSE_MAIN "NSE_MAIN" /* the main function */
 
 /* Script Scan phases */
@@ -51,13 +55,6 @@ extern NmapOps o;
 /* global object to store Pre-Scan and Post-Scan script results */
 static ScriptResults script_scan_results;
 
-static int timedOut (lua_State *L)
-{
-  Target *target = nseU_gettarget(L, 1);
-  lua_pushboolean(L, target->timedOut(NULL));
-  return 1;
-}
-
 static int startTimeOutClock (lua_State *L)
 {
   Target *target = nseU_gettarget(L, 1);
@@ -198,6 +195,120 @@ static int scan_progress_meter (lua_State *L)
   return 1;
 }
 
+/* The hosts whose timeout clocks are running during a script scan, ordered by
+   when they time out, so that the main loop of nse_main.lua only has to look
+   at hosts that are due rather than at every waiting thread. A host has at
+   most one entry. Its deadline can only move later (when its clock is stopped
+   and started again), so an entry that comes due early is simply checked
+   again and put back. */
+struct HostDeadline {
+  struct timeval deadline;
+  Target *target;
+  int ref; /* Registry reference to the host table */
+
+  /* Reversed, so that std::priority_queue gives the earliest deadline. */
+  bool operator< (const HostDeadline &other) const {
+    return TIMEVAL_AFTER(deadline, other.deadline);
+  }
+};
+
+struct HostTimeouts {
+  std::priority_queue<HostDeadline> deadlines;
+  std::set<Target *> watched; /* Targets with an entry in deadlines */
+};
+
+#define HOST_TIMEOUTS_METATABLE "HOST_TIMEOUTS"
+
+/* Releases the host tables held by a HostTimeouts and frees it. The userdata
+   holding it is left pointing at NULL. */
+static void host_timeouts_free (lua_State *L, HostTimeouts **htp)
+{
+  HostTimeouts *ht = *htp;
+
+  if (ht == NULL)
+    return;
+  while (!ht->deadlines.empty()) {
+    luaL_unref(L, LUA_REGISTRYINDEX, ht->deadlines.top().ref);
+    ht->deadlines.pop();
+  }
+  delete ht;
+  *htp = NULL;
+}
+
+/* Frees the heap of a run() that ended without closing it, e.g. on error. */
+static int host_timeouts_gc (lua_State *L)
+{
+  host_timeouts_free(L, (HostTimeouts **) luaL_checkudata(L, 1, HOST_TIMEOUTS_METATABLE));
+  return 0;
+}
+
+static int host_timeouts_op (lua_State *L)
+{
+  static const char * const ops[] = {"watch", "expired", "close", NULL};
+  HostTimeouts **htp = (HostTimeouts **) lua_touserdata(L, lua_upvalueindex(1));
+  HostTimeouts *ht = *htp;
+  HostDeadline hd;
+  struct timeval now;
+  int n;
+  int op;
+
+  op = luaL_checkoption(L, 1, NULL, ops);
+  if (ht == NULL)
+    return luaL_error(L, "host timeouts used after close");
+  switch (op)
+  {
+    case 0: /* watch */
+      hd.target = nseU_gettarget(L, 2);
+      if (ht->watched.count(hd.target) || !hd.target->timeOutDeadline(&hd.deadline))
+        return 0;
+      lua_pushvalue(L, 2);
+      hd.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+      ht->deadlines.push(hd);
+      ht->watched.insert(hd.target);
+      return 0;
+    case 1: /* expired */
+      /* Returns an array of the host tables that have timed out since the
+         last call. */
+      gettimeofday(&now, NULL);
+      lua_newtable(L);
+      n = 0;
+      while (!ht->deadlines.empty() && !TIMEVAL_AFTER(ht->deadlines.top().deadline, now)) {
+        hd = ht->deadlines.top();
+        ht->deadlines.pop();
+        if (hd.target->timedOut(&now)) {
+          lua_rawgeti(L, LUA_REGISTRYINDEX, hd.ref);
+          lua_rawseti(L, -2, ++n);
+        } else if (hd.target->timeOutDeadline(&hd.deadline)) {
+          ht->deadlines.push(hd);
+          continue;
+        }
+        luaL_unref(L, LUA_REGISTRYINDEX, hd.ref);
+        ht->watched.erase(hd.target);
+      }
+      return 1;
+    case 2: /* close */
+      host_timeouts_free(L, htp);
+      return 0;
+  }
+  return 0;
+}
+
+static int host_timeouts (lua_State *L)
+{
+  HostTimeouts **htp;
+
+  htp = (HostTimeouts **) lua_newuserdata(L, sizeof(HostTimeouts *));
+  *htp = NULL;
+  if (luaL_newmetatable(L, HOST_TIMEOUTS_METATABLE)) {
+    lua_pushcfunction(L, host_timeouts_gc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_setmetatable(L, -2);
+  *htp = new HostTimeouts;
+  lua_pushcclosure(L, host_timeouts_op, 1);
+  return 1;
+}
+
 /* This is like nmap.log_write, but doesn't append "NSE:" to the beginning of
    messages. It is only used internally by nse_main.lua and is not available to
    scripts. */
@@ -359,7 +470,7 @@ static void open_cnse (lua_State *L)
     {"fetchscript", fetchscript},
     {"key_was_pressed", key_was_pressed},
     {"scan_progress_meter", scan_progress_meter},
-    {"timedOut", timedOut},
+    {"host_timeouts", host_timeouts},
     {"startTimeOutClock", startTimeOutClock},
     {"stopTimeOutClock", stopTimeOutClock},
     {"ports", ports},
@@ -600,6 +711,9 @@ static int run_main (lua_State *L)
 {
   std::vector<Target *> *targets = (std::vector<Target*> *)
       lua_touserdata(L, 1);
+  /* Passed along rather than read from o.current_scantype, which the port scan
+     of the next host group may change meanwhile (--pipeline-groups). */
+  stype scantype = (stype) lua_tointeger(L, 2);
 
   /* New host group */
   lua_newtable(L);
@@ -633,7 +747,7 @@ static int run_main (lua_State *L)
   lua_settop(L, targets_table);
 
   /* Push script scan phase type. Second argument to NSE main function */
-  switch (o.current_scantype)
+  switch (scantype)
   {
     case SCRIPT_PRE_SCAN:
       lua_pushliteral(L, NSE_PRE_SCAN);
@@ -806,7 +920,8 @@ void script_scan (std::vector<Target *> &targets, stype scantype)
   lua_pushcfunction(L_NSE, nseU_traceback);
   lua_pushcfunction(L_NSE, run_main);
   lua_pushlightuserdata(L_NSE, &targets);
-  if (lua_pcall(L_NSE, 1, 0, 1))
+  lua_pushinteger(L_NSE, scantype);
+  if (lua_pcall(L_NSE, 2, 0, 1))
     error("%s: Script Engine Scan Aborted.\nAn error was thrown by the "
           "engine: %s", SCRIPT_ENGINE, lua_tostring(L_NSE, -1));
   lua_settop(L_NSE, 0);
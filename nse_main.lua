@@ -234,10 +234,6 @@ local function log_error (fmt, ...)
   log_write("stderr", format(fmt, ...));
 end
 
-local function table_size (t)
-  local n = 0; for _ in pairs(t) do n = n + 1; end return n;
-end
-
 local function loadscript (filename)
   local source = "@"..filename;
   local function ld ()
@@ -381,18 +377,12 @@ do
     end
   end
 
-  -- prerule/postrule scripts may be timed out in the future
-  -- based on start time and script lifetime?
-  function Thread:timed_out ()
-    if self.type == "hostrule" or self.type == "portrule" then
-      return cnse.timedOut(self.host);
-    end
-    return nil;
-  end
-
-  function Thread:start_time_out_clock ()
+  -- host_timeouts is told about the host so that run() learns when it times
+  -- out.
+  function Thread:start_time_out_clock (host_timeouts)
     if self.type == "hostrule" or self.type == "portrule" then
       cnse.startTimeOutClock(self.host);
+      host_timeouts("watch", self.host);
     end
   end
 
@@ -869,6 +859,10 @@ local function run (threads_iter, hosts)
   local total = 0; -- Number of threads, for record keeping.
   local timeouts = {}; -- A list to save and to track scripts timeout.
   local num_threads = 0; -- Number of script instances currently running.
+  local num_waiting = 0; -- Number of threads in waiting.
+  -- Hosts in the order they time out, and the hosts that have timed out but
+  -- still have threads.
+  local host_timeouts, timed_out = cnse.host_timeouts(), {};
 
   -- Map of yielded threads to the base Thread
   local yielded_base = setmetatable({}, {__mode = "kv"});
@@ -887,6 +881,7 @@ local function run (threads_iter, hosts)
       co = base.co;
       if waiting[co] then -- ignore a thread not waiting
         pending[co], waiting[co] = waiting[co], nil;
+        num_waiting = num_waiting - 1;
         pending[co].args = pack(...);
       end
     end
@@ -957,7 +952,8 @@ local function run (threads_iter, hosts)
       thread:start(timeouts);
     end
 
-    local nr, nw = table_size(running), table_size(waiting);
+    -- pending is always empty here, so every other thread is running.
+    local nr, nw = num_threads - num_waiting, num_waiting;
     if cnse.key_was_pressed() then
       print_verbose(1, "Active NSE Script Threads: %d (%d waiting)",
           nr+nw, nw);
@@ -980,24 +976,34 @@ local function run (threads_iter, hosts)
       end
     end
 
-    -- Checked for timed-out scripts and hosts.
-    for co, thread in pairs(waiting) do
-      if thread:timed_out() then
-        waiting[co], all[co], num_threads = nil, nil, num_threads-1;
-        thread:d("%THREAD %stimed out", thread.host
-            and format("%s%s ", thread.host.ip,
-                    thread.port and ":"..thread.port.number or "")
-            or "");
-        thread:close(timeouts, "timed out");
+    -- Check for timed-out hosts. Their threads are timed out as they wait.
+    for _, host in ipairs(host_timeouts "expired") do
+      timed_out[host] = true;
+    end
+    for host in pairs(timed_out) do
+      for co in pairs(timeouts[host] or {}) do
+        local thread = waiting[co];
+        if thread then
+          waiting[co], all[co], num_threads = nil, nil, num_threads-1;
+          num_waiting = num_waiting - 1;
+          thread:d("%THREAD %stimed out", thread.host
+              and format("%s%s ", thread.host.ip,
+                      thread.port and ":"..thread.port.number or "")
+              or "");
+          thread:close(timeouts, "timed out");
+        end
+      end
+      if not timeouts[host] then
+        timed_out[host] = nil;
       end
     end
 
     for co, thread in pairs(running) do
       current, running[co] = thread, nil;
-      thread:start_time_out_clock();
+      thread:start_time_out_clock(host_timeouts);
 
       if thread:resume(timeouts) then
-        waiting[co] = thread;
+        waiting[co], num_waiting = thread, num_waiting + 1;
       else
         all[co], num_threads = nil, num_threads-1;
       end
@@ -1013,6 +1019,7 @@ local function run (threads_iter, hosts)
     collectgarbage "step";
   end
 
+  host_timeouts "close";
   progress "endTask";
 end
 
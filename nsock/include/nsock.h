@@ -227,6 +227,24 @@ void nsock_pool_set_broadcast(nsock_pool nsp, int optval);
 /* Sets the name of the interface for new sockets to bind to. */
 void nsock_pool_set_device(nsock_pool nsp, const char *device);
 
+/* System call counters of a pool, to compare IO engines (see
+ * nsock_set_default_engine()). */
+struct nsock_pool_stats {
+  /* Name of the IO engine used by the pool */
+  const char *engine;
+  /* Calls to select(), poll(), epoll_wait() or kevent() to wait for events */
+  unsigned long wait_calls;
+  /* Readiness notifications returned by those calls */
+  unsigned long events;
+  /* Calls to epoll_ctl() or kevent() to change the watched events */
+  unsigned long ctl_calls;
+  /* Socket I/O calls: connect, send, recv, and their SSL counterparts */
+  unsigned long io_calls;
+};
+
+/* Fill in stats with the counters accumulated since the pool was created. */
+void nsock_pool_get_stats(nsock_pool nsp, struct nsock_pool_stats *stats);
+
 /* Initializes an Nsock pool to create SSL connections. This sets an internal
  * SSL_CTX, which is like a template that sets options for all connections that
  * are made from it. Returns the SSL_CTX so you can set your own options.
@@ -267,6 +285,16 @@ const char *nsock_list_engines(void);
  * NULL. */
 nsock_pool nsock_pool_new(void *udata);
 
+/* Same as nsock_pool_new(), with a bitmask of the following flags.
+ *
+ * NSOCK_POOL_TIMER_WHEEL: keep event timeouts in a hierarchical timing wheel
+ * instead of a binary heap. Adding and removing a timeout then costs O(1)
+ * instead of O(log n), which pays off for pools with many thousands of
+ * concurrent events that mostly complete before they time out. Timeouts are
+ * rounded up to the next millisecond. */
+#define NSOCK_POOL_TIMER_WHEEL (1 << 0)
+nsock_pool nsock_pool_new2(void *udata, int flags);
+
 /* If nsock_pool_new returned success, you must free the nsp when you are done with it
  * to conserve memory (and in some cases, sockets).  After this call, nsp may no
  * longer be used.  Any pending events are sent an NSE_STATUS_KILL callback and
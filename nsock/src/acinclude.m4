@@ -118,6 +118,30 @@ $1],[AC_MSG_RESULT([no])
 $2])
 ])dnl
 
+dnl Checks for the Linux io_uring(7) interface, with the extended argument
+dnl to io_uring_enter() that lets a wait time out (Linux 5.11).
+AC_DEFUN([AX_HAVE_IO_URING], [dnl
+  AC_MSG_CHECKING([for Linux io_uring(7) interface])
+  AC_CACHE_VAL([ax_cv_have_io_uring], [dnl
+    AC_LINK_IFELSE([dnl
+      AC_LANG_PROGRAM(
+        [#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <unistd.h>],
+        [struct io_uring_params p;
+struct io_uring_getevents_arg arg;
+int rc;
+rc = syscall(__NR_io_uring_setup, 1, &p);
+rc = syscall(__NR_io_uring_enter, rc, 0, 0, IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+rc = IORING_OP_POLL_ADD + IORING_FEAT_EXT_ARG;])],
+      [ax_cv_have_io_uring=yes],
+      [ax_cv_have_io_uring=no])])
+  AS_IF([test "${ax_cv_have_io_uring}" = "yes"],
+    [AC_MSG_RESULT([yes])
+$1],[AC_MSG_RESULT([no])
+$2])
+])dnl
+
 dnl Checks if PCAP_NETMASK_UNKNOWN is defined (has been since libpcap 1.1.1)
 dnl Sets it to 0 (no checking) if it's not defined.
 AC_DEFUN([PCAP_DEFINE_NETMASK_UNKNOWN],
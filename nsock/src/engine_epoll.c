@@ -90,6 +90,11 @@ static int epoll_iod_unregister(struct npool *nsp, struct niod *iod);
 static int epoll_iod_modify(struct npool *nsp, struct niod *iod, int ev_set, int ev_clr);
 static int epoll_loop(struct npool *nsp, int msec_timeout);
 
+static int epoll_et_iod_register(struct npool *nsp, struct niod *iod, int ev);
+static int epoll_et_iod_unregister(struct npool *nsp, struct niod *iod);
+static int epoll_et_iod_modify(struct npool *nsp, struct niod *iod, int ev_set, int ev_clr);
+static int epoll_et_loop(struct npool *nsp, int msec_timeout);
+
 
 /* ---- ENGINE DEFINITION ---- */
 struct io_engine engine_epoll = {
@@ -102,9 +107,24 @@ struct io_engine engine_epoll = {
   epoll_loop
 };
 
+/* Edge-triggered variant. Descriptors are registered once for all events and
+ * the engine remembers which ones were reported ready, instead of calling
+ * epoll_ctl() each time the set of watched events changes. */
+struct io_engine engine_epoll_et = {
+  "epoll_et",
+  epoll_init,
+  epoll_destroy,
+  epoll_et_iod_register,
+  epoll_et_iod_unregister,
+  epoll_et_iod_modify,
+  epoll_et_loop
+};
+
 
 /* --- INTERNAL PROTOTYPES --- */
+static int epoll_wait_events(struct npool *nsp, int msec_timeout, int poll_only);
 static void iterate_through_event_lists(struct npool *nsp, int evcount);
+static void iterate_through_ready_iods(struct npool *nsp, int evcount);
 
 /* defined in nsock_core.c */
 void process_iod_events(struct npool *nsp, struct niod *nsi, int ev);
@@ -120,7 +140,7 @@ int pcap_read_on_nonselect(struct npool *nsp);
 void update_first_events(struct nevent *nse);
 
 
-extern struct timeval nsock_tod;
+extern NSOCK_THREAD_LOCAL struct timeval nsock_tod;
 
 
 /*
@@ -133,6 +153,12 @@ struct epoll_engine_info {
   int evlen;
   /* list of epoll events, resized if necessary (when polling over large numbers of IODs) */
   struct epoll_event *events;
+  /* epoll_et only: IODs that were reported ready for some of the events they
+   * watch and that have to be serviced without waiting for another edge. May
+   * contain stale entries, only those with IOD_READY set are valid. */
+  struct niod **ready;
+  int ready_count;
+  int ready_len;
 };
 
 
@@ -144,6 +170,9 @@ int epoll_init(struct npool *nsp) {
   einfo->epfd = epoll_create(10); /* argument is ignored */
   einfo->evlen = INITIAL_EV_COUNT;
   einfo->events = (struct epoll_event *)safe_malloc(einfo->evlen * sizeof(struct epoll_event));
+  einfo->ready = NULL;
+  einfo->ready_count = 0;
+  einfo->ready_len = 0;
 
   nsp->engine_data = (void *)einfo;
 
@@ -156,6 +185,7 @@ void epoll_destroy(struct npool *nsp) {
   assert(einfo != NULL);
   close(einfo->epfd);
   free(einfo->events);
+  free(einfo->ready);
   free(einfo);
 }
 
@@ -180,6 +210,7 @@ int epoll_iod_register(struct npool *nsp, struct niod *iod, int ev) {
     epev.events |= EPOLL_X_FLAGS;
 
   sd = nsock_iod_get_sd(iod);
+  nsp->stats.ctl_calls++;
   if (epoll_ctl(einfo->epfd, EPOLL_CTL_ADD, sd, &epev) < 0)
     fatal("Unable to register IOD #%lu: %s", iod->id, strerror(errno));
 
@@ -197,6 +228,7 @@ int epoll_iod_unregister(struct npool *nsp, struct niod *iod) {
     int sd;
 
     sd = nsock_iod_get_sd(iod);
+    nsp->stats.ctl_calls++;
     epoll_ctl(einfo->epfd, EPOLL_CTL_DEL, sd, NULL);
 
     IOD_PROPCLR(iod, IOD_REGISTERED);
@@ -236,6 +268,7 @@ int epoll_iod_modify(struct npool *nsp, struct niod *iod, int ev_set, int ev_clr
 
   sd = nsock_iod_get_sd(iod);
 
+  nsp->stats.ctl_calls++;
   if (epoll_ctl(einfo->epfd, EPOLL_CTL_MOD, sd, &epev) < 0)
     fatal("Unable to update events for IOD #%lu: %s", iod->id, strerror(errno));
 
@@ -243,10 +276,7 @@ int epoll_iod_modify(struct npool *nsp, struct niod *iod, int ev_set, int ev_clr
 }
 
 int epoll_loop(struct npool *nsp, int msec_timeout) {
-  int results_left = 0;
-  int event_msecs; /* msecs before an event goes off */
-  int combined_msecs;
-  int sock_err = 0;
+  int results_left;
   unsigned int iod_count;
   struct epoll_engine_info *einfo = (struct epoll_engine_info *)nsp->engine_data;
 
@@ -262,16 +292,122 @@ int epoll_loop(struct npool *nsp, int msec_timeout) {
     einfo->events = (struct epoll_event *)safe_realloc(einfo->events, einfo->evlen * sizeof(struct epoll_event));
   }
 
-  do {
-    struct nevent *nse;
+  results_left = epoll_wait_events(nsp, msec_timeout, 0);
+  if (results_left == -1)
+    return -1;
+
+  iterate_through_event_lists(nsp, results_left);
+
+  return 1;
+}
+
+int epoll_et_iod_register(struct npool *nsp, struct niod *iod, int ev) {
+  int sd;
+  struct epoll_event epev;
+  struct epoll_engine_info *einfo = (struct epoll_engine_info *)nsp->engine_data;
+
+  /* pcap descriptors don't report would-block conditions the way sockets do,
+   * keep them on the level-triggered code path */
+  if (iod->pcap)
+    return epoll_iod_register(nsp, iod, ev);
+
+  assert(!IOD_PROPGET(iod, IOD_REGISTERED));
+
+  iod->watched_events = ev;
+  iod->ready_events = EV_NONE;
+
+  memset(&epev, 0x00, sizeof(struct epoll_event));
+  epev.events = EPOLLET | EPOLL_R_FLAGS | EPOLL_W_FLAGS | EPOLL_X_FLAGS;
+  epev.data.ptr = (void *)iod;
+
+  sd = nsock_iod_get_sd(iod);
+  nsp->stats.ctl_calls++;
+  if (epoll_ctl(einfo->epfd, EPOLL_CTL_ADD, sd, &epev) < 0)
+    fatal("Unable to register IOD #%lu: %s", iod->id, strerror(errno));
+
+  IOD_PROPSET(iod, IOD_REGISTERED);
+  return 1;
+}
+
+int epoll_et_iod_unregister(struct npool *nsp, struct niod *iod) {
+  IOD_PROPCLR(iod, IOD_READY);
+  iod->ready_events = EV_NONE;
+  return epoll_iod_unregister(nsp, iod);
+}
+
+static void ready_push(struct epoll_engine_info *einfo, struct niod *iod) {
+  if (IOD_PROPGET(iod, IOD_READY))
+    return;
+
+  if (einfo->ready_count == einfo->ready_len) {
+    einfo->ready_len = einfo->ready_len ? einfo->ready_len * 2 : INITIAL_EV_COUNT;
+    einfo->ready = (struct niod **)safe_realloc(einfo->ready, einfo->ready_len * sizeof(struct niod *));
+  }
+  einfo->ready[einfo->ready_count++] = iod;
+  IOD_PROPSET(iod, IOD_READY);
+}
+
+int epoll_et_iod_modify(struct npool *nsp, struct niod *iod, int ev_set, int ev_clr) {
+  struct epoll_engine_info *einfo = (struct epoll_engine_info *)nsp->engine_data;
+
+  if (iod->pcap)
+    return epoll_iod_modify(nsp, iod, ev_set, ev_clr);
+
+  assert((ev_set & ev_clr) == 0);
+  assert(IOD_PROPGET(iod, IOD_REGISTERED));
+
+  /* The kernel already watches everything, but an IOD that is known to be ready
+   * won't get another edge until the I/O code hits a would-block condition. */
+  iod->watched_events = (iod->watched_events | ev_set) & ~ev_clr;
+  if (iod->ready_events & iod->watched_events)
+    ready_push(einfo, iod);
+
+  return 1;
+}
+
+int epoll_et_loop(struct npool *nsp, int msec_timeout) {
+  int results_left;
+  struct epoll_engine_info *einfo = (struct epoll_engine_info *)nsp->engine_data;
+
+  assert(msec_timeout >= -1);
+
+  if (nsp->events_pending == 0)
+    return 0; /* No need to wait on 0 events ... */
+
+  /* Don't block if some IODs can already make progress */
+  results_left = epoll_wait_events(nsp, msec_timeout, einfo->ready_count > 0);
+  if (results_left == -1)
+    return -1;
+
+  iterate_through_ready_iods(nsp, results_left);
+
+  /* The batch was full, more events are probably waiting */
+  if (results_left == einfo->evlen) {
+    einfo->evlen *= 2;
+    einfo->events = (struct epoll_event *)safe_realloc(einfo->events, einfo->evlen * sizeof(struct epoll_event));
+  }
+
+  return 1;
+}
+
 
+/* ---- INTERNAL FUNCTIONS ---- */
+
+/* Wait for events, up to the next event timeout or msec_timeout, or not at all
+ * if poll_only is set. Returns the number of events stored in einfo->events,
+ * or -1 on error. */
+static int epoll_wait_events(struct npool *nsp, int msec_timeout, int poll_only) {
+  int results_left = 0;
+  int event_msecs; /* msecs before an event goes off */
+  int combined_msecs;
+  int sock_err = 0;
+  struct epoll_engine_info *einfo = (struct epoll_engine_info *)nsp->engine_data;
+
+  do {
     nsock_log_debug_all("wait for events");
 
-    nse = next_expirable_event(nsp);
-    if (!nse)
-      event_msecs = -1; /* None of the events specified a timeout */
-    else
-      event_msecs = MAX(0, TIMEVAL_MSEC_SUBTRACT(nse->timeout, nsock_tod));
+    /* -1 if none of the events specified a timeout */
+    event_msecs = next_expirable_msecs(nsp, &nsock_tod);
 
 #if HAVE_PCAP
 #ifndef PCAP_CAN_DO_SELECT
@@ -286,6 +422,8 @@ int epoll_loop(struct npool *nsp, int msec_timeout) {
     /* We cast to unsigned because we want -1 to be very high (since it means no
      * timeout) */
     combined_msecs = MIN((unsigned)event_msecs, (unsigned)msec_timeout);
+    if (poll_only)
+      combined_msecs = 0;
 
 #if HAVE_PCAP
 #ifndef PCAP_CAN_DO_SELECT
@@ -298,8 +436,11 @@ int epoll_loop(struct npool *nsp, int msec_timeout) {
 #endif
     {
       results_left = epoll_wait(einfo->epfd, einfo->events, einfo->evlen, combined_msecs);
+      nsp->stats.wait_calls++;
       if (results_left == -1)
         sock_err = socket_errno();
+      else
+        nsp->stats.events += results_left;
     }
 
     gettimeofday(&nsock_tod, NULL); /* Due to epoll delay */
@@ -311,13 +452,9 @@ int epoll_loop(struct npool *nsp, int msec_timeout) {
     return -1;
   }
 
-  iterate_through_event_lists(nsp, results_left);
-
-  return 1;
+  return results_left;
 }
 
-
-/* ---- INTERNAL FUNCTIONS ---- */
 static inline int get_evmask(struct epoll_engine_info *einfo, int n) {
   int evmask = EV_NONE;
 
@@ -356,5 +493,69 @@ void iterate_through_event_lists(struct npool *nsp, int evcount) {
   process_expired_events(nsp);
 }
 
+/* Edge-triggered counterpart of iterate_through_event_lists(). The reported
+ * edges are only recorded, then every IOD that is ready for one of the events
+ * it watches gets serviced. An IOD stays on the ready list for the next round
+ * as long as it makes I/O calls and none of them would block. */
+static void iterate_through_ready_iods(struct npool *nsp, int evcount) {
+  struct epoll_engine_info *einfo = (struct epoll_engine_info *)nsp->engine_data;
+  int n, count;
+
+  for (n = 0; n < evcount; n++) {
+    struct niod *nsi = (struct niod *)einfo->events[n].data.ptr;
+
+    assert(nsi);
+
+    if (nsi->pcap) {
+      process_iod_events(nsp, nsi, get_evmask(einfo, n));
+      if (nsi->state == NSIOD_STATE_DELETED) {
+        gh_list_remove(&nsp->active_iods, &nsi->nodeq);
+        gh_list_prepend(&nsp->free_iods, &nsi->nodeq);
+      }
+      continue;
+    }
+
+    if (!IOD_PROPGET(nsi, IOD_REGISTERED))
+      continue;
+
+    nsi->ready_events |= get_evmask(einfo, n);
+    if (nsi->ready_events & nsi->watched_events)
+      ready_push(einfo, nsi);
+  }
+
+  /* IODs queued while servicing these are left for the next round */
+  count = einfo->ready_count;
+  for (n = 0; n < count; n++) {
+    struct niod *nsi = einfo->ready[n];
+    unsigned long io_calls;
+    int ev;
+
+    if (!IOD_PROPGET(nsi, IOD_READY))
+      continue;
+    IOD_PROPCLR(nsi, IOD_READY);
+
+    ev = nsi->ready_events & (nsi->watched_events | EV_EXCEPT);
+    if (ev == EV_NONE)
+      continue;
+
+    io_calls = nsp->stats.io_calls;
+    process_iod_events(nsp, nsi, ev);
+
+    if (nsi->state == NSIOD_STATE_DELETED) {
+      gh_list_remove(&nsp->active_iods, &nsi->nodeq);
+      gh_list_prepend(&nsp->free_iods, &nsi->nodeq);
+    } else if (nsp->stats.io_calls != io_calls &&
+               (nsi->ready_events & nsi->watched_events)) {
+      ready_push(einfo, nsi);
+    }
+  }
+
+  einfo->ready_count -= count;
+  memmove(einfo->ready, einfo->ready + count, einfo->ready_count * sizeof(struct niod *));
+
+  /* iterate through timers and expired events */
+  process_expired_events(nsp);
+}
+
 #endif /* HAVE_EPOLL */
 
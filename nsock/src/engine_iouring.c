@@ -0,0 +1,681 @@
+/***************************************************************************
+ * engine_iouring.c -- io_uring(7) based IO engine.                        *
+ *                                                                         *
+ ***********************IMPORTANT NSOCK LICENSE TERMS***********************
+ *                                                                         *
+ * The nsock parallel socket event library is (C) 1999-2016 Insecure.Com   *
+ * LLC This library is free software; you may redistribute and/or          *
+ * modify it under the terms of the GNU General Public License as          *
+ * published by the Free Software Foundation; Version 2.  This guarantees  *
+ * your right to use, modify, and redistribute this software under certain *
+ * conditions.  If this license is unacceptable to you, Insecure.Com LLC   *
+ * may be willing to sell alternative licenses (contact                    *
+ * sales@insecure.com ).                                                   *
+ *                                                                         *
+ * As a special exception to the GPL terms, Insecure.Com LLC grants        *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two. You must obey the GNU GPL in all *
+ * respects for all of the code used other than OpenSSL.  If you modify    *
+ * this file, you may extend this exception to your version of the file,   *
+ * but you are not obligated to do so.                                     *
+ *                                                                         *
+ * If you received these files with a written license agreement stating    *
+ * terms other than the (GPL) terms above, then that alternative license   *
+ * agreement takes precedence over this comment.                           *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU       *
+ * General Public License v2.0 for more details                            *
+ * (http://www.gnu.org/licenses/gpl-2.0.html).                             *
+ *                                                                         *
+ ***************************************************************************/
+
+/* $Id$ */
+
+#ifdef HAVE_CONFIG_H
+#include "nsock_config.h"
+#endif
+
+#if HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <errno.h>
+
+#include "nsock_internal.h"
+#include "nsock_log.h"
+
+#if HAVE_PCAP
+#include "nsock_pcap.h"
+#endif
+
+#define RING_ENTRIES      256
+#define INITIAL_EV_COUNT  128
+
+#define IOURING_R_FLAGS (POLLIN | POLLPRI)
+#define IOURING_W_FLAGS POLLOUT
+#ifdef POLLRDHUP
+  #define IOURING_X_FLAGS (POLLERR | POLLRDHUP | POLLHUP)
+#else
+  #define IOURING_X_FLAGS (POLLERR | POLLHUP)
+#endif /* POLLRDHUP */
+
+/* user_data of the requests we don't care about the completion of */
+#define IGNORED_USER_DATA 0ULL
+
+
+/* --- ENGINE INTERFACE PROTOTYPES --- */
+static int iouring_init(struct npool *nsp);
+static void iouring_destroy(struct npool *nsp);
+static int iouring_iod_register(struct npool *nsp, struct niod *iod, int ev);
+static int iouring_iod_unregister(struct npool *nsp, struct niod *iod);
+static int iouring_iod_modify(struct npool *nsp, struct niod *iod, int ev_set, int ev_clr);
+static int iouring_loop(struct npool *nsp, int msec_timeout);
+
+
+/* ---- ENGINE DEFINITION ---- */
+struct io_engine engine_iouring = {
+  "io_uring",
+  iouring_init,
+  iouring_destroy,
+  iouring_iod_register,
+  iouring_iod_unregister,
+  iouring_iod_modify,
+  iouring_loop
+};
+
+
+/* --- INTERNAL PROTOTYPES --- */
+static void iterate_through_event_lists(struct npool *nsp, int evcount);
+
+/* defined in nsock_core.c */
+void process_iod_events(struct npool *nsp, struct niod *nsi, int ev);
+void process_event(struct npool *nsp, gh_list_t *evlist, struct nevent *nse, int ev);
+void process_expired_events(struct npool *nsp);
+#if HAVE_PCAP
+#ifndef PCAP_CAN_DO_SELECT
+int pcap_read_on_nonselect(struct npool *nsp);
+#endif
+#endif
+
+/* defined in nsock_event.c */
+void update_first_events(struct nevent *nse);
+
+
+extern NSOCK_THREAD_LOCAL struct timeval nsock_tod;
+
+
+/*
+ * Engine specific data structures
+ */
+
+/* Per descriptor state. Poll requests are one-shot: a descriptor is armed with
+ * a POLL_ADD for the events its IOD watches, and has to be armed again once the
+ * request completes. The generation number is bumped every time a request gets
+ * cancelled or the descriptor changes hands, so that completions of stale
+ * requests can be recognized and dropped. */
+struct iouring_slot {
+  struct niod *iod;
+  unsigned int gen;
+  /* poll mask of the outstanding request, 0 if none */
+  unsigned int armed;
+  /* set while the slot is on the dirty list */
+  int dirty;
+};
+
+struct iouring_engine_info {
+  /* file descriptor corresponding to our io_uring instance */
+  int ringfd;
+
+  /* mmap()ed submission and completion rings */
+  void *sq_ring;
+  size_t sq_ring_sz;
+  void *cq_ring;
+  size_t cq_ring_sz;
+  struct io_uring_sqe *sqes;
+  size_t sqes_sz;
+
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  unsigned int sq_entries;
+  /* local copy of the tail, published to the kernel before each enter */
+  unsigned int sq_local_tail;
+
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  /* descriptor table, indexed by socket descriptor */
+  struct iouring_slot *slots;
+  int slots_len;
+
+  /* descriptors whose poll request has to be (re)armed before the next wait */
+  int *dirty;
+  int dirty_count;
+  int dirty_len;
+
+  /* completions harvested by the last wait, resized if necessary */
+  struct io_uring_cqe *events;
+  int evlen;
+};
+
+
+static inline int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                                     unsigned int flags, void *arg, size_t argsz) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static inline __u64 slot_user_data(int sd, const struct iouring_slot *slot) {
+  return ((__u64)slot->gen << 32) | (unsigned int)sd;
+}
+
+static void iouring_unmap(struct iouring_engine_info *uinfo) {
+  if (uinfo->sqes != MAP_FAILED)
+    munmap(uinfo->sqes, uinfo->sqes_sz);
+  if (uinfo->cq_ring != MAP_FAILED && uinfo->cq_ring != uinfo->sq_ring)
+    munmap(uinfo->cq_ring, uinfo->cq_ring_sz);
+  if (uinfo->sq_ring != MAP_FAILED)
+    munmap(uinfo->sq_ring, uinfo->sq_ring_sz);
+}
+
+int iouring_init(struct npool *nsp) {
+  struct iouring_engine_info *uinfo;
+  struct io_uring_params params;
+
+  uinfo = (struct iouring_engine_info *)safe_zalloc(sizeof(struct iouring_engine_info));
+  uinfo->sq_ring = uinfo->cq_ring = MAP_FAILED;
+  uinfo->sqes = (struct io_uring_sqe *)MAP_FAILED;
+
+  memset(&params, 0x00, sizeof(params));
+  uinfo->ringfd = sys_io_uring_setup(RING_ENTRIES, &params);
+  if (uinfo->ringfd < 0) {
+    /* ENOSYS on old kernels, EPERM when disabled by sysctl or seccomp */
+    nsock_log_info("io_uring_setup failed: %s", strerror(errno));
+    free(uinfo);
+    return 0;
+  }
+
+  /* Timed waits need IORING_ENTER_EXT_ARG, and we can't afford to have
+   * completions dropped when the CQ ring overflows. */
+  if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP)) {
+    nsock_log_info("io_uring lacks required features (0x%x)", params.features);
+    close(uinfo->ringfd);
+    free(uinfo);
+    return 0;
+  }
+
+  uinfo->sq_ring_sz = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  uinfo->cq_ring_sz = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (uinfo->cq_ring_sz > uinfo->sq_ring_sz)
+      uinfo->sq_ring_sz = uinfo->cq_ring_sz;
+    uinfo->cq_ring_sz = uinfo->sq_ring_sz;
+  }
+
+  uinfo->sq_ring = mmap(NULL, uinfo->sq_ring_sz, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, uinfo->ringfd, IORING_OFF_SQ_RING);
+  if (uinfo->sq_ring != MAP_FAILED) {
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+      uinfo->cq_ring = uinfo->sq_ring;
+    else
+      uinfo->cq_ring = mmap(NULL, uinfo->cq_ring_sz, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, uinfo->ringfd, IORING_OFF_CQ_RING);
+  }
+  uinfo->sqes_sz = params.sq_entries * sizeof(struct io_uring_sqe);
+  if (uinfo->cq_ring != MAP_FAILED)
+    uinfo->sqes = (struct io_uring_sqe *)mmap(NULL, uinfo->sqes_sz, PROT_READ | PROT_WRITE,
+                                              MAP_SHARED | MAP_POPULATE, uinfo->ringfd, IORING_OFF_SQES);
+  if (uinfo->sqes == MAP_FAILED) {
+    nsock_log_info("Unable to map io_uring rings: %s", strerror(errno));
+    iouring_unmap(uinfo);
+    close(uinfo->ringfd);
+    free(uinfo);
+    return 0;
+  }
+
+  uinfo->sq_head = (unsigned int *)((char *)uinfo->sq_ring + params.sq_off.head);
+  uinfo->sq_tail = (unsigned int *)((char *)uinfo->sq_ring + params.sq_off.tail);
+  uinfo->sq_mask = (unsigned int *)((char *)uinfo->sq_ring + params.sq_off.ring_mask);
+  uinfo->sq_array = (unsigned int *)((char *)uinfo->sq_ring + params.sq_off.array);
+  uinfo->sq_entries = params.sq_entries;
+  uinfo->sq_local_tail = *uinfo->sq_tail;
+
+  uinfo->cq_head = (unsigned int *)((char *)uinfo->cq_ring + params.cq_off.head);
+  uinfo->cq_tail = (unsigned int *)((char *)uinfo->cq_ring + params.cq_off.tail);
+  uinfo->cq_mask = (unsigned int *)((char *)uinfo->cq_ring + params.cq_off.ring_mask);
+  uinfo->cqes = (struct io_uring_cqe *)((char *)uinfo->cq_ring + params.cq_off.cqes);
+
+  uinfo->evlen = INITIAL_EV_COUNT;
+  uinfo->events = (struct io_uring_cqe *)safe_malloc(uinfo->evlen * sizeof(struct io_uring_cqe));
+
+  nsp->engine_data = (void *)uinfo;
+
+  return 1;
+}
+
+void iouring_destroy(struct npool *nsp) {
+  struct iouring_engine_info *uinfo = (struct iouring_engine_info *)nsp->engine_data;
+
+  assert(uinfo != NULL);
+  /* closing the ring cancels all outstanding requests */
+  iouring_unmap(uinfo);
+  close(uinfo->ringfd);
+  free(uinfo->slots);
+  free(uinfo->dirty);
+  free(uinfo->events);
+  free(uinfo);
+}
+
+/* Hand the queued SQEs over to the kernel. If wait is set, also wait for at
+ * least one completion, or until ts expires if it is not NULL. */
+static int iouring_enter(struct npool *nsp, int wait, struct __kernel_timespec *ts) {
+  struct iouring_engine_info *uinfo = (struct iouring_engine_info *)nsp->engine_data;
+  struct io_uring_getevents_arg arg;
+  unsigned int to_submit;
+  unsigned int flags = 0;
+  int rc;
+
+  __atomic_store_n(uinfo->sq_tail, uinfo->sq_local_tail, __ATOMIC_RELEASE);
+  to_submit = uinfo->sq_local_tail - __atomic_load_n(uinfo->sq_head, __ATOMIC_ACQUIRE);
+
+  memset(&arg, 0x00, sizeof(arg));
+  arg.ts = (__u64)(unsigned long)ts;
+
+  flags = IORING_ENTER_EXT_ARG;
+  if (wait)
+    flags |= IORING_ENTER_GETEVENTS;
+
+  rc = sys_io_uring_enter(uinfo->ringfd, to_submit, wait ? 1 : 0, flags, &arg, sizeof(arg));
+  if (rc >= 0)
+    nsp->stats.ctl_calls += rc;
+  return rc;
+}
+
+/* Queue a request, submitting the pending ones first if the SQ ring is full. */
+static struct io_uring_sqe *iouring_get_sqe(struct npool *nsp) {
+  struct iouring_engine_info *uinfo = (struct iouring_engine_info *)nsp->engine_data;
+  struct io_uring_sqe *sqe;
+  unsigned int idx;
+
+  while (uinfo->sq_local_tail - __atomic_load_n(uinfo->sq_head, __ATOMIC_ACQUIRE) >= uinfo->sq_entries) {
+    if (iouring_enter(nsp, 0, NULL) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      fatal("Unable to submit io_uring requests: %s", strerror(errno));
+  }
+
+  idx = uinfo->sq_local_tail & *uinfo->sq_mask;
+  sqe = &uinfo->sqes[idx];
+  memset(sqe, 0x00, sizeof(*sqe));
+  uinfo->sq_array[idx] = idx;
+  uinfo->sq_local_tail++;
+  return sqe;
+}
+
+static inline unsigned int ev_to_pollmask(int ev) {
+  unsigned int mask = 0;
+
+  if (ev & EV_READ)
+    mask |= IOURING_R_FLAGS;
+  if (ev & EV_WRITE)
+    mask |= IOURING_W_FLAGS;
+  if (ev & EV_EXCEPT)
+    mask |= IOURING_X_FLAGS;
+
+  return mask;
+}
+
+/* Cancel the outstanding poll request of a slot, if any. Its completion will
+ * carry a stale generation number and be ignored. */
+static void slot_disarm(struct npool *nsp, int sd, struct iouring_slot *slot) {
+  struct io_uring_sqe *sqe;
+
+  if (!slot->armed)
+    return;
+
+  sqe = iouring_get_sqe(nsp);
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->fd = -1;
+  sqe->addr = slot_user_data(sd, slot);
+  sqe->user_data = IGNORED_USER_DATA;
+
+  slot->armed = 0;
+  slot->gen++;
+}
+
+static void slot_mark_dirty(struct iouring_engine_info *uinfo, int sd) {
+  struct iouring_slot *slot = &uinfo->slots[sd];
+
+  if (slot->dirty)
+    return;
+
+  if (uinfo->dirty_count == uinfo->dirty_len) {
+    uinfo->dirty_len = uinfo->dirty_len ? uinfo->dirty_len * 2 : INITIAL_EV_COUNT;
+    uinfo->dirty = (int *)safe_realloc(uinfo->dirty, uinfo->dirty_len * sizeof(int));
+  }
+  uinfo->dirty[uinfo->dirty_count++] = sd;
+  slot->dirty = 1;
+}
+
+/* Bring the poll requests of all the descriptors whose watched events changed
+ * (or whose request completed) in line with what their IOD watches. This is
+ * where the changes of a whole loop iteration get batched. */
+static void flush_dirty_slots(struct npool *nsp) {
+  struct iouring_engine_info *uinfo = (struct iouring_engine_info *)nsp->engine_data;
+  int i;
+
+  for (i = 0; i < uinfo->dirty_count; i++) {
+    int sd = uinfo->dirty[i];
+    struct iouring_slot *slot = &uinfo->slots[sd];
+    struct io_uring_sqe *sqe;
+    unsigned int want;
+
+    slot->dirty = 0;
+    if (slot->iod == NULL)
+      continue;
+
+    want = ev_to_pollmask(slot->iod->watched_events);
+
+    /* A request watching more than needed is kept, the extra wake up it may
+     * cause is cheaper than cancelling it. */
+    if (want && slot->armed && (want & ~slot->armed) == 0)
+      continue;
+
+    slot_disarm(nsp, sd, slot);
+    if (!want)
+      continue;
+
+    sqe = iouring_get_sqe(nsp);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = sd;
+    sqe->poll_events = (__u16)want;
+    sqe->user_data = slot_user_data(sd, slot);
+    slot->armed = want;
+  }
+  uinfo->dirty_count = 0;
+}
+
+int iouring_iod_register(struct npool *nsp, struct niod *iod, int ev) {
+  struct iouring_engine_info *uinfo = (struct iouring_engine_info *)nsp->engine_data;
+  struct iouring_slot *slot;
+  int sd;
+
+  assert(!IOD_PROPGET(iod, IOD_REGISTERED));
+
+  iod->watched_events = ev;
+
+  sd = nsock_iod_get_sd(iod);
+  if (sd < 0)
+    fatal("Unable to register IOD #%lu: invalid descriptor", iod->id);
+
+  if (sd >= uinfo->slots_len) {
+    int len = uinfo->slots_len ? uinfo->slots_len : INITIAL_EV_COUNT;
+
+    while (len <= sd)
+      len *= 2;
+    uinfo->slots = (struct iouring_slot *)safe_realloc(uinfo->slots, len * sizeof(struct iouring_slot));
+    memset(uinfo->slots + uinfo->slots_len, 0x00, (len - uinfo->slots_len) * sizeof(struct iouring_slot));
+    uinfo->slots_len = len;
+  }
+
+  slot = &uinfo->slots[sd];
+  /* Generation 0 is never used, so that no request has IGNORED_USER_DATA. */
+  slot->gen++;
+  if (slot->gen == 0)
+    slot->gen++;
+  slot->iod = iod;
+  slot_mark_dirty(uinfo, sd);
+
+  IOD_PROPSET(iod, IOD_REGISTERED);
+  return 1;
+}
+
+int iouring_iod_unregister(struct npool *nsp, struct niod *iod) {
+  iod->watched_events = EV_NONE;
+
+  /* some IODs can be unregistered here if they're associated to an event that was
+   * immediately completed */
+  if (IOD_PROPGET(iod, IOD_REGISTERED)) {
+    struct iouring_engine_info *uinfo = (struct iouring_engine_info *)nsp->engine_data;
+    int sd;
+
+    sd = nsock_iod_get_sd(iod);
+    if (sd >= 0 && sd < uinfo->slots_len && uinfo->slots[sd].iod == iod) {
+      /* The descriptor is about to be closed and its number may be reused
+       * before the next submission. Queue the cancellation now, ahead of any
+       * request for the next owner of the slot. */
+      slot_disarm(nsp, sd, &uinfo->slots[sd]);
+      uinfo->slots[sd].iod = NULL;
+    }
+
+    IOD_PROPCLR(iod, IOD_REGISTERED);
+  }
+  return 1;
+}
+
+int iouring_iod_modify(struct npool *nsp, struct niod *iod, int ev_set, int ev_clr) {
+  struct iouring_engine_info *uinfo = (struct iouring_engine_info *)nsp->engine_data;
+  int new_events;
+
+  assert((ev_set & ev_clr) == 0);
+  assert(IOD_PROPGET(iod, IOD_REGISTERED));
+
+  new_events = iod->watched_events;
+  new_events |= ev_set;
+  new_events &= ~ev_clr;
+
+  if (new_events == iod->watched_events)
+    return 1; /* nothing to do */
+
+  iod->watched_events = new_events;
+  slot_mark_dirty(uinfo, nsock_iod_get_sd(iod));
+
+  return 1;
+}
+
+/* Move the available completions out of the CQ ring, so that the ring can be
+ * refilled while we process them. Completions of cancelled or superseded
+ * requests are dropped. */
+static int harvest_completions(struct npool *nsp) {
+  struct iouring_engine_info *uinfo = (struct iouring_engine_info *)nsp->engine_data;
+  unsigned int head, tail;
+  int count = 0;
+
+  head = *uinfo->cq_head;
+  tail = __atomic_load_n(uinfo->cq_tail, __ATOMIC_ACQUIRE);
+
+  for (; head != tail; head++) {
+    struct io_uring_cqe *cqe = &uinfo->cqes[head & *uinfo->cq_mask];
+    struct iouring_slot *slot;
+    unsigned int sd;
+
+    if (cqe->user_data == IGNORED_USER_DATA)
+      continue;
+
+    sd = (unsigned int)(cqe->user_data & 0xffffffffU);
+    if (sd >= (unsigned int)uinfo->slots_len)
+      continue;
+    slot = &uinfo->slots[sd];
+    if (slot->iod == NULL || slot_user_data(sd, slot) != cqe->user_data)
+      continue;
+
+    /* the request is over, a new one gets armed once the IOD is processed */
+    slot->armed = 0;
+    slot->gen++;
+    if (slot->gen == 0)
+      slot->gen++;
+
+    /* keep the new generation, to detect a change of hands before the
+     * completion gets processed */
+    if (count == uinfo->evlen) {
+      uinfo->evlen *= 2;
+      uinfo->events = (struct io_uring_cqe *)safe_realloc(uinfo->events, uinfo->evlen * sizeof(struct io_uring_cqe));
+    }
+    uinfo->events[count] = *cqe;
+    uinfo->events[count].user_data = slot_user_data(sd, slot);
+    count++;
+  }
+
+  __atomic_store_n(uinfo->cq_head, head, __ATOMIC_RELEASE);
+  nsp->stats.events += count;
+  return count;
+}
+
+int iouring_loop(struct npool *nsp, int msec_timeout) {
+  int results_left = 0;
+  int event_msecs; /* msecs before an event goes off */
+  int combined_msecs;
+  int sock_err = 0;
+  struct __kernel_timespec ts;
+
+  assert(msec_timeout >= -1);
+
+  if (nsp->events_pending == 0)
+    return 0; /* No need to wait on 0 events ... */
+
+  flush_dirty_slots(nsp);
+
+  do {
+    int rc = 0;
+
+    nsock_log_debug_all("wait for events");
+
+    /* -1 if none of the events specified a timeout */
+    event_msecs = next_expirable_msecs(nsp, &nsock_tod);
+
+#if HAVE_PCAP
+#ifndef PCAP_CAN_DO_SELECT
+    /* Force a low timeout when capturing packets on systems where
+     * the pcap descriptor is not select()able. */
+    if (gh_list_count(&nsp->pcap_read_events) > 0)
+      if (event_msecs > PCAP_POLL_INTERVAL)
+        event_msecs = PCAP_POLL_INTERVAL;
+#endif
+#endif
+
+    /* We cast to unsigned because we want -1 to be very high (since it means no
+     * timeout) */
+    combined_msecs = MIN((unsigned)event_msecs, (unsigned)msec_timeout);
+
+#if HAVE_PCAP
+#ifndef PCAP_CAN_DO_SELECT
+    /* do non-blocking read on pcap devices that doesn't support select()
+     * If there is anything read, just leave this loop. */
+    if (pcap_read_on_nonselect(nsp)) {
+      /* okay, something was read. */
+      rc = iouring_enter(nsp, 0, NULL);
+    } else
+#endif
+#endif
+    {
+      ts.tv_sec = combined_msecs / 1000;
+      ts.tv_nsec = (combined_msecs % 1000) * 1000000LL;
+      rc = iouring_enter(nsp, 1, combined_msecs == -1 ? NULL : &ts);
+      nsp->stats.wait_calls++;
+    }
+
+    /* ETIME means the wait timed out, EBUSY that completions are waiting in
+     * the overflow list, none of these is an error */
+    if (rc == -1 && errno != ETIME && errno != EBUSY && errno != EAGAIN)
+      sock_err = errno;
+    else
+      sock_err = 0;
+
+    results_left = harvest_completions(nsp);
+
+    gettimeofday(&nsock_tod, NULL); /* Due to io_uring delay */
+  } while (results_left == 0 && sock_err == EINTR); /* repeat only if signal occurred */
+
+  if (sock_err != 0 && sock_err != EINTR) {
+    nsock_log_error("nsock_loop error %d: %s", sock_err, socket_strerror(sock_err));
+    nsp->errnum = sock_err;
+    return -1;
+  }
+
+  iterate_through_event_lists(nsp, results_left);
+
+  return 1;
+}
+
+
+/* ---- INTERNAL FUNCTIONS ---- */
+
+static inline int get_evmask(const struct io_uring_cqe *cqe) {
+  int evmask = EV_NONE;
+
+  /* An error polling the descriptor. Let the I/O code find out about it. */
+  if (cqe->res < 0)
+    return EV_READ | EV_WRITE | EV_EXCEPT;
+
+  if (cqe->res & IOURING_R_FLAGS)
+    evmask |= EV_READ;
+  if (cqe->res & IOURING_W_FLAGS)
+    evmask |= EV_WRITE;
+  if (cqe->res & IOURING_X_FLAGS)
+    evmask |= (EV_READ | EV_WRITE | EV_EXCEPT);
+
+  return evmask;
+}
+
+/* Iterate through all the event lists (such as connect_events, read_events,
+ * timer_events, etc) and take action for those that have completed (due to
+ * timeout, i/o, etc) */
+void iterate_through_event_lists(struct npool *nsp, int evcount) {
+  struct iouring_engine_info *uinfo = (struct iouring_engine_info *)nsp->engine_data;
+  int n;
+
+  for (n = 0; n < evcount; n++) {
+    unsigned int sd = (unsigned int)(uinfo->events[n].user_data & 0xffffffffU);
+    struct iouring_slot *slot = &uinfo->slots[sd];
+    struct niod *nsi = slot->iod;
+
+    /* unregistered (and maybe reused) while processing a previous completion */
+    if (nsi == NULL || slot_user_data(sd, slot) != uinfo->events[n].user_data)
+      continue;
+
+    /* process all the pending events for this IOD */
+    process_iod_events(nsp, nsi, get_evmask(&uinfo->events[n]));
+
+    if (nsi->state == NSIOD_STATE_DELETED) {
+      gh_list_remove(&nsp->active_iods, &nsi->nodeq);
+      gh_list_prepend(&nsp->free_iods, &nsi->nodeq);
+    } else if (uinfo->slots[sd].iod == nsi && IOD_PROPGET(nsi, IOD_REGISTERED)) {
+      /* one-shot request, arm it again if the IOD still watches something */
+      slot_mark_dirty(uinfo, sd);
+    }
+  }
+
+  /* iterate through timers and expired events */
+  process_expired_events(nsp);
+}
+
+#endif /* HAVE_IO_URING */
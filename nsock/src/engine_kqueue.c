@@ -113,7 +113,7 @@ int pcap_read_on_nonselect(struct npool *nsp);
 void update_first_events(struct nevent *nse);
 
 
-extern struct timeval nsock_tod;
+extern NSOCK_THREAD_LOCAL struct timeval nsock_tod;
 
 
 /*
@@ -210,8 +210,11 @@ int kqueue_iod_modify(struct npool *nsp, struct niod *iod, int ev_set, int ev_cl
     i++;
   }
 
-  if (i > 0 && kevent(kinfo->kqfd, kev, i, NULL, 0, NULL) < 0)
-    fatal("Unable to update events for IOD #%lu: %s", iod->id, strerror(errno));
+  if (i > 0) {
+    nsp->stats.ctl_calls++;
+    if (kevent(kinfo->kqfd, kev, i, NULL, 0, NULL) < 0)
+      fatal("Unable to update events for IOD #%lu: %s", iod->id, strerror(errno));
+  }
 
   iod->watched_events = new_events;
   return 1;
@@ -237,15 +240,10 @@ int kqueue_loop(struct npool *nsp, int msec_timeout) {
   }
 
   do {
-    struct nevent *nse;
-
     nsock_log_debug_all("wait for events");
 
-    nse = next_expirable_event(nsp);
-    if (!nse)
-      event_msecs = -1; /* None of the events specified a timeout */
-    else
-      event_msecs = MAX(0, TIMEVAL_MSEC_SUBTRACT(nse->timeout, nsock_tod));
+    /* -1 if none of the events specified a timeout */
+    event_msecs = next_expirable_msecs(nsp, &nsock_tod);
 
 #if HAVE_PCAP
 #ifndef PCAP_CAN_DO_SELECT
@@ -282,8 +280,11 @@ int kqueue_loop(struct npool *nsp, int msec_timeout) {
 #endif
     {
       results_left = kevent(kinfo->kqfd, NULL, 0, kinfo->events, kinfo->evlen, ts_p);
+      nsp->stats.wait_calls++;
       if (results_left == -1)
         sock_err = socket_errno();
+      else
+        nsp->stats.events += results_left;
     }
 
     gettimeofday(&nsock_tod, NULL); /* Due to kevent delay */
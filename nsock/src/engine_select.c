@@ -107,7 +107,7 @@ int pcap_read_on_nonselect(struct npool *nsp);
 void update_first_events(struct nevent *nse);
 
 
-extern struct timeval nsock_tod;
+extern NSOCK_THREAD_LOCAL struct timeval nsock_tod;
 
 
 /*
@@ -252,15 +252,10 @@ int select_loop(struct npool *nsp, int msec_timeout) {
     return 0; /* No need to wait on 0 events ... */
 
   do {
-    struct nevent *nse;
-
     nsock_log_debug_all("wait for events");
 
-    nse = next_expirable_event(nsp);
-    if (!nse)
-      event_msecs = -1; /* None of the events specified a timeout */
-    else
-      event_msecs = MAX(0, TIMEVAL_MSEC_SUBTRACT(nse->timeout, nsock_tod));
+    /* -1 if none of the events specified a timeout */
+    event_msecs = next_expirable_msecs(nsp, &nsock_tod);
 
 #if HAVE_PCAP
 #ifndef PCAP_CAN_DO_SELECT
@@ -307,9 +302,12 @@ int select_loop(struct npool *nsp, int msec_timeout) {
 
       results_left = fselect(sinfo->max_sd + 1, &sinfo->fds_results_r,
                              &sinfo->fds_results_w, &sinfo->fds_results_x, select_tv_p);
+      nsp->stats.wait_calls++;
 
       if (results_left == -1)
         sock_err = socket_errno();
+      else
+        nsp->stats.events += results_left;
     }
 
     gettimeofday(&nsock_tod, NULL); /* Due to select delay */
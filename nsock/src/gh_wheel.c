@@ -0,0 +1,333 @@
+/***************************************************************************
+ * gh_wheel.c -- hierarchical timing wheel.                                *
+ *                                                                         *
+ ***********************IMPORTANT NSOCK LICENSE TERMS***********************
+ *                                                                         *
+ * The nsock parallel socket event library is (C) 1999-2016 Insecure.Com   *
+ * LLC This library is free software; you may redistribute and/or          *
+ * modify it under the terms of the GNU General Public License as          *
+ * published by the Free Software Foundation; Version 2.  This guarantees  *
+ * your right to use, modify, and redistribute this software under certain *
+ * conditions.  If this license is unacceptable to you, Insecure.Com LLC   *
+ * may be willing to sell alternative licenses (contact                    *
+ * sales@insecure.com ).                                                   *
+ *                                                                         *
+ * As a special exception to the GPL terms, Insecure.Com LLC grants        *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two. You must obey the GNU GPL in all *
+ * respects for all of the code used other than OpenSSL.  If you modify    *
+ * this file, you may extend this exception to your version of the file,   *
+ * but you are not obligated to do so.                                     *
+ *                                                                         *
+ * If you received these files with a written license agreement stating    *
+ * terms other than the (GPL) terms above, then that alternative license   *
+ * agreement takes precedence over this comment.                           *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU       *
+ * General Public License v2.0 for more details                            *
+ * (http://www.gnu.org/licenses/gpl-2.0.html).                             *
+ *                                                                         *
+ ***************************************************************************/
+
+/* $Id$ */
+
+#ifdef HAVE_CONFIG_H
+#include "nsock_config.h"
+#include "nbase_config.h"
+#endif
+
+#ifdef WIN32
+#include "nbase_winconfig.h"
+#endif
+
+#include <nbase.h>
+#include "gh_wheel.h"
+
+/* Number of ticks covered by all the levels */
+#define WHEEL_SPAN_BITS  (GH_WHEEL_BITS * GH_WHEEL_LEVELS)
+
+
+static int lowest_bit(uint64_t x) {
+#if defined(__GNUC__)
+  return __builtin_ctzll(x);
+#else
+  int n = 0;
+
+  assert(x != 0);
+  while (!(x & 1)) {
+    x >>= 1;
+    n++;
+  }
+  return n;
+#endif
+}
+
+/* Bucket a node expiring at t belongs to: the lowest level whose range, as seen
+ * from the current time, still contains t. */
+static unsigned int wheel_bucket(const gh_wheel_t *wheel, uint64_t t) {
+  int level;
+
+  if (t <= wheel->now)
+    return GH_WHEEL_DUE;
+
+  for (level = 0; level < GH_WHEEL_LEVELS; level++) {
+    int shift = GH_WHEEL_BITS * (level + 1);
+
+    if ((t >> shift) == (wheel->now >> shift))
+      return level * GH_WHEEL_SIZE + ((t >> (GH_WHEEL_BITS * level)) & GH_WHEEL_MASK);
+  }
+  return GH_WHEEL_OVERFLOW;
+}
+
+static void wheel_link(gh_wheel_t *wheel, gh_wnode_t *node, unsigned int bucket) {
+  gh_wnode_t *head = &wheel->buckets[bucket];
+
+  node->bucket = bucket;
+  node->next = head;
+  node->prev = head->prev;
+  head->prev->next = node;
+  head->prev = node;
+
+  if (bucket < GH_WHEEL_DUE)
+    wheel->bitmap[bucket / GH_WHEEL_SIZE] |= (uint64_t)1 << (bucket % GH_WHEEL_SIZE);
+}
+
+static void wheel_unlink(gh_wheel_t *wheel, gh_wnode_t *node) {
+  unsigned int bucket = node->bucket;
+  gh_wnode_t *head = &wheel->buckets[bucket];
+
+  node->prev->next = node->next;
+  node->next->prev = node->prev;
+
+  if (bucket < GH_WHEEL_DUE && head->next == head)
+    wheel->bitmap[bucket / GH_WHEEL_SIZE] &= ~((uint64_t)1 << (bucket % GH_WHEEL_SIZE));
+}
+
+/* Redistribute the content of a bucket according to the current time. */
+static void wheel_cascade(gh_wheel_t *wheel, unsigned int bucket) {
+  gh_wnode_t *head = &wheel->buckets[bucket];
+  gh_wnode_t *node, *next;
+
+  node = head->next;
+  if (node == head)
+    return;
+
+  /* Detach the whole list first, nodes may be linked back to this bucket */
+  head->prev->next = NULL;
+  head->next = head->prev = head;
+  if (bucket < GH_WHEEL_DUE)
+    wheel->bitmap[bucket / GH_WHEEL_SIZE] &= ~((uint64_t)1 << (bucket % GH_WHEEL_SIZE));
+
+  for (; node != NULL; node = next) {
+    next = node->next;
+    wheel_link(wheel, node, wheel_bucket(wheel, node->expires));
+  }
+}
+
+/* Find the next time at which a bucket has to be cascaded, that is the start
+ * of the range of the first non-empty slot, or the wrap around of the last
+ * level if only the overflow bucket is populated. */
+static int wheel_next_event(const gh_wheel_t *wheel, uint64_t *when) {
+  int level;
+
+  for (level = 0; level < GH_WHEEL_LEVELS; level++) {
+    int shift = GH_WHEEL_BITS * level;
+    unsigned int cur = (wheel->now >> shift) & GH_WHEEL_MASK;
+    uint64_t pending;
+
+    if (cur == GH_WHEEL_MASK)
+      continue;
+
+    pending = wheel->bitmap[level] & (~(uint64_t)0 << (cur + 1));
+    if (pending) {
+      *when = ((wheel->now >> (shift + GH_WHEEL_BITS)) << (shift + GH_WHEEL_BITS))
+              | ((uint64_t)lowest_bit(pending) << shift);
+      return 1;
+    }
+  }
+
+  if (wheel->buckets[GH_WHEEL_OVERFLOW].next != &wheel->buckets[GH_WHEEL_OVERFLOW]) {
+    *when = ((wheel->now >> WHEEL_SPAN_BITS) + 1) << WHEEL_SPAN_BITS;
+    return 1;
+  }
+  return 0;
+}
+
+void gh_wheel_init(gh_wheel_t *wheel, uint64_t now) {
+  int i;
+
+  wheel->now = now;
+  wheel->count = 0;
+  for (i = 0; i < GH_WHEEL_LEVELS; i++)
+    wheel->bitmap[i] = 0;
+  for (i = 0; i < GH_WHEEL_BUCKETS; i++)
+    wheel->buckets[i].next = wheel->buckets[i].prev = &wheel->buckets[i];
+}
+
+void gh_wheel_free(gh_wheel_t *wheel) {
+  assert(wheel->count == 0);
+  gh_wheel_init(wheel, 0);
+}
+
+void gh_wheel_add(gh_wheel_t *wheel, gh_wnode_t *node, uint64_t expires) {
+  assert(!gh_wnode_is_valid(node));
+
+  node->expires = expires;
+  wheel_link(wheel, node, wheel_bucket(wheel, expires));
+  wheel->count++;
+}
+
+void gh_wheel_remove(gh_wheel_t *wheel, gh_wnode_t *node) {
+  assert(gh_wnode_is_valid(node));
+  assert(wheel->count > 0);
+
+  wheel_unlink(wheel, node);
+  gh_wnode_invalidate(node);
+  wheel->count--;
+}
+
+void gh_wheel_advance(gh_wheel_t *wheel, uint64_t now) {
+  uint64_t t;
+
+  /* Jump from one non-empty slot to the next rather than tick by tick, so that
+   * the cost depends on the number of nodes rather than on the elapsed time. */
+  while (wheel_next_event(wheel, &t) && t <= now) {
+    int level;
+
+    wheel->now = t;
+
+    if ((t & (((uint64_t)1 << WHEEL_SPAN_BITS) - 1)) == 0)
+      wheel_cascade(wheel, GH_WHEEL_OVERFLOW);
+
+    /* Higher levels first, their nodes may land in lower level slots that
+     * start right now. */
+    for (level = GH_WHEEL_LEVELS - 1; level >= 0; level--) {
+      int shift = GH_WHEEL_BITS * level;
+
+      if ((t & (((uint64_t)1 << shift) - 1)) != 0)
+        continue;
+
+      wheel_cascade(wheel, level * GH_WHEEL_SIZE + ((t >> shift) & GH_WHEEL_MASK));
+    }
+  }
+
+  if (now > wheel->now)
+    wheel->now = now;
+}
+
+/* Move the wheel's clock back to now, which is before wheel->now, and put
+ * every node back in the bucket it belongs to as seen from there. The clock is
+ * set to the earliest expiration time if that comes first, so that advancing it
+ * to now afterwards lets the nodes out in order. */
+static void wheel_rebase(gh_wheel_t *wheel, uint64_t now) {
+  gh_wnode_t *nodes = NULL;
+  gh_wnode_t *node, *next;
+  unsigned int count;
+  int i;
+
+  /* Chain all the lists together before resetting the buckets */
+  for (i = 0; i < GH_WHEEL_BUCKETS; i++) {
+    gh_wnode_t *head = &wheel->buckets[i];
+
+    if (head->next == head)
+      continue;
+    head->prev->next = nodes;
+    nodes = head->next;
+  }
+
+  for (node = nodes; node != NULL; node = node->next) {
+    if (node->expires < now)
+      now = node->expires;
+  }
+
+  count = wheel->count;
+  gh_wheel_init(wheel, now);
+  wheel->count = count;
+
+  for (node = nodes; node != NULL; node = next) {
+    next = node->next;
+    wheel_link(wheel, node, wheel_bucket(wheel, node->expires));
+  }
+}
+
+gh_wnode_t *gh_wheel_pop_expired(gh_wheel_t *wheel, uint64_t now) {
+  gh_wnode_t *head = &wheel->buckets[GH_WHEEL_DUE];
+  gh_wnode_t *node;
+
+  if (now < wheel->now)
+    wheel_rebase(wheel, now);
+  if (now > wheel->now)
+    gh_wheel_advance(wheel, now);
+
+  node = head->next;
+  if (node == head)
+    return NULL;
+
+  gh_wheel_remove(wheel, node);
+  return node;
+}
+
+int gh_wheel_next_expiry(gh_wheel_t *wheel, uint64_t *when) {
+  if (wheel->count == 0)
+    return 0;
+
+  if (wheel->buckets[GH_WHEEL_DUE].next != &wheel->buckets[GH_WHEEL_DUE]) {
+    *when = wheel->now;
+    return 1;
+  }
+  return wheel_next_event(wheel, when);
+}
+
+gh_wnode_t *gh_wheel_next(gh_wheel_t *wheel, gh_wnode_t *node) {
+  unsigned int bucket;
+
+  if (node == NULL) {
+    bucket = 0;
+  } else {
+    bucket = node->bucket;
+    if (node->next != &wheel->buckets[bucket])
+      return node->next;
+    bucket++;
+  }
+
+  /* Use the bitmaps to skip empty slots */
+  while (bucket < GH_WHEEL_DUE) {
+    unsigned int level = bucket / GH_WHEEL_SIZE;
+    uint64_t pending;
+
+    pending = wheel->bitmap[level] & (~(uint64_t)0 << (bucket % GH_WHEEL_SIZE));
+    if (pending)
+      return wheel->buckets[level * GH_WHEEL_SIZE + lowest_bit(pending)].next;
+
+    bucket = (level + 1) * GH_WHEEL_SIZE;
+  }
+
+  for (; bucket < GH_WHEEL_BUCKETS; bucket++) {
+    if (wheel->buckets[bucket].next != &wheel->buckets[bucket])
+      return wheel->buckets[bucket].next;
+  }
+  return NULL;
+}
@@ -0,0 +1,176 @@
+/***************************************************************************
+ * gh_wheel.h -- hierarchical timing wheel.                                *
+ *                                                                         *
+ ***********************IMPORTANT NSOCK LICENSE TERMS***********************
+ *                                                                         *
+ * The nsock parallel socket event library is (C) 1999-2016 Insecure.Com   *
+ * LLC This library is free software; you may redistribute and/or          *
+ * modify it under the terms of the GNU General Public License as          *
+ * published by the Free Software Foundation; Version 2.  This guarantees  *
+ * your right to use, modify, and redistribute this software under certain *
+ * conditions.  If this license is unacceptable to you, Insecure.Com LLC   *
+ * may be willing to sell alternative licenses (contact                    *
+ * sales@insecure.com ).                                                   *
+ *                                                                         *
+ * As a special exception to the GPL terms, Insecure.Com LLC grants        *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two. You must obey the GNU GPL in all *
+ * respects for all of the code used other than OpenSSL.  If you modify    *
+ * this file, you may extend this exception to your version of the file,   *
+ * but you are not obligated to do so.                                     *
+ *                                                                         *
+ * If you received these files with a written license agreement stating    *
+ * terms other than the (GPL) terms above, then that alternative license   *
+ * agreement takes precedence over this comment.                           *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU       *
+ * General Public License v2.0 for more details                            *
+ * (http://www.gnu.org/licenses/gpl-2.0.html).                             *
+ *                                                                         *
+ ***************************************************************************/
+
+/* $Id$ */
+
+#ifndef GH_WHEEL_H
+#define GH_WHEEL_H
+
+#ifdef HAVE_CONFIG_H
+#include "nsock_config.h"
+#include "nbase_config.h"
+#endif
+
+#ifdef WIN32
+#include "nbase_winconfig.h"
+#endif
+
+#include <assert.h>
+#include <stdint.h>
+
+
+#if !defined(container_of)
+#include <stddef.h>
+
+#define container_of(ptr, type, member) \
+        ((type *)((char *)(ptr) - offsetof(type, member)))
+#endif
+
+
+/* Hierarchical timing wheel. Expiration times are expressed in ticks (nsock
+ * uses milliseconds). Level 0 has one slot per tick, and every following level
+ * has slots GH_WHEEL_SIZE times wider. Insertion and removal are O(1); nodes
+ * are moved down one level at a time as the wheel is advanced, so each node is
+ * touched at most GH_WHEEL_LEVELS times before it expires. Nodes that expire
+ * past the last level are kept in an overflow bucket and reconsidered each
+ * time the last level wraps around. */
+#define GH_WHEEL_BITS     6
+#define GH_WHEEL_SIZE     (1 << GH_WHEEL_BITS)
+#define GH_WHEEL_MASK     (GH_WHEEL_SIZE - 1)
+#define GH_WHEEL_LEVELS   4
+
+/* Bucket indexes past the regular slots: expired nodes waiting to be popped and
+ * nodes beyond the range of the last level. */
+#define GH_WHEEL_DUE      (GH_WHEEL_LEVELS * GH_WHEEL_SIZE)
+#define GH_WHEEL_OVERFLOW (GH_WHEEL_DUE + 1)
+#define GH_WHEEL_BUCKETS  (GH_WHEEL_OVERFLOW + 1)
+
+
+typedef struct gh_wnode {
+  struct gh_wnode *next;
+  struct gh_wnode *prev;
+  uint64_t expires;
+  unsigned int bucket;
+} gh_wnode_t;
+
+typedef struct gh_wheel {
+  uint64_t now;
+  unsigned int count;
+  /* One bit per non-empty slot, for each level */
+  uint64_t bitmap[GH_WHEEL_LEVELS];
+  /* Sentinels of the circular bucket lists */
+  gh_wnode_t buckets[GH_WHEEL_BUCKETS];
+} gh_wheel_t;
+
+
+void gh_wheel_init(gh_wheel_t *wheel, uint64_t now);
+
+void gh_wheel_free(gh_wheel_t *wheel);
+
+void gh_wheel_add(gh_wheel_t *wheel, gh_wnode_t *node, uint64_t expires);
+
+void gh_wheel_remove(gh_wheel_t *wheel, gh_wnode_t *node);
+
+/* Move the wheel's clock forward to now (it never goes backward). Nodes that
+ * expire at or before now become available through gh_wheel_pop_expired(). */
+void gh_wheel_advance(gh_wheel_t *wheel, uint64_t now);
+
+/* Advance the wheel to now and remove/return one of the expired nodes. Nodes
+ * come out tick by tick in expiration order, except that nodes added with an
+ * expiration time already reached are queued after the ones already due. If
+ * now is before the wheel's clock (the system time was set back), the wheel is
+ * rebuilt around now first, so that no node comes out before its time.
+ * Returns NULL if nothing has expired. */
+gh_wnode_t *gh_wheel_pop_expired(gh_wheel_t *wheel, uint64_t now);
+
+/* Store in *when a lower bound of the earliest expiration time in the wheel.
+ * The bound is exact for nodes within the first level, which covers the next
+ * GH_WHEEL_SIZE ticks. Returns 0 (and leaves *when untouched) if the wheel is
+ * empty. */
+int gh_wheel_next_expiry(gh_wheel_t *wheel, uint64_t *when);
+
+/* Iterate over all the nodes, in no particular order. Pass NULL to get the
+ * first node. The wheel must not be modified during the iteration, except for
+ * removing the last returned node and stopping there. */
+gh_wnode_t *gh_wheel_next(gh_wheel_t *wheel, gh_wnode_t *node);
+
+
+static inline gh_wnode_t *gh_wheel_pop(gh_wheel_t *wheel) {
+  gh_wnode_t *wnode;
+
+  wnode = gh_wheel_next(wheel, NULL);
+  if (wnode != NULL)
+    gh_wheel_remove(wheel, wnode);
+
+  return wnode;
+}
+
+static inline size_t gh_wheel_count(gh_wheel_t *wheel) {
+  return wheel->count;
+}
+
+static inline int gh_wheel_is_empty(gh_wheel_t *wheel) {
+  return wheel->count == 0;
+}
+
+static inline void gh_wnode_invalidate(gh_wnode_t *node) {
+  node->next = NULL;
+  node->prev = NULL;
+}
+
+static inline int gh_wnode_is_valid(const gh_wnode_t *node) {
+  return (node && node->next != NULL);
+}
+
+#endif /* GH_WHEEL_H */
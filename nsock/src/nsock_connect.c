@@ -253,6 +253,7 @@ void nsock_connect_internal(struct npool *ms, struct nevent *nse, int type, int
       memcpy(&iod->peer, ss, sslen);
     iod->peerlen = sslen;
 
+    ms->stats.io_calls++;
     if (connect(iod->sd, (struct sockaddr *)ss, sslen) == -1) {
       int err = socket_errno();
 
@@ -90,7 +90,7 @@
 /* Nsock time of day -- we update this at least once per nsock_loop round (and
  * after most calls that are likely to block).  Other nsock files should grab
  * this */
-struct timeval nsock_tod;
+NSOCK_THREAD_LOCAL struct timeval nsock_tod;
 
 /* Internal function defined in nsock_event.c
  * Update the nse->iod first events, assuming nse is about to be deleted */
@@ -339,6 +339,7 @@ void handle_connect_result(struct npool *ms, struct nevent *nse, enum nse_status
     /* Do nothing */
   } else if (status == NSE_STATUS_SUCCESS) {
     /* First we want to determine whether the socket really is connected */
+    ms->stats.io_calls++;
     if (getsockopt(iod->sd, SOL_SOCKET, SO_ERROR, (char *)&optval, &optlen) != 0)
       optval = socket_errno(); /* Stupid Solaris */
 
@@ -448,6 +449,7 @@ void handle_connect_result(struct npool *ms, struct nevent *nse, enum nse_status
       update_events(iod, ms, EV_NONE, ev);
     }
 
+    ms->stats.io_calls++;
     rc = SSL_connect(iod->ssl);
     if (rc == 1) {
       /* Woop!  Connect is done! */
@@ -465,10 +467,12 @@ void handle_connect_result(struct npool *ms, struct nevent *nse, enum nse_status
 
       sslerr = SSL_get_error(iod->ssl, rc);
       if (rc == -1 && sslerr == SSL_ERROR_WANT_READ) {
+        iod->ready_events &= ~EV_READ;
         nse->sslinfo.ssl_desire = sslerr;
         socket_count_read_inc(iod);
         update_events(iod, ms, EV_READ, EV_NONE);
       } else if (rc == -1 && sslerr == SSL_ERROR_WANT_WRITE) {
+        iod->ready_events &= ~EV_WRITE;
         nse->sslinfo.ssl_desire = sslerr;
         socket_count_write_inc(iod);
         update_events(iod, ms, EV_WRITE, EV_NONE);
@@ -537,6 +541,7 @@ void handle_write_result(struct npool *ms, struct nevent *nse, enum nse_status s
     bytesleft = fs_length(&nse->iobuf) - nse->writeinfo.written_so_far;
     if (nse->writeinfo.written_so_far > 0)
       assert(bytesleft > 0);
+    ms->stats.io_calls++;
 #if HAVE_OPENSSL
     if (iod->ssl)
       res = SSL_write(iod->ssl, str, bytesleft);
@@ -559,6 +564,7 @@ void handle_write_result(struct npool *ms, struct nevent *nse, enum nse_status s
         if (err == SSL_ERROR_WANT_READ) {
           int evclr;
 
+          iod->ready_events &= ~EV_READ;
           evclr = socket_count_dec_ssl_desire(nse);
           socket_count_read_inc(iod);
           update_events(iod, ms, EV_READ, evclr);
@@ -566,6 +572,7 @@ void handle_write_result(struct npool *ms, struct nevent *nse, enum nse_status s
         } else if (err == SSL_ERROR_WANT_WRITE) {
           int evclr;
 
+          iod->ready_events &= ~EV_WRITE;
           evclr = socket_count_dec_ssl_desire(nse);
           socket_count_write_inc(iod);
           update_events(iod, ms, EV_WRITE, evclr);
@@ -583,6 +590,8 @@ void handle_write_result(struct npool *ms, struct nevent *nse, enum nse_status s
           nse->event_done = 1;
           nse->status = NSE_STATUS_ERROR;
           nse->errnum = err;
+        } else if (err == EAGAIN) {
+          iod->ready_events &= ~EV_WRITE;
         }
       }
     }
@@ -628,6 +637,7 @@ static int do_actual_read(struct npool *ms, struct nevent *nse) {
       socklen_t peerlen;
 
       peerlen = sizeof(peer);
+      ms->stats.io_calls++;
       buflen = recvfrom(iod->sd, buf, sizeof(buf), 0, (struct sockaddr *)&peer, &peerlen);
 
       /* Using recv() was failing, at least on UNIX, for non-network sockets
@@ -637,6 +647,7 @@ static int do_actual_read(struct npool *ms, struct nevent *nse) {
         if (socket_errno() == ENOTSOCK) {
           peer.ss_family = AF_UNSPEC;
           peerlen = 0;
+          ms->stats.io_calls++;
           buflen = read(iod->sd, buf, sizeof(buf));
         }
       }
@@ -684,11 +695,14 @@ static int do_actual_read(struct npool *ms, struct nevent *nse) {
         nse->errnum = err;
         return -1;
       }
+      if (err == EAGAIN)
+        iod->ready_events &= ~EV_READ;
     }
   } else {
 #if HAVE_OPENSSL
     /* OpenSSL read */
     while ((buflen = SSL_read(iod->ssl, buf, sizeof(buf))) > 0) {
+      ms->stats.io_calls++;
 
       if (fs_cat(&nse->iobuf, buf, buflen) == -1) {
         nse->event_done = 1;
@@ -703,12 +717,15 @@ static int do_actual_read(struct npool *ms, struct nevent *nse) {
       if (fs_length(&nse->iobuf) > max_chunk)
         return fs_length(&nse->iobuf) - startlen;
     }
+    /* The call that ended the loop */
+    ms->stats.io_calls++;
 
     if (buflen == -1) {
       err = SSL_get_error(iod->ssl, buflen);
       if (err == SSL_ERROR_WANT_READ) {
         int evclr;
 
+        iod->ready_events &= ~EV_READ;
         evclr = socket_count_dec_ssl_desire(nse);
         socket_count_read_inc(iod);
         update_events(iod, ms, EV_READ, evclr);
@@ -716,6 +733,7 @@ static int do_actual_read(struct npool *ms, struct nevent *nse) {
       } else if (err == SSL_ERROR_WANT_WRITE) {
         int evclr;
 
+        iod->ready_events &= ~EV_WRITE;
         evclr = socket_count_dec_ssl_desire(nse);
         socket_count_write_inc(iod);
         update_events(iod, ms, EV_WRITE, evclr);
@@ -1148,7 +1166,7 @@ void process_iod_events(struct npool *nsp, struct niod *nsi, int ev) {
         gh_list_append(&nsp->free_events, &nse->nodeq_io);
 
         if (nse->timeout.tv_sec)
-          gh_heap_remove(&nsp->expirables, &nse->expire);
+          expirable_remove(nsp, nse);
       }
     }
   }
@@ -1203,20 +1221,44 @@ static int nevent_unref(struct npool *nsp, struct nevent *nse) {
   return 0;
 }
 
-void process_expired_events(struct npool *nsp) {
-  for (;;) {
+/* Remove and return the next expirable event whose timeout has been reached, or
+ * NULL if there is none. */
+static struct nevent *pop_timedout_event(struct npool *nsp) {
+  struct nevent *nse;
+
+  if (nsp->wheel) {
+    gh_wnode_t *wnode;
+
+    wnode = gh_wheel_pop_expired(nsp->wheel, timeval_to_tick(&nsock_tod, 0));
+    if (!wnode)
+      return NULL;
+
+    nse = container_of(wnode, struct nevent, expire.wheel);
+    assert(event_timedout(nse));
+  } else {
     gh_hnode_t *hnode;
-    struct nevent *nse;
 
     hnode = gh_heap_min(&nsp->expirables);
     if (!hnode)
-      break;
+      return NULL;
 
-    nse = container_of(hnode, struct nevent, expire);
+    nse = container_of(hnode, struct nevent, expire.heap);
     if (!event_timedout(nse))
-      break;
+      return NULL;
 
     gh_heap_pop(&nsp->expirables);
+  }
+  return nse;
+}
+
+void process_expired_events(struct npool *nsp) {
+  for (;;) {
+    struct nevent *nse;
+
+    nse = pop_timedout_event(nsp);
+    if (!nse)
+      break;
+
     process_event(nsp, NULL, nse, EV_NONE);
     assert(nse->event_done);
     update_first_events(nse);
@@ -1254,7 +1296,7 @@ void nsock_pool_add_event(struct npool *nsp, struct nevent *nse) {
 
   if (!nse->event_done && nse->timeout.tv_sec) {
     /* This event is expirable, add it to the queue */
-    gh_heap_push(&nsp->expirables, &nse->expire);
+    expirable_add(nsp, nse);
   }
 
   /* Now we do the event type specific actions */
@@ -65,11 +65,19 @@
 
 #if HAVE_EPOLL
   extern struct io_engine engine_epoll;
-  #define ENGINE_EPOLL &engine_epoll,
+  extern struct io_engine engine_epoll_et;
+  #define ENGINE_EPOLL &engine_epoll, &engine_epoll_et,
 #else
   #define ENGINE_EPOLL
 #endif /* HAVE_EPOLL */
 
+#if HAVE_IO_URING
+  extern struct io_engine engine_iouring;
+  #define ENGINE_IOURING &engine_iouring,
+#else
+  #define ENGINE_IOURING
+#endif /* HAVE_IO_URING */
+
 #if HAVE_KQUEUE
   extern struct io_engine engine_kqueue;
   #define ENGINE_KQUEUE &engine_kqueue,
@@ -92,6 +100,7 @@ extern struct io_engine engine_select;
  * available on your system. Engines must be sorted by order of preference */
 static struct io_engine *available_engines[] = {
   ENGINE_EPOLL
+  ENGINE_IOURING
   ENGINE_KQUEUE
   ENGINE_POLL
   ENGINE_SELECT
@@ -122,6 +131,19 @@ struct io_engine *get_io_engine(void) {
   return engine;
 }
 
+/* Engine to use instead of the one returned by get_io_engine() when that one
+ * can't be initialized, e.g. because the running kernel doesn't support it. */
+struct io_engine *get_fallback_io_engine(const struct io_engine *failed) {
+  int i;
+
+  for (i = 0; available_engines[i] != NULL; i++)
+    if (available_engines[i] != failed)
+      return available_engines[i];
+
+  fatal("No suitable IO engine found! (%s failed)\n", failed->name);
+  return NULL;
+}
+
 int nsock_set_default_engine(char *engine) {
   if (engine_hint)
     free(engine_hint);
@@ -146,7 +168,10 @@ int nsock_set_default_engine(char *engine) {
 const char *nsock_list_engines(void) {
   return
 #if HAVE_EPOLL
-  "epoll "
+  "epoll epoll_et "
+#endif
+#if HAVE_IO_URING
+  "io_uring "
 #endif
 #if HAVE_KQUEUE
   "kqueue "
@@ -68,7 +68,7 @@
 
 #include <string.h>
 
-extern struct timeval nsock_tod;
+extern NSOCK_THREAD_LOCAL struct timeval nsock_tod;
 
 /* Find the type of an event that spawned a callback */
 enum nse_type nse_type(nsock_event nse) {
@@ -211,11 +211,22 @@ int nsock_event_cancel(nsock_pool ms_pool, nsock_event_id id, int notify) {
       break;
 
     case NSE_TYPE_TIMER:
+      if (nsp->wheel) {
+        gh_wnode_t *wnode;
+
+        for (wnode = gh_wheel_next(nsp->wheel, NULL); wnode != NULL;
+             wnode = gh_wheel_next(nsp->wheel, wnode)) {
+          nse = container_of(wnode, struct nevent, expire.wheel);
+          if (nse->id == id)
+            return nevent_delete(nsp, nse, NULL, NULL, notify);
+        }
+        return 0;
+      }
       for (i = 0; i < gh_heap_count(&nsp->expirables); i++) {
         gh_hnode_t *hnode;
 
         hnode = gh_heap_find(&nsp->expirables, i);
-        nse = container_of(hnode, struct nevent, expire);
+        nse = container_of(hnode, struct nevent, expire.heap);
         if (nse->id == id)
           return nevent_delete(nsp, nse, NULL, NULL, notify);
       }
@@ -307,7 +318,7 @@ int nevent_delete(struct npool *nsp, struct nevent *nse, gh_list_t *event_list,
   assert(nse->event_done);
 
   if (nse->timeout.tv_sec)
-    gh_heap_remove(&nsp->expirables, &nse->expire);
+    expirable_remove(nsp, nse);
 
   if (event_list) {
     update_first_events(nse);
@@ -437,7 +448,7 @@ struct nevent *event_new(struct npool *nsp, enum nse_type type,
   nse->id = get_new_event_id(nsp, type);
   nse->type = type;
   nse->status = NSE_STATUS_NONE;
-  gh_hnode_invalidate(&nse->expire);
+  expirable_invalidate(nsp, nse);
 #if HAVE_OPENSSL
   nse->sslinfo.ssl_desire = SSL_ERROR_NONE;
 #endif
@@ -73,6 +73,7 @@
 
 #include "gh_list.h"
 #include "gh_heap.h"
+#include "gh_wheel.h"
 #include "filespace.h"
 #include "nsock.h" /* The public interface -- I need it for some enum defs */
 #include "nsock_ssl.h"
@@ -102,11 +103,20 @@
 #if HAVE_SYS_UN_H
 #include <sys/un.h>
 #endif
+#include <limits.h>
 
 #ifndef IPPROTO_SCTP
 #define IPPROTO_SCTP 132
 #endif
 
+/* Pools may run on different threads (one pool per thread at a time), each
+ * thread keeps its own cached time of day in nsock_tod. */
+#ifdef _MSC_VER
+#define NSOCK_THREAD_LOCAL __declspec(thread)
+#else
+#define NSOCK_THREAD_LOCAL __thread
+#endif
+
 
 /* ------------------- CONSTANTS ------------------- */
 
@@ -167,7 +177,15 @@ struct npool {
 #if HAVE_PCAP
   gh_list_t pcap_read_events;
 #endif
+
+  /* Events that have a timeout, ordered by expiration time. They live in the
+   * binary heap unless the pool was created with NSOCK_POOL_TIMER_WHEEL, in
+   * which case wheel is non-NULL and used instead. */
   gh_heap_t expirables;
+  gh_wheel_t *wheel;
+
+  /* System call counters, see nsock_pool_get_stats() */
+  struct nsock_pool_stats stats;
 
   /* Active iods and related lists of events */
   gh_list_t active_iods;
@@ -236,6 +254,11 @@ struct niod {
 
   int watched_events;
 
+  /* Readiness reported by an edge-triggered IO engine and not consumed yet.
+   * The I/O code clears the corresponding bit whenever a call on the socket
+   * would block. */
+  int ready_events;
+
   /* The struct npool used to create the iod (used for deletion) */
   struct npool *nsp;
 
@@ -262,6 +285,7 @@ struct niod {
 
 #define IOD_REGISTERED  0x01
 #define IOD_PROCESSED   0x02    /* internally used by engine_kqueue.c */
+#define IOD_READY       0x04    /* internally used by engine_epoll.c */
 
 #define IOD_PROPSET(iod, flag)  ((iod)->_flags |= (flag))
 #define IOD_PROPCLR(iod, flag)  ((iod)->_flags &= ~(flag))
@@ -339,8 +363,11 @@ struct nevent {
   /* The handler to call when event is complete */
   nsock_ev_handler handler;
 
-  /* slot in the expirable binheap */
-  gh_hnode_t expire;
+  /* slot in the expirable binheap or timing wheel, depending on the pool */
+  union {
+    gh_hnode_t heap;
+    gh_wnode_t wheel;
+  } expire;
 
   /* For some reasons (see nsock_pcap.c) we register pcap events as both read
    * and pcap_read events when in PCAP_BSD_SELECT_HACK mode. We then need two
@@ -484,14 +511,68 @@ void nsock_trace_handler_callback(struct npool *ms, struct nevent *nse);
 void nsi_set_ssl_session(struct niod *iod, SSL_SESSION *sessid);
 #endif
 
-static inline struct nevent *next_expirable_event(struct npool *nsp) {
-  gh_hnode_t *hnode;
+/* Timing wheel ticks are milliseconds. Expiration times are rounded up and the
+ * current time down, so that events never fire before their timeout. */
+static inline u64 timeval_to_tick(const struct timeval *tv, int round_up) {
+  return (u64)tv->tv_sec * 1000 + (tv->tv_usec + (round_up ? 999 : 0)) / 1000;
+}
+
+static inline void expirable_invalidate(struct npool *nsp, struct nevent *nse) {
+  if (nsp->wheel)
+    gh_wnode_invalidate(&nse->expire.wheel);
+  else
+    gh_hnode_invalidate(&nse->expire.heap);
+}
+
+static inline void expirable_add(struct npool *nsp, struct nevent *nse) {
+  if (nsp->wheel)
+    gh_wheel_add(nsp->wheel, &nse->expire.wheel, timeval_to_tick(&nse->timeout, 1));
+  else
+    gh_heap_push(&nsp->expirables, &nse->expire.heap);
+}
+
+static inline void expirable_remove(struct npool *nsp, struct nevent *nse) {
+  if (nsp->wheel)
+    gh_wheel_remove(nsp->wheel, &nse->expire.wheel);
+  else
+    gh_heap_remove(&nsp->expirables, &nse->expire.heap);
+}
+
+/* Remove and return any expirable event, or NULL if there are none left. */
+static inline struct nevent *expirable_pop(struct npool *nsp) {
+  if (nsp->wheel) {
+    gh_wnode_t *wnode = gh_wheel_pop(nsp->wheel);
+
+    return wnode ? container_of(wnode, struct nevent, expire.wheel) : NULL;
+  } else {
+    gh_hnode_t *hnode = gh_heap_pop(&nsp->expirables);
+
+    return hnode ? container_of(hnode, struct nevent, expire.heap) : NULL;
+  }
+}
+
+/* Number of milliseconds from now until the next expirable event times out, or
+ * -1 if no event has a timeout. */
+static inline int next_expirable_msecs(struct npool *nsp, const struct timeval *now) {
+  if (nsp->wheel) {
+    u64 when, tick;
+
+    if (!gh_wheel_next_expiry(nsp->wheel, &when))
+      return -1;
+
+    tick = timeval_to_tick(now, 0);
+    return (when <= tick) ? 0 : (int)MIN(when - tick, INT_MAX);
+  } else {
+    gh_hnode_t *hnode;
+    struct nevent *nse;
 
-  hnode = gh_heap_min(&nsp->expirables);
-  if (!hnode)
-    return NULL;
+    hnode = gh_heap_min(&nsp->expirables);
+    if (!hnode)
+      return -1;
 
-  return container_of(hnode, struct nevent, expire);
+    nse = container_of(hnode, struct nevent, expire.heap);
+    return MAX(0, TIMEVAL_MSEC_SUBTRACT(nse->timeout, *now));
+  }
 }
 
 static inline struct nevent *lnode_nevent(gh_lnode_t *lnode) {
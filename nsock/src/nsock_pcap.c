@@ -77,7 +77,7 @@
 
 #include "nsock_pcap.h"
 
-extern struct timeval nsock_tod;
+extern NSOCK_THREAD_LOCAL struct timeval nsock_tod;
 
 #if HAVE_PCAP
 
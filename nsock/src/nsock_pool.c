@@ -72,7 +72,7 @@
 #include <signal.h>
 
 
-extern struct timeval nsock_tod;
+extern NSOCK_THREAD_LOCAL struct timeval nsock_tod;
 
 /* To use this library, the first thing they must do is create a pool
  * so we do the initialization during the first pool creation */
@@ -81,6 +81,7 @@ static int nsocklib_initialized = 0;
 
 /* defined in nsock_engines.h */
 struct io_engine *get_io_engine(void);
+struct io_engine *get_fallback_io_engine(const struct io_engine *failed);
 
 /* ---- INTERNAL FUNCTIONS PROTOTYPES ---- */
 static void nsock_library_initialize(void);
@@ -122,12 +123,20 @@ void nsock_pool_set_device(nsock_pool nsp, const char *device) {
   mt->device = device;
 }
 
+/* Fill in stats with the counters accumulated since the pool was created. */
+void nsock_pool_get_stats(nsock_pool nsp, struct nsock_pool_stats *stats) {
+  struct npool *mt = (struct npool *)nsp;
+
+  *stats = mt->stats;
+  stats->engine = mt->engine->name;
+}
+
 static int expirable_cmp(gh_hnode_t *n1, gh_hnode_t *n2) {
   struct nevent *nse1;
   struct nevent *nse2;
 
-  nse1 = container_of(n1, struct nevent, expire);
-  nse2 = container_of(n2, struct nevent, expire);
+  nse1 = container_of(n1, struct nevent, expire.heap);
+  nse2 = container_of(n2, struct nevent, expire.heap);
 
   return (TIMEVAL_BEFORE(nse1->timeout, nse2->timeout)) ? 1 : 0;
 }
@@ -137,6 +146,11 @@ static int expirable_cmp(gh_hnode_t *n1, gh_hnode_t *n2) {
  * returned.  If you do not wish to immediately associate any userdata, pass in
  * NULL. */
 nsock_pool nsock_pool_new(void *userdata) {
+  return nsock_pool_new2(userdata, 0);
+}
+
+/* Same as nsock_pool_new() but with NSOCK_POOL_* flags. */
+nsock_pool nsock_pool_new2(void *userdata, int flags) {
   struct npool *nsp;
 
   /* initialize the library in not already done */
@@ -153,7 +167,14 @@ nsock_pool nsock_pool_new(void *userdata) {
   nsp->userdata = userdata;
 
   nsp->engine = get_io_engine();
-  nsock_engine_init(nsp);
+  if (!nsock_engine_init(nsp)) {
+    const struct io_engine *failed = nsp->engine;
+
+    nsp->engine = get_fallback_io_engine(failed);
+    nsock_log_info("%s engine unavailable, falling back to %s",
+                   failed->name, nsp->engine->name);
+    nsock_engine_init(nsp);
+  }
 
   /* initialize IO events lists */
   gh_list_init(&nsp->connect_events);
@@ -163,8 +184,14 @@ nsock_pool nsock_pool_new(void *userdata) {
   gh_list_init(&nsp->pcap_read_events);
 #endif
 
-  /* initialize timer heap */
+  /* initialize timer heap, or wheel */
   gh_heap_init(&nsp->expirables, expirable_cmp);
+  if (flags & NSOCK_POOL_TIMER_WHEEL) {
+    nsp->wheel = (gh_wheel_t *)safe_malloc(sizeof(*nsp->wheel));
+    gh_wheel_init(nsp->wheel, timeval_to_tick(&nsock_tod, 0));
+  } else {
+    nsp->wheel = NULL;
+  }
 
   /* initialize the list of IODs */
   gh_list_init(&nsp->active_iods);
@@ -238,12 +265,7 @@ void nsock_pool_delete(nsock_pool ms_pool) {
   }
 
   /* Kill timers too, they're not in event lists */
-  while (gh_heap_count(&nsp->expirables) > 0) {
-    gh_hnode_t *hnode;
-
-    hnode = gh_heap_pop(&nsp->expirables);
-    nse = container_of(hnode, struct nevent, expire);
-
+  while ((nse = expirable_pop(nsp)) != NULL) {
     if (nse->type == NSE_TYPE_TIMER) {
       nse->status = NSE_STATUS_KILL;
       nsock_trace_handler_callback(nsp, nse);
@@ -254,6 +276,10 @@ void nsock_pool_delete(nsock_pool ms_pool) {
   }
 
   gh_heap_free(&nsp->expirables);
+  if (nsp->wheel) {
+    gh_wheel_free(nsp->wheel);
+    free(nsp->wheel);
+  }
 
   /* foreach struct niod */
   for (current = gh_list_first_elem(&nsp->active_iods);
@@ -65,7 +65,7 @@
 #define DEFAULT_PROXY_PORT_HTTP 8080
 
 
-extern struct timeval nsock_tod;
+extern NSOCK_THREAD_LOCAL struct timeval nsock_tod;
 extern const struct proxy_spec ProxySpecHttp;
 
 
@@ -66,7 +66,7 @@
 #define DEFAULT_PROXY_PORT_SOCKS4 1080
 
 
-extern struct timeval nsock_tod;
+extern NSOCK_THREAD_LOCAL struct timeval nsock_tod;
 extern const struct proxy_spec ProxySpecSocks4;
 
 
@@ -0,0 +1,251 @@
+/*
+ * Nsock regression test suite
+ * Same license as nmap -- see https://nmap.org/book/man-legal.html
+ */
+
+#include "test-common.h"
+#include "../src/gh_wheel.h"
+#include <stdint.h>
+#include <time.h>
+
+
+#define WHEEL_NODES  50000
+
+struct testitem {
+  int removed;
+  gh_wnode_t node;
+};
+
+/* Random expiration time, spread so that every level and the overflow bucket
+ * get populated. */
+static uint64_t rand_expiry(uint64_t now) {
+  switch (rand() % 4) {
+    case 0:
+      return now + rand() % 64;
+    case 1:
+      return now + rand() % 5000;
+    case 2:
+      return now + rand() % 300000;
+    default:
+      return now + (uint64_t)(rand() % 1000) * 100000;
+  }
+}
+
+static int check_expired(gh_wheel_t *wheel, uint64_t now, uint64_t *last, int *popped) {
+  gh_wnode_t *wnode;
+
+  while ((wnode = gh_wheel_pop_expired(wheel, now)) != NULL) {
+    if (wnode->expires > now) {
+      fprintf(stderr, "Node expiring at %llu popped at %llu\n",
+              (unsigned long long)wnode->expires, (unsigned long long)now);
+      return -EINVAL;
+    }
+    if (wnode->expires < *last) {
+      fprintf(stderr, "Node expiring at %llu popped after %llu\n",
+              (unsigned long long)wnode->expires, (unsigned long long)*last);
+      return -EINVAL;
+    }
+    *last = wnode->expires;
+    (*popped)++;
+  }
+  return 0;
+}
+
+static struct testitem *sort_items;
+
+static int item_cmp(const void *a, const void *b) {
+  uint64_t ea = sort_items[*(const int *)a].node.expires;
+  uint64_t eb = sort_items[*(const int *)b].node.expires;
+
+  return (ea > eb) - (ea < eb);
+}
+
+static int ghwheel_ordering(void *tdata) {
+  gh_wheel_t wheel;
+  struct testitem *items;
+  int *order;
+  uint64_t now, start, last, when;
+  int i, rc, popped, removed, first;
+
+  srand(time(NULL));
+
+  items = calloc(WHEEL_NODES, sizeof(struct testitem));
+  assert(items != NULL);
+
+  start = now = 1000000007ULL;
+  gh_wheel_init(&wheel, now);
+
+  for (i = 0; i < WHEEL_NODES; i++) {
+    gh_wnode_invalidate(&items[i].node);
+    gh_wheel_add(&wheel, &items[i].node, rand_expiry(now) + 1);
+  }
+
+  /* Remove a fraction of the nodes, as nsock does for completed events */
+  removed = 0;
+  for (i = 0; i < WHEEL_NODES; i += 3) {
+    gh_wheel_remove(&wheel, &items[i].node);
+    items[i].removed = 1;
+    removed++;
+  }
+
+  if (gh_wheel_count(&wheel) != (size_t)(WHEEL_NODES - removed))
+    return -EINVAL;
+
+  order = calloc(WHEEL_NODES, sizeof(int));
+  assert(order != NULL);
+  for (i = 0; i < WHEEL_NODES; i++)
+    order[i] = i;
+  sort_items = items;
+  qsort(order, WHEEL_NODES, sizeof(int), item_cmp);
+
+  /* Walk time forward with irregular steps. The next expiry must never be
+   * after the earliest remaining node. */
+  popped = 0;
+  last = 0;
+  first = 0;
+  while (!gh_wheel_is_empty(&wheel)) {
+    uint64_t earliest;
+
+    while (items[order[first]].removed || !gh_wnode_is_valid(&items[order[first]].node))
+      first++;
+    earliest = items[order[first]].node.expires;
+
+    if (!gh_wheel_next_expiry(&wheel, &when) || when > earliest) {
+      fprintf(stderr, "Bogus next expiry %llu (earliest is %llu)\n",
+              (unsigned long long)when, (unsigned long long)earliest);
+      return -EINVAL;
+    }
+
+    now = ((when > now) ? when : now + 1) + rand() % 50;
+    rc = check_expired(&wheel, now, &last, &popped);
+    if (rc)
+      return rc;
+
+    /* Catch up faster once the near future is drained */
+    if (now - start > 10000)
+      now += rand() % 200000;
+  }
+
+  if (popped != WHEEL_NODES - removed) {
+    fprintf(stderr, "Popped %d nodes, expected %d\n", popped, WHEEL_NODES - removed);
+    return -EINVAL;
+  }
+
+  if (gh_wheel_pop_expired(&wheel, (uint64_t)-1 >> 1) != NULL)
+    return -EINVAL;
+
+  gh_wheel_free(&wheel);
+  free(order);
+  free(items);
+  return 0;
+}
+
+static int ghwheel_iterate(void *tdata) {
+  gh_wheel_t wheel;
+  struct testitem *items;
+  gh_wnode_t *wnode;
+  int i, n;
+
+  items = calloc(WHEEL_NODES, sizeof(struct testitem));
+  assert(items != NULL);
+
+  gh_wheel_init(&wheel, 0);
+  for (i = 0; i < WHEEL_NODES; i++) {
+    gh_wnode_invalidate(&items[i].node);
+    gh_wheel_add(&wheel, &items[i].node, rand_expiry(0));
+  }
+
+  n = 0;
+  for (wnode = gh_wheel_next(&wheel, NULL); wnode != NULL;
+       wnode = gh_wheel_next(&wheel, wnode)) {
+    struct testitem *item = container_of(wnode, struct testitem, node);
+
+    if (item->removed)
+      return -EINVAL;
+    item->removed = 1;
+    n++;
+  }
+
+  if (n != WHEEL_NODES)
+    return -EINVAL;
+
+  while ((wnode = gh_wheel_pop(&wheel)) != NULL)
+    n--;
+
+  if (n != 0 || !gh_wheel_is_empty(&wheel))
+    return -EINVAL;
+
+  gh_wheel_free(&wheel);
+  free(items);
+  return 0;
+}
+
+static int ghwheel_clock_back(void *tdata) {
+  gh_wheel_t wheel;
+  struct testitem *items;
+  uint64_t now, last;
+  int i, rc, popped;
+
+  items = calloc(WHEEL_NODES, sizeof(struct testitem));
+  assert(items != NULL);
+
+  now = 1000000007ULL;
+  gh_wheel_init(&wheel, now);
+  for (i = 0; i < WHEEL_NODES / 2; i++) {
+    gh_wnode_invalidate(&items[i].node);
+    gh_wheel_add(&wheel, &items[i].node, rand_expiry(now) + 1);
+  }
+
+  popped = 0;
+  last = 0;
+  rc = check_expired(&wheel, now + 200000, &last, &popped);
+  if (rc)
+    return rc;
+
+  /* The clock is set back past the nodes just popped. Nodes added now must not
+   * be taken for expired, and neither may the ones left from before. */
+  now += 100000;
+  for (; i < WHEEL_NODES; i++) {
+    gh_wnode_invalidate(&items[i].node);
+    gh_wheel_add(&wheel, &items[i].node, rand_expiry(now) + 1);
+  }
+
+  last = 0;
+  while (!gh_wheel_is_empty(&wheel)) {
+    now += 1 + rand() % 5000;
+    rc = check_expired(&wheel, now, &last, &popped);
+    if (rc)
+      return rc;
+  }
+
+  if (popped != WHEEL_NODES) {
+    fprintf(stderr, "Popped %d nodes, expected %d\n", popped, WHEEL_NODES);
+    return -EINVAL;
+  }
+
+  gh_wheel_free(&wheel);
+  free(items);
+  return 0;
+}
+
+
+const struct test_case TestGHWheels = {
+  .t_name     = "test nsock internal ghwheels",
+  .t_setup    = NULL,
+  .t_run      = ghwheel_ordering,
+  .t_teardown = NULL
+};
+
+const struct test_case TestWheelIteration = {
+  .t_name     = "test wheel iteration",
+  .t_setup    = NULL,
+  .t_run      = ghwheel_iterate,
+  .t_teardown = NULL
+};
+
+const struct test_case TestWheelClockBack = {
+  .t_name     = "test wheel with the clock set back",
+  .t_setup    = NULL,
+  .t_run      = ghwheel_clock_back,
+  .t_teardown = NULL
+};
@@ -109,10 +109,13 @@ static int log_setup(void **tdata) {
   if (ltd == NULL)
     return -ENOMEM;
 
+  /* the handler of the previous test may be called while creating the pool */
+  GlobalLTD = ltd;
+
   ltd->nsp = nsock_pool_new(ltd);
   AssertNonNull(ltd->nsp);
 
-  *tdata = GlobalLTD = ltd;
+  *tdata = ltd;
   return 0;
 }
 
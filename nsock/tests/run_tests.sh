@@ -39,7 +39,7 @@ then
         ;;
 
     "-h")
-        echo "Usage: `basename $0` [gdb|trace|leak]"
+        echo "Usage: [NSOCK_ENGINE=<engine>] `basename $0` [gdb|trace|leak]"
         exit 0
         ;;
 
@@ -78,7 +78,7 @@ main() {
   setup_echo_tcp $PORT_TCP
   $EXEC_MAIN --ssl && setup_echo_tcpssl $PORT_TCPSSL
 
-  $TRACER $EXEC_MAIN
+  $TRACER $EXEC_MAIN ${NSOCK_ENGINE:+--engine $NSOCK_ENGINE}
 
   cleanup_all $pid_udp $pid_tcp $pid_tcpssl
 }
@@ -28,6 +28,7 @@ char *socket_strerror(int errnum);
 
 extern const struct test_case TestPoolUserData;
 extern const struct test_case TestTimer;
+extern const struct test_case TestTimerWheel;
 extern const struct test_case TestLogLevels;
 extern const struct test_case TestErrLevels;
 extern const struct test_case TestConnectTCP;
@@ -35,6 +36,9 @@ extern const struct test_case TestConnectFailure;
 extern const struct test_case TestGHLists;
 extern const struct test_case TestGHHeaps;
 extern const struct test_case TestHeapOrdering;
+extern const struct test_case TestGHWheels;
+extern const struct test_case TestWheelIteration;
+extern const struct test_case TestWheelClockBack;
 extern const struct test_case TestCancelTCP;
 extern const struct test_case TestCancelUDP;
 #ifdef HAVE_OPENSSL
@@ -47,6 +51,7 @@ static const struct test_case *TestCases[] = {
   &TestPoolUserData,
   /* ---- timer.c */
   &TestTimer,
+  &TestTimerWheel,
   /* ---- logs.c */
   &TestLogLevels,
   &TestErrLevels,
@@ -58,6 +63,10 @@ static const struct test_case *TestCases[] = {
   /* ---- ghheaps.c */
   &TestGHHeaps,
   &TestHeapOrdering,
+  /* ---- ghwheels.c */
+  &TestGHWheels,
+  &TestWheelIteration,
+  &TestWheelClockBack,
   /* ---- cancel.c */
   &TestCancelTCP,
   &TestCancelUDP,
@@ -108,6 +117,14 @@ int main(int ac, char **av) {
 #endif
   }
 
+  /* run the suite against a given IO engine */
+  if (ac == 3 && !strcmp(av[1], "--engine")) {
+    if (nsock_set_default_engine(av[2]) < 0) {
+      fprintf(stderr, "Unknown engine %s (available: %s)\n", av[2], nsock_list_engines());
+      return 1;
+    }
+  }
+
 #ifdef WIN32
   win_init();
 #endif
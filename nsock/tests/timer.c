@@ -81,6 +81,22 @@ static int timer_setup(void **tdata) {
   return 0;
 }
 
+static int timer_setup_wheel(void **tdata) {
+  struct timer_test_data *ttd;
+
+  srand(time(NULL));
+
+  ttd = calloc(1, sizeof(struct timer_test_data));
+  if (ttd == NULL)
+    return -ENOMEM;
+
+  ttd->nsp = nsock_pool_new2(NULL, NSOCK_POOL_TIMER_WHEEL);
+  AssertNonNull(ttd->nsp);
+
+  *tdata = ttd;
+  return 0;
+}
+
 static int timer_teardown(void *tdata) {
   struct timer_test_data *ttd = (struct timer_test_data *)tdata;
 
@@ -127,3 +143,10 @@ const struct test_case TestTimer = {
   .t_teardown = timer_teardown
 };
 
+
+const struct test_case TestTimerWheel = {
+  .t_name     = "test timer operations (timing wheel)",
+  .t_setup    = timer_setup_wheel,
+  .t_run      = timer_totalmess,
+  .t_teardown = timer_teardown
+};
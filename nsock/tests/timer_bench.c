@@ -0,0 +1,186 @@
+/*
+ * Nsock timer queue benchmark: binary heap vs. timing wheel
+ * Same license as nmap -- see https://nmap.org/book/man-legal.html
+ *
+ * Simulates the way nsock uses its expirable events queue during a large scan:
+ * a fixed number of events with timeouts are in flight, most complete (and are
+ * removed from the queue) before they time out and are replaced by new ones,
+ * while the clock moves forward one millisecond at a time and expired events
+ * are popped.
+ *
+ * Usage: ./timer_bench [concurrency ...]
+ */
+
+#include "../src/gh_heap.h"
+#include "../src/gh_wheel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+
+#define SIM_MSECS         5000
+#define COMPLETE_PER_MSEC 20   /* per thousand events in flight */
+#define TIMEOUT_MIN       200
+#define TIMEOUT_RANGE     5000
+
+struct item {
+  uint64_t expires;
+  gh_hnode_t hnode;
+  gh_wnode_t wnode;
+};
+
+static uint64_t rnd_state = 88172645463325252ULL;
+
+static unsigned int rnd(void) {
+  rnd_state ^= rnd_state << 13;
+  rnd_state ^= rnd_state >> 7;
+  rnd_state ^= rnd_state << 17;
+  return (unsigned int)rnd_state;
+}
+
+static int item_cmp(gh_hnode_t *n1, gh_hnode_t *n2) {
+  return container_of(n1, struct item, hnode)->expires <
+         container_of(n2, struct item, hnode)->expires;
+}
+
+static double cpu_seconds(void) {
+  return (double)clock() / CLOCKS_PER_SEC;
+}
+
+struct result {
+  double secs;
+  unsigned long ops;
+  unsigned long expired;
+};
+
+static void run_heap(struct item *items, int n, struct result *res) {
+  gh_heap_t heap;
+  uint64_t now;
+  int i, ms, completions;
+  double start;
+
+  rnd_state = 88172645463325252ULL;
+  gh_heap_init(&heap, item_cmp);
+  start = cpu_seconds();
+
+  now = 0;
+  for (i = 0; i < n; i++) {
+    items[i].expires = now + TIMEOUT_MIN + rnd() % TIMEOUT_RANGE;
+    gh_hnode_invalidate(&items[i].hnode);
+    gh_heap_push(&heap, &items[i].hnode);
+  }
+
+  completions = (n * COMPLETE_PER_MSEC) / 1000 + 1;
+  res->ops = n;
+  res->expired = 0;
+  for (ms = 0; ms < SIM_MSECS; ms++) {
+    gh_hnode_t *hnode;
+
+    now++;
+    for (i = 0; i < completions; i++) {
+      struct item *it = &items[rnd() % n];
+
+      gh_heap_remove(&heap, &it->hnode);
+      gh_hnode_invalidate(&it->hnode);
+      it->expires = now + TIMEOUT_MIN + rnd() % TIMEOUT_RANGE;
+      gh_heap_push(&heap, &it->hnode);
+      res->ops += 2;
+    }
+    while ((hnode = gh_heap_min(&heap)) != NULL &&
+           container_of(hnode, struct item, hnode)->expires <= now) {
+      struct item *it = container_of(hnode, struct item, hnode);
+
+      gh_heap_pop(&heap);
+      gh_hnode_invalidate(&it->hnode);
+      it->expires = now + TIMEOUT_MIN + rnd() % TIMEOUT_RANGE;
+      gh_heap_push(&heap, &it->hnode);
+      res->ops += 2;
+      res->expired++;
+    }
+  }
+
+  res->secs = cpu_seconds() - start;
+  while (gh_heap_pop(&heap) != NULL)
+    ;
+  gh_heap_free(&heap);
+}
+
+static void run_wheel(struct item *items, int n, struct result *res) {
+  gh_wheel_t wheel;
+  uint64_t now;
+  int i, ms, completions;
+  double start;
+
+  rnd_state = 88172645463325252ULL;
+  gh_wheel_init(&wheel, 0);
+  start = cpu_seconds();
+
+  now = 0;
+  for (i = 0; i < n; i++) {
+    gh_wnode_invalidate(&items[i].wnode);
+    gh_wheel_add(&wheel, &items[i].wnode, now + TIMEOUT_MIN + rnd() % TIMEOUT_RANGE);
+  }
+
+  completions = (n * COMPLETE_PER_MSEC) / 1000 + 1;
+  res->ops = n;
+  res->expired = 0;
+  for (ms = 0; ms < SIM_MSECS; ms++) {
+    gh_wnode_t *wnode;
+
+    now++;
+    for (i = 0; i < completions; i++) {
+      struct item *it = &items[rnd() % n];
+
+      gh_wheel_remove(&wheel, &it->wnode);
+      gh_wheel_add(&wheel, &it->wnode, now + TIMEOUT_MIN + rnd() % TIMEOUT_RANGE);
+      res->ops += 2;
+    }
+    while ((wnode = gh_wheel_pop_expired(&wheel, now)) != NULL) {
+      gh_wheel_add(&wheel, wnode, now + TIMEOUT_MIN + rnd() % TIMEOUT_RANGE);
+      res->ops += 2;
+      res->expired++;
+    }
+  }
+
+  res->secs = cpu_seconds() - start;
+  while (gh_wheel_pop(&wheel) != NULL)
+    ;
+  gh_wheel_free(&wheel);
+}
+
+int main(int argc, char *argv[]) {
+  static const int defaults[] = { 1000, 10000, 100000, 1000000 };
+  int i, count;
+
+  count = (argc > 1) ? argc - 1 : (int)(sizeof(defaults) / sizeof(defaults[0]));
+
+  printf("%10s %12s %10s %12s %10s\n", "in flight",
+         "heap ns/op", "expired", "wheel ns/op", "expired");
+
+  for (i = 0; i < count; i++) {
+    struct result heap, wheel;
+    struct item *items;
+    int n;
+
+    n = (argc > 1) ? atoi(argv[i + 1]) : defaults[i];
+    if (n <= 0) {
+      fprintf(stderr, "Invalid concurrency: %s\n", argv[i + 1]);
+      return 1;
+    }
+
+    items = (struct item *)calloc(n, sizeof(struct item));
+    if (items == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+    }
+
+    run_heap(items, n, &heap);
+    run_wheel(items, n, &wheel);
+
+    printf("%10d %12.1f %10lu %12.1f %10lu\n", n,
+           heap.secs * 1e9 / heap.ops, heap.expired,
+           wheel.secs * 1e9 / wheel.ops, wheel.expired);
+    free(items);
+  }
+  return 0;
+}
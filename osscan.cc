@@ -148,8 +148,13 @@
 
 #include <algorithm>
 #include <list>
+#include <map>
 #include <set>
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 extern NmapOps o;
 
 /* Store a string uniquely. The first time this function is called with a
@@ -228,7 +233,91 @@ const char *string_pool_sprintf(const char *fmt, ...)
   return s;
 }
 
-FingerPrintDB::FingerPrintDB() : MatchPoints(NULL) {
+/* The compiled database. Every (test, attribute) pair that appears in a
+   reference print gets an attribute id, and every distinct (attribute,
+   expression) pair gets a pair id; a reference print is then just a run of
+   pair ids in the entries array. Matching an observed fingerprint evaluates
+   each distinct pair once, and scoring a print is a sum over its run. */
+
+/* Kinds of the terms of a reference expression; see expr_match. */
+enum expr_term_op {
+  EXPR_NONZERO, /* + */
+  EXPR_LT,      /* <n */
+  EXPR_GT,      /* >n */
+  EXPR_RANGE,   /* n-m */
+  EXPR_STRING   /* anything else, compared literally */
+};
+
+struct ExprTerm {
+  enum expr_term_op op;
+  unsigned int lo, hi;
+  int str_id; /* For EXPR_STRING, an id from CompiledFingerPrintDB::strings */
+};
+
+struct CompiledExpr {
+  bool orexp;
+  unsigned int first_term;
+  unsigned int num_terms;
+};
+
+struct CompiledAttr {
+  const char *test;
+  const char *attribute;
+  /* Points from MatchPoints, or one of the negative values below. */
+  int points;
+  const char *points_value;
+};
+
+#define POINTS_NO_TEST -1
+#define POINTS_NO_ATTR -2
+#define POINTS_BOGUS -3
+
+struct CompiledPair {
+  unsigned int attr;
+  unsigned int expr;
+};
+
+struct cstr_less {
+  bool operator()(const char *a, const char *b) const {
+    return strcmp(a, b) < 0;
+  }
+};
+
+struct cstr_pair_less {
+  bool operator()(const std::pair<const char *, const char *> &a,
+                  const std::pair<const char *, const char *> &b) const {
+    int d = strcmp(a.first, b.first);
+    return d < 0 || (d == 0 && strcmp(a.second, b.second) < 0);
+  }
+};
+
+struct CompiledFingerPrintDB {
+  std::vector<CompiledAttr> attrs;
+  std::vector<ExprTerm> terms;
+  std::vector<CompiledExpr> exprs;
+  std::vector<CompiledPair> pairs;
+  /* Pair ids of print i are entries[print_start[i]] to
+     entries[print_start[i + 1] - 1]. */
+  std::vector<u32> entries;
+  std::vector<u32> print_start;
+
+  /* Lookups used while compiling and when preparing an observed print. These
+     are only read after compilation, so matching is safe from any thread. */
+  std::map<std::pair<const char *, const char *>, unsigned int, cstr_pair_less> attr_ids;
+  std::map<const char *, int, cstr_less> strings;
+};
+
+/* An attribute of an observed fingerprint, decoded once per match the same way
+   expr_match decodes it. */
+struct ObservedValue {
+  bool present;
+  bool empty;
+  bool num_ok;
+  unsigned int num;
+  int str_id;
+};
+
+FingerPrintDB::FingerPrintDB() : MatchPoints(NULL), compiled(NULL) {
 }
 
 FingerPrintDB::~FingerPrintDB() {
@@ -236,6 +325,8 @@ FingerPrintDB::~FingerPrintDB() {
 
   if (MatchPoints != NULL)
     delete MatchPoints;
+  if (compiled != NULL)
+    delete compiled;
   for (current = prints.begin(); current != prints.end(); current++)
     delete *current;
 }
@@ -532,6 +623,334 @@ double compare_fingerprints(const FingerPrint *referenceFP, const FingerPrint *o
   return (num_subtests) ? (num_subtests_succeeded / (double) num_subtests) : 0;
 }
 
+static unsigned int compile_expr(CompiledFingerPrintDB *C, const char *expr) {
+  CompiledExpr ce;
+  ExprTerm term;
+  char exprcpy[512];
+  char *p, *q, *q1;
+  int expchar;
+
+  Strncpy(exprcpy, expr, sizeof(exprcpy));
+  p = exprcpy;
+  ce.orexp = strchr(expr, '|') != NULL;
+  expchar = ce.orexp ? '|' : '&';
+  ce.first_term = C->terms.size();
+  ce.num_terms = 0;
+
+  do {
+    q = strchr(p, expchar);
+    if (q)
+      *q = '\0';
+    term.lo = term.hi = 0;
+    term.str_id = -1;
+    if (strcmp(p, "+") == 0) {
+      term.op = EXPR_NONZERO;
+    } else if (*p == '<' && isxdigit((int) (unsigned char) p[1])) {
+      term.op = EXPR_LT;
+      term.lo = strtol(p + 1, NULL, 16);
+    } else if (*p == '>' && isxdigit((int) (unsigned char) p[1])) {
+      term.op = EXPR_GT;
+      term.lo = strtol(p + 1, NULL, 16);
+    } else if (((q1 = strchr(p, '-')) != NULL) && isxdigit((int) (unsigned char) p[0]) && isxdigit((int) (unsigned char) q1[1])) {
+      term.op = EXPR_RANGE;
+      *q1 = '\0';
+      term.lo = strtol(p, NULL, 16);
+      term.hi = strtol(q1 + 1, NULL, 16);
+      if (term.hi < term.lo && o.debugging)
+        error("Range error in reference expr: %s", expr);
+    } else {
+      std::map<const char *, int, cstr_less>::iterator it;
+
+      term.op = EXPR_STRING;
+      it = C->strings.find(p);
+      if (it == C->strings.end())
+        it = C->strings.insert(std::make_pair(string_pool_insert(p), (int) C->strings.size())).first;
+      term.str_id = it->second;
+    }
+    C->terms.push_back(term);
+    ce.num_terms++;
+    if (q)
+      p = q + 1;
+  } while (q);
+
+  C->exprs.push_back(ce);
+  return C->exprs.size() - 1;
+}
+
+/* Look up the points MatchPoints assigns to test.attribute, remembering why
+   there are none so that matching can fail the way AVal_match does. */
+static void lookup_points(CompiledAttr *ca, const FingerPrint *MatchPoints) {
+  std::vector<FingerTest>::const_iterator test;
+  std::vector<struct AVal>::const_iterator av;
+  char *endptr;
+
+  ca->points = POINTS_NO_TEST;
+  ca->points_value = NULL;
+  for (test = MatchPoints->tests.begin(); test != MatchPoints->tests.end(); test++) {
+    if (strcmp(test->name, ca->test) == 0)
+      break;
+  }
+  if (test == MatchPoints->tests.end())
+    return;
+
+  ca->points = POINTS_NO_ATTR;
+  for (av = test->results.begin(); av != test->results.end(); av++) {
+    if (strcmp(av->attribute, ca->attribute) == 0)
+      break;
+  }
+  if (av == test->results.end())
+    return;
+
+  ca->points_value = av->value;
+  errno = 0;
+  ca->points = strtol(av->value, &endptr, 10);
+  if (errno != 0 || *endptr != '\0' || ca->points < 0)
+    ca->points = POINTS_BOGUS;
+}
+
+static CompiledFingerPrintDB *compile_fingerprint_db(const FingerPrintDB *DB) {
+  std::map<std::pair<unsigned int, const char *>, unsigned int> pair_ids;
+  std::map<const char *, unsigned int> expr_ids;
+  std::vector<FingerPrint *>::const_iterator current_os;
+  std::vector<FingerTest>::const_iterator test;
+  std::vector<struct AVal>::const_iterator av;
+  CompiledFingerPrintDB *C;
+
+  C = new CompiledFingerPrintDB;
+  for (current_os = DB->prints.begin(); current_os != DB->prints.end(); current_os++) {
+    C->print_start.push_back(C->entries.size());
+    for (test = (*current_os)->tests.begin(); test != (*current_os)->tests.end(); test++) {
+      for (av = test->results.begin(); av != test->results.end(); av++) {
+        std::map<std::pair<const char *, const char *>, unsigned int, cstr_pair_less>::iterator ait;
+        std::map<std::pair<unsigned int, const char *>, unsigned int>::iterator pit;
+        std::map<const char *, unsigned int>::iterator eit;
+        unsigned int attr, expr;
+
+        ait = C->attr_ids.find(std::make_pair(test->name, av->attribute));
+        if (ait == C->attr_ids.end()) {
+          CompiledAttr ca;
+
+          ca.test = test->name;
+          ca.attribute = av->attribute;
+          lookup_points(&ca, DB->MatchPoints);
+          C->attrs.push_back(ca);
+          ait = C->attr_ids.insert(std::make_pair(std::make_pair(ca.test, ca.attribute), (unsigned int) C->attrs.size() - 1)).first;
+        }
+        attr = ait->second;
+
+        /* Expression strings come from the string pool, so equal expressions
+           have equal pointers. */
+        eit = expr_ids.find(av->value);
+        if (eit == expr_ids.end())
+          eit = expr_ids.insert(std::make_pair(av->value, compile_expr(C, av->value))).first;
+        expr = eit->second;
+
+        pit = pair_ids.find(std::make_pair(attr, av->value));
+        if (pit == pair_ids.end()) {
+          CompiledPair cp;
+
+          cp.attr = attr;
+          cp.expr = expr;
+          C->pairs.push_back(cp);
+          pit = pair_ids.insert(std::make_pair(std::make_pair(attr, av->value), (unsigned int) C->pairs.size() - 1)).first;
+        }
+        C->entries.push_back(pit->second);
+      }
+    }
+  }
+  C->print_start.push_back(C->entries.size());
+
+  if (o.debugging > 1) {
+    log_write(LOG_PLAIN, "Compiled %u OS fingerprints: %u attributes, %u expressions, %u distinct tests\n",
+              (unsigned int) DB->prints.size(), (unsigned int) C->attrs.size(),
+              (unsigned int) C->exprs.size(), (unsigned int) C->pairs.size());
+  }
+
+  return C;
+}
+
+/* The compiled counterpart of expr_match. */
+static bool compiled_expr_match(const CompiledFingerPrintDB *C, const CompiledExpr *ce,
+                                const ObservedValue *v) {
+  const ExprTerm *term;
+  unsigned int i;
+  bool ok;
+
+  for (i = 0; i < ce->num_terms; i++) {
+    term = &C->terms[ce->first_term + i];
+    switch (term->op) {
+    case EXPR_NONZERO:
+      ok = !v->empty && v->num != 0 && v->num_ok;
+      break;
+    case EXPR_LT:
+      ok = !(v->empty && !ce->orexp) && v->num_ok && v->num < term->lo;
+      break;
+    case EXPR_GT:
+      ok = !(v->empty && !ce->orexp) && v->num_ok && v->num > term->lo;
+      break;
+    case EXPR_RANGE:
+      ok = !(v->empty && !ce->orexp) && v->num_ok && v->num >= term->lo && v->num <= term->hi;
+      break;
+    default:
+      ok = v->str_id == term->str_id;
+      break;
+    }
+    if (ce->orexp && ok)
+      return true;
+    if (!ce->orexp && !ok)
+      return false;
+  }
+
+  return !ce->orexp && ce->num_terms > 0;
+}
+
+static void score_fingerprint_compiled(const FingerPrint *FP, const CompiledFingerPrintDB *C,
+                                       double *accuracy) {
+  std::vector<FingerTest>::const_iterator test;
+  std::vector<struct AVal>::const_iterator av;
+  std::vector<ObservedValue> values;
+  std::vector<u32> pair_points, pair_hits;
+  const CompiledAttr *ca;
+  unsigned int i, k, n;
+
+  /* Decode the observed values once. */
+  values.resize(C->attrs.size());
+  for (i = 0; i < values.size(); i++)
+    values[i].present = false;
+  for (test = FP->tests.begin(); test != FP->tests.end(); test++) {
+    for (av = test->results.begin(); av != test->results.end(); av++) {
+      std::map<std::pair<const char *, const char *>, unsigned int, cstr_pair_less>::const_iterator ait;
+      std::map<const char *, int, cstr_less>::const_iterator sit;
+      ObservedValue *v;
+      char *endptr;
+
+      ait = C->attr_ids.find(std::make_pair(test->name, av->attribute));
+      if (ait == C->attr_ids.end())
+        continue;
+      v = &values[ait->second];
+      v->present = true;
+      v->empty = *av->value == '\0';
+      v->num = strtol(av->value, &endptr, 16);
+      v->num_ok = *endptr == '\0';
+      sit = C->strings.find(av->value);
+      v->str_id = (sit == C->strings.end()) ? -1 : sit->second;
+
+      ca = &C->attrs[ait->second];
+      if (ca->points == POINTS_NO_TEST)
+        fatal("%s: Failed to locate test %s in MatchPoints directive of fingerprint file", __func__, ca->test);
+      else if (ca->points == POINTS_NO_ATTR)
+        fatal("%s: Failed to find point amount for test %s.%s", __func__, ca->test, ca->attribute);
+      else if (ca->points == POINTS_BOGUS)
+        fatal("%s: Got bogus point amount (%s) for test %s.%s", __func__, ca->points_value, ca->test, ca->attribute);
+    }
+  }
+
+  /* Evaluate every distinct (attribute, expression) pair once. */
+  pair_points.resize(C->pairs.size());
+  pair_hits.resize(C->pairs.size());
+  for (i = 0; i < C->pairs.size(); i++) {
+    const ObservedValue *v = &values[C->pairs[i].attr];
+
+    if (!v->present) {
+      pair_points[i] = pair_hits[i] = 0;
+      continue;
+    }
+    pair_points[i] = C->attrs[C->pairs[i].attr].points;
+    pair_hits[i] = compiled_expr_match(C, &C->exprs[C->pairs[i].expr], v) ? pair_points[i] : 0;
+  }
+
+  /* Each print is now a sum of table lookups. */
+  n = C->print_start.size() - 1;
+  for (i = 0; i < n; i++) {
+    unsigned long num_subtests = 0, num_subtests_succeeded = 0;
+
+    for (k = C->print_start[i]; k < C->print_start[i + 1]; k++) {
+      num_subtests += pair_points[C->entries[k]];
+      num_subtests_succeeded += pair_hits[C->entries[k]];
+    }
+    accuracy[i] = (num_subtests) ? (num_subtests_succeeded / (double) num_subtests) : 0;
+  }
+}
+
+void score_fingerprint(const FingerPrint *FP, const FingerPrintDB *DB,
+                       double *accuracy) {
+  std::vector<FingerPrint *>::const_iterator current_os;
+  FingerPrint FP_copy;
+  unsigned int i;
+
+  if (DB->compiled != NULL) {
+    score_fingerprint_compiled(FP, DB->compiled, accuracy);
+    return;
+  }
+
+  FP_copy = *FP;
+  FP_copy.sort();
+  for (i = 0, current_os = DB->prints.begin(); current_os != DB->prints.end(); current_os++, i++)
+    accuracy[i] = compare_fingerprints(*current_os, &FP_copy, DB->MatchPoints, 0);
+}
+
+#ifdef HAVE_PTHREAD
+/* Shared by the threads of osscan_parallel_for. Each thread claims the next
+   unclaimed index until none are left. */
+struct ParallelFor {
+  void (*fn)(void *arg, unsigned int i);
+  void *arg;
+  unsigned int n;
+  unsigned int next; /* Next index to hand out */
+  pthread_mutex_t lock; /* Protects next */
+};
+
+static void *parallel_for_worker(void *arg) {
+  ParallelFor *pf = (ParallelFor *) arg;
+  unsigned int i;
+
+  for (;;) {
+    pthread_mutex_lock(&pf->lock);
+    i = pf->next++;
+    pthread_mutex_unlock(&pf->lock);
+    if (i >= pf->n)
+      break;
+    pf->fn(pf->arg, i);
+  }
+
+  return NULL;
+}
+#endif
+
+void osscan_parallel_for(void (*fn)(void *arg, unsigned int i), void *arg,
+                         unsigned int n) {
+#ifdef HAVE_PTHREAD
+  std::vector<pthread_t> threads;
+  pthread_t thread;
+  ParallelFor pf;
+#endif
+  unsigned int i;
+
+#ifdef HAVE_PTHREAD
+  if (o.osscan_threads > 1 && n > 1) {
+    pf.fn = fn;
+    pf.arg = arg;
+    pf.n = n;
+    pf.next = 0;
+    pthread_mutex_init(&pf.lock, NULL);
+    /* The calling thread is one of the workers. */
+    for (i = 1; i < (unsigned int) o.osscan_threads && i < n; i++) {
+      if (pthread_create(&thread, NULL, parallel_for_worker, &pf) != 0)
+        fatal("%s: failed to create OS matching thread", __func__);
+      threads.push_back(thread);
+    }
+    parallel_for_worker(&pf);
+    for (i = 0; i < threads.size(); i++)
+      pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&pf.lock);
+    return;
+  }
+#endif
+
+  for (i = 0; i < n; i++)
+    fn(arg, i);
+}
+
 /* Takes a fingerprint and looks for matches inside the passed in
    reference fingerprint DB.  The results are stored in in FPR (which
    must point to an instantiated FingerPrintResultsIPv4 class) -- results
@@ -545,7 +964,7 @@ void match_fingerprint(const FingerPrint *FP, FingerPrintResultsIPv4 *FPR,
                                                            to be added to the
                                                            list */
   std::vector<FingerPrint *>::const_iterator current_os;
-  FingerPrint FP_copy;
+  std::vector<double> accuracy;
   double acc;
   int state;
   int skipfp;
@@ -558,15 +977,16 @@ void match_fingerprint(const FingerPrint *FP, FingerPrintResultsIPv4 *FPR,
   assert(FPR);
   assert(accuracy_threshold >= 0 && accuracy_threshold <= 1);
 
-  FP_copy = *FP;
-  FP_copy.sort();
-
   FPR->overall_results = OSSCAN_SUCCESS;
 
+  accuracy.resize(DB->prints.size());
+  if (!accuracy.empty())
+    score_fingerprint(FP, DB, &accuracy[0]);
+
   for (current_os = DB->prints.begin(); current_os != DB->prints.end(); current_os++) {
     skipfp = 0;
 
-    acc = compare_fingerprints(*current_os, &FP_copy, DB->MatchPoints, 0);
+    acc = accuracy[current_os - DB->prints.begin()];
 
     /*    error("Comp to %s: %li/%li=%f", o.reference_FPs1[i]->OS_name, num_subtests_succeeded, num_subtests, acc); */
     if (acc >= FPR_entrance_requirement || acc == 1.0) {
@@ -644,6 +1064,34 @@ void match_fingerprint(const FingerPrint *FP, FingerPrintResultsIPv4 *FPR,
   return;
 }
 
+struct MatchFingerprintsArgs {
+  std::vector<OSMatchJob> *jobs;
+  const FingerPrintDB *DB;
+  double accuracy_threshold;
+};
+
+static void run_match_job(void *arg, unsigned int i) {
+  MatchFingerprintsArgs *args = (MatchFingerprintsArgs *) arg;
+  OSMatchJob *job = &(*args->jobs)[i];
+
+  match_fingerprint(job->FP, job->FPR, args->DB, args->accuracy_threshold);
+}
+
+/* Runs match_fingerprint for every job, on o.osscan_threads threads if
+   requested. Each job has its own FPR, so the jobs don't share any state
+   while matching. */
+void match_fingerprints(std::vector<OSMatchJob> &jobs, const FingerPrintDB *DB,
+                        double accuracy_threshold) {
+  MatchFingerprintsArgs args;
+
+  if (jobs.empty())
+    return;
+  args.jobs = &jobs;
+  args.DB = DB;
+  args.accuracy_threshold = accuracy_threshold;
+  osscan_parallel_for(run_match_job, &args, jobs.size());
+}
+
 static const char *dist_method_fp_string(enum dist_calc_method method)
 {
   const char *s = "";
@@ -1287,6 +1735,10 @@ fparse:
   }
 
   fclose(fp);
+
+  if (DB->MatchPoints != NULL)
+    DB->compiled = compile_fingerprint_db(DB);
+
   return DB;
 }
 
@@ -195,11 +195,16 @@ struct FingerPrint {
   FingerPrint();
   void sort();
 };
+/* A numeric form of the reference prints, built when the database is loaded.
+   Defined in osscan.cc. */
+struct CompiledFingerPrintDB;
+
 /* This structure contains the important data from the fingerprint
    database (nmap-os-db) */
 struct FingerPrintDB {
   FingerPrint *MatchPoints;
   std::vector<FingerPrint *> prints;
+  CompiledFingerPrintDB *compiled;
 
   FingerPrintDB();
   ~FingerPrintDB();
@@ -238,6 +243,20 @@ void free_fingerprint_file(FingerPrintDB *DB);
 double compare_fingerprints(const FingerPrint *referenceFP, const FingerPrint *observedFP,
                             const FingerPrint *MatchPoints, int verbose);
 
+/* Computes the accuracy of an observed fingerprint against every print in
+   DB->prints, storing them in the same order in accuracy (which must have room
+   for DB->prints.size() values). Gives the same numbers as
+   compare_fingerprints, but uses the compiled form of the database when there
+   is one. */
+void score_fingerprint(const FingerPrint *FP, const FingerPrintDB *DB,
+                       double *accuracy);
+
+/* Calls fn(arg, i) for every i from 0 to n - 1, spread over up to
+   o.osscan_threads threads. Each call must only write data belonging to its
+   own i. Returns when all calls have finished. */
+void osscan_parallel_for(void (*fn)(void *arg, unsigned int i), void *arg,
+                         unsigned int n);
+
 /* Takes a fingerprint and looks for matches inside the passed in
    reference fingerprint DB.  The results are stored in in FPR (which
    must point to an instantiated FingerPrintResultsIPv4 class) -- results
@@ -247,6 +266,17 @@ double compare_fingerprints(const FingerPrint *referenceFP, const FingerPrint *o
 void match_fingerprint(const FingerPrint *FP, FingerPrintResultsIPv4 *FPR,
                        const FingerPrintDB *DB, double accuracy_threshold);
 
+/* One match_fingerprint call, for match_fingerprints. */
+struct OSMatchJob {
+  const FingerPrint *FP;
+  FingerPrintResultsIPv4 *FPR;
+};
+
+/* Calls match_fingerprint for each of a batch of jobs, on o.osscan_threads
+   threads if requested. */
+void match_fingerprints(std::vector<OSMatchJob> &jobs, const FingerPrintDB *DB,
+                        double accuracy_threshold);
+
 /* Returns true if perfect match -- if num_subtests & num_subtests_succeeded are non_null it updates them.  if shortcircuit is zero, it does all the tests, otherwise it returns when the first one fails */
 
 void freeFingerPrint(FingerPrint *FP);
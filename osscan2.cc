@@ -583,6 +583,7 @@ static void doSeqTests(OsScanInfo *OSI, HostOsScan *HOS) {
     }
 
     /* Send a seq probe to each host. */
+    send_ip_packet_batch_begin();
     while (unableToSend < OSI->numIncompleteHosts() && HOS->stats->sendOK()) {
       hsi = OSI->nextIncompleteHost();
       hss = hsi->hss;
@@ -595,6 +596,7 @@ static void doSeqTests(OsScanInfo *OSI, HostOsScan *HOS) {
         unableToSend++;
       }
     }
+    send_ip_packet_batch_end();
 
     HOS->stats->num_probes_sent_at_last_wait = HOS->stats->num_probes_sent;
 
@@ -753,6 +755,7 @@ static void doTUITests(OsScanInfo *OSI, HostOsScan *HOS) {
       }
     }
 
+    send_ip_packet_batch_begin();
     while (unableToSend < OSI->numIncompleteHosts() && HOS->stats->sendOK()) {
       hsi = OSI->nextIncompleteHost();
       hss = hsi->hss;
@@ -765,6 +768,7 @@ static void doTUITests(OsScanInfo *OSI, HostOsScan *HOS) {
         unableToSend++;
       }
     }
+    send_ip_packet_batch_end();
 
     HOS->stats->num_probes_sent_at_last_wait = HOS->stats->num_probes_sent;
 
@@ -868,11 +872,12 @@ static void doTUITests(OsScanInfo *OSI, HostOsScan *HOS) {
 static void endRound(OsScanInfo *OSI, HostOsScan *HOS, int roundNum) {
   std::list<HostOsScanInfo *>::iterator hostI;
   HostOsScanInfo *hsi = NULL;
+  std::vector<OSMatchJob> jobs;
+  OSMatchJob job;
   int distance = -1;
   enum dist_calc_method distance_calculation_method = DIST_METHOD_NONE;
 
   for (hostI = OSI->incompleteHosts.begin(); hostI != OSI->incompleteHosts.end(); hostI++) {
-    distance = -1;
     hsi = *hostI;
     HOS->makeFP(hsi->hss);
 
@@ -881,8 +886,16 @@ static void endRound(OsScanInfo *OSI, HostOsScan *HOS, int roundNum) {
     hsi->FPR->numFPs = roundNum + 1;
     double tr = hsi->hss->timingRatio();
     hsi->target->FPR->maxTimingRatio = MAX(hsi->target->FPR->maxTimingRatio, tr);
-    match_fingerprint(hsi->FPs[roundNum], &hsi->FP_matches[roundNum],
-                      o.reference_FPs, OSSCAN_GUESS_THRESHOLD);
+    job.FP = hsi->FPs[roundNum];
+    job.FPR = &hsi->FP_matches[roundNum];
+    jobs.push_back(job);
+  }
+  match_fingerprints(jobs, o.reference_FPs, OSSCAN_GUESS_THRESHOLD);
+  jobs.clear();
+
+  for (hostI = OSI->incompleteHosts.begin(); hostI != OSI->incompleteHosts.end(); hostI++) {
+    distance = -1;
+    hsi = *hostI;
 
     if (hsi->FP_matches[roundNum].overall_results == OSSCAN_SUCCESS &&
         hsi->FP_matches[roundNum].num_perfect_matches > 0) {
@@ -891,8 +904,9 @@ static void endRound(OsScanInfo *OSI, HostOsScan *HOS, int roundNum) {
         if (o.verbose)
           log_write(LOG_STDOUT, "WARNING: OS didn't match until try #%d\n", roundNum + 1);
       }
-      match_fingerprint(hsi->FPR->FPs[roundNum], hsi->FPR,
-                        o.reference_FPs, OSSCAN_GUESS_THRESHOLD);
+      job.FP = hsi->FPR->FPs[roundNum];
+      job.FPR = hsi->FPR;
+      jobs.push_back(job);
       hsi->isCompleted = true;
     }
 
@@ -914,6 +928,7 @@ static void endRound(OsScanInfo *OSI, HostOsScan *HOS, int roundNum) {
     hsi->target->FPR->distance_guess = hsi->hss->distance_guess;
 
   }
+  match_fingerprints(jobs, o.reference_FPs, OSSCAN_GUESS_THRESHOLD);
   OSI->removeCompletedHosts();
 }
 
@@ -921,6 +936,8 @@ static void endRound(OsScanInfo *OSI, HostOsScan *HOS, int roundNum) {
 static void findBestFPs(OsScanInfo *OSI) {
   std::list<HostOsScanInfo *>::iterator hostI;
   HostOsScanInfo *hsi = NULL;
+  std::vector<OSMatchJob> jobs;
+  OSMatchJob job;
   int i;
 
   double bestacc;
@@ -947,9 +964,11 @@ static void findBestFPs(OsScanInfo *OSI) {
     // Now we redo the match, since target->FPR has various data (such as
     // target->FPR->numFPs) which is not in FP_matches[bestaccidx].  This is
     // kinda ugly.
-    match_fingerprint(hsi->FPR->FPs[bestaccidx], (FingerPrintResultsIPv4 *) hsi->target->FPR,
-                      o.reference_FPs, OSSCAN_GUESS_THRESHOLD);
+    job.FP = hsi->FPR->FPs[bestaccidx];
+    job.FPR = (FingerPrintResultsIPv4 *) hsi->target->FPR;
+    jobs.push_back(job);
   }
+  match_fingerprints(jobs, o.reference_FPs, OSSCAN_GUESS_THRESHOLD);
 }
 
 
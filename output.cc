@@ -145,6 +145,10 @@
 
 #include <math.h>
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 #include <set>
 #include <vector>
 #include <list>
@@ -153,6 +157,37 @@
 extern NmapOps o;
 static const char *logtypes[LOG_NUM_FILES] = LOG_NAMES;
 
+#ifdef HAVE_PTHREAD
+/* Version detection may run on several threads (--version-shards), and the
+   later phases of a host group may run alongside the next group's port scan
+   (--pipeline-groups). This keeps their messages from being interleaved. It is
+   recursive because writing to a log can fail and call fatal(), which logs
+   too, and because log_lock() callers go on to call log_write(). */
+static pthread_mutex_t log_mutex;
+static pthread_once_t log_mutex_once = PTHREAD_ONCE_INIT;
+
+static void log_mutex_init(void) {
+  pthread_mutexattr_t attr;
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&log_mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+void log_lock() {
+  pthread_once(&log_mutex_once, log_mutex_init);
+  pthread_mutex_lock(&log_mutex);
+}
+
+void log_unlock() {
+  pthread_mutex_unlock(&log_mutex);
+}
+#else
+void log_lock() {}
+void log_unlock() {}
+#endif
+
 /* Used in creating skript kiddie style output.  |<-R4d! */
 static void skid_output(char *s) {
   int i;
@@ -965,6 +1000,7 @@ void log_vwrite(int logt, const char *fmt, va_list ap) {
   int logtype;
   va_list apcopy;
 
+  log_lock();
   for (logtype = 1; logtype <= LOG_MAX; logtype <<= 1) {
 
     if (!(logt & logtype))
@@ -1021,6 +1057,7 @@ void log_vwrite(int logt, const char *fmt, va_list ap) {
         assert(0); /* We want people to report it. */
     }
   }
+  log_unlock();
 
   return;
 }
@@ -1034,6 +1071,7 @@ void log_write(int logt, const char *fmt, ...) {
   if (!fmt || !*fmt)
     return;
 
+  log_lock();
   for (int l = 1; l <= LOG_MAX; l <<= 1) {
     if (logt & l) {
       va_start(ap, fmt);
@@ -1041,6 +1079,7 @@ void log_write(int logt, const char *fmt, ...) {
       va_end(ap);
     }
   }
+  log_unlock();
   return;
 }
 
@@ -2537,6 +2576,13 @@ void printfinaloutput() {
   if (o.verbose && o.isr00t && o.RawScan())
     log_write(LOG_STDOUT | LOG_SKID, "           %s\n",
               getFinalPacketStats(statbuf, sizeof(statbuf)));
+  if (o.debugging) {
+    unsigned long hits, misses;
+
+    route_dst_cache_stats(&hits, &misses);
+    if (hits + misses > 0)
+      log_write(LOG_STDOUT, "Route cache: %lu hits, %lu misses\n", hits, misses);
+  }
 
   Strncpy(mytime, ctime(&timep), sizeof(mytime));
   chomp(mytime);
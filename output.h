@@ -207,6 +207,12 @@ void log_write(int logt, const char *fmt, ...)
    va_start() AND va_end() calls. */
 void log_vwrite(int logt, const char *fmt, va_list ap);
 
+/* Keep other threads from logging until the matching log_unlock(), so that
+   output written with several calls, like a host's report, stays together.
+   Calls may be nested. */
+void log_lock();
+void log_unlock();
+
 /* Close the given log stream(s) */
 void log_close(int logt);
 
@@ -461,11 +461,9 @@ void PortList::addScriptResult(u16 portno, int protocol, ScriptResult& sr) {
 PortList::PortList() {
   int proto;
   memset(state_counts_proto, 0, sizeof(state_counts_proto));
-  memset(port_list, 0, sizeof(port_list));
+  memset(port_entries, 0, sizeof(port_entries));
 
   for(proto=0; proto < PORTLIST_PROTO_MAX; proto++) {
-    if(port_list_count[proto] > 0)
-      port_list[proto] = (Port**) safe_zalloc(sizeof(Port*)*port_list_count[proto]);
     default_port_state[proto].proto = PORTLISTPROTO2INPROTO(proto);
     default_port_state[proto].reason.reason_id = ER_NORESPONSE;
     state_counts_proto[proto][default_port_state[proto].state] = port_list_count[proto];
@@ -476,7 +474,8 @@ PortList::PortList() {
 }
 
 PortList::~PortList() {
-  int proto, i;
+  std::map<u16, Port *>::iterator it;
+  int proto;
 
   if (idstr) {
     free(idstr);
@@ -484,16 +483,14 @@ PortList::~PortList() {
   }
 
   for(proto=0; proto < PORTLIST_PROTO_MAX; proto++) { // for every protocol
-    if(port_list[proto]) {
-      for(i=0; i < port_list_count[proto]; i++) { // free every Port
-        if(port_list[proto][i]) {
-          port_list[proto][i]->freeService(true);
-          port_list[proto][i]->freeScriptResults();
-          delete port_list[proto][i];
-        }
-      }
-      free(port_list[proto]);
+    for(it = port_objects[proto].begin(); it != port_objects[proto].end(); it++) {
+      it->second->freeService(true);
+      it->second->freeScriptResults();
+      delete it->second;
     }
+    port_objects[proto].clear();
+    if(port_entries[proto])
+      free(port_entries[proto]);
   }
 }
 
@@ -502,7 +499,7 @@ void PortList::setDefaultPortState(u8 protocol, int state) {
   int i;
 
   for (i = 0; i < port_list_count[proto]; i++) {
-    if (port_list[proto][i] == NULL) {
+    if (port_entries[proto] == NULL || port_entries[proto][i].state == PORT_UNKNOWN) {
       state_counts_proto[proto][default_port_state[proto].state]--;
       state_counts_proto[proto][state]++;
     }
@@ -512,8 +509,10 @@ void PortList::setDefaultPortState(u8 protocol, int state) {
 }
 
 void PortList::setPortState(u16 portno, u8 protocol, int state) {
-  const Port *oldport;
-  Port *current;
+  const PortEntry *oldentry;
+  PortEntry *current;
+  u16 mapped_portno;
+  u8 mapped_protocol;
   int proto = INPROTO2PORTLISTPROTO(protocol);
 
   assert(state < PORT_HIGHEST_STATE);
@@ -534,18 +533,22 @@ void PortList::setPortState(u16 portno, u8 protocol, int state) {
 
   assert(protocol!=IPPROTO_IP || portno<256);
 
-  oldport = lookupPort(portno, protocol);
-  if (oldport != NULL) {
+  mapped_portno = portno;
+  mapped_protocol = protocol;
+  mapPort(&mapped_portno, &mapped_protocol);
+
+  oldentry = lookupEntry(mapped_protocol, mapped_portno);
+  if (oldentry != NULL) {
     /* We must discount our statistics from the old values.  Also warn
        if a complete duplicate */
-    if (o.debugging && oldport->state == state) {
+    if (o.debugging && oldentry->state == state) {
       error("Duplicate port (%hu/%s)", portno, proto2ascii_lowercase(protocol));
     }
-    state_counts_proto[proto][oldport->state]--;
+    state_counts_proto[proto][oldentry->state]--;
   } else {
     state_counts_proto[proto][default_port_state[proto].state]--;
   }
-  current = createPort(portno, protocol);
+  current = createEntry(mapped_protocol, mapped_portno);
 
   current->state = state;
   state_counts_proto[proto][state]++;
@@ -556,20 +559,22 @@ void PortList::setPortState(u16 portno, u8 protocol, int state) {
 }
 
 int PortList::getPortState(u16 portno, u8 protocol) {
-  const Port *port;
+  const PortEntry *entry;
 
-  port = lookupPort(portno, protocol);
-  if (port == NULL)
-    return default_port_state[INPROTO2PORTLISTPROTO(protocol)].state;
+  mapPort(&portno, &protocol);
+  entry = lookupEntry(protocol, portno);
+  if (entry == NULL)
+    return default_port_state[protocol].state;
 
-  return port->state;
+  return entry->state;
 }
 
 /* Return true if nothing special is known about this port; i.e., it's in the
    default state as defined by setDefaultPortState and every other data field is
    unset. */
 bool PortList::portIsDefault(u16 portno, u8 protocol) {
-  return lookupPort(portno, protocol) == NULL;
+  mapPort(&portno, &protocol);
+  return lookupEntry(protocol, portno) == NULL;
 }
 
   /* Saves an identification string for the target containing these
@@ -610,9 +615,10 @@ int PortList::getStateCounts(int state) const {
    will be returned before we start returning UDP and SCTP ports */
 Port *PortList::nextPort(const Port *cur, Port *next,
                          int allowed_protocol, int allowed_state) {
+  std::map<u16, Port *>::const_iterator it;
+  const PortEntry *entry;
   int proto;
   int mapped_pno;
-  Port *port;
 
   if (cur) {
     proto = INPROTO2PORTLISTPROTO(cur->proto);
@@ -630,14 +636,22 @@ Port *PortList::nextPort(const Port *cur, Port *next,
     mapped_pno = 0;
   }
 
-  if(port_list[proto] != NULL) {
+  if(port_map[proto] != NULL) {
     for(;mapped_pno < port_list_count[proto]; mapped_pno++) {
-      port = port_list[proto][mapped_pno];
-      if (port && (allowed_state==0 || port->state==allowed_state)) {
-        *next = *port;
+      entry = lookupEntry(proto, mapped_pno);
+      if (entry && (allowed_state==0 || entry->state==allowed_state)) {
+        it = port_objects[proto].find(mapped_pno);
+        if (it != port_objects[proto].end())
+          *next = *it->second;
+        else
+          *next = default_port_state[proto];
+        next->portno = port_map_rev[proto][mapped_pno];
+        next->state = entry->state;
+        next->reason.reason_id = entry->reason_id;
+        next->reason.ttl = entry->ttl;
         return next;
       }
-      if (!port && (allowed_state==0 || default_port_state[proto].state==allowed_state)) {
+      if (!entry && (allowed_state==0 || default_port_state[proto].state==allowed_state)) {
         *next = default_port_state[proto];
         next->portno = port_map_rev[proto][mapped_pno];
         return next;
@@ -659,7 +673,7 @@ Port *PortList::nextPort(const Port *cur, Port *next,
 }
 
 /* Convert portno and protocol into the internal indices used to index
-   port_list. */
+   port_entries and port_objects. */
 void PortList::mapPort(u16 *portno, u8 *protocol) const {
   int mapped_portno, mapped_protocol;
 
@@ -667,7 +681,7 @@ void PortList::mapPort(u16 *portno, u8 *protocol) const {
 
   if (*protocol == IPPROTO_IP)
     assert(*portno < 256);
-  if(port_map[mapped_protocol]==NULL || port_list[mapped_protocol]==NULL) {
+  if(port_map[mapped_protocol]==NULL) {
     fatal("%s(%i,%i): you're trying to access uninitialized protocol", __func__, *portno, *protocol);
   }
   mapped_portno = port_map[mapped_protocol][*portno];
@@ -679,13 +693,53 @@ void PortList::mapPort(u16 *portno, u8 *protocol) const {
   *protocol = mapped_protocol;
 }
 
+/* Return the packed entry of a mapped port, or NULL if nothing has been
+   recorded for it. */
+const PortList::PortEntry *PortList::lookupEntry(int proto, u16 mapped_portno) const {
+  const PortEntry *entry;
+
+  if (port_entries[proto] == NULL)
+    return NULL;
+  entry = &port_entries[proto][mapped_portno];
+  if (entry->state == PORT_UNKNOWN)
+    return NULL;
+
+  return entry;
+}
+
+/* Create the entry if it doesn't exist; otherwise this is like lookupEntry. */
+PortList::PortEntry *PortList::createEntry(int proto, u16 mapped_portno) {
+  PortEntry *entry;
+
+  if (port_entries[proto] == NULL)
+    port_entries[proto] = (PortEntry *) safe_zalloc(sizeof(PortEntry) * port_list_count[proto]);
+
+  entry = &port_entries[proto][mapped_portno];
+  if (entry->state == PORT_UNKNOWN) {
+    entry->state = default_port_state[proto].state;
+    entry->reason_id = ER_NORESPONSE;
+    entry->ttl = 0;
+  }
+
+  return entry;
+}
+
 const Port *PortList::lookupPort(u16 portno, u8 protocol) const {
+  std::map<u16, Port *>::const_iterator it;
+
   mapPort(&portno, &protocol);
-  return port_list[protocol][portno];
+  it = port_objects[protocol].find(portno);
+  if (it == port_objects[protocol].end())
+    return NULL;
+
+  return it->second;
 }
 
-/* Create the port if it doesn't exist; otherwise this is like lookupPort. */
+/* Create the port if it doesn't exist; otherwise this is like lookupPort.
+   The state and reason code of the returned Port are not maintained; they
+   live in the packed entry and are filled in by nextPort. */
 Port *PortList::createPort(u16 portno, u8 protocol) {
+  std::map<u16, Port *>::iterator it;
   Port *p;
   u16 mapped_portno;
   u8 mapped_protocol;
@@ -694,43 +748,58 @@ Port *PortList::createPort(u16 portno, u8 protocol) {
   mapped_protocol = protocol;
   mapPort(&mapped_portno, &mapped_protocol);
 
-  p = port_list[mapped_protocol][mapped_portno];
-  if (p == NULL) {
-    p = new Port();
-    p->portno = portno;
-    p->proto = protocol;
-    p->state = default_port_state[mapped_protocol].state;
-    p->reason.reason_id = ER_NORESPONSE;
-    port_list[mapped_protocol][mapped_portno] = p;
-  }
+  createEntry(mapped_protocol, mapped_portno);
 
-  return port_list[mapped_protocol][mapped_portno];
+  it = port_objects[mapped_protocol].find(mapped_portno);
+  if (it != port_objects[mapped_protocol].end())
+    return it->second;
+
+  p = new Port();
+  p->portno = portno;
+  p->proto = protocol;
+  p->state = default_port_state[mapped_protocol].state;
+  p->reason.reason_id = ER_NORESPONSE;
+  port_objects[mapped_protocol][mapped_portno] = p;
+
+  return p;
 }
 
 int PortList::forgetPort(u16 portno, u8 protocol) {
-  Port *answer = NULL;
+  std::map<u16, Port *>::iterator it;
+  PortEntry *entry;
+  u16 mapped_portno;
+  u8 mapped_protocol;
 
   log_write(LOG_PLAIN, "Removed %d\n", portno);
 
-  mapPort(&portno, &protocol);
+  mapped_portno = portno;
+  mapped_protocol = protocol;
+  mapPort(&mapped_portno, &mapped_protocol);
 
-  answer = port_list[protocol][portno];
-  if (answer == NULL)
+  if (lookupEntry(mapped_protocol, mapped_portno) == NULL)
     return -1;
+  entry = &port_entries[mapped_protocol][mapped_portno];
 
-  state_counts_proto[protocol][answer->state]--;
-  state_counts_proto[protocol][default_port_state[protocol].state]++;
-
-  port_list[protocol][portno] = NULL;
+  state_counts_proto[mapped_protocol][entry->state]--;
+  state_counts_proto[mapped_protocol][default_port_state[mapped_protocol].state]++;
 
   if (o.verbose) {
     log_write(LOG_STDOUT, "Deleting port %hu/%s, which we thought was %s\n",
-              portno, proto2ascii_lowercase(answer->proto),
-              statenum2str(answer->state));
+              portno, proto2ascii_lowercase(protocol),
+              statenum2str(entry->state));
     log_flush(LOG_STDOUT);
   }
 
-  delete answer;
+  memset(entry, 0, sizeof(*entry));
+
+  it = port_objects[mapped_protocol].find(mapped_portno);
+  if (it != port_objects[mapped_protocol].end()) {
+    it->second->freeService(true);
+    it->second->freeScriptResults();
+    delete it->second;
+    port_objects[mapped_protocol].erase(it);
+  }
+
   return 0;
 }
 
@@ -781,8 +850,8 @@ void PortList::initializePortMap(int protocol, u16 *ports, int portcount) {
     port_map_rev[proto][i] = ports[i];
   }
   /* So now port_map should have such structure (lets scan 2nd,4th and 6th port):
-   * 	port_map[0,0,1,0,2,0,3,...]	        <- indexes to port_list structure
-   * 	port_list[port_2,port_4,port_6] */
+   * 	port_map[0,0,1,0,2,0,3,...]	        <- indexes to port_entries structure
+   * 	port_entries[port_2,port_4,port_6] */
 }
 
   /* Cycles through the 0 or more "ignored" ports which should be
@@ -923,17 +992,30 @@ bool PortList::isTCPwrapped(u16 portno) const {
 
 int PortList::setStateReason(u16 portno, u8 proto, reason_t reason, u8 ttl,
   const struct sockaddr_storage *ip_addr) {
-    Port *answer = NULL;
+    std::map<u16, Port *>::iterator it;
+    PortEntry *entry;
+    Port *answer;
+    u16 mapped_portno;
+    u8 mapped_protocol;
 
-    answer = createPort(portno, proto);
+    mapped_portno = portno;
+    mapped_protocol = proto;
+    mapPort(&mapped_portno, &mapped_protocol);
 
     /* set new reason and increment its count */
-    answer->reason.reason_id = reason;
-    if (ip_addr == NULL)
-      answer->reason.ip_addr.sockaddr.sa_family = AF_UNSPEC;
-    else
+    entry = createEntry(mapped_protocol, mapped_portno);
+    entry->reason_id = reason;
+    entry->ttl = ttl;
+
+    /* Only a reason address needs a full Port object. */
+    if (ip_addr != NULL) {
+      answer = createPort(portno, proto);
       answer->reason.set_ip_addr(ip_addr);
-        answer->reason.ttl = ttl;
+    } else {
+      it = port_objects[mapped_protocol].find(mapped_portno);
+      if (it != port_objects[mapped_protocol].end())
+        it->second->reason.ip_addr.sockaddr.sa_family = AF_UNSPEC;
+    }
     return 0;
 }
 
@@ -132,6 +132,7 @@
 
 #include "portreasons.h"
 
+#include <map>
 #include <vector>
 
 /* port states */
@@ -326,25 +327,39 @@ class PortList {
 
  private:
   void mapPort(u16 *portno, u8 *protocol) const;
-  /* Get Port structure from PortList structure.*/
+  /* Get Port structure from PortList structure. Only ports carrying
+     service, script or reason address information have one. */
   const Port *lookupPort(u16 portno, u8 protocol) const;
   Port *createPort(u16 portno, u8 protocol);
-  /* Set Port structure to PortList structure.*/
-  void  setPortEntry(u16 portno, u8 protocol, Port *port);
+
+  /* The state and reason of every scanned port are kept in a packed
+     array indexed through port_map. A state of PORT_UNKNOWN means nothing
+     has been recorded and default_port_state applies. */
+  struct PortEntry {
+    reason_t reason_id;
+    u8 state;
+    u8 ttl;
+  };
+  const PortEntry *lookupEntry(int proto, u16 mapped_portno) const;
+  PortEntry *createEntry(int proto, u16 mapped_portno);
 
   /* A string identifying the system these ports are on.  Just used for
      printing open ports, if it is set with setIdStr() */
   char *idstr;
   /* Number of ports in each state per each protocol. */
   int state_counts_proto[PORTLIST_PROTO_MAX][PORT_HIGHEST_STATE];
-  Port **port_list[PORTLIST_PROTO_MAX];
+  /* Allocated on the first non-default port, so hosts that never answer
+     cost nothing. */
+  PortEntry *port_entries[PORTLIST_PROTO_MAX];
+  /* Port objects of "interesting" ports, keyed by mapped port number. */
+  std::map<u16, Port *> port_objects[PORTLIST_PROTO_MAX];
  protected:
-  /* Maps port_number to index in port_list array.
-   * Only functions: getPortEntry, setPortEntry, initializePortMap and
-   * nextPort should access this structure directly. */
+  /* Maps port_number to index in port_entries array.
+   * Only functions: mapPort, initializePortMap and nextPort should
+   * access this structure directly. */
   static u16 *port_map[PORTLIST_PROTO_MAX];
   static u16 *port_map_rev[PORTLIST_PROTO_MAX];
-  /* Number of allocated elements in port_list per each protocol. */
+  /* Number of allocated elements in port_entries per each protocol. */
   static int port_list_count[PORTLIST_PROTO_MAX];
   Port default_port_state[PORTLIST_PROTO_MAX];
 };
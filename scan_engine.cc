@@ -155,6 +155,19 @@ void UltraScanInfo::log_overall_rates(int logt) {
   log_write(logt, ".\n");
 }
 
+void UltraScanInfo::log_probe_allocations(int logt) {
+  log_write(logt, "Probe allocations: %lu new, %lu reused, %lu live; connect probes: %lu new, %lu reused, %lu live.\n",
+            probePool.num_allocated, probePool.num_reused, probePool.num_live,
+            connectProbePool.num_allocated, connectProbePool.num_reused,
+            connectProbePool.num_live);
+}
+
+void UltraScanInfo::deleteProbe(UltraProbe *probe) {
+  if (probe->type == UltraProbe::UP_CONNECT)
+    connectProbePool.release(probe->CP());
+  probePool.release(probe);
+}
+
 void UltraScanInfo::log_current_rates(int logt, bool update) {
   log_write(logt, "Current sending rates: %.2f packets / s", send_rate_meter.getCurrentPacketRate(&now, update));
   if (send_rate_meter.getNumBytes() > 0)
@@ -294,8 +307,6 @@ UltraProbe::UltraProbe() {
 }
 
 UltraProbe::~UltraProbe() {
-  if (type == UP_CONNECT)
-    delete probes.CP;
 }
 
 GroupScanStats::GroupScanStats(UltraScanInfo *UltraSI) {
@@ -510,6 +521,7 @@ HostScanStats::HostScanStats(Target *t, UltraScanInfo *UltraSI) {
   rld.max_tryno_sent = 0;
   rld.rld_waiting = false;
   rld.rld_waittime = USI->now;
+  probe_index_count = 0;
   if (!pingprobe_is_appropriate(USI, &target->pingprobe)) {
     if (o.debugging > 1)
       log_write(LOG_STDOUT, "%s pingprobe type %s is inappropriate for this scan type; resetting.\n", target->targetipstr(), pspectype2ascii(target->pingprobe.type));
@@ -956,6 +968,16 @@ void UltraScanInfo::Init(std::vector<Target *> &Targets, struct scan_lists *pts,
     hss = new HostScanStats(Targets[targetno], this);
     incompleteHosts.push_back(hss);
   }
+  /* Size the host index for about one host per bucket. */
+  hostIndexMask = 1;
+  while (hostIndexMask < incompleteHosts.size())
+    hostIndexMask <<= 1;
+  hostIndex.resize(hostIndexMask);
+  hostIndexMask--;
+  for (std::list<HostScanStats *>::iterator hostI = incompleteHosts.begin();
+       hostI != incompleteHosts.end(); hostI++) {
+    indexHost(*hostI);
+  }
   numInitialTargets = Targets.size();
   nextI = incompleteHosts.begin();
 
@@ -1109,28 +1131,43 @@ bool UltraScanInfo::sendOK(struct timeval *when) {
   return (TIMEVAL_MSEC_SUBTRACT(lowhtime, now) == 0);
 }
 
+/* Adds a host to the address index used by findHost(). */
+void UltraScanInfo::indexHost(HostScanStats *hss) {
+  const struct sockaddr_storage *ss = hss->target->TargetSockAddr();
+
+  hostIndex[sockaddr_storage_hash(ss) & hostIndexMask].push_back(hss);
+}
+
+/* Removes a host from the address index used by findHost(). */
+void UltraScanInfo::unindexHost(HostScanStats *hss) {
+  const struct sockaddr_storage *ss = hss->target->TargetSockAddr();
+  std::vector<HostScanStats *> &bucket = hostIndex[sockaddr_storage_hash(ss) & hostIndexMask];
+  std::vector<HostScanStats *>::iterator it;
+
+  for (it = bucket.begin(); it != bucket.end(); it++) {
+    if (*it == hss) {
+      *it = bucket.back();
+      bucket.pop_back();
+      return;
+    }
+  }
+  assert(0);
+}
+
 /* Find a HostScanStats by its IP address in the incomplete and completed lists.
    Returns NULL if none are found. */
 HostScanStats *UltraScanInfo::findHost(struct sockaddr_storage *ss) {
-  std::list<HostScanStats *>::iterator hss;
-  struct sockaddr_storage target_addr;
-  size_t target_addr_len;
-
-  for (hss = incompleteHosts.begin(); hss != incompleteHosts.end(); hss++) {
-    target_addr_len = sizeof(target_addr);
-    (*hss)->target->TargetSockAddr(&target_addr, &target_addr_len);
-    if (sockaddr_storage_cmp(&target_addr, ss) == 0) {
-      if (o.debugging > 2)
-        log_write(LOG_STDOUT, "Found %s in incomplete hosts list.\n", (*hss)->target->targetipstr());
-      return *hss;
-    }
-  }
-  for (hss = completedHosts.begin(); hss != completedHosts.end(); hss++) {
-    target_addr_len = sizeof(target_addr);
-    (*hss)->target->TargetSockAddr(&target_addr, &target_addr_len);
-    if (sockaddr_storage_cmp(&target_addr, ss) == 0) {
+  std::vector<HostScanStats *>::iterator hss;
+
+  if (hostIndex.empty())
+    return NULL;
+
+  std::vector<HostScanStats *> &bucket = hostIndex[sockaddr_storage_hash(ss) & hostIndexMask];
+  for (hss = bucket.begin(); hss != bucket.end(); hss++) {
+    if (sockaddr_storage_cmp((*hss)->target->TargetSockAddr(), ss) == 0) {
       if (o.debugging > 2)
-        log_write(LOG_STDOUT, "Found %s in completed hosts list.\n", (*hss)->target->targetipstr());
+        log_write(LOG_STDOUT, "Found %s in %s hosts list.\n", (*hss)->target->targetipstr(),
+                  (*hss)->completiontime.tv_sec == 0 ? "incomplete" : "completed");
       return *hss;
     }
   }
@@ -1182,7 +1219,12 @@ int UltraScanInfo::removeCompletedHosts() {
 
       TIMEVAL_MSEC_ADD(compare, hss->completiontime, completedHostLifetime);
       if (TIMEVAL_AFTER(now, compare) ) {
+        unindexHost(hss);
         completedHosts.erase(hostI);
+        /* Nothing will look for responses to its probes any more; release
+           them to the probe pool before it is destroyed. */
+        hss->destroyAllOutstandingProbes();
+        delete hss;
         hostsRemoved++;
       }
     }
@@ -1550,6 +1592,101 @@ int HostScanStats::freshPortsLeft() {
   return 0;
 }
 
+unsigned int HostScanStats::probeIndexHash(u8 proto, u16 sport, u16 dport) {
+  u32 h = (proto << 24) ^ (sport << 8) ^ dport ^ (dport << 16);
+
+  h ^= h >> 16;
+  h *= 0x45d9f3b;
+  h ^= h >> 16;
+  return h;
+}
+
+/* Only probes whose responses are matched by port are indexed. */
+bool HostScanStats::isIndexedProbe(const UltraProbe *probe) {
+  if (probe->type != UltraProbe::UP_IP)
+    return false;
+  return probe->protocol() == IPPROTO_TCP || probe->protocol() == IPPROTO_UDP
+         || probe->protocol() == IPPROTO_SCTP;
+}
+
+void HostScanStats::indexProbe(std::list<UltraProbe *>::iterator probeI) {
+  const UltraProbe *probe = *probeI;
+  unsigned int h;
+
+  if (!isIndexedProbe(probe))
+    return;
+  if (probe_index_count >= 2 * probe_index.size()) {
+    /* This reindexes everything in probes_outstanding, including probeI. */
+    growProbeIndex();
+    return;
+  }
+  h = probeIndexHash(probe->protocol(), probe->sport(), probe->dport());
+  probe_index[h & (probe_index.size() - 1)].push_back(probeI);
+  probe_index_count++;
+}
+
+void HostScanStats::unindexProbe(std::list<UltraProbe *>::iterator probeI) {
+  const UltraProbe *probe = *probeI;
+  ProbeIndexBucket::iterator it;
+  unsigned int h;
+
+  if (!isIndexedProbe(probe))
+    return;
+  h = probeIndexHash(probe->protocol(), probe->sport(), probe->dport());
+  ProbeIndexBucket &bucket = probe_index[h & (probe_index.size() - 1)];
+  for (it = bucket.begin(); it != bucket.end(); it++) {
+    if (*it == probeI) {
+      /* Erase rather than swap with the back, to keep send order. */
+      bucket.erase(it);
+      probe_index_count--;
+      return;
+    }
+  }
+  assert(0);
+}
+
+/* Doubles the number of buckets in the probe index and reinserts every
+   indexed probe. Walking probes_outstanding from the front keeps each bucket
+   in send order. */
+void HostScanStats::growProbeIndex() {
+  std::list<UltraProbe *>::iterator probeI;
+  size_t nbuckets;
+
+  nbuckets = probe_index.empty() ? 16 : probe_index.size() * 2;
+  probe_index.clear();
+  probe_index.resize(nbuckets);
+  probe_index_count = 0;
+  for (probeI = probes_outstanding.begin(); probeI != probes_outstanding.end(); probeI++) {
+    const UltraProbe *probe = *probeI;
+    unsigned int h;
+
+    if (!isIndexedProbe(probe))
+      continue;
+    h = probeIndexHash(probe->protocol(), probe->sport(), probe->dport());
+    probe_index[h & (nbuckets - 1)].push_back(probeI);
+    probe_index_count++;
+  }
+}
+
+void HostScanStats::addOutstandingProbe(UltraProbe *probe) {
+  std::list<UltraProbe *>::iterator probeI;
+
+  probes_outstanding.push_back(probe);
+  probeI = probes_outstanding.end();
+  probeI--;
+  indexProbe(probeI);
+}
+
+const HostScanStats::ProbeIndexBucket &HostScanStats::probesByPorts(u8 proto, u16 sport, u16 dport) const {
+  static const ProbeIndexBucket empty;
+  unsigned int h;
+
+  if (probe_index.empty())
+    return empty;
+  h = probeIndexHash(proto, sport, dport);
+  return probe_index[h & (probe_index.size() - 1)];
+}
+
 /* Removes a probe from probes_outstanding, adjusts HSS and USS
    active probe stats accordingly, then deletes the probe. */
 void HostScanStats::destroyOutstandingProbe(std::list<UltraProbe *>::iterator probeI) {
@@ -1571,8 +1708,9 @@ void HostScanStats::destroyOutstandingProbe(std::list<UltraProbe *>::iterator pr
   if (probe->type == UltraProbe::UP_CONNECT && probe->CP()->sd > 0)
     USI->gstats->CSI->clearSD(probe->CP()->sd);
 
+  unindexProbe(probeI);
   probes_outstanding.erase(probeI);
-  delete probe;
+  USI->deleteProbe(probe);
 }
 
 /* Removes all probes from probes_outstanding using
@@ -1951,9 +2089,10 @@ void HostScanStats::moveProbeToBench(std::list<UltraProbe *>::iterator probeI) {
     probe_bench.reserve(128);
   }
   probe_bench.push_back(*probe->pspec());
+  unindexProbe(probeI);
   probes_outstanding.erase(probeI);
   num_probes_waiting_retransmit--;
-  delete probe;
+  USI->deleteProbe(probe);
 }
 
 /* Called when a ping response is discovered. If adjust_timing is false, timing
@@ -2459,6 +2598,7 @@ static void printAnyStats(UltraScanInfo *USI) {
 
     USI->log_current_rates(LOG_PLAIN);
     USI->log_overall_rates(LOG_PLAIN);
+    USI->log_probe_allocations(LOG_PLAIN);
   }
 
   if (USI->SPM->mayBePrinted(&USI->now))
@@ -2694,12 +2834,18 @@ void ultra_scan(std::vector<Target *> &Targets, struct scan_lists *ports,
   /* Otherwise, no sniffer needed! */
 
   while (!USI.incompleteHostsEmpty()) {
+    /* Raw probes sent during this round go out in batches; the batch is
+       flushed before we start listening for the replies. */
+    if (USI.isRawScan())
+      send_ip_packet_batch_begin();
     doAnyPings(&USI);
     doAnyOutstandingRetransmits(&USI); // Retransmits from probes_outstanding
     /* Retransmits from retry_stack -- goes after OutstandingRetransmits for
        memory consumption reasons */
     doAnyRetryStackRetransmits(&USI);
     doAnyNewProbes(&USI);
+    if (USI.isRawScan())
+      send_ip_packet_batch_end();
     gettimeofday(&USI.now, NULL);
     // printf("TRACE: Finished doAnyNewProbes() at %.4fs\n", o.TimeSinceStartMS(&USI.now) / 1000.0);
     printAnyStats(&USI);
@@ -2744,8 +2890,10 @@ void ultra_scan(std::vector<Target *> &Targets, struct scan_lists *ports,
                     (USI.gstats->num_hosts_timedout == 1) ? "host" : "hosts");
     USI.SPM->endTask(NULL, additional_info);
   }
-  if (o.debugging)
+  if (o.debugging) {
     USI.log_overall_rates(LOG_STDOUT);
+    USI.log_probe_allocations(LOG_STDOUT);
+  }
 
   if (o.debugging > 2 && USI.pd != NULL)
     pcap_print_stats(LOG_PLAIN, USI.pd);
@@ -134,6 +134,7 @@
 #include "timing.h"
 #include "tcpip.h"
 #include <list>
+#include <new>
 #include <vector>
 
 struct probespec_tcpdata {
@@ -206,6 +207,65 @@ int determineScanGroupSize(int hosts_scanned_so_far,
 
 class UltraScanInfo;
 
+/* A free-list allocator for the objects ultra_scan creates and destroys once
+   per probe. Objects are carved out of slabs of SLAB_SIZE and recycled
+   through a free list; the memory goes back to the system only when the pool
+   itself is destroyed, so every object must be released before then. */
+template <class T> class ObjectPool {
+public:
+  ObjectPool() : num_allocated(0), num_reused(0), num_live(0), slab_used(SLAB_SIZE) {}
+  ~ObjectPool() {
+    std::vector<char *>::iterator it;
+
+    assert(num_live == 0);
+    for (it = slabs.begin(); it != slabs.end(); it++)
+      free(*it);
+  }
+
+  /* Returns a default-constructed T. */
+  T *alloc() {
+    void *mem;
+
+    if (!free_list.empty()) {
+      mem = free_list.back();
+      free_list.pop_back();
+      num_reused++;
+    } else {
+      if (slab_used == SLAB_SIZE) {
+        slabs.push_back((char *) safe_malloc(SLAB_SIZE * sizeof(T)));
+        slab_used = 0;
+      }
+      mem = slabs.back() + slab_used * sizeof(T);
+      slab_used++;
+      num_allocated++;
+    }
+    num_live++;
+    return new (mem) T();
+  }
+
+  /* Destroys obj and puts its memory on the free list. */
+  void release(T *obj) {
+    assert(num_live > 0);
+    obj->~T();
+    free_list.push_back(obj);
+    num_live--;
+  }
+
+  /* Objects that had to be carved from a slab, and objects handed out again
+     from the free list. */
+  unsigned long num_allocated;
+  unsigned long num_reused;
+  /* Objects currently handed out. */
+  unsigned long num_live;
+
+private:
+  enum { SLAB_SIZE = 256 };
+  std::vector<char *> slabs;
+  std::vector<void *> free_list;
+  /* Number of objects used in slabs.back(). */
+  unsigned int slab_used;
+};
+
 struct ppkt { /* Beginning of ICMP Echo/Timestamp header         */
   u8 type;
   u8 code;
@@ -263,8 +323,9 @@ public:
      tcp packet could be PS_PROTO or PS_TCP). */
   void setIP(u8 *ippacket, u32 iplen, const probespec *pspec);
   /* Sets this UltraProbe as type UP_CONNECT, preparing to connect to given
-   port number*/
-  void setConnect(u16 portno);
+   port number. The ConnectProbe is owned by the caller, normally the
+   UltraScanInfo pool it came from. */
+  void setConnect(u16 portno, ConnectProbe *cp);
   /* Pass an arp packet, including ethernet header. Must be 42bytes */
   void setARP(u8 *arppkt, u32 arplen);
   void setND(u8 *ndpkt, u32 ndlen);
@@ -534,6 +595,17 @@ public:
      maximum tryno and expired) are not counted in
      probes_outstanding.  */
   std::list<UltraProbe *> probes_outstanding;
+  /* Appends a newly sent probe to probes_outstanding, adding it to the port
+     index if it is a TCP, UDP, or SCTP IP probe. */
+  void addOutstandingProbe(UltraProbe *probe);
+
+  typedef std::vector<std::list<UltraProbe *>::iterator> ProbeIndexBucket;
+  /* Returns the outstanding TCP, UDP, and SCTP IP probes that may have been
+     sent with the given protocol and ports, in the order they were sent. The
+     result can include probes with other ports, so each one must still be
+     checked, but it always includes every probe that does match. It is only
+     valid until probes_outstanding is next changed. */
+  const ProbeIndexBucket &probesByPorts(u8 proto, u16 sport, u16 dport) const;
   /* The number of probes in probes_outstanding, minus the inactive (timed out) ones */
   unsigned int num_probes_active;
   /* Probes timed out but not yet retransmitted because of congestion
@@ -633,6 +705,19 @@ public:
 
 private:
   u8 nxtpseq; /* the next scanping sequence number to use */
+
+  /* Hash index over the TCP, UDP, and SCTP IP probes in probes_outstanding,
+     keyed by protocol, source port, and destination port, so that responses
+     can be matched without walking every outstanding probe. Each bucket
+     keeps its probes in the order they were sent. The number of buckets is a
+     power of two and is doubled as the index fills up. */
+  std::vector<ProbeIndexBucket> probe_index;
+  unsigned int probe_index_count;
+  static unsigned int probeIndexHash(u8 proto, u16 sport, u16 dport);
+  static bool isIndexedProbe(const UltraProbe *probe);
+  void indexProbe(std::list<UltraProbe *>::iterator probeI);
+  void unindexProbe(std::list<UltraProbe *>::iterator probeI);
+  void growProbeIndex();
 };
 
 /* A few extra performance tuning parameters specific to ultra_scan. */
@@ -727,6 +812,18 @@ public:
 
   void log_overall_rates(int logt);
   void log_current_rates(int logt, bool update = true);
+  void log_probe_allocations(int logt);
+
+  /* Allocate UltraProbes (and the ConnectProbes of connect probes) from
+     per-scan pools instead of the heap. A probe from newProbe() must be
+     released with deleteProbe(), which also releases its ConnectProbe. */
+  UltraProbe *newProbe() {
+    return probePool.alloc();
+  }
+  ConnectProbe *newConnectProbe() {
+    return connectProbePool.alloc();
+  }
+  void deleteProbe(UltraProbe *probe);
 
   /* Any function which messes with (removes elements from)
      incompleteHosts may have to manipulate nextI */
@@ -753,6 +850,20 @@ private:
   unsigned int numInitialTargets;
   std::list<HostScanStats *>::iterator nextI;
 
+  /* ~UltraScanInfo deletes every host, and so every probe, before these are
+     destroyed. */
+  ObjectPool<UltraProbe> probePool;
+  ObjectPool<ConnectProbe> connectProbePool;
+
+  /* Hash index over every host in incompleteHosts and completedHosts, keyed
+     by target address. It lets findHost() answer in constant time rather
+     than walking both lists for every received packet. The number of
+     buckets is a power of two; hostIndexMask is one less than that. */
+  std::vector<std::vector<HostScanStats *> > hostIndex;
+  unsigned int hostIndexMask;
+  void indexHost(HostScanStats *hss);
+  void unindexHost(HostScanStats *hss);
+
 };
 
 /* Whether this is storing timing stats for a whole group or an
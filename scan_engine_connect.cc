@@ -134,10 +134,11 @@
 extern NmapOps o;
 
 /* Sets this UltraProbe as type UP_CONNECT, preparing to connect to given
-   port number*/
-void UltraProbe::setConnect(u16 portno) {
+   port number. The ConnectProbe is owned by the caller, normally the
+   UltraScanInfo pool it came from. */
+void UltraProbe::setConnect(u16 portno, ConnectProbe *cp) {
   type = UP_CONNECT;
-  probes.CP = new ConnectProbe();
+  probes.CP = cp;
   mypspec.type = PS_CONNECTTCP;
   mypspec.proto = IPPROTO_TCP;
   mypspec.pd.tcp.dport = portno;
@@ -404,7 +405,7 @@ static void init_socket(int sd) {
 UltraProbe *sendConnectScanProbe(UltraScanInfo *USI, HostScanStats *hss,
                                  u16 destport, u8 tryno, u8 pingseq) {
 
-  UltraProbe *probe = new UltraProbe();
+  UltraProbe *probe = USI->newProbe();
   std::list<UltraProbe *>::iterator probeI;
   int rc;
   int connect_errno = 0;
@@ -419,7 +420,7 @@ UltraProbe *sendConnectScanProbe(UltraScanInfo *USI, HostScanStats *hss,
   probe->tryno = tryno;
   probe->pingseq = pingseq;
   /* First build the probe */
-  probe->setConnect(destport);
+  probe->setConnect(destport, USI->newConnectProbe());
   CP = probe->CP();
   /* Initiate the connection */
   CP->sd = socket(o.af(), SOCK_STREAM, IPPROTO_TCP);
@@ -446,7 +447,7 @@ UltraProbe *sendConnectScanProbe(UltraScanInfo *USI, HostScanStats *hss,
   if (rc == -1)
     connect_errno = socket_errno();
   /* This counts as probe being sent, so update structures */
-  hss->probes_outstanding.push_back(probe);
+  hss->addOutstandingProbe(probe);
   probeI = hss->probes_outstanding.end();
   probeI--;
   USI->gstats->num_probes_active++;
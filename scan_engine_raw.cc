@@ -636,8 +636,20 @@ int get_ping_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
         if (!hss)
           continue; // Not referring to a host that interests us
         setTargetMACIfAvailable(hss->target, &linkhdr, &encaps_hdr.dst, 0);
-        probeI = hss->probes_outstanding.end();
-        listsz = hss->num_probes_outstanding();
+        /* TCP, UDP, and SCTP headers all begin with the source and destination
+           ports, which is enough to look up candidate probes in the index. */
+        const HostScanStats::ProbeIndexBucket *candidates = NULL;
+        if (((encaps_hdr.proto == IPPROTO_TCP && USI->ptech.rawtcpscan)
+            || (encaps_hdr.proto == IPPROTO_UDP && USI->ptech.rawudpscan)
+            || (encaps_hdr.proto == IPPROTO_SCTP && USI->ptech.rawsctpscan))
+            && encaps_len >= 4) {
+          const u16 *encaps_ports = (const u16 *) encaps_data;
+          candidates = &hss->probesByPorts(encaps_hdr.proto, ntohs(encaps_ports[0]), ntohs(encaps_ports[1]));
+          listsz = candidates->size();
+        } else {
+          probeI = hss->probes_outstanding.end();
+          listsz = hss->num_probes_outstanding();
+        }
 
         ss_len = sizeof(target_src);
         hss->target->SourceSockAddr(&target_src, &ss_len);
@@ -646,7 +658,10 @@ int get_ping_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
 
         /* Find the probe that provoked this response. */
         for (probenum = 0; probenum < listsz; probenum++) {
-          probeI--;
+          if (candidates)
+            probeI = (*candidates)[listsz - 1 - probenum];
+          else
+            probeI--;
           probe = *probeI;
 
           if (probe->protocol() != encaps_hdr.proto ||
@@ -746,14 +761,15 @@ int get_ping_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       if (!hss)
         continue; // Not from a host that interests us
       setTargetMACIfAvailable(hss->target, &linkhdr, &hdr.src, 0);
-      probeI = hss->probes_outstanding.end();
-      listsz = hss->num_probes_outstanding();
+      const HostScanStats::ProbeIndexBucket &candidates =
+        hss->probesByPorts(IPPROTO_TCP, ntohs(tcp->th_dport), ntohs(tcp->th_sport));
+      listsz = candidates.size();
 
       goodone = false;
 
       /* Find the probe that provoked this response. */
       for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-        probeI--;
+        probeI = candidates[listsz - 1 - probenum];
         probe = *probeI;
 
         if (!tcp_probe_match(USI, probe, hss, tcp, &hdr.src, &hdr.dst, hdr.ipid))
@@ -783,15 +799,16 @@ int get_ping_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       hss = USI->findHost(&hdr.src);
       if (!hss)
         continue; // Not from a host that interests us
-      probeI = hss->probes_outstanding.end();
-      listsz = hss->num_probes_outstanding();
+      const HostScanStats::ProbeIndexBucket &candidates =
+        hss->probesByPorts(IPPROTO_UDP, ntohs(udp->uh_dport), ntohs(udp->uh_sport));
+      listsz = candidates.size();
       goodone = false;
 
       ss_len = sizeof(target_src);
       hss->target->SourceSockAddr(&target_src, &ss_len);
 
       for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-        probeI--;
+        probeI = candidates[listsz - 1 - probenum];
         probe = *probeI;
 
         if (o.af() != AF_INET || probe->protocol() != IPPROTO_UDP)
@@ -833,15 +850,16 @@ int get_ping_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       hss = USI->findHost(&hdr.src);
       if (!hss)
         continue; // Not from a host that interests us
-      probeI = hss->probes_outstanding.end();
-      listsz = hss->num_probes_outstanding();
+      const HostScanStats::ProbeIndexBucket &candidates =
+        hss->probesByPorts(IPPROTO_SCTP, ntohs(sctp->sh_dport), ntohs(sctp->sh_sport));
+      listsz = candidates.size();
       goodone = false;
 
       ss_len = sizeof(target_dst);
       hss->target->SourceSockAddr(&target_src, &ss_len);
 
       for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-        probeI--;
+        probeI = candidates[listsz - 1 - probenum];
         probe = *probeI;
 
         if (o.af() != AF_INET || probe->protocol() != IPPROTO_SCTP)
@@ -1035,7 +1053,7 @@ void begin_sniffer(UltraScanInfo *USI, std::vector<Target *> &Targets) {
 UltraProbe *sendArpScanProbe(UltraScanInfo *USI, HostScanStats *hss,
                              u8 tryno, u8 pingseq) {
   int rc;
-  UltraProbe *probe = new UltraProbe();
+  UltraProbe *probe = USI->newProbe();
 
   /* 3 cheers for libdnet header files */
   u8 frame[ETH_HDR_LEN + ARP_HDR_LEN + ARP_ETHIP_LEN];
@@ -1062,7 +1080,7 @@ UltraProbe *sendArpScanProbe(UltraScanInfo *USI, HostScanStats *hss,
   probe->setARP(frame, sizeof(frame));
 
   /* Now that the probe has been sent, add it to the Queue for this host */
-  hss->probes_outstanding.push_back(probe);
+  hss->addOutstandingProbe(probe);
   USI->gstats->num_probes_active++;
   hss->num_probes_active++;
 
@@ -1072,7 +1090,7 @@ UltraProbe *sendArpScanProbe(UltraScanInfo *USI, HostScanStats *hss,
 
 UltraProbe *sendNDScanProbe(UltraScanInfo *USI, HostScanStats *hss,
                             u8 tryno, u8 pingseq) {
-  UltraProbe *probe = new UltraProbe();
+  UltraProbe *probe = USI->newProbe();
   struct eth_nfo eth;
   struct eth_nfo *ethptr = NULL;
   u8 *packet = NULL;
@@ -1131,7 +1149,7 @@ UltraProbe *sendNDScanProbe(UltraScanInfo *USI, HostScanStats *hss,
   free(packet);
 
   /* Now that the probe has been sent, add it to the Queue for this host */
-  hss->probes_outstanding.push_back(probe);
+  hss->addOutstandingProbe(probe);
   USI->gstats->num_probes_active++;
   hss->num_probes_active++;
 
@@ -1262,7 +1280,7 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
                             const probespec *pspec, u8 tryno, u8 pingseq) {
   u8 *packet = NULL;
   u32 packetlen = 0;
-  UltraProbe *probe = new UltraProbe();
+  UltraProbe *probe = USI->newProbe();
   int decoy = 0;
   u32 seq = 0;
   u32 ack = 0;
@@ -1516,7 +1534,7 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
   } else assert(0);
 
   /* Now that the probe has been sent, add it to the Queue for this host */
-  hss->probes_outstanding.push_back(probe);
+  hss->addOutstandingProbe(probe);
   USI->gstats->num_probes_active++;
   hss->num_probes_active++;
 
@@ -1769,14 +1787,15 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       if (!hss)
         continue; // Not from a host that interests us
       setTargetMACIfAvailable(hss->target, &linkhdr, &hdr.src, 0);
-      probeI = hss->probes_outstanding.end();
-      listsz = hss->num_probes_outstanding();
+      const HostScanStats::ProbeIndexBucket &candidates =
+        hss->probesByPorts(IPPROTO_TCP, ntohs(tcp->th_dport), ntohs(tcp->th_sport));
+      listsz = candidates.size();
 
       goodone = false;
 
       /* Find the probe that provoked this response. */
       for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-        probeI--;
+        probeI = candidates[listsz - 1 - probenum];
         probe = *probeI;
 
         if (!tcp_probe_match(USI, probe, hss, tcp, &hdr.src, &hdr.dst, hdr.ipid))
@@ -1817,8 +1836,9 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       if (!hss)
         continue; // Not from a host that interests us
       setTargetMACIfAvailable(hss->target, &linkhdr, &hdr.src, 0);
-      probeI = hss->probes_outstanding.end();
-      listsz = hss->num_probes_outstanding();
+      const HostScanStats::ProbeIndexBucket &candidates =
+        hss->probesByPorts(IPPROTO_SCTP, ntohs(sctp->sh_dport), ntohs(sctp->sh_sport));
+      listsz = candidates.size();
 
       goodone = false;
 
@@ -1827,7 +1847,7 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
 
       /* Find the probe that provoked this response. */
       for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-        probeI--;
+        probeI = candidates[listsz - 1 - probenum];
         probe = *probeI;
 
         if (probe->protocol() != IPPROTO_SCTP)
@@ -1917,8 +1937,18 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       hss = USI->findHost(&encaps_hdr.dst);
       if (!hss)
         continue; // Not from a host that interests us
-      probeI = hss->probes_outstanding.end();
-      listsz = hss->num_probes_outstanding();
+      /* TCP, UDP, and SCTP headers all begin with the source and destination
+         ports, which is enough to look up candidate probes in the index. */
+      const HostScanStats::ProbeIndexBucket *candidates = NULL;
+      if ((!USI->prot_scan)
+          && encaps_len >= 4) {
+        const u16 *encaps_ports = (const u16 *) encaps_data;
+        candidates = &hss->probesByPorts(encaps_hdr.proto, ntohs(encaps_ports[0]), ntohs(encaps_ports[1]));
+        listsz = candidates->size();
+      } else {
+        probeI = hss->probes_outstanding.end();
+        listsz = hss->num_probes_outstanding();
+      }
 
       ss_len = sizeof(target_src);
       hss->target->SourceSockAddr(&target_src, &ss_len);
@@ -1928,7 +1958,10 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       goodone = false;
       /* Find the matching probe */
       for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-        probeI--;
+        if (candidates)
+          probeI = (*candidates)[listsz - 1 - probenum];
+        else
+          probeI--;
         probe = *probeI;
         if (probe->protocol() != encaps_hdr.proto ||
             sockaddr_storage_cmp(&target_src, &encaps_hdr.src) != 0 ||
@@ -2046,8 +2079,18 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       hss = USI->findHost(&encaps_hdr.dst);
       if (!hss)
         continue; // Not from a host that interests us
-      probeI = hss->probes_outstanding.end();
-      listsz = hss->num_probes_outstanding();
+      /* TCP, UDP, and SCTP headers all begin with the source and destination
+         ports, which is enough to look up candidate probes in the index. */
+      const HostScanStats::ProbeIndexBucket *candidates = NULL;
+      if ((!USI->prot_scan)
+          && encaps_len >= 4) {
+        const u16 *encaps_ports = (const u16 *) encaps_data;
+        candidates = &hss->probesByPorts(encaps_hdr.proto, ntohs(encaps_ports[0]), ntohs(encaps_ports[1]));
+        listsz = candidates->size();
+      } else {
+        probeI = hss->probes_outstanding.end();
+        listsz = hss->num_probes_outstanding();
+      }
 
       ss_len = sizeof(target_src);
       hss->target->SourceSockAddr(&target_src, &ss_len);
@@ -2057,7 +2100,10 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       goodone = false;
       /* Find the matching probe */
       for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-        probeI--;
+        if (candidates)
+          probeI = (*candidates)[listsz - 1 - probenum];
+        else
+          probeI--;
         probe = *probeI;
         if (probe->protocol() != encaps_hdr.proto ||
             sockaddr_storage_cmp(&target_src, &encaps_hdr.src) != 0 ||
@@ -2168,15 +2214,16 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       hss = USI->findHost(&hdr.src);
       if (!hss)
         continue; // Not from a host that interests us
-      probeI = hss->probes_outstanding.end();
-      listsz = hss->num_probes_outstanding();
+      const HostScanStats::ProbeIndexBucket &candidates =
+        hss->probesByPorts(IPPROTO_UDP, ntohs(udp->uh_dport), ntohs(udp->uh_sport));
+      listsz = candidates.size();
       ss_len = sizeof(target_src);
       hss->target->SourceSockAddr(&target_src, &ss_len);
 
       goodone = false;
 
       for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-        probeI--;
+        probeI = candidates[listsz - 1 - probenum];
         probe = *probeI;
         newstate = PORT_UNKNOWN;
 
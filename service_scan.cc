@@ -134,9 +134,15 @@
 #include "protocols.h"
 
 #include "nmap_tty.h"
+#include "datacache.h"
+#include "NsockShards.h"
 
 #include <errno.h>
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 #if HAVE_OPENSSL
 /* OpenSSL 1.0.0 needs _WINSOCKAPI_ to be defined, otherwise it loads
    <windows.h> (through openssl/dtls1.h), which is incompatible with the
@@ -161,6 +167,7 @@
 
 #include <algorithm>
 #include <list>
+#include <map>
 
 extern NmapOps o;
 
@@ -259,10 +266,25 @@ private:
   int servicefpalloc;
 };
 
+class MatchThreads;
+
+#ifdef HAVE_PTHREAD
+// Progress of a sharded scan, updated by the shards and printed by the main
+// thread.
+struct ShardProgress {
+  pthread_mutex_t lock;
+  unsigned int finished; // Services finished by all the shards together
+  unsigned int total; // Services scanned by all the shards together
+  ScanProgressMeter *SPM;
+};
+#endif
+
 // This holds the service information for a group of Targets being service scanned.
 class ServiceGroup {
 public:
-  ServiceGroup(std::vector<Target *> &Targets, AllProbes *AP);
+  // A group that is one shard of a larger scan (see service_scan_sharded)
+  // gets no progress meter of its own; pass meter as false for those.
+  ServiceGroup(std::vector<Target *> &Targets, AllProbes *AP, bool meter = true);
   ~ServiceGroup();
   std::list<ServiceNFO *> services_finished; // Services finished (discovered or not)
   std::list<ServiceNFO *> services_in_progress; // Services currently being probed
@@ -270,6 +292,13 @@ public:
   unsigned int ideal_parallelism; // Max (and desired) number of probes out at once.
   ScanProgressMeter *SPM;
   int num_hosts_timedout; // # of hosts timed out during (or before) scan
+  MatchThreads *match_threads; // Matches responses off the nsock loop, or NULL
+  struct MatchResult match_result; // Holds the matches made in the read handler
+#ifdef HAVE_PTHREAD
+  NsockShards *shards; // The shards this group is part of, or NULL
+  int shard; // Index of this group's pool in shards
+  struct ShardProgress *progress; // Shared with the other shards, or NULL
+#endif
 };
 
 #define SUBSTARGS_MAX_ARGS 5
@@ -295,6 +324,68 @@ static void servicescan_write_handler(nsock_pool nsp, nsock_event nse, void *myd
 static void servicescan_connect_handler(nsock_pool nsp, nsock_event nse, void *mydata);
 static void end_svcprobe(nsock_pool nsp, enum serviceprobestate probe_state, ServiceGroup *SG, ServiceNFO *svc, nsock_iod nsi);
 
+#ifdef PCRE_STUDY_JIT_COMPILE
+/* A JIT-compiled regex runs on a JIT stack.  PCRE's default one (32K on the
+   machine stack) is too small for some of the regexes in
+   nmap-service-probes, so every thread that matches gets a larger stack of
+   its own.  PCRE calls this before each pcre_exec() of a JIT regex. */
+#define JIT_STACK_START (32 * 1024)
+#define JIT_STACK_MAX (1024 * 1024)
+
+#ifdef HAVE_PTHREAD
+static pthread_key_t jit_stack_key;
+static pthread_once_t jit_stack_once = PTHREAD_ONCE_INIT;
+
+static void jit_stack_free(void *stack) {
+  pcre_jit_stack_free((pcre_jit_stack *) stack);
+}
+
+static void jit_stack_key_create(void) {
+  if (pthread_key_create(&jit_stack_key, jit_stack_free) != 0)
+    fatal("%s: failed to create thread-specific key", __func__);
+}
+#endif
+
+static pcre_jit_stack *jit_stack_callback(void *data) {
+  pcre_jit_stack *stack;
+
+#ifdef HAVE_PTHREAD
+  pthread_once(&jit_stack_once, jit_stack_key_create);
+  stack = (pcre_jit_stack *) pthread_getspecific(jit_stack_key);
+  if (stack == NULL) {
+    stack = pcre_jit_stack_alloc(JIT_STACK_START, JIT_STACK_MAX);
+    pthread_setspecific(jit_stack_key, stack);
+  }
+#else
+  static pcre_jit_stack *main_stack = NULL;
+
+  if (main_stack == NULL)
+    main_stack = pcre_jit_stack_alloc(JIT_STACK_START, JIT_STACK_MAX);
+  stack = main_stack;
+#endif
+
+  /* If the allocation failed, PCRE falls back to its default stack. */
+  return stack;
+}
+#endif
+
+/* A monotonic clock in seconds, for profiling regexes. */
+static double profile_clock() {
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+#endif
+}
+
+bool ServiceProbeMatch::profiling = false;
+
 ServiceProbeMatch::ServiceProbeMatch() {
   deflineno = -1;
   servicename = NULL;
@@ -307,6 +398,7 @@ ServiceProbeMatch::ServiceProbeMatch() {
   matchops_ignorecase = false;
   matchops_dotall = false;
   isSoft = false;
+  resetProfile();
 }
 
 ServiceProbeMatch::~ServiceProbeMatch() {
@@ -324,7 +416,11 @@ ServiceProbeMatch::~ServiceProbeMatch() {
     free(*it);
   matchstrlen = 0;
   if (regex_compiled) pcre_free(regex_compiled);
+#ifdef PCRE_STUDY_JIT_COMPILE
+  if (regex_extra) pcre_free_study(regex_extra);
+#else
   if (regex_extra) pcre_free(regex_extra);
+#endif
   isInitialized = false;
   matchops_anchor = -1;
 }
@@ -471,10 +567,7 @@ void ServiceProbeMatch::InitMatch(const char *matchtext, int lineno) {
   if (regex_compiled == NULL)
     fatal("%s: illegal regexp on line %d of nmap-service-probes (at regexp offset %d): %s\n", __func__, lineno, pcre_erroffset, pcre_errptr);
 
-  // Now study the regexp for greater efficiency
-  regex_extra = pcre_study(regex_compiled, 0, &pcre_errptr);
-  if (pcre_errptr != NULL)
-    fatal("%s: failed to pcre_study regexp on line %d of nmap-service-probes: %s\n", __func__, lineno, pcre_errptr);
+  studyRegex(lineno);
 
   free(modestr);
   free(flags);
@@ -520,6 +613,101 @@ void ServiceProbeMatch::InitMatch(const char *matchtext, int lineno) {
   isInitialized = 1;
 }
 
+void ServiceProbeMatch::studyRegex(int lineno) {
+  const char *pcre_errptr = NULL;
+
+  // Study the regexp for greater efficiency, and JIT-compile it if
+  // this libpcre can.  Without JIT support, PCRE_STUDY_JIT_COMPILE is
+  // ignored.
+#ifdef PCRE_STUDY_JIT_COMPILE
+  regex_extra = pcre_study(regex_compiled, PCRE_STUDY_JIT_COMPILE, &pcre_errptr);
+#else
+  regex_extra = pcre_study(regex_compiled, 0, &pcre_errptr);
+#endif
+  if (pcre_errptr != NULL)
+    fatal("%s: failed to pcre_study regexp on line %d of nmap-service-probes: %s\n", __func__, lineno, pcre_errptr);
+
+  if (regex_extra == NULL) {
+    regex_extra = (pcre_extra *) pcre_malloc(sizeof(pcre_extra));
+    memset(regex_extra, 0, sizeof(pcre_extra));
+  }
+  regex_extra->flags |= PCRE_EXTRA_MATCH_LIMIT;
+  regex_extra->match_limit = SERVICEMATCH_MATCH_LIMIT;
+#ifdef PCRE_STUDY_JIT_COMPILE
+  pcre_assign_jit_stack(regex_extra, jit_stack_callback, NULL);
+#endif
+}
+
+void ServiceProbeMatch::saveToCache(CacheWriter *cache) const {
+  std::vector<char *>::const_iterator it;
+  size_t size;
+
+  assert(isInitialized);
+  cache->putInt(deflineno);
+  cache->putString(servicename);
+  cache->putInt(matchtype);
+  cache->putString(matchstr);
+  cache->putInt(matchops_ignorecase);
+  cache->putInt(matchops_dotall);
+  cache->putInt(isSoft);
+  cache->putString(product_template);
+  cache->putString(version_template);
+  cache->putString(info_template);
+  cache->putString(hostname_template);
+  cache->putString(ostype_template);
+  cache->putString(devicetype_template);
+  cache->putU32(cpe_templates.size());
+  for (it = cpe_templates.begin(); it != cpe_templates.end(); it++)
+    cache->putString(*it);
+
+  // A compiled pattern is a single relocatable block, which PCRE
+  // explicitly allows to be saved and reloaded by the same library.
+  if (pcre_fullinfo(regex_compiled, NULL, PCRE_INFO_SIZE, &size) != 0)
+    fatal("%s: pcre_fullinfo failed for line %d of nmap-service-probes", __func__, deflineno);
+  cache->putU32(size);
+  cache->putBytes(regex_compiled, size);
+}
+
+bool ServiceProbeMatch::loadFromCache(CacheReader *cache) {
+  const u8 *regex;
+  size_t size;
+  u32 i, n;
+
+  assert(!isInitialized);
+  // From here on, the destructor frees whatever has been loaded.
+  isInitialized = true;
+  deflineno = cache->getInt();
+  servicename = cache->getString();
+  matchtype = cache->getInt();
+  matchstr = cache->getString();
+  matchops_ignorecase = cache->getInt();
+  matchops_dotall = cache->getInt();
+  isSoft = cache->getInt();
+  product_template = cache->getString();
+  version_template = cache->getString();
+  info_template = cache->getString();
+  hostname_template = cache->getString();
+  ostype_template = cache->getString();
+  devicetype_template = cache->getString();
+  n = cache->getU32();
+  for (i = 0; i < n && !cache->failed(); i++)
+    cpe_templates.push_back(cache->getString());
+
+  n = cache->getU32();
+  regex = cache->getBytes(n);
+  if (cache->failed() || servicename == NULL || matchstr == NULL
+      || matchtype != SERVICEMATCH_REGEX)
+    return false;
+  regex_compiled = (pcre *) pcre_malloc(n);
+  memcpy(regex_compiled, regex, n);
+  // This also checks PCRE's magic number.
+  if (pcre_fullinfo(regex_compiled, NULL, PCRE_INFO_SIZE, &size) != 0 || size != n)
+    return false;
+  studyRegex(deflineno);
+
+  return true;
+}
+
   // If the buf (of length buflen) match the regex in this
   // ServiceProbeMatch, returns the details of the match (service
   // name, version number if applicable, and whether this is a "soft"
@@ -530,56 +718,373 @@ void ServiceProbeMatch::InitMatch(const char *matchtext, int lineno) {
   // program execution.  If no version matched, that field will be
   // NULL.
 const struct MatchDetails *ServiceProbeMatch::testMatch(const u8 *buf, int buflen) {
+  static struct MatchResult result;
+
+  return testMatch(buf, buflen, &result);
+}
+
+const struct MatchDetails *ServiceProbeMatch::testMatch(const u8 *buf, int buflen,
+                                                        struct MatchResult *result) {
   int rc;
-  static char product[80];
-  static char version[80];
-  static char info[256];  /* We will truncate with ... later */
-  static char hostname[80];
-  static char ostype[32];
-  static char devicetype[32];
-  static char cpe_a[80], cpe_h[80], cpe_o[80];
-  char *bufc = (char *) buf;
+  struct MatchDetails *MD = &result->MD;
   int ovector[150]; // allows 50 substring matches (including the overall match)
   assert(isInitialized);
 
-  assert (matchtype == SERVICEMATCH_REGEX);
-
   // Clear out the output struct
-  memset(&MD_return, 0, sizeof(MD_return));
-  MD_return.isSoft = isSoft;
+  memset(MD, 0, sizeof(*MD));
+  MD->isSoft = isSoft;
 
-  rc = pcre_exec(regex_compiled, regex_extra, bufc, buflen, 0, 0, ovector, sizeof(ovector) / sizeof(*ovector));
+  if (profiling) {
+    double start = profile_clock();
+    rc = execRegex(buf, buflen, ovector, sizeof(ovector) / sizeof(*ovector));
+    addToProfile(rc, profile_clock() - start);
+  } else {
+    rc = execRegex(buf, buflen, ovector, sizeof(ovector) / sizeof(*ovector));
+  }
   if (rc < 0) {
-#ifdef PCRE_ERROR_MATCHLIMIT  // earlier PCRE versions lack this
-    if (rc == PCRE_ERROR_MATCHLIMIT) {
-      if (o.debugging || o.verbose > 1)
-        error("Warning: Hit PCRE_ERROR_MATCHLIMIT when probing for service %s with the regex '%s'", servicename, matchstr);
-    } else
-#endif // PCRE_ERROR_MATCHLIMIT
-      if (rc != PCRE_ERROR_NOMATCH) {
-        fatal("Unexpected PCRE error (%d) when probing for service %s with the regex '%s'", rc, servicename, matchstr);
-      }
+    reportExecError(rc);
   } else {
     // Yeah!  Match apparently succeeded.
     // Now lets get the version number if available
-    getVersionStr(buf, buflen, ovector, rc, product, sizeof(product), version, sizeof(version), info, sizeof(info),
-                  hostname, sizeof(hostname), ostype, sizeof(ostype), devicetype, sizeof(devicetype),
-                  cpe_a, sizeof(cpe_a), cpe_h, sizeof(cpe_h), cpe_o, sizeof(cpe_o));
-    if (*product) MD_return.product = product;
-    if (*version) MD_return.version = version;
-    if (*info) MD_return.info = info;
-    if (*hostname) MD_return.hostname = hostname;
-    if (*ostype) MD_return.ostype = ostype;
-    if (*devicetype) MD_return.devicetype = devicetype;
-    if (*cpe_a) MD_return.cpe_a = cpe_a;
-    if (*cpe_h) MD_return.cpe_h = cpe_h;
-    if (*cpe_o) MD_return.cpe_o = cpe_o;
+    getVersionStr(buf, buflen, ovector, rc,
+                  result->product, sizeof(result->product),
+                  result->version, sizeof(result->version),
+                  result->info, sizeof(result->info),
+                  result->hostname, sizeof(result->hostname),
+                  result->ostype, sizeof(result->ostype),
+                  result->devicetype, sizeof(result->devicetype),
+                  result->cpe_a, sizeof(result->cpe_a),
+                  result->cpe_h, sizeof(result->cpe_h),
+                  result->cpe_o, sizeof(result->cpe_o));
+    if (*result->product) MD->product = result->product;
+    if (*result->version) MD->version = result->version;
+    if (*result->info) MD->info = result->info;
+    if (*result->hostname) MD->hostname = result->hostname;
+    if (*result->ostype) MD->ostype = result->ostype;
+    if (*result->devicetype) MD->devicetype = result->devicetype;
+    if (*result->cpe_a) MD->cpe_a = result->cpe_a;
+    if (*result->cpe_h) MD->cpe_h = result->cpe_h;
+    if (*result->cpe_o) MD->cpe_o = result->cpe_o;
+
+    MD->serviceName = servicename;
+    MD->lineno = getLineNo();
+  }
+
+  return MD;
+}
+
+int ServiceProbeMatch::execRegex(const u8 *buf, int buflen, int *ovector, int ovecsize) const {
+  assert(isInitialized);
+  assert (matchtype == SERVICEMATCH_REGEX);
+
+  return pcre_exec(regex_compiled, regex_extra, (const char *) buf, buflen, 0, 0, ovector, ovecsize);
+}
+
+void ServiceProbeMatch::reportExecError(int rc) const {
+#ifdef PCRE_ERROR_MATCHLIMIT  // earlier PCRE versions lack this
+  if (rc == PCRE_ERROR_MATCHLIMIT) {
+    if (o.debugging || o.verbose > 1)
+      error("Warning: Hit PCRE_ERROR_MATCHLIMIT when probing for service %s with the regex '%s'", servicename, matchstr);
+  } else
+#endif // PCRE_ERROR_MATCHLIMIT
+    if (rc != PCRE_ERROR_NOMATCH) {
+      fatal("Unexpected PCRE error (%d) when probing for service %s with the regex '%s'", rc, servicename, matchstr);
+    }
+}
+
+void ServiceProbeMatch::addToProfile(int rc, double elapsed) {
+  profile.execs++;
+  if (rc >= 0)
+    profile.hits++;
+#ifdef PCRE_ERROR_MATCHLIMIT
+  else if (rc == PCRE_ERROR_MATCHLIMIT)
+    profile.limits++;
+#endif
+  profile.elapsed += elapsed;
+}
+
+/* The following helpers are used by ServiceProbeMatch::getRequiredLiterals.
+   They know just enough PCRE syntax to step over the items of a regex.
+   Anything they are unsure about is treated as a non-literal item, which
+   only makes the prefilter less selective, never wrong. */
+
+/* Case folding as done by PCRE's default (C locale) tables. */
+static inline u8 fold_case(u8 c) {
+  return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+/* If the item at re[*i] is a single literal byte, stores it in *c, advances
+   *i past it and returns true. */
+static bool regex_literal_byte(const char *re, size_t *i, u8 *c) {
+  const char *p = re + *i;
+  int n, v;
+
+  if (*p == '\\') {
+    p++;
+    switch (*p) {
+    case 'a': *c = '\a'; break;
+    case 'e': *c = 27; break;
+    case 'f': *c = '\f'; break;
+    case 'n': *c = '\n'; break;
+    case 'r': *c = '\r'; break;
+    case 't': *c = '\t'; break;
+    case '0':
+      /* \0 and up to two more octal digits */
+      for (v = 0, n = 1; n < 3 && p[n] >= '0' && p[n] <= '7'; n++)
+        v = v * 8 + p[n] - '0';
+      *c = v;
+      *i += 1 + n;
+      return true;
+    case 'x':
+      /* \xhh with one or two hex digits. \x{...} is not handled. */
+      for (v = 0, n = 1; n < 3 && isxdigit((int) (unsigned char) p[n]); n++)
+        v = v * 16 + (isdigit((int) (unsigned char) p[n]) ? p[n] - '0' : tolower((int) (unsigned char) p[n]) - 'a' + 10);
+      if (n == 1)
+        return false;
+      *c = v;
+      *i += 1 + n;
+      return true;
+    default:
+      /* An escaped non-alphanumeric is always that character. */
+      if (*p == '\0' || isalnum((int) (unsigned char) *p))
+        return false;
+      *c = *p;
+      break;
+    }
+    *i += 2;
+    return true;
+  }
+
+  if (*p == '\0' || strchr("^$.[|()?*+", *p) != NULL)
+    return false;
+  *c = *p;
+  *i += 1;
+  return true;
+}
+
+/* If a quantifier starts at re[i], returns its length (including a lazy or
+   possessive suffix) and stores its minimum repeat count in *min. Returns 0
+   if there is none. A '{' that does not start a valid quantifier is a
+   literal, as in PCRE. */
+static size_t regex_quantifier(const char *re, size_t i, unsigned long *min) {
+  const char *p = re + i;
+  char *end;
+  size_t len;
+
+  switch (*p) {
+  case '?':
+  case '*':
+    *min = 0;
+    len = 1;
+    break;
+  case '+':
+    *min = 1;
+    len = 1;
+    break;
+  case '{':
+    if (!isdigit((int) (unsigned char) p[1]))
+      return 0;
+    *min = strtoul(p + 1, &end, 10);
+    if (*end == ',') {
+      end++;
+      while (isdigit((int) (unsigned char) *end))
+        end++;
+    }
+    if (*end != '}')
+      return 0;
+    len = end + 1 - p;
+    break;
+  default:
+    return 0;
+  }
+  if (p[len] == '?' || p[len] == '+')
+    len++;
+
+  return len;
+}
+
+/* Returns the index just past the character class starting at re[i]. */
+static size_t regex_skip_class(const char *re, size_t i) {
+  size_t j;
+
+  i++;
+  if (re[i] == '^')
+    i++;
+  if (re[i] == ']')
+    i++;
+  while (re[i] != '\0' && re[i] != ']') {
+    if (re[i] == '\\' && re[i + 1] != '\0') {
+      i += 2;
+    } else if (re[i] == '[' && re[i + 1] == ':') {
+      /* A POSIX class like [:alpha:] */
+      for (j = i + 2; isalpha((int) (unsigned char) re[j]); j++)
+        ;
+      if (re[j] == ':' && re[j + 1] == ']')
+        i = j + 2;
+      else
+        i++;
+    } else {
+      i++;
+    }
+  }
+
+  return re[i] == ']' ? i + 1 : i;
+}
+
+/* Returns the index just past the item starting at re[i], for an item that
+   regex_literal_byte did not accept. */
+static size_t regex_skip_item(const char *re, size_t i) {
+  const char *p;
+  int depth;
+
+  switch (re[i]) {
+  case '\\':
+    if (re[i + 1] == '\0')
+      return i + 1;
+    if (strchr("xpPgk", re[i + 1]) != NULL && (re[i + 2] == '{' || re[i + 2] == '<')) {
+      p = strchr(re + i + 3, re[i + 2] == '{' ? '}' : '>');
+      return p ? p - re + 1 : strlen(re);
+    }
+    if (re[i + 1] == 'c' && re[i + 2] != '\0')
+      return i + 3;
+    if (isdigit((int) (unsigned char) re[i + 1])) {
+      /* Back reference (or octal escape) */
+      for (i++; isdigit((int) (unsigned char) re[i]); i++)
+        ;
+      return i;
+    }
+    return i + 2;
+  case '[':
+    return regex_skip_class(re, i);
+  case '(':
+    depth = 0;
+    while (re[i] != '\0') {
+      if (re[i] == '\\') {
+        i += (re[i + 1] != '\0') ? 2 : 1;
+        continue;
+      }
+      if (re[i] == '[') {
+        i = regex_skip_class(re, i);
+        continue;
+      }
+      if (re[i] == '(')
+        depth++;
+      else if (re[i] == ')' && --depth == 0)
+        return i + 1;
+      i++;
+    }
+    return i;
+  default:
+    return i + 1;
+  }
+}
+
+/* Returns false for regexes that use syntax the helpers above do not
+   understand well enough to find required literals: \Q...\E quoting,
+   (?#...) comments, (*VERB)s, and extended mode set by (?x). */
+static bool regex_prefilter_ok(const char *re) {
+  const char *p;
+
+  if (strstr(re, "\\Q") != NULL || strstr(re, "(?#") != NULL || strstr(re, "(*") != NULL)
+    return false;
+  for (p = strstr(re, "(?"); p != NULL; p = strstr(p + 2, "(?")) {
+    const char *q = p + 2;
+    bool extended = false;
+    while (isalpha((int) (unsigned char) *q) || *q == '-') {
+      if (*q == 'x')
+        extended = true;
+      q++;
+    }
+    if (extended && (*q == ')' || *q == ':'))
+      return false;
+  }
+
+  return true;
+}
+
+/* Finds the longest run of literal bytes that every match of the regex
+   branch re[start..end) must contain and stores it in *lit. Returns false
+   if there is no such run. */
+static bool regex_branch_literal(const char *re, size_t start, size_t end,
+                                 MatchLiteral *lit) {
+  std::string run;
+  bool run_anchored = false;
+  unsigned long min;
+  size_t i, qlen;
+  u8 c;
+
+  lit->text.clear();
+  lit->anchored = false;
+  i = start;
+  if (i < end && re[i] == '^') {
+    run_anchored = true;
+    i++;
+  }
+  while (i <= end) {
+    if (i < end && regex_literal_byte(re, &i, &c)) {
+      qlen = regex_quantifier(re, i, &min);
+      if (qlen == 0 || min > 0)
+        run.push_back(fold_case(c));
+      if (qlen == 0)
+        continue;
+      i += qlen;
+      if (min > 0) {
+        /* The last repetition is followed directly by the next item, so a
+           new run can start with it. */
+        if (run.size() > lit->text.size()) {
+          lit->text = run;
+          lit->anchored = run_anchored;
+        }
+        run.assign(1, fold_case(c));
+        run_anchored = false;
+        continue;
+      }
+    } else if (i < end) {
+      i = regex_skip_item(re, i);
+      i += regex_quantifier(re, i, &min);
+    } else {
+      i++;
+    }
+    /* The run is broken here. Keep it if it is the best so far. */
+    if (run.size() > lit->text.size()) {
+      lit->text = run;
+      lit->anchored = run_anchored;
+    }
+    run.clear();
+    run_anchored = false;
+  }
+
+  return !lit->text.empty();
+}
+
+bool ServiceProbeMatch::getRequiredLiterals(std::vector<MatchLiteral> *literals) const {
+  MatchLiteral lit;
+  size_t start, i;
+
+  literals->clear();
+  if (!regex_prefilter_ok(matchstr))
+    return false;
 
-    MD_return.serviceName = servicename;
-    MD_return.lineno = getLineNo();
+  /* Split the regex into its top-level alternatives. */
+  start = i = 0;
+  for (;;) {
+    if (matchstr[i] == '|' || matchstr[i] == '\0') {
+      if (!regex_branch_literal(matchstr, start, i, &lit)) {
+        literals->clear();
+        return false;
+      }
+      literals->push_back(lit);
+      if (matchstr[i] == '\0')
+        break;
+      start = ++i;
+    } else if (matchstr[i] == '\\' || matchstr[i] == '[' || matchstr[i] == '(') {
+      i = regex_skip_item(matchstr, i);
+    } else {
+      i++;
+    }
   }
 
-  return &MD_return;
+  return true;
 }
 
 // This simple function parses arguments out of a string.  The string
@@ -1260,11 +1765,72 @@ void ServiceProbe::addMatch(const char *match, int lineno) {
   matches.push_back(newmatch);
 }
 
+void ServiceProbe::saveToCache(CacheWriter *cache) const {
+  std::vector<ServiceProbeMatch *>::const_iterator vi;
+  unsigned int i;
+
+  cache->putString(probename);
+  cache->putInt(probestringlen);
+  cache->putBytes(probestring, probestringlen);
+  cache->putInt(probeprotocol);
+  cache->putInt(totalwaitms);
+  cache->putInt(tcpwrappedms);
+  cache->putInt(rarity);
+  cache->putU32(probableports.size());
+  for (i = 0; i < probableports.size(); i++)
+    cache->putU32(probableports[i]);
+  cache->putU32(probablesslports.size());
+  for (i = 0; i < probablesslports.size(); i++)
+    cache->putU32(probablesslports[i]);
+  cache->putU32(matches.size());
+  for (vi = matches.begin(); vi != matches.end(); vi++)
+    (*vi)->saveToCache(cache);
+  prefilter.saveToCache(cache);
+}
+
+bool ServiceProbe::loadFromCache(CacheReader *cache) {
+  const u8 *ps;
+  u32 i, n;
+  int len;
+
+  probename = cache->getString();
+  len = cache->getInt();
+  ps = cache->getBytes(len);
+  if (cache->failed() || probename == NULL)
+    return false;
+  setProbeString(ps, len);
+  probeprotocol = cache->getInt();
+  if (probeprotocol != IPPROTO_TCP && probeprotocol != IPPROTO_UDP)
+    return false;
+  totalwaitms = cache->getInt();
+  tcpwrappedms = cache->getInt();
+  rarity = cache->getInt();
+  n = cache->getU32();
+  for (i = 0; i < n && !cache->failed(); i++)
+    probableports.push_back(cache->getU32());
+  n = cache->getU32();
+  for (i = 0; i < n && !cache->failed(); i++)
+    probablesslports.push_back(cache->getU32());
+
+  n = cache->getU32();
+  for (i = 0; i < n && !cache->failed(); i++) {
+    ServiceProbeMatch *newmatch = new ServiceProbeMatch();
+    matches.push_back(newmatch);
+    if (!newmatch->loadFromCache(cache))
+      return false;
+    if (!serviceIsPossible(newmatch->getName()))
+      detectedServices.push_back(newmatch->getName());
+  }
+
+  return prefilter.loadFromCache(cache) && prefilter.numMatches() == matches.size();
+}
+
 /* Parses the given nmap-service-probes file into the AP class Must
    NOT be made static because I have external maintenance tools
    (servicematch) which use this */
 void parse_nmap_service_probe_file(AllProbes *AP, char *filename) {
   ServiceProbe *newProbe = NULL;
+  std::vector<ServiceProbe *>::iterator vi;
   char line[2048];
   int lineno = 0;
   FILE *fp;
@@ -1347,6 +1913,11 @@ void parse_nmap_service_probe_file(AllProbes *AP, char *filename) {
   fclose(fp);
 
   AP->compileFallbacks();
+
+  if (AP->nullProbe)
+    AP->nullProbe->compileMatchPrefilter();
+  for (vi = AP->probes.begin(); vi != AP->probes.end(); vi++)
+    (*vi)->compileMatchPrefilter();
 }
 
 // Parses the nmap-service-probes file, and adds each probe to
@@ -1358,7 +1929,17 @@ static void parse_nmap_service_probes(AllProbes *AP) {
     fatal("Service scan requested but I cannot find nmap-service-probes file.  It should be in %s, ~/.nmap/ or .", NMAPDATADIR);
   }
 
-  parse_nmap_service_probe_file(AP, filename);
+  // Parsing the file and compiling thousands of regexes dominates the
+  // startup of short scans, so --version-cache keeps the result in a binary
+  // cache file.
+  if (o.version_cache != NULL && AP->loadFromCache(o.version_cache, filename)) {
+    if (o.debugging)
+      log_write(LOG_PLAIN, "Loaded %s from cache %s\n", filename, o.version_cache);
+  } else {
+    parse_nmap_service_probe_file(AP, filename);
+    if (o.version_cache != NULL && !AP->saveToCache(o.version_cache, filename))
+      error("WARNING: Unable to write version cache file %s", o.version_cache);
+  }
   /* Record where this data file was found. */
   o.loaded_data_files["nmap-service-probes"] = filename;
 }
@@ -1405,6 +1986,289 @@ int AllProbes::check_excluded_port(unsigned short portno, int proto)
   return excluded;
 }
 
+MatchPrefilter::MatchPrefilter() {
+  nummatches = 0;
+}
+
+void MatchPrefilter::compile(const std::vector<ServiceProbeMatch *> &matches) {
+  std::vector<std::pair<std::string, int> > sorted;
+  std::vector<MatchLiteral> lits;
+  std::vector<MatchLiteral>::const_iterator li;
+  std::vector<int> path, parents, children, queue;
+  std::vector<u8> chars;
+  unsigned int m, q, k, l;
+
+  nodes.clear();
+  edge_chars.clear();
+  edge_next.clear();
+  literals.clear();
+  always.clear();
+  nummatches = matches.size();
+
+  for (m = 0; m < matches.size(); m++) {
+    if (!matches[m]->getRequiredLiterals(&lits)) {
+      always.push_back(m);
+      continue;
+    }
+    for (li = lits.begin(); li != lits.end(); li++) {
+      Literal lit;
+
+      lit.match = m;
+      lit.len = li->text.size();
+      lit.anchored = li->anchored;
+      lit.next = -1;
+      sorted.push_back(std::make_pair(li->text, (int) literals.size()));
+      literals.push_back(lit);
+    }
+  }
+
+  /* Build the trie from the sorted literals.  Each literal shares a path
+     with its predecessor up to their common prefix, so only the rest needs
+     new nodes, and each node gets its children in increasing order.  The
+     edges are recorded as (parent, label, child) as they are made. */
+  std::sort(sorted.begin(), sorted.end());
+  nodes.push_back(Node());
+  nodes[0].output = -1;
+  path.push_back(0);
+  for (k = 0; k < sorted.size(); k++) {
+    const std::string &text = sorted[k].first;
+
+    l = 0;
+    if (k > 0) {
+      const std::string &prev = sorted[k - 1].first;
+      while (l < text.size() && l < prev.size() && text[l] == prev[l])
+        l++;
+    }
+    path.resize(l + 1);
+    for (; l < text.size(); l++) {
+      parents.push_back(path[l]);
+      chars.push_back(text[l]);
+      children.push_back(nodes.size());
+      path.push_back(nodes.size());
+      nodes.push_back(Node());
+      nodes.back().output = -1;
+    }
+    literals[sorted[k].second].next = nodes[path.back()].output;
+    nodes[path.back()].output = sorted[k].second;
+  }
+
+  /* Group the edges by parent with a counting sort, which keeps each
+     node's edges in label order. */
+  for (k = 0; k < nodes.size(); k++)
+    nodes[k].edges_count = 0;
+  for (k = 0; k < parents.size(); k++)
+    nodes[parents[k]].edges_count++;
+  l = 0;
+  for (k = 0; k < nodes.size(); k++) {
+    nodes[k].edges_start = l;
+    l += nodes[k].edges_count;
+    nodes[k].edges_count = 0;
+  }
+  edge_chars.resize(parents.size());
+  edge_next.resize(parents.size());
+  for (k = 0; k < parents.size(); k++) {
+    Node &parent = nodes[parents[k]];
+    edge_chars[parent.edges_start + parent.edges_count] = chars[k];
+    edge_next[parent.edges_start + parent.edges_count] = children[k];
+    parent.edges_count++;
+  }
+
+  /* Compute failure and dictionary links breadth first, so that the links
+     of shallower nodes are ready when deeper nodes need them. */
+  nodes[0].fail = 0;
+  nodes[0].dictlink = 0;
+  queue.push_back(0);
+  for (q = 0; q < queue.size(); q++) {
+    const Node &u = nodes[queue[q]];
+
+    for (k = u.edges_start; k < u.edges_start + u.edges_count; k++) {
+      int v = edge_next[k];
+      int f = (queue[q] == 0) ? 0 : step(u.fail, edge_chars[k]);
+
+      nodes[v].fail = f;
+      nodes[v].dictlink = (nodes[f].output == -1) ? nodes[f].dictlink : f;
+      queue.push_back(v);
+    }
+  }
+
+  for (k = 0; k < 256; k++)
+    root_next[k] = step(0, k);
+}
+
+/* Follows the goto function from state on byte c, falling back along the
+   failure links when there is no edge. */
+int MatchPrefilter::step(int state, u8 c) const {
+  for (;;) {
+    const Node &node = nodes[state];
+    unsigned int lo = node.edges_start, hi = node.edges_start + node.edges_count;
+
+    while (lo < hi) {
+      unsigned int mid = (lo + hi) / 2;
+      if (edge_chars[mid] < c)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo < node.edges_start + node.edges_count && edge_chars[lo] == c)
+      return edge_next[lo];
+    if (state == 0)
+      return 0;
+    state = node.fail;
+  }
+}
+
+void MatchPrefilter::getCandidates(const u8 *buf, int buflen,
+                                   std::vector<bool> *candidates) const {
+  std::vector<int>::const_iterator ai;
+  int i, n, lit_idx, state;
+
+  candidates->assign(nummatches, false);
+  for (ai = always.begin(); ai != always.end(); ai++)
+    (*candidates)[*ai] = true;
+  if (literals.empty())
+    return;
+
+  state = 0;
+  for (i = 0; i < buflen; i++) {
+    u8 c = fold_case(buf[i]);
+
+    state = (state == 0) ? root_next[c] : step(state, c);
+    for (n = state; n != 0; n = nodes[n].dictlink) {
+      for (lit_idx = nodes[n].output; lit_idx != -1; lit_idx = literals[lit_idx].next) {
+        const Literal &lit = literals[lit_idx];
+        if (!lit.anchored || (unsigned int) i + 1 == lit.len)
+          (*candidates)[lit.match] = true;
+      }
+    }
+  }
+}
+
+/* The node, edge and literal arrays are written out whole. */
+void MatchPrefilter::saveToCache(CacheWriter *cache) const {
+  std::vector<int>::const_iterator ii;
+  unsigned int k;
+
+  cache->putU32(nummatches);
+  for (k = 0; k < 256; k++)
+    cache->putInt(root_next[k]);
+  cache->putU32(nodes.size());
+  cache->putBytes(&nodes[0], nodes.size() * sizeof(Node));
+  cache->putU32(edge_chars.size());
+  if (!edge_chars.empty()) {
+    cache->putBytes(&edge_next[0], edge_next.size() * sizeof(int));
+    cache->putBytes(&edge_chars[0], edge_chars.size());
+  }
+  cache->putU32(literals.size());
+  if (!literals.empty())
+    cache->putBytes(&literals[0], literals.size() * sizeof(Literal));
+  cache->putU32(always.size());
+  for (ii = always.begin(); ii != always.end(); ii++)
+    cache->putInt(*ii);
+}
+
+bool MatchPrefilter::loadFromCache(CacheReader *cache) {
+  const u8 *p;
+  unsigned int k, n;
+
+  nummatches = cache->getU32();
+  for (k = 0; k < 256; k++)
+    root_next[k] = cache->getInt();
+  n = cache->getU32();
+  if (n == 0 || n > 0x7fffffff / sizeof(Node)
+      || (p = cache->getBytes(n * sizeof(Node))) == NULL)
+    return false;
+  nodes.resize(n);
+  memcpy(&nodes[0], p, n * sizeof(Node));
+  n = cache->getU32();
+  if (n > 0) {
+    if (n > 0x7fffffff / sizeof(int)
+        || (p = cache->getBytes(n * sizeof(int))) == NULL)
+      return false;
+    edge_next.resize(n);
+    memcpy(&edge_next[0], p, n * sizeof(int));
+    if ((p = cache->getBytes(n)) == NULL)
+      return false;
+    edge_chars.assign(p, p + n);
+  }
+  n = cache->getU32();
+  if (n > 0) {
+    if (n > 0x7fffffff / sizeof(Literal)
+        || (p = cache->getBytes(n * sizeof(Literal))) == NULL)
+      return false;
+    literals.resize(n);
+    memcpy(&literals[0], p, n * sizeof(Literal));
+  }
+  n = cache->getU32();
+  for (k = 0; k < n && !cache->failed(); k++)
+    always.push_back(cache->getInt());
+
+  return !cache->failed() && isConsistent();
+}
+
+/* Checks an automaton read from a cache, so that a damaged file cannot send
+   getCandidates() out of bounds or around a loop. Every index must be in
+   range, every edge must lead to a later node (as compile() numbers them),
+   failure and dictionary links must lead to shallower nodes, and each
+   literal must be on exactly one node's output list. */
+bool MatchPrefilter::isConsistent() const {
+  std::vector<unsigned int> depth;
+  std::vector<bool> seen;
+  std::vector<int>::const_iterator ai;
+  unsigned int k, i, n;
+  int lit_idx;
+
+  n = nodes.size();
+  for (k = 0; k < 256; k++) {
+    if (root_next[k] < 0 || (unsigned int) root_next[k] >= n)
+      return false;
+  }
+
+  /* A node's parent comes before it, so its depth is known when its own
+     edges are reached. */
+  depth.assign(n, 0);
+  for (k = 0; k < n; k++) {
+    const Node &node = nodes[k];
+
+    if (node.edges_start > edge_next.size()
+        || node.edges_count > edge_next.size() - node.edges_start)
+      return false;
+    for (i = node.edges_start; i < node.edges_start + node.edges_count; i++) {
+      if (edge_next[i] <= (int) k || (unsigned int) edge_next[i] >= n)
+        return false;
+      depth[edge_next[i]] = depth[k] + 1;
+    }
+  }
+
+  seen.assign(literals.size(), false);
+  for (k = 0; k < n; k++) {
+    const Node &node = nodes[k];
+
+    if (k > 0) {
+      if (node.fail < 0 || (unsigned int) node.fail >= n
+          || depth[node.fail] >= depth[k])
+        return false;
+      if (node.dictlink < 0 || (unsigned int) node.dictlink >= n
+          || depth[node.dictlink] >= depth[k])
+        return false;
+    }
+    for (lit_idx = node.output; lit_idx != -1; lit_idx = literals[lit_idx].next) {
+      if (lit_idx < 0 || (unsigned int) lit_idx >= literals.size() || seen[lit_idx])
+        return false;
+      seen[lit_idx] = true;
+      if (literals[lit_idx].match < 0
+          || (unsigned int) literals[lit_idx].match >= nummatches)
+        return false;
+    }
+  }
+
+  for (ai = always.begin(); ai != always.end(); ai++) {
+    if (*ai < 0 || (unsigned int) *ai >= nummatches)
+      return false;
+  }
+
+  return true;
+}
+
 // If the buf (of length buflen) matches one of the regexes in this
 // ServiceProbe, returns the details of nth match (service name,
 // version number if applicable, and whether this is a "soft" match.
@@ -1415,11 +2279,27 @@ int AllProbes::check_excluded_port(unsigned short portno, int proto)
 // no version matched, that field will be NULL. This function may
 // return NULL if there are no match lines at all in this probe.
 const struct MatchDetails *ServiceProbe::testMatch(const u8 *buf, int buflen, int n = 0) {
+  static struct MatchResult result;
+
+  return testMatch(buf, buflen, n, &result);
+}
+
+const struct MatchDetails *ServiceProbe::testMatch(const u8 *buf, int buflen, int n,
+                                                   struct MatchResult *result) {
   std::vector<ServiceProbeMatch *>::iterator vi;
+  std::vector<bool> candidates;
   const struct MatchDetails *MD;
+  unsigned int i;
 
-  for(vi = matches.begin(); vi != matches.end(); vi++) {
-    MD = (*vi)->testMatch(buf, buflen);
+  // Only run the regexes that the prefilter cannot rule out.
+  if (prefilter.numMatches() != matches.size())
+    prefilter.compile(matches);
+  prefilter.getCandidates(buf, buflen, &candidates);
+
+  for(vi = matches.begin(), i = 0; vi != matches.end(); vi++, i++) {
+    if (!candidates[i])
+      continue;
+    MD = (*vi)->testMatch(buf, buflen, result);
     if (MD->serviceName) {
       if (n == 0)
         return MD;
@@ -1430,6 +2310,38 @@ const struct MatchDetails *ServiceProbe::testMatch(const u8 *buf, int buflen, in
   return NULL;
 }
 
+ServiceProbeMatch *ServiceProbe::findMatch(const u8 *buf, int buflen,
+                                           std::vector<struct RegexRun> *runs) const {
+  std::vector<bool> candidates;
+  struct RegexRun run;
+  double start = 0;
+  int ovector[150];
+  unsigned int i;
+  int rc;
+
+  assert(prefilter.numMatches() == matches.size());
+  prefilter.getCandidates(buf, buflen, &candidates);
+
+  for (i = 0; i < matches.size(); i++) {
+    if (!candidates[i])
+      continue;
+    if (ServiceProbeMatch::profiling)
+      start = profile_clock();
+    rc = matches[i]->execRegex(buf, buflen, ovector, sizeof(ovector) / sizeof(*ovector));
+    // A successful match is rerun (and profiled) by testMatch.
+    if (rc >= 0)
+      return matches[i];
+    if (rc != PCRE_ERROR_NOMATCH || ServiceProbeMatch::profiling) {
+      run.match = matches[i];
+      run.rc = rc;
+      run.elapsed = ServiceProbeMatch::profiling ? profile_clock() - start : 0;
+      runs->push_back(run);
+    }
+  }
+
+  return NULL;
+}
+
 AllProbes::AllProbes() {
   nullProbe = NULL;
   excluded_seen = false;
@@ -1465,6 +2377,127 @@ ServiceProbe *AllProbes::getProbeByName(const char *name, int proto) {
   return NULL;
 }
 
+/* Everything besides nmap-service-probes itself that a cache of it depends
+   on. The compiled regexes may only be loaded by the same libpcre. */
+static void service_probes_cache_tag(char *buf, size_t buflen) {
+  int linksize = 0;
+
+  pcre_config(PCRE_CONFIG_LINK_SIZE, &linksize);
+  Snprintf(buf, buflen, "nmap-service-probes %s pcre %s/%d", NMAP_VERSION,
+           pcre_version(), linksize);
+}
+
+static void cache_put_ports(CacheWriter *cache, const unsigned short *ports, int count) {
+  cache->putInt(count);
+  cache->putBytes(ports, count * sizeof(*ports));
+}
+
+static void cache_get_ports(CacheReader *cache, unsigned short **ports, int *count) {
+  const u8 *p;
+
+  *count = cache->getInt();
+  p = cache->getBytes(*count * sizeof(**ports));
+  if (p == NULL || *count <= 0) {
+    *count = 0;
+    return;
+  }
+  *ports = (unsigned short *) safe_malloc(*count * sizeof(**ports));
+  memcpy(*ports, p, *count * sizeof(**ports));
+}
+
+bool AllProbes::saveToCache(const char *cachefile, const char *srcfile) const {
+  CacheWriter cache;
+  std::vector<ServiceProbe *> all;
+  std::vector<ServiceProbe *>::iterator vi;
+  char tag[128];
+  int i;
+
+  cache.putInt(excluded_seen);
+  cache_put_ports(&cache, excludedports.tcp_ports, excludedports.tcp_count);
+  cache_put_ports(&cache, excludedports.udp_ports, excludedports.udp_count);
+  cache_put_ports(&cache, excludedports.sctp_ports, excludedports.sctp_count);
+  cache_put_ports(&cache, excludedports.prots, excludedports.prot_count);
+
+  // The NULL probe (if any) goes first, and fallbacks refer to probes by
+  // their index in this list.
+  if (nullProbe != NULL)
+    all.push_back(nullProbe);
+  all.insert(all.end(), probes.begin(), probes.end());
+  cache.putInt(nullProbe != NULL);
+  cache.putU32(all.size());
+  for (vi = all.begin(); vi != all.end(); vi++)
+    (*vi)->saveToCache(&cache);
+  for (vi = all.begin(); vi != all.end(); vi++) {
+    assert((*vi)->fallbackStr == NULL);
+    for (i = 0; i <= MAXFALLBACKS && (*vi)->fallbacks[i] != NULL; i++)
+      cache.putInt(std::find(all.begin(), all.end(), (*vi)->fallbacks[i]) - all.begin());
+    cache.putInt(-1);
+  }
+
+  service_probes_cache_tag(tag, sizeof(tag));
+  return cache.save(cachefile, srcfile, tag);
+}
+
+bool AllProbes::loadFromCache(const char *cachefile, const char *srcfile) {
+  CacheReader cache;
+  std::vector<ServiceProbe *> all;
+  std::vector<ServiceProbe *>::iterator vi;
+  ServiceProbe *probe;
+  char tag[128];
+  bool hasnull, ok;
+  u32 n, i;
+  int j, index;
+
+  assert(nullProbe == NULL && probes.empty());
+  service_probes_cache_tag(tag, sizeof(tag));
+  if (!cache.open(cachefile, srcfile, tag))
+    return false;
+
+  excluded_seen = cache.getInt();
+  cache_get_ports(&cache, &excludedports.tcp_ports, &excludedports.tcp_count);
+  cache_get_ports(&cache, &excludedports.udp_ports, &excludedports.udp_count);
+  cache_get_ports(&cache, &excludedports.sctp_ports, &excludedports.sctp_count);
+  cache_get_ports(&cache, &excludedports.prots, &excludedports.prot_count);
+
+  hasnull = cache.getInt();
+  n = cache.getU32();
+  ok = !cache.failed() && (!hasnull || n > 0);
+  for (i = 0; ok && i < n; i++) {
+    probe = new ServiceProbe();
+    all.push_back(probe);
+    ok = probe->loadFromCache(&cache) && probe->isNullProbe() == (hasnull && i == 0);
+  }
+  for (vi = all.begin(); ok && vi != all.end(); vi++) {
+    for (j = 0; ok; j++) {
+      index = cache.getInt();
+      if (index == -1 || cache.failed())
+        break;
+      if (j >= MAXFALLBACKS || index < 0 || (u32) index >= n)
+        ok = false;
+      else
+        (*vi)->fallbacks[j] = all[index];
+    }
+  }
+  ok = ok && !cache.failed() && cache.atEnd();
+
+  if (!ok) {
+    for (vi = all.begin(); vi != all.end(); vi++)
+      delete *vi;
+    free_scan_lists(&excludedports);
+    memset(&excludedports, 0, sizeof(excludedports));
+    excluded_seen = false;
+    return false;
+  }
+
+  if (hasnull) {
+    nullProbe = all[0];
+    all.erase(all.begin());
+  }
+  probes = all;
+
+  return true;
+}
+
 
 
 // Returns nonzero if port was specified in the excludeports
@@ -1873,7 +2906,7 @@ u8 *ServiceNFO::getcurrentproberesponse(int *respstrlen) {
 }
 
 
-ServiceGroup::ServiceGroup(std::vector<Target *> &Targets, AllProbes *AP) {
+ServiceGroup::ServiceGroup(std::vector<Target *> &Targets, AllProbes *AP, bool meter) {
   unsigned int targetno;
   ServiceNFO *svc;
   Port *nxtport;
@@ -1881,6 +2914,12 @@ ServiceGroup::ServiceGroup(std::vector<Target *> &Targets, AllProbes *AP) {
   int desired_par;
   struct timeval now;
   num_hosts_timedout = 0;
+  match_threads = NULL;
+#ifdef HAVE_PTHREAD
+  shards = NULL;
+  shard = -1;
+  progress = NULL;
+#endif
   gettimeofday(&now, NULL);
 
   for(targetno = 0 ; targetno < Targets.size(); targetno++) {
@@ -1915,7 +2954,7 @@ ServiceGroup::ServiceGroup(std::vector<Target *> &Targets, AllProbes *AP) {
     }
   }
 
-  SPM = new ScanProgressMeter("Service scan");
+  SPM = meter ? new ScanProgressMeter("Service scan") : NULL;
   desired_par = 1;
   if (o.timing_level == 3) desired_par = 20;
   if (o.timing_level == 4) desired_par = 30;
@@ -2127,6 +3166,17 @@ static int scanThroughTunnel(nsock_pool nsp, nsock_iod nsi, ServiceGroup *SG,
 
 /* Prints completion estimates and the like when appropriate */
 static void considerPrintingStats(nsock_pool nsp, ServiceGroup *SG) {
+#ifdef HAVE_PTHREAD
+  /* The shards of a sharded scan only count what they finish; the main thread
+     prints the progress of all of them together. */
+  if (SG->progress) {
+    pthread_mutex_lock(&SG->progress->lock);
+    SG->progress->finished++;
+    pthread_mutex_unlock(&SG->progress->lock);
+    return;
+  }
+#endif
+
    /* Check for status requests */
    if (keyWasPressed()) {
       nmap_adjust_loglevel(o.versionTrace());
@@ -2204,6 +3254,13 @@ static void end_svcprobe(nsock_pool nsp, enum serviceprobestate probe_state, Ser
     nsock_iod_delete(nsi, NSOCK_PENDING_SILENT);
 
   handleHostIfDone(SG, target);
+
+#ifdef HAVE_PTHREAD
+  /* The wakeup read of a shard keeps its nsock loop alive, so the last service
+     of the group has to end the loop itself. */
+  if (SG->shards && SG->services_remaining.empty() && SG->services_in_progress.empty())
+    SG->shards->stop(SG->shard);
+#endif
   return;
 }
 
@@ -2353,8 +3410,9 @@ static void servicescan_write_handler(nsock_pool nsp, nsock_event nse, void *myd
   SG = (ServiceGroup *) nsock_pool_get_udata(nsp);
   nsi = nse_iod(nse);
 
-  // Check if a status message was requested
-  if (keyWasPressed()) {
+  // Check if a status message was requested. The shards of a sharded scan
+  // have no meter; the main thread watches the keyboard for them.
+  if (SG->SPM && keyWasPressed()) {
      SG->SPM->printStats(SG->services_finished.size() /
                          ((double)SG->services_remaining.size() + SG->services_in_progress.size() +
                           SG->services_finished.size()), nsock_gettimeofday());
@@ -2393,6 +3451,307 @@ static void servicescan_write_handler(nsock_pool nsp, nsock_event nse, void *myd
   return;
 }
 
+// Acts on the result of matching the response received so far for the
+// current probe: records a match, or reads more / moves on to the next
+// probe if there was none (or only a soft one).  MD is NULL or the
+// result of testMatch for probe->fallbacks[fallbackDepth].
+static void processProbeMatch(nsock_pool nsp, nsock_iod nsi, ServiceGroup *SG,
+                              ServiceNFO *svc, ServiceProbe *probe,
+                              const struct MatchDetails *MD, int fallbackDepth) {
+  const u8 *readstr;
+  int readstrlen;
+
+  readstr = svc->getcurrentproberesponse(&readstrlen);
+
+  if (MD && MD->serviceName) {
+    // WOO HOO!!!!!!  MATCHED!  But might be soft
+    if (MD->isSoft && svc->probe_matched) {
+      if (strcmp(svc->probe_matched, MD->serviceName) != 0)
+        error("WARNING: Service %s:%hu had already soft-matched %s, but now soft-matched %s; ignoring second value", svc->target->targetipstr(), svc->portno, svc->probe_matched, MD->serviceName);
+      // No error if its the same - that happens frequently.  For
+      // example, if we read more data for the same probe response
+      // it will probably still match.
+    } else {
+      if (o.debugging > 1 || o.versionTrace()) {
+        if (MD->product || MD->version || MD->info)
+          log_write(LOG_PLAIN, "Service scan match (Probe %s matched with %s line %d): %s:%hu is %s%s.  Version: |%s|%s|%s|\n",
+                    probe->getName(), (*probe->fallbacks[fallbackDepth]).getName(),
+                    MD->lineno,
+                    svc->target->targetipstr(), svc->portno, (svc->tunnel == SERVICE_TUNNEL_SSL)? "SSL/" : "",
+                    MD->serviceName, (MD->product)? MD->product : "", (MD->version)? MD->version : "",
+                    (MD->info)? MD->info : "");
+        else
+          log_write(LOG_PLAIN, "Service scan %s match (Probe %s matched with %s line %d): %s:%hu is %s%s\n",
+                    (MD->isSoft)? "soft" : "hard",
+                    probe->getName(), (*probe->fallbacks[fallbackDepth]).getName(),
+                    MD->lineno,
+                    svc->target->targetipstr(), svc->portno, (svc->tunnel == SERVICE_TUNNEL_SSL)? "SSL/" : "", MD->serviceName);
+      }
+      svc->probe_matched = MD->serviceName;
+      if (MD->product)
+        Strncpy(svc->product_matched, MD->product, sizeof(svc->product_matched));
+      if (MD->version)
+        Strncpy(svc->version_matched, MD->version, sizeof(svc->version_matched));
+      if (MD->info)
+        Strncpy(svc->extrainfo_matched, MD->info, sizeof(svc->extrainfo_matched));
+      if (MD->hostname)
+        Strncpy(svc->hostname_matched, MD->hostname, sizeof(svc->hostname_matched));
+      if (MD->ostype)
+        Strncpy(svc->ostype_matched, MD->ostype, sizeof(svc->ostype_matched));
+      if (MD->devicetype)
+        Strncpy(svc->devicetype_matched, MD->devicetype, sizeof(svc->devicetype_matched));
+      if (MD->cpe_a)
+        Strncpy(svc->cpe_a_matched, MD->cpe_a, sizeof(svc->cpe_a_matched));
+      if (MD->cpe_h)
+        Strncpy(svc->cpe_h_matched, MD->cpe_h, sizeof(svc->cpe_h_matched));
+      if (MD->cpe_o)
+        Strncpy(svc->cpe_o_matched, MD->cpe_o, sizeof(svc->cpe_o_matched));
+      svc->softMatchFound = MD->isSoft;
+      if (!svc->softMatchFound) {
+        // We might be able to continue scan through a tunnel protocol
+        // like SSL
+        if (scanThroughTunnel(nsp, nsi, SG, svc) == 0)
+          end_svcprobe(nsp, PROBESTATE_FINISHED_HARDMATCHED, SG, svc, nsi);
+      }
+    }
+  }
+
+  if (!MD || !MD->serviceName || MD->isSoft) {
+    // Didn't match... maybe reading more until timeout will help
+    // TODO: For efficiency I should be able to test if enough data
+    // has been received rather than always waiting for the reading
+    // to timeout.  For now I'll limit it to 4096 bytes just to
+    // avoid reading megs from services like chargen.  But better
+    // approach is needed.
+    if (svc->probe_timemsleft(probe) > 0 && readstrlen < 4096) {
+      nsock_read(nsp, nsi, servicescan_read_handler, svc->probe_timemsleft(probe), svc);
+    } else {
+      // Failed -- lets go to the next probe.
+      if (readstrlen > 0)
+        svc->addToServiceFingerprint(probe->getName(), readstr, readstrlen);
+      startNextProbe(nsp, nsi, SG, svc, false);
+    }
+  }
+}
+
+#ifdef HAVE_PTHREAD
+// A response handed to MatchThreads.  The response itself is not copied: it
+// stays in svc, which the main thread leaves alone (no nsock events are
+// pending on it) until the job has been finished.
+struct MatchJob {
+  ServiceNFO *svc;
+  nsock_iod nsi;
+  ServiceProbe *probe;
+  const u8 *response;
+  int responselen;
+  // Filled in by a worker thread
+  ServiceProbeMatch *match; // First match found, or NULL
+  int fallbackDepth; // Index of the fallback probe that match belongs to
+  std::vector<struct RegexRun> runs; // Failed runs to report and profile
+  // Filled in by the main thread
+  struct MatchResult result;
+};
+
+// A pool of threads that run the regexes of nmap-service-probes against
+// responses while the main thread keeps the nsock loop going
+// (--version-threads).  Workers announce finished jobs by writing to a pipe
+// that the nsock pool reads, so results are picked up by the loop like any
+// other event.  Everything other than the regex matching, including all
+// output, still happens in the main thread.
+class MatchThreads {
+public:
+  MatchThreads(nsock_pool nsp, int numthreads);
+  ~MatchThreads();
+  // Queues matching of the current response of svc to probe.
+  void submit(ServiceNFO *svc, nsock_iod nsi, ServiceProbe *probe);
+
+private:
+  static void *worker(void *arg);
+  static void runJob(MatchJob *job);
+  static void finishJob(nsock_pool nsp, MatchJob *job);
+  static void notify_handler(nsock_pool nsp, nsock_event nse, void *mydata);
+  // Makes sure the pipe is being read while jobs are outstanding.
+  void watch();
+
+  nsock_pool nsp;
+  nsock_iod notify_iod;
+  int notify_fds[2];
+  bool watching; // Is a read pending on notify_iod?
+  unsigned int outstanding; // Jobs submitted but not yet finished
+  bool stopping;
+  std::list<MatchJob *> pending; // Waiting for a worker
+  std::list<MatchJob *> done; // Matched, waiting for the main thread
+  std::vector<pthread_t> threads;
+  pthread_mutex_t lock; // Protects pending, done and stopping
+  pthread_cond_t cond; // Signaled when pending or stopping change
+};
+
+MatchThreads::MatchThreads(nsock_pool nsp, int numthreads) {
+  pthread_t thread;
+  int i;
+
+  this->nsp = nsp;
+  watching = false;
+  outstanding = 0;
+  stopping = false;
+
+  if (pipe(notify_fds) == -1)
+    pfatal("%s: pipe() failed", __func__);
+  // A full pipe already guarantees a wakeup, so workers never block on it.
+  unblock_socket(notify_fds[1]);
+  notify_iod = nsock_iod_new2(nsp, notify_fds[0], this);
+  if (notify_iod == NULL)
+    fatal("Failed to allocate nsock iod in %s", __func__);
+
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&cond, NULL);
+  for (i = 0; i < numthreads; i++) {
+    if (pthread_create(&thread, NULL, worker, this) != 0)
+      fatal("%s: failed to create version matching thread", __func__);
+    threads.push_back(thread);
+  }
+}
+
+MatchThreads::~MatchThreads() {
+  std::list<MatchJob *>::iterator it;
+  unsigned int i;
+
+  pthread_mutex_lock(&lock);
+  stopping = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&lock);
+  for (i = 0; i < threads.size(); i++)
+    pthread_join(threads[i], NULL);
+
+  for (it = pending.begin(); it != pending.end(); it++)
+    delete *it;
+  for (it = done.begin(); it != done.end(); it++)
+    delete *it;
+
+  nsock_iod_delete(notify_iod, NSOCK_PENDING_SILENT);
+  close(notify_fds[0]);
+  close(notify_fds[1]);
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&lock);
+}
+
+void MatchThreads::submit(ServiceNFO *svc, nsock_iod nsi, ServiceProbe *probe) {
+  MatchJob *job = new MatchJob;
+
+  job->svc = svc;
+  job->nsi = nsi;
+  job->probe = probe;
+  job->response = svc->getcurrentproberesponse(&job->responselen);
+  job->match = NULL;
+  job->fallbackDepth = 0;
+
+  pthread_mutex_lock(&lock);
+  pending.push_back(job);
+  pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&lock);
+
+  outstanding++;
+  watch();
+}
+
+void MatchThreads::watch() {
+  if (!watching && outstanding > 0) {
+    nsock_read(nsp, notify_iod, notify_handler, -1, this);
+    watching = true;
+  }
+}
+
+void *MatchThreads::worker(void *arg) {
+  MatchThreads *MT = (MatchThreads *) arg;
+  MatchJob *job;
+  char c = 0;
+
+  pthread_mutex_lock(&MT->lock);
+  for (;;) {
+    while (MT->pending.empty() && !MT->stopping)
+      pthread_cond_wait(&MT->cond, &MT->lock);
+    if (MT->pending.empty())
+      break;
+    job = MT->pending.front();
+    MT->pending.pop_front();
+    pthread_mutex_unlock(&MT->lock);
+
+    runJob(job);
+
+    pthread_mutex_lock(&MT->lock);
+    MT->done.push_back(job);
+    if (write(MT->notify_fds[1], &c, 1) == -1) {
+      // EAGAIN: the main thread has plenty of wakeups waiting already.
+    }
+  }
+  pthread_mutex_unlock(&MT->lock);
+
+  return NULL;
+}
+
+// Does the same search as the fallback loop in servicescan_read_handler,
+// but only finds out which match (if any) succeeds.
+void MatchThreads::runJob(MatchJob *job) {
+  ServiceProbe **fallbacks = job->probe->fallbacks;
+
+  for (job->fallbackDepth = 0; fallbacks[job->fallbackDepth] != NULL; job->fallbackDepth++) {
+    job->match = fallbacks[job->fallbackDepth]->findMatch(job->response,
+        job->responselen, &job->runs);
+    if (job->match)
+      break;
+  }
+}
+
+void MatchThreads::finishJob(nsock_pool nsp, MatchJob *job) {
+  ServiceGroup *SG = (ServiceGroup *) nsock_pool_get_udata(nsp);
+  ServiceNFO *svc = job->svc;
+  const struct MatchDetails *MD = NULL;
+  std::vector<struct RegexRun>::iterator it;
+
+  for (it = job->runs.begin(); it != job->runs.end(); it++) {
+    it->match->reportExecError(it->rc);
+    if (ServiceProbeMatch::profiling)
+      it->match->addToProfile(it->rc, it->elapsed);
+  }
+
+  if (svc->target->timedOut(nsock_gettimeofday())) {
+    end_svcprobe(nsp, PROBESTATE_INCOMPLETE, SG, svc, job->nsi);
+    return;
+  }
+
+  // Rerun the one successful regex to fill in the version templates.
+  if (job->match)
+    MD = job->match->testMatch(job->response, job->responselen, &job->result);
+  processProbeMatch(nsp, job->nsi, SG, svc, job->probe, MD, job->fallbackDepth);
+}
+
+void MatchThreads::notify_handler(nsock_pool nsp, nsock_event nse, void *mydata) {
+  MatchThreads *MT = (MatchThreads *) mydata;
+  ServiceGroup *SG = (ServiceGroup *) nsock_pool_get_udata(nsp);
+  std::list<MatchJob *> finished;
+  std::list<MatchJob *>::iterator it;
+
+  assert(nse_type(nse) == NSE_TYPE_READ);
+  if (nse_status(nse) != NSE_STATUS_SUCCESS)
+    fatal("Unexpected status (%s) reading from version matching threads", nse_status2str(nse_status(nse)));
+  MT->watching = false;
+
+  pthread_mutex_lock(&MT->lock);
+  finished.swap(MT->done);
+  pthread_mutex_unlock(&MT->lock);
+
+  for (it = finished.begin(); it != finished.end(); it++) {
+    finishJob(nsp, *it);
+    delete *it;
+    MT->outstanding--;
+  }
+
+  MT->watch();
+  // We may have room for more probes!
+  launchSomeServiceProbes(nsp, SG);
+}
+#endif
+
 static void servicescan_read_handler(nsock_pool nsp, nsock_event nse, void *mydata) {
   nsock_iod nsi = nse_iod(nse);
   enum nse_status status = nse_status(nse);
@@ -2419,79 +3778,18 @@ static void servicescan_read_handler(nsock_pool nsp, nsock_event nse, void *myda
     // now get the full version
     readstr = svc->getcurrentproberesponse(&readstrlen);
 
-    for (MD = NULL; probe->fallbacks[fallbackDepth] != NULL; fallbackDepth++) {
-      MD = (probe->fallbacks[fallbackDepth])->testMatch(readstr, readstrlen);
-      if (MD && MD->serviceName) break; // Found one!
-    }
-
-    if (MD && MD->serviceName) {
-      // WOO HOO!!!!!!  MATCHED!  But might be soft
-      if (MD->isSoft && svc->probe_matched) {
-        if (strcmp(svc->probe_matched, MD->serviceName) != 0)
-          error("WARNING: Service %s:%hu had already soft-matched %s, but now soft-matched %s; ignoring second value", svc->target->targetipstr(), svc->portno, svc->probe_matched, MD->serviceName);
-        // No error if its the same - that happens frequently.  For
-        // example, if we read more data for the same probe response
-        // it will probably still match.
-      } else {
-        if (o.debugging > 1 || o.versionTrace()) {
-          if (MD->product || MD->version || MD->info)
-            log_write(LOG_PLAIN, "Service scan match (Probe %s matched with %s line %d): %s:%hu is %s%s.  Version: |%s|%s|%s|\n",
-                      probe->getName(), (*probe->fallbacks[fallbackDepth]).getName(),
-                      MD->lineno,
-                      svc->target->targetipstr(), svc->portno, (svc->tunnel == SERVICE_TUNNEL_SSL)? "SSL/" : "",
-                      MD->serviceName, (MD->product)? MD->product : "", (MD->version)? MD->version : "",
-                      (MD->info)? MD->info : "");
-          else
-            log_write(LOG_PLAIN, "Service scan %s match (Probe %s matched with %s line %d): %s:%hu is %s%s\n",
-                      (MD->isSoft)? "soft" : "hard",
-                      probe->getName(), (*probe->fallbacks[fallbackDepth]).getName(),
-                      MD->lineno,
-                      svc->target->targetipstr(), svc->portno, (svc->tunnel == SERVICE_TUNNEL_SSL)? "SSL/" : "", MD->serviceName);
-        }
-        svc->probe_matched = MD->serviceName;
-        if (MD->product)
-          Strncpy(svc->product_matched, MD->product, sizeof(svc->product_matched));
-        if (MD->version)
-          Strncpy(svc->version_matched, MD->version, sizeof(svc->version_matched));
-        if (MD->info)
-          Strncpy(svc->extrainfo_matched, MD->info, sizeof(svc->extrainfo_matched));
-        if (MD->hostname)
-          Strncpy(svc->hostname_matched, MD->hostname, sizeof(svc->hostname_matched));
-        if (MD->ostype)
-          Strncpy(svc->ostype_matched, MD->ostype, sizeof(svc->ostype_matched));
-        if (MD->devicetype)
-          Strncpy(svc->devicetype_matched, MD->devicetype, sizeof(svc->devicetype_matched));
-        if (MD->cpe_a)
-          Strncpy(svc->cpe_a_matched, MD->cpe_a, sizeof(svc->cpe_a_matched));
-        if (MD->cpe_h)
-          Strncpy(svc->cpe_h_matched, MD->cpe_h, sizeof(svc->cpe_h_matched));
-        if (MD->cpe_o)
-          Strncpy(svc->cpe_o_matched, MD->cpe_o, sizeof(svc->cpe_o_matched));
-        svc->softMatchFound = MD->isSoft;
-        if (!svc->softMatchFound) {
-          // We might be able to continue scan through a tunnel protocol
-          // like SSL
-          if (scanThroughTunnel(nsp, nsi, SG, svc) == 0)
-            end_svcprobe(nsp, PROBESTATE_FINISHED_HARDMATCHED, SG, svc, nsi);
-        }
-      }
-    }
-
-    if (!MD || !MD->serviceName || MD->isSoft) {
-      // Didn't match... maybe reading more until timeout will help
-      // TODO: For efficiency I should be able to test if enough data
-      // has been received rather than always waiting for the reading
-      // to timeout.  For now I'll limit it to 4096 bytes just to
-      // avoid reading megs from services like chargen.  But better
-      // approach is needed.
-      if (svc->probe_timemsleft(probe) > 0 && readstrlen < 4096) {
-        nsock_read(nsp, nsi, servicescan_read_handler, svc->probe_timemsleft(probe), svc);
-      } else {
-        // Failed -- lets go to the next probe.
-        if (readstrlen > 0)
-          svc->addToServiceFingerprint(probe->getName(), readstr, readstrlen);
-        startNextProbe(nsp, nsi, SG, svc, false);
+#ifdef HAVE_PTHREAD
+    if (SG->match_threads) {
+      // The match is finished by MatchThreads::notify_handler.
+      SG->match_threads->submit(svc, nsi, probe);
+    } else
+#endif
+    {
+      for (MD = NULL; probe->fallbacks[fallbackDepth] != NULL; fallbackDepth++) {
+        MD = (probe->fallbacks[fallbackDepth])->testMatch(readstr, readstrlen, 0, &SG->match_result);
+        if (MD && MD->serviceName) break; // Found one!
       }
+      processProbeMatch(nsp, nsi, SG, svc, probe, MD, fallbackDepth);
     }
   } else if (status == NSE_STATUS_TIMEOUT) {
     // Failed to read enough to make a match in the given amount of time.  So we
@@ -2711,6 +4009,247 @@ static void remove_excluded_ports(AllProbes *AP, ServiceGroup *SG) {
 }
 
 
+// Orders matches by the time spent in them, slowest first.
+static bool profileGreater(const ServiceProbeMatch *a, const ServiceProbeMatch *b) {
+  return a->getProfile().elapsed > b->getProfile().elapsed;
+}
+
+// Prints how much time the regexes of each match line took during this
+// service scan, most expensive first, and resets the counts.  Only the
+// top lines are shown unless debugging is high.
+static void printMatchProfile(AllProbes *AP) {
+  std::vector<ServiceProbeMatch *> profiled;
+  std::vector<ServiceProbe *> probes;
+  std::vector<ServiceProbe *>::iterator pi;
+  std::vector<ServiceProbeMatch *>::const_iterator mi;
+  unsigned long execs = 0;
+  double elapsed = 0;
+  unsigned int i, shown;
+
+  if (AP->nullProbe)
+    probes.push_back(AP->nullProbe);
+  probes.insert(probes.end(), AP->probes.begin(), AP->probes.end());
+  for (pi = probes.begin(); pi != probes.end(); pi++) {
+    for (mi = (*pi)->getMatches().begin(); mi != (*pi)->getMatches().end(); mi++) {
+      if ((*mi)->getProfile().execs == 0)
+        continue;
+      execs += (*mi)->getProfile().execs;
+      elapsed += (*mi)->getProfile().elapsed;
+      profiled.push_back(*mi);
+    }
+  }
+  std::sort(profiled.begin(), profiled.end(), profileGreater);
+
+  shown = profiled.size();
+  if (o.debugging < 4 && shown > 20)
+    shown = 20;
+  log_write(LOG_PLAIN, "Service match profile: %u regexes run %lu times in %.6fs%s\n",
+            (unsigned) profiled.size(), execs, elapsed,
+            shown < profiled.size() ? " (most expensive shown)" : "");
+  for (i = 0; i < shown; i++) {
+    const struct MatchProfile &prof = profiled[i]->getProfile();
+    log_write(LOG_PLAIN, "  line %d (%s): %lu runs, %lu matches, %lu match limits, %.6fs total, %.2fus per run\n",
+              profiled[i]->getLineNo(), profiled[i]->getName(),
+              prof.execs, prof.hits, prof.limits, prof.elapsed,
+              prof.elapsed * 1000000.0 / prof.execs);
+  }
+
+  for (i = 0; i < profiled.size(); i++)
+    profiled[i]->resetProfile();
+}
+
+// Creates the nsock pool that runs the probes of SG. The service group is
+// stored in the pool for availability in callbacks.
+static nsock_pool servicescan_pool_new(ServiceGroup *SG) {
+  nsock_pool nsp;
+
+  // Nearly every probe read carries a timeout and most of them complete early,
+  // so keep the timeouts in a timing wheel rather than the default heap.
+  if ((nsp = nsock_pool_new2(SG, NSOCK_POOL_TIMER_WHEEL)) == NULL) {
+    fatal("%s() failed to create new nsock pool.", __func__);
+  }
+
+  nsock_pool_set_device(nsp, o.device);
+
+  if (o.proxy_chain) {
+    nsock_pool_set_proxychain(nsp, o.proxy_chain);
+  }
+
+#if HAVE_OPENSSL
+  /* We don't care about connection security in version detection. */
+  nsock_pool_ssl_init(nsp, NSOCK_SSL_MAX_SPEED);
+#endif
+
+#ifdef HAVE_PTHREAD
+  if (o.version_threads > 0)
+    SG->match_threads = new MatchThreads(nsp, o.version_threads);
+#endif
+
+  return nsp;
+}
+
+// Deletes a pool made by servicescan_pool_new, along with the match threads of
+// its service group.
+static void servicescan_pool_delete(nsock_pool nsp, ServiceGroup *SG) {
+#ifdef HAVE_PTHREAD
+  delete SG->match_threads;
+  SG->match_threads = NULL;
+#endif
+  nsock_pool_delete(nsp);
+}
+
+static void print_pool_stats(const struct nsock_pool_stats *stats) {
+  log_write(LOG_PLAIN, "Service scan nsock engine %s: %lu waits returned %lu events, %lu event changes, %lu I/O calls\n",
+            stats->engine, stats->wait_calls, stats->events, stats->ctl_calls, stats->io_calls);
+}
+
+static void print_scan_end(ScanProgressMeter *SPM, unsigned int finished,
+                           unsigned int numtargets, int num_hosts_timedout) {
+  char additional_info[128];
+
+  if (num_hosts_timedout == 0)
+    Snprintf(additional_info, sizeof(additional_info), "%u %s on %u %s",
+              finished, (finished == 1)? "service" : "services",
+              numtargets, (numtargets == 1)? "host" : "hosts");
+  else Snprintf(additional_info, sizeof(additional_info), "%u %s timed out",
+                 num_hosts_timedout,
+                 (num_hosts_timedout == 1)? "host" : "hosts");
+  SPM->endTask(NULL, additional_info);
+}
+
+static void print_scan_start(std::vector<Target *> &Targets, unsigned int numservices) {
+  char targetstr[128];
+  bool plural = (Targets.size() != 1);
+
+  if (!plural) {
+    (*(Targets.begin()))->NameIP(targetstr, sizeof(targetstr));
+  } else Snprintf(targetstr, sizeof(targetstr), "%u hosts", (unsigned) Targets.size());
+
+  log_write(LOG_STDOUT, "Scanning %u %s on %s\n", numservices,
+            (numservices == 1)? "service" : "services", targetstr);
+}
+
+#ifdef HAVE_PTHREAD
+static void start_shard(nsock_pool nsp, void *arg) {
+  launchSomeServiceProbes(nsp, (ServiceGroup *) arg);
+}
+
+static void print_shard_progress(void *arg) {
+  struct ShardProgress *progress = (struct ShardProgress *) arg;
+  struct timeval now;
+  double done;
+
+  pthread_mutex_lock(&progress->lock);
+  done = (double) progress->finished / progress->total;
+  pthread_mutex_unlock(&progress->lock);
+
+  gettimeofday(&now, NULL);
+  if (keyWasPressed()) {
+    nmap_adjust_loglevel(o.versionTrace());
+    progress->SPM->printStats(done, &now);
+  }
+  if (progress->SPM->mayBePrinted(&now))
+    progress->SPM->printStatsIfNecessary(done, &now);
+}
+
+/* Like service_scan, but splits the targets across nshards service groups,
+   each with its own nsock pool running on its own thread, so that probing and
+   matching can use more than one core. A target always stays within one
+   shard. */
+static int service_scan_sharded(std::vector<Target *> &Targets, AllProbes *AP,
+                                int nshards) {
+  std::vector<std::vector<Target *> > parts(nshards);
+  std::vector<ServiceGroup *> groups;
+  std::vector<nsock_pool> pools;
+  struct ShardProgress progress;
+  struct nsock_pool_stats stats, total_stats;
+  NsockShards *shards;
+  ServiceGroup *SG;
+  unsigned int i, finished;
+  int num_hosts_timedout;
+
+  for (i = 0; i < Targets.size(); i++)
+    parts[i % nshards].push_back(Targets[i]);
+
+  num_hosts_timedout = 0;
+  progress.total = 0;
+  for (i = 0; i < parts.size(); i++) {
+    SG = new ServiceGroup(parts[i], AP, false);
+    if (!o.override_excludeports)
+      remove_excluded_ports(AP, SG);
+    startTimeOutClocks(SG);
+    num_hosts_timedout += SG->num_hosts_timedout;
+    if (SG->services_remaining.size() == 0) {
+      delete SG;
+      continue;
+    }
+    // --max-parallelism limits the scan as a whole, not each shard.
+    if (o.max_parallelism)
+      SG->ideal_parallelism = MAX(1, SG->ideal_parallelism / nshards);
+    progress.total += SG->services_remaining.size();
+    groups.push_back(SG);
+  }
+
+  if (o.override_excludeports && (o.debugging || o.verbose))
+    log_write(LOG_PLAIN, "Overriding exclude ports option! Some undesirable ports may be version scanned!\n");
+
+  if (groups.empty())
+    return 1;
+
+  progress.SPM = new ScanProgressMeter("Service scan");
+  progress.finished = 0;
+  pthread_mutex_init(&progress.lock, NULL);
+  if (o.verbose)
+    print_scan_start(Targets, progress.total);
+
+  nsock_set_log_function(nmap_nsock_stderr_logger);
+  nmap_adjust_loglevel(o.versionTrace());
+
+  shards = new NsockShards();
+  for (i = 0; i < groups.size(); i++) {
+    SG = groups[i];
+    pools.push_back(servicescan_pool_new(SG));
+    SG->shards = shards;
+    SG->shard = shards->add(pools[i]);
+    SG->progress = &progress;
+    shards->post(SG->shard, start_shard, SG);
+  }
+
+  shards->run(print_shard_progress, &progress, 1000);
+  delete shards;
+
+  memset(&total_stats, 0, sizeof(total_stats));
+  finished = 0;
+  for (i = 0; i < groups.size(); i++) {
+    if (o.debugging) {
+      nsock_pool_get_stats(pools[i], &stats);
+      total_stats.engine = stats.engine;
+      total_stats.wait_calls += stats.wait_calls;
+      total_stats.events += stats.events;
+      total_stats.ctl_calls += stats.ctl_calls;
+      total_stats.io_calls += stats.io_calls;
+    }
+    servicescan_pool_delete(pools[i], groups[i]);
+    finished += groups[i]->services_finished.size();
+  }
+  if (o.debugging)
+    print_pool_stats(&total_stats);
+
+  if (o.verbose)
+    print_scan_end(progress.SPM, finished, Targets.size(), num_hosts_timedout);
+
+  for (i = 0; i < groups.size(); i++) {
+    processResults(groups[i]);
+    delete groups[i];
+  }
+
+  pthread_mutex_destroy(&progress.lock);
+  delete progress.SPM;
+
+  return 0;
+}
+#endif
+
 /* Execute a service fingerprinting scan against all open ports of the
    Targets specified. */
 int service_scan(std::vector<Target *> &Targets) {
@@ -2718,8 +4257,12 @@ int service_scan(std::vector<Target *> &Targets) {
   AllProbes *AP;
   ServiceGroup *SG;
   nsock_pool nsp;
+  struct nsock_pool_stats stats;
   struct timeval now;
   int timeout;
+#ifdef HAVE_PTHREAD
+  int nshards;
+#endif
   enum nsock_loopstatus looprc;
   struct timeval starttv;
 
@@ -2727,7 +4270,14 @@ int service_scan(std::vector<Target *> &Targets) {
     return 1;
 
   AP = AllProbes::service_scan_init();
+  ServiceProbeMatch::profiling = (o.debugging > 1);
 
+#ifdef HAVE_PTHREAD
+  // Regex profiling keeps global counters, so it needs a single shard.
+  nshards = MIN((unsigned int) o.version_shards, Targets.size());
+  if (nshards > 1 && !ServiceProbeMatch::profiling)
+    return service_scan_sharded(Targets, AP, nshards);
+#endif
 
   // Now I convert the targets into a new ServiceGroup
   SG = new ServiceGroup(Targets, AP);
@@ -2746,38 +4296,14 @@ int service_scan(std::vector<Target *> &Targets) {
   }
 
   gettimeofday(&starttv, NULL);
-  if (o.verbose) {
-    char targetstr[128];
-    bool plural = (Targets.size() != 1);
-    if (!plural) {
-      (*(Targets.begin()))->NameIP(targetstr, sizeof(targetstr));
-    } else Snprintf(targetstr, sizeof(targetstr), "%u hosts", (unsigned) Targets.size());
-
-    log_write(LOG_STDOUT, "Scanning %u %s on %s\n",
-              (unsigned) SG->services_remaining.size(),
-              (SG->services_remaining.size() == 1)? "service" : "services",
-              targetstr);
-  }
+  if (o.verbose)
+    print_scan_start(Targets, SG->services_remaining.size());
 
   // Lets create a nsock pool for managing all the concurrent probes
-  // Store the servicegroup in there for availability in callbacks
-  if ((nsp = nsock_pool_new(SG)) == NULL) {
-    fatal("%s() failed to create new nsock pool.", __func__);
-  }
+  nsp = servicescan_pool_new(SG);
   nsock_set_log_function(nmap_nsock_stderr_logger);
   nmap_adjust_loglevel(o.versionTrace());
 
-  nsock_pool_set_device(nsp, o.device);
-
-  if (o.proxy_chain) {
-    nsock_pool_set_proxychain(nsp, o.proxy_chain);
-  }
-
-#if HAVE_OPENSSL
-  /* We don't care about connection security in version detection. */
-  nsock_pool_ssl_init(nsp, NSOCK_SSL_MAX_SPEED);
-#endif
-
   launchSomeServiceProbes(nsp, SG);
 
   // How long do we have before timing out?
@@ -2791,20 +4317,18 @@ int service_scan(std::vector<Target *> &Targets) {
     fatal("Unexpected nsock_loop error.  Error code %d (%s)", err, socket_strerror(err));
   }
 
-  nsock_pool_delete(nsp);
-
-  if (o.verbose) {
-    char additional_info[128];
-    if (SG->num_hosts_timedout == 0)
-      Snprintf(additional_info, sizeof(additional_info), "%u %s on %u %s",
-                (unsigned) SG->services_finished.size(),
-                (SG->services_finished.size() == 1)? "service" : "services",
-                (unsigned) Targets.size(), (Targets.size() == 1)? "host" : "hosts");
-    else Snprintf(additional_info, sizeof(additional_info), "%u %s timed out",
-                   SG->num_hosts_timedout,
-                   (SG->num_hosts_timedout == 1)? "host" : "hosts");
-    SG->SPM->endTask(NULL, additional_info);
+  if (o.debugging) {
+    nsock_pool_get_stats(nsp, &stats);
+    print_pool_stats(&stats);
   }
+  servicescan_pool_delete(nsp, SG);
+
+  if (o.verbose)
+    print_scan_end(SG->SPM, SG->services_finished.size(), Targets.size(),
+                   SG->num_hosts_timedout);
+
+  if (ServiceProbeMatch::profiling)
+    printMatchProfile(AP);
 
   // Yeah - done with the service scan.  Now I go through the results
   // discovered, store the important info away, and free up everything
@@ -130,6 +130,7 @@
 #include "portlist.h"
 #include "nmap.h"
 
+#include <string>
 #include <vector>
 
 #ifdef HAVE_PCRE_PCRE_H
@@ -144,6 +145,10 @@
 #define DEFAULT_CONNECT_TIMEOUT 5000
 #define DEFAULT_CONNECT_SSL_TIMEOUT 8000  // includes connect() + ssl negotiation
 #define SERVICEMATCH_REGEX 1
+// Backtracking steps allowed per regex and response before giving up with
+// PCRE_ERROR_MATCHLIMIT.  PCRE's default of 10 million lets one bad regex
+// stall the scan; the regexes in nmap-service-probes need far fewer.
+#define SERVICEMATCH_MATCH_LIMIT 1000000
 // #define SERVICEMATCH_STATIC 2 -- no longer supported
 
 /**********************  STRUCTURES  ***********************************/
@@ -177,6 +182,48 @@ struct MatchDetails {
   const char *cpe_h;
 };
 
+// Storage for the strings that a MatchDetails points to. Callers that
+// may match concurrently (see --version-threads) each use their own.
+struct MatchResult {
+  struct MatchDetails MD;
+  char product[80];
+  char version[80];
+  char info[256];  /* We will truncate with ... later */
+  char hostname[80];
+  char ostype[32];
+  char devicetype[32];
+  char cpe_a[80], cpe_h[80], cpe_o[80];
+};
+
+// The cost of running a match's regex, summed over a service scan while
+// profiling is on (ServiceProbeMatch::profiling).
+struct MatchProfile {
+  unsigned long execs;  // Number of times the regex was run
+  unsigned long hits;   // Number of times it matched
+  unsigned long limits; // Number of times it hit the match limit
+  double elapsed;       // Total seconds spent running it
+};
+
+// A byte string that must appear in any response matched by a regex. The
+// text is case-folded (ASCII only, as PCRE does by default), and if
+// anchored is true it must appear at the very start of the response.
+struct MatchLiteral {
+  std::string text;
+  bool anchored;
+  MatchLiteral() : anchored(false) {}
+};
+
+class ServiceProbeMatch;
+class CacheReader;
+class CacheWriter;
+
+// One run of a match's regex, as recorded by ServiceProbe::findMatch.
+struct RegexRun {
+  ServiceProbeMatch *match;
+  int rc;         // What pcre_exec() returned
+  double elapsed; // Seconds taken, if profiling
+};
+
 /**********************  CLASSES     ***********************************/
 
 class ServiceProbeMatch {
@@ -201,11 +248,38 @@ class ServiceProbeMatch {
   // is that the serviceName field can be saved throughout program
   // execution.  If no version matched, that field will be NULL.
   const struct MatchDetails *testMatch(const u8 *buf, int buflen);
+  // The same, but the details are stored in (and returned from) result,
+  // which stays valid for as long as the caller keeps it.
+  const struct MatchDetails *testMatch(const u8 *buf, int buflen,
+                                       struct MatchResult *result);
+  // Runs just the regex against buf and returns the pcre_exec() result.
+  // Unlike testMatch, this logs nothing and may be called from any thread.
+  int execRegex(const u8 *buf, int buflen, int *ovector, int ovecsize) const;
+  // Reports a failed execRegex() result other than PCRE_ERROR_NOMATCH.
+  void reportExecError(int rc) const;
+  // Adds a run of the regex that returned rc and took elapsed seconds to
+  // the profile of this match.
+  void addToProfile(int rc, double elapsed);
+  const struct MatchProfile &getProfile() const { return profile; }
+  void resetProfile() { memset(&profile, 0, sizeof(profile)); }
+  // When true, testMatch and ServiceProbe::findMatch time every regex run
+  // for the profile printed at the end of a service scan (-d2).
+  static bool profiling;
+  // Writes this match, including its compiled regex, to a cache of
+  // nmap-service-probes.  loadFromCache reads it back in place of
+  // InitMatch and returns false if the cached data is unusable.
+  void saveToCache(CacheWriter *cache) const;
+  bool loadFromCache(CacheReader *cache);
 // Returns the service name this matches
   const char *getName() { return servicename; }
   // The Line number where this match string was defined.  Returns
   // -1 if unknown.
   int getLineNo() { return deflineno; }
+  // Finds literals that a response must contain for the regex to match
+  // it: one for each top-level alternative of the regex. Returns false
+  // (and leaves literals empty) if some alternative has no literal that
+  // can be proven to be required.
+  bool getRequiredLiterals(std::vector<MatchLiteral> *literals) const;
  private:
   int deflineno; // The line number where this match is defined.
   bool isInitialized; // Has InitMatch yet been called?
@@ -232,9 +306,10 @@ class ServiceProbeMatch {
   // The anchor is for SERVICESCAN_STATIC matches.  If the anchor is not -1, the match must
   // start at that zero-indexed position in the response str.
   int matchops_anchor;
-// Details to fill out and return for testMatch() calls
-  struct MatchDetails MD_return;
+  struct MatchProfile profile;
 
+  // Studies the compiled regex and sets its match limit.
+  void studyRegex(int lineno);
   // Use the six version templates and the match data included here
   // to put the version info into the given strings, (as long as the sizes
   // are sufficient).  Returns zero for success.  If no template is available
@@ -251,6 +326,55 @@ class ServiceProbeMatch {
 };
 
 
+// An Aho-Corasick automaton over the required literals of a probe's
+// matches. Scanning a response once tells which matches could possibly
+// succeed on it, so that only those regexes have to be run. Matches
+// without required literals are always candidates.
+class MatchPrefilter {
+ public:
+  MatchPrefilter();
+  // Builds the automaton for the given list of matches.
+  void compile(const std::vector<ServiceProbeMatch *> &matches);
+  // Fills candidates (one entry per match) with whether each match could
+  // match buf.
+  void getCandidates(const u8 *buf, int buflen,
+                     std::vector<bool> *candidates) const;
+  // Number of matches the automaton was built for.
+  unsigned int numMatches() const { return nummatches; }
+  // Number of matches that have no literals and are always tried.
+  unsigned int numUnfiltered() const { return always.size(); }
+  // Writes the automaton to a cache, or reads it back in place of compile.
+  void saveToCache(CacheWriter *cache) const;
+  bool loadFromCache(CacheReader *cache);
+
+ private:
+  // Nodes and literals are plain data so that they can be cached as is.
+  struct Node {
+    unsigned int edges_start, edges_count; // Sorted range in edge_chars
+    int fail;      // Longest proper suffix that is also in the trie
+    int dictlink;  // Nearest node along fail links that ends a literal
+    int output;    // First literal ending at this node, or -1
+  };
+  struct Literal {
+    int match;         // Index into the probe's matches
+    unsigned int len;
+    int anchored;
+    int next;          // Next literal ending at the same node, or -1
+  };
+
+  int step(int state, u8 c) const;
+  bool isConsistent() const;
+
+  std::vector<Node> nodes;
+  // Edges out of each node, as parallel arrays of labels and targets.
+  std::vector<u8> edge_chars;
+  std::vector<int> edge_next;
+  std::vector<Literal> literals;
+  std::vector<int> always;
+  int root_next[256]; // step() from the root, precomputed
+  unsigned int nummatches;
+};
+
 class ServiceProbe {
  public:
   ServiceProbe();
@@ -332,6 +456,30 @@ class ServiceProbe {
   // no version matched, that field will be NULL. This function may
   // return NULL if there are no match lines at all in this probe.
   const struct MatchDetails *testMatch(const u8 *buf, int buflen, int n);
+  // Same, but the MatchDetails are stored in (and valid as long as) result.
+  const struct MatchDetails *testMatch(const u8 *buf, int buflen, int n,
+                                       struct MatchResult *result);
+
+  // Returns the first of this probe's matches whose regex matches buf,
+  // or NULL, without filling in any version information.  Regex runs
+  // that failed with a PCRE error, and when profiling all runs but the
+  // successful one, are added to runs so the caller can report them.
+  // Safe to call from any thread.
+  ServiceProbeMatch *findMatch(const u8 *buf, int buflen,
+                               std::vector<struct RegexRun> *runs) const;
+
+  // Builds the prefilter used by testMatch. Called once all of the
+  // probe's matches have been added.
+  void compileMatchPrefilter() { prefilter.compile(matches); }
+  const std::vector<ServiceProbeMatch *> &getMatches() const { return matches; }
+  // Number of this probe's matches that the prefilter cannot rule out.
+  unsigned int numUnfilteredMatches() const { return prefilter.numUnfiltered(); }
+
+  // Writes the probe and its matches to a cache of nmap-service-probes,
+  // or reads them back in place of parsing.  Fallbacks are handled by
+  // AllProbes.
+  void saveToCache(CacheWriter *cache) const;
+  bool loadFromCache(CacheReader *cache);
 
   char *fallbackStr;
   ServiceProbe *fallbacks[MAXFALLBACKS+1];
@@ -349,6 +497,7 @@ class ServiceProbe {
   std::vector<const char *> detectedServices;
   int probeprotocol;
   std::vector<ServiceProbeMatch *> matches; // first-ever use of STL in Nmap!
+  MatchPrefilter prefilter;
 };
 
 class AllProbes {
@@ -374,6 +523,13 @@ public:
   bool excluded_seen;
   struct scan_lists excludedports;
 
+  // Writes all the parsed probes to cachefile, so that loadFromCache can
+  // later read them back instead of parsing srcfile (nmap-service-probes)
+  // again.  loadFromCache fails, leaving this object empty, if the cache
+  // is missing, corrupt, or out of date with respect to srcfile.
+  bool saveToCache(const char *cachefile, const char *srcfile) const;
+  bool loadFromCache(const char *cachefile, const char *srcfile);
+
   static AllProbes *service_scan_init(void);
   static void service_scan_free(void);
   static int check_excluded_port(unsigned short port, int proto);
@@ -150,7 +150,33 @@ extern NmapOps o;
 #include "pcap-int.h"
 #endif
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 static PacketCounter PktCt;
+#ifdef HAVE_PTHREAD
+/* Packets are traced both by the scanning thread and, with --pipeline-groups,
+   by NSE on the pipeline's thread. */
+static pthread_mutex_t PktCt_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Adds a packet of len bytes to the totals reported by getFinalPacketStats. */
+static void count_packet(PacketTrace::pdirection pdir, u32 len) {
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock(&PktCt_lock);
+#endif
+  if (pdir == PacketTrace::SENT) {
+    PktCt.sendPackets++;
+    PktCt.sendBytes += len;
+  } else {
+    PktCt.recvPackets++;
+    PktCt.recvBytes += len;
+  }
+#ifdef HAVE_PTHREAD
+  pthread_mutex_unlock(&PktCt_lock);
+#endif
+}
 
 
 
@@ -213,13 +239,7 @@ void PacketTrace::traceArp(pdirection pdir, const u8 *frame, u32 len,
   char arpdesc[128];
   char who_has[INET_ADDRSTRLEN], tell[INET_ADDRSTRLEN];
 
-  if (pdir == SENT) {
-    PktCt.sendPackets++;
-    PktCt.sendBytes += len;
-  } else {
-    PktCt.recvPackets++;
-    PktCt.recvBytes += len;
-  }
+  count_packet(pdir, len);
 
   if (!o.packetTrace())
     return;
@@ -267,13 +287,7 @@ void PacketTrace::traceND(pdirection pdir, const u8 *frame, u32 len,
   char who_has[INET6_ADDRSTRLEN], tgt_is[INET6_ADDRSTRLEN];
   char desc[128];
 
-  if (pdir == SENT) {
-    PktCt.sendPackets++;
-    PktCt.sendBytes += len;
-  } else {
-    PktCt.recvPackets++;
-    PktCt.recvBytes += len;
-  }
+  count_packet(pdir, len);
 
   if (!o.packetTrace())
     return;
@@ -356,13 +370,7 @@ void PacketTrace::trace(pdirection pdir, const u8 *packet, u32 len,
                         struct timeval *now) {
   struct timeval tv;
 
-  if (pdir == SENT) {
-    PktCt.sendPackets++;
-    PktCt.sendBytes += len;
-  } else {
-    PktCt.recvPackets++;
-    PktCt.recvBytes += len;
-  }
+  count_packet(pdir, len);
 
   if (!o.packetTrace())
     return;
@@ -494,12 +502,115 @@ struct addrinfo *resolve_all(const char *hostname, int pf) {
 }
 
 
+/* Raw socket packets queued by send_ipv4_packet while a batch is open. The
+   buffers are kept between batches and only grow. */
+struct IPBatch {
+  bool active;
+  int sd;
+  int count;
+  struct sockaddr_in dsts[SEND_IP_PACKETS_CHUNK];
+  u8 *packets[SEND_IP_PACKETS_CHUNK];
+  unsigned int packetlens[SEND_IP_PACKETS_CHUNK];
+  unsigned int bufsizes[SEND_IP_PACKETS_CHUNK];
+};
+
+/* Each thread has a batch of its own, so that packets sent by another thread
+   (NSE's raw sockets during --pipeline-groups, for instance) go out directly
+   instead of joining a batch the scanning thread has open. */
+#ifdef HAVE_PTHREAD
+static pthread_key_t ip_batch_key;
+static pthread_once_t ip_batch_once = PTHREAD_ONCE_INIT;
+
+static void ip_batch_free(void *arg) {
+  struct IPBatch *batch = (struct IPBatch *) arg;
+  int i;
+
+  for (i = 0; i < SEND_IP_PACKETS_CHUNK; i++)
+    free(batch->packets[i]);
+  free(batch);
+}
+
+static void ip_batch_key_create(void) {
+  if (pthread_key_create(&ip_batch_key, ip_batch_free) != 0)
+    fatal("%s: failed to create thread-specific key", __func__);
+}
+#endif
+
+/* Returns the calling thread's batch. If it has none yet, creates one when
+   create is true and returns NULL otherwise. */
+static struct IPBatch *ip_batch_get(bool create) {
+  struct IPBatch *batch;
+
+#ifdef HAVE_PTHREAD
+  pthread_once(&ip_batch_once, ip_batch_key_create);
+  batch = (struct IPBatch *) pthread_getspecific(ip_batch_key);
+  if (batch == NULL && create) {
+    batch = (struct IPBatch *) safe_zalloc(sizeof(*batch));
+    pthread_setspecific(ip_batch_key, batch);
+  }
+#else
+  static struct IPBatch *main_batch = NULL;
+
+  if (main_batch == NULL && create)
+    main_batch = (struct IPBatch *) safe_zalloc(sizeof(*main_batch));
+  batch = main_batch;
+#endif
+
+  return batch;
+}
+
+static void send_ip_packet_batch_flush(struct IPBatch *batch) {
+  if (batch->count == 0)
+    return;
+  send_ip_packets_sd(batch->sd, batch->dsts,
+                     (const u8 *const *) batch->packets,
+                     batch->packetlens, batch->count);
+  batch->count = 0;
+}
+
+static void send_ip_packet_batch_add(struct IPBatch *batch, int sd,
+                                     const struct sockaddr_in *dst,
+                                     const u8 *packet, unsigned int packetlen) {
+  int i;
+
+  if (batch->count > 0 && batch->sd != sd)
+    send_ip_packet_batch_flush(batch);
+  i = batch->count;
+  if (batch->bufsizes[i] < packetlen) {
+    batch->packets[i] = (u8 *) safe_realloc(batch->packets[i], packetlen);
+    batch->bufsizes[i] = packetlen;
+  }
+  memcpy(batch->packets[i], packet, packetlen);
+  batch->packetlens[i] = packetlen;
+  batch->dsts[i] = *dst;
+  batch->sd = sd;
+  batch->count++;
+  if (batch->count == SEND_IP_PACKETS_CHUNK)
+    send_ip_packet_batch_flush(batch);
+}
+
+void send_ip_packet_batch_begin() {
+  struct IPBatch *batch = ip_batch_get(true);
+
+  assert(!batch->active);
+  batch->active = true;
+}
+
+void send_ip_packet_batch_end() {
+  struct IPBatch *batch = ip_batch_get(false);
+
+  assert(batch != NULL && batch->active);
+  send_ip_packet_batch_flush(batch);
+  batch->active = false;
+}
+
 /* Send a pre-built IPv4 packet. Handles fragmentation and whether to send with
    an ethernet handle or a socket. */
 static int send_ipv4_packet(int sd, const struct eth_nfo *eth,
                             const struct sockaddr_in *dst,
                             const u8 *packet, unsigned int packetlen) {
   struct ip *ip = (struct ip *) packet;
+  struct IPBatch *batch;
   int res;
 
   assert(packet);
@@ -509,6 +620,9 @@ static int send_ipv4_packet(int sd, const struct eth_nfo *eth,
   if (o.fragscan && !(ntohs(ip->ip_off) & IP_DF) &&
       (packetlen - ip->ip_hl * 4 > (unsigned int) o.fragscan)) {
     res = send_frag_ip_packet(sd, eth, dst, packet, packetlen, o.fragscan);
+  } else if (eth == NULL && (batch = ip_batch_get(false)) != NULL && batch->active) {
+    send_ip_packet_batch_add(batch, sd, dst, packet, packetlen);
+    res = packetlen;
   } else {
     res = send_ip_packet_eth_or_sd(sd, eth, dst, packet, packetlen);
   }
@@ -1546,67 +1660,34 @@ char *readipv4_pcap(pcap_t *pd, unsigned int *len, long to_usec,
   return buf;
 }
 
-char *readip_pcap(pcap_t *pd, unsigned int *len, long to_usec,
-                  struct timeval *rcvdtime, struct link_header *linknfo, bool validate) {
-  unsigned int offset = 0;
-  struct pcap_pkthdr head;
-  char *p;
-  int datalink;
-  int timedout = 0;
-  struct timeval tv_start, tv_end;
-  static char *alignedbuf = NULL;
-  static unsigned int alignedbufsz = 0;
-  static int warning = 0;
-
-  if (linknfo) {
-    memset(linknfo, 0, sizeof(*linknfo));
-  }
-
-  if (!pd)
-    fatal("NULL packet device passed to %s", __func__);
-
-  if (to_usec < 0) {
-    if (!warning) {
-      warning = 1;
-      error("WARNING: Negative timeout value (%lu) passed to %s() -- using 0", to_usec, __func__);
-    }
-    to_usec = 0;
-  }
-
-  /* New packet capture device, need to recompute offset */
-  if ((datalink = pcap_datalink(pd)) < 0)
-    fatal("Cannot obtain datalink information: %s", pcap_geterr(pd));
-
+/* Returns the length of the link-layer header that precedes the IP header for
+   the given pcap datalink type, or -1 if the type is not one we understand. */
+static int datalink_offset(int datalink) {
   /* NOTE: IF A NEW OFFSET EVER EXCEEDS THE CURRENT MAX (24), ADJUST
      MAX_LINK_HEADERSZ in libnetutil/netutil.h */
   switch (datalink) {
   case DLT_EN10MB:
-    offset = 14;
-    break;
+    return 14;
   case DLT_IEEE802:
-    offset = 22;
-    break;
+    return 22;
 #ifdef __amigaos__
   case DLT_MIAMI:
-    offset = 16;
-    break;
+    return 16;
 #endif
 #ifdef DLT_LOOP
   case DLT_LOOP:
 #endif
   case DLT_NULL:
-    offset = 4;
-    break;
+    return 4;
   case DLT_SLIP:
 #ifdef DLT_SLIP_BSDOS
   case DLT_SLIP_BSDOS:
 #endif
 #if (FREEBSD || OPENBSD || NETBSD || BSDI || MACOSX)
-    offset = 16;
+    return 16;
 #else
-    offset = 24; /* Anyone use this??? */
+    return 24; /* Anyone use this??? */
 #endif
-    break;
   case DLT_PPP:
 #ifdef DLT_PPP_BSDOS
   case DLT_PPP_BSDOS:
@@ -1618,52 +1699,143 @@ char *readip_pcap(pcap_t *pd, unsigned int *len, long to_usec,
   case DLT_PPP_ETHER:
 #endif
 #if (FREEBSD || OPENBSD || NETBSD || BSDI || MACOSX)
-    offset = 4;
+    return 4;
 #else
 #ifdef SOLARIS
-    offset = 8;
+    return 8;
 #else
-    offset = 24; /* Anyone use this? */
+    return 24; /* Anyone use this? */
 #endif /* ifdef solaris */
 #endif /* if freebsd || openbsd || netbsd || bsdi */
-    break;
   case DLT_RAW:
-    offset = 0;
-    break;
+    return 0;
   case DLT_FDDI:
-    offset = 21;
-    break;
+    return 21;
 #ifdef DLT_ENC
   case DLT_ENC:
-    offset = 12;
-    break;
+    return 12;
 #endif /* DLT_ENC */
 #ifdef DLT_LINUX_SLL
   case DLT_LINUX_SLL:
-    offset = 16;
-    break;
+    return 16;
 #endif
 #ifdef DLT_IPNET
   case DLT_IPNET:
-    offset = 24;
-    break;
+    return 24;
 #endif
   default:
-    p = (char *) pcap_next(pd, &head);
-    if (head.caplen == 0) {
-      /* Lets sleep a brief time and try again to increase the chance of seeing
-         a real packet ... */
-      usleep(500000);
-      p = (char *) pcap_next(pd, &head);
+    return -1;
+  }
+}
+
+/* A frame handed over by pcap_dispatch() to readip_pcap_frame(). The IP part
+   is copied straight out of libpcap's buffer (the mmap ring on Linux) into
+   readip_buf, which is reused between calls and only grows. */
+struct readip_frame {
+  unsigned int offset;
+  int datalink;
+  struct link_header *linknfo;
+  struct pcap_pkthdr head;
+  bool got;
+};
+
+static char *readip_buf = NULL;
+static unsigned int readip_bufsz = 0;
+
+static void readip_pcap_frame(u_char *user, const struct pcap_pkthdr *h,
+                              const u_char *bytes) {
+  struct readip_frame *frame = (struct readip_frame *) user;
+  unsigned int len;
+
+  frame->head = *h;
+  frame->got = true;
+  if (h->caplen <= frame->offset)
+    return;
+  if (frame->offset && frame->linknfo) {
+    frame->linknfo->datalinktype = frame->datalink;
+    frame->linknfo->headerlen = frame->offset;
+    assert(frame->offset <= MAX_LINK_HEADERSZ);
+    memcpy(frame->linknfo->header, bytes,
+           MIN(sizeof(frame->linknfo->header), frame->offset));
+  }
+  len = h->caplen - frame->offset;
+  if (len > readip_bufsz) {
+    readip_buf = (char *) safe_realloc(readip_buf, len);
+    readip_bufsz = len;
+  }
+  memcpy(readip_buf, bytes + frame->offset, len);
+}
+
+char *readip_pcap(pcap_t *pd, unsigned int *len, long to_usec,
+                  struct timeval *rcvdtime, struct link_header *linknfo, bool validate) {
+  struct readip_frame frame;
+  struct pcap_pkthdr head;
+  char *p;
+  int datalink;
+  int offset;
+  bool nonblocking_ring = false;
+  int timedout = 0;
+  struct timeval tv_start, tv_end;
+  static int last_datalink = -1;
+  static int last_offset = 0;
+  static int warning = 0;
+
+  if (linknfo) {
+    memset(linknfo, 0, sizeof(*linknfo));
+  }
+
+  if (!pd)
+    fatal("NULL packet device passed to %s", __func__);
+
+  if (to_usec < 0) {
+    if (!warning) {
+      warning = 1;
+      error("WARNING: Negative timeout value (%lu) passed to %s() -- using 0", to_usec, __func__);
     }
-    if (head.caplen > 100000) {
-      fatal("FATAL: %s: bogus caplen from libpcap (%d) on interface type %d", __func__, head.caplen, datalink);
+    to_usec = 0;
+  }
+
+  /* The offset only changes with the datalink type, which is almost always the
+     same as on the previous call. */
+  if ((datalink = pcap_datalink(pd)) < 0)
+    fatal("Cannot obtain datalink information: %s", pcap_geterr(pd));
+  if (datalink == last_datalink) {
+    offset = last_offset;
+  } else {
+    offset = datalink_offset(datalink);
+    if (offset < 0) {
+      p = (char *) pcap_next(pd, &head);
+      if (head.caplen == 0) {
+        /* Lets sleep a brief time and try again to increase the chance of seeing
+           a real packet ... */
+        usleep(500000);
+        p = (char *) pcap_next(pd, &head);
+      }
+      if (head.caplen > 100000) {
+        fatal("FATAL: %s: bogus caplen from libpcap (%d) on interface type %d", __func__, head.caplen, datalink);
+      }
+      error("FATAL:  Unknown datalink type (%d). Caplen: %d; Packet:", datalink, head.caplen);
+      nmap_hexdump((unsigned char *) p, head.caplen);
+      exit(1);
     }
-    error("FATAL:  Unknown datalink type (%d). Caplen: %d; Packet:", datalink, head.caplen);
-    nmap_hexdump((unsigned char *) p, head.caplen);
-    exit(1);
+    last_datalink = datalink;
+    last_offset = offset;
   }
 
+  frame.offset = offset;
+  frame.datalink = datalink;
+  frame.linknfo = linknfo;
+
+#ifdef LINUX
+  /* On Linux libpcap reads from a memory-mapped ring, and a nonblocking read
+     costs no system call while frames are waiting in it. Leave the handle
+     nonblocking and only select() once the ring is empty, so that a burst of
+     replies is drained with a single wakeup. */
+  if (pcap_getnonblock(pd, NULL) == 0)
+    pcap_setnonblock(pd, 1, NULL);
+  nonblocking_ring = true;
+#endif
+
   if (to_usec > 0) {
     gettimeofday(&tv_start, NULL);
   }
@@ -1682,44 +1854,38 @@ char *readip_pcap(pcap_t *pd, unsigned int *len, long to_usec,
     PacketSetReadTimeout(pd->adapter, to_left);
 #endif
 
-    p = NULL;
-    /* It may be that protecting this with !pcap_selectable_fd_one_to_one is not
-       necessary, that it is always safe to do a nonblocking read in this way on
-       all platforms. But I have only tested it on Solaris. */
-    if (!pcap_selectable_fd_one_to_one()) {
+    frame.got = false;
+    if (nonblocking_ring) {
+      pcap_dispatch(pd, 1, readip_pcap_frame, (u_char *) &frame);
+    } else if (!pcap_selectable_fd_one_to_one()) {
+      /* It may be that protecting this with !pcap_selectable_fd_one_to_one is
+         not necessary, that it is always safe to do a nonblocking read in this
+         way on all platforms. But I have only tested it on Solaris. */
       int rc, nonblock;
 
       nonblock = pcap_getnonblock(pd, NULL);
       assert(nonblock == 0);
       rc = pcap_setnonblock(pd, 1, NULL);
       assert(rc == 0);
-      p = (char *) pcap_next(pd, &head);
+      pcap_dispatch(pd, 1, readip_pcap_frame, (u_char *) &frame);
       rc = pcap_setnonblock(pd, nonblock, NULL);
       assert(rc == 0);
     }
 
-    if (p == NULL) {
-      /* Nonblocking pcap_next didn't get anything. */
+    if (!frame.got) {
+      /* Nonblocking read didn't get anything. */
       if (pcap_select(pd, to_usec) == 0)
         timedout = 1;
       else
-        p = (char *) pcap_next(pd, &head);
+        pcap_dispatch(pd, 1, readip_pcap_frame, (u_char *) &frame);
     }
 
-    if (p) {
-      if (head.caplen <= offset) {
+    if (frame.got) {
+      if (frame.head.caplen <= (unsigned int) offset) {
         *len = 0;
         return NULL;
       }
-      if (offset && linknfo) {
-        linknfo->datalinktype = datalink;
-        linknfo->headerlen = offset;
-        assert(offset <= MAX_LINK_HEADERSZ);
-        memcpy(linknfo->header, p, MIN(sizeof(linknfo->header), offset));
-      }
-      p += offset;
-    }
-    if (!p) {
+    } else {
       /* Should we timeout? */
       if (to_usec == 0) {
         timedout = 1;
@@ -1730,22 +1896,18 @@ char *readip_pcap(pcap_t *pd, unsigned int *len, long to_usec,
         }
       }
     }
-  } while (!timedout && (!p));
+  } while (!timedout && !frame.got);
 
   if (timedout) {
     *len = 0;
     return NULL;
   }
+  head = frame.head;
   *len = head.caplen - offset;
-  if (*len > alignedbufsz) {
-    alignedbuf = (char *) safe_realloc(alignedbuf, *len);
-    alignedbufsz = *len;
-  }
-  memcpy(alignedbuf, p, *len);
 
   if (validate) {
     /* Let's see if this packet passes inspection.. */
-    if (!validatepkt((u8 *) alignedbuf, len)) {
+    if (!validatepkt((u8 *) readip_buf, len)) {
       *len = 0;
       return NULL;
     }
@@ -1769,12 +1931,12 @@ char *readip_pcap(pcap_t *pd, unsigned int *len, long to_usec,
   }
 
   if (rcvdtime)
-    PacketTrace::trace(PacketTrace::RCVD, (u8 *) alignedbuf, *len,
+    PacketTrace::trace(PacketTrace::RCVD, (u8 *) readip_buf, *len,
                        rcvdtime);
   else
-    PacketTrace::trace(PacketTrace::RCVD, (u8 *) alignedbuf, *len);
+    PacketTrace::trace(PacketTrace::RCVD, (u8 *) readip_buf, *len);
 
-  return alignedbuf;
+  return readip_buf;
 }
 
 /* Attempts to read one IPv6 Neighbor Solicitation reply packet from the pcap
@@ -1973,21 +2135,59 @@ bool setTargetNextHopMAC(Target *target) {
   return false;
 }
 
+#ifdef HAVE_PTHREAD
+/* The MAC and route caches in libnetutil are used both by the scanning
+   thread and, with --pipeline-groups, by NSE raw sends on the pipeline's
+   thread. libnetutil does no locking of its own. */
+static pthread_mutex_t mac_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t route_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* mac_cache_set() under mac_cache_lock. */
+static void next_hop_mac_set(const struct sockaddr_storage *ss, u8 *mac) {
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock(&mac_cache_lock);
+#endif
+  mac_cache_set(ss, mac);
+#ifdef HAVE_PTHREAD
+  pthread_mutex_unlock(&mac_cache_lock);
+#endif
+}
+
 /* Like to getTargetNextHopMAC(), but for arbitrary hosts (not Targets) */
 bool getNextHopMAC(const char *iface, const u8 *srcmac, const struct sockaddr_storage *srcss,
                    const struct sockaddr_storage *dstss, u8 *dstmac) {
+  static bool system_cache_loaded = false;
   arp_t *a;
   struct arp_entry ae;
+  int n;
+  bool found;
+
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock(&mac_cache_lock);
+#endif
+  /* Start the Nmap arp cache off with everything the system already knows,
+     instead of asking it one address at a time below. */
+  if (!system_cache_loaded) {
+    n = mac_cache_load_system();
+    if (o.debugging > 1 && n >= 0)
+      log_write(LOG_STDOUT, "Loaded %d entries from the system neighbor cache\n", n);
+    system_cache_loaded = true;
+  }
 
   /* First, let us check the Nmap arp cache ... */
-  if (mac_cache_get(dstss, dstmac))
+  found = mac_cache_get(dstss, dstmac);
+#ifdef HAVE_PTHREAD
+  pthread_mutex_unlock(&mac_cache_lock);
+#endif
+  if (found)
     return true;
 
   /* Maybe the system ARP cache will be more helpful */
   a = arp_open();
   addr_ston((sockaddr *) dstss, &ae.arp_pa);
   if (arp_get(a, &ae) == 0) {
-    mac_cache_set(dstss, ae.arp_ha.addr_eth.data);
+    next_hop_mac_set(dstss, ae.arp_ha.addr_eth.data);
     memcpy(dstmac, ae.arp_ha.addr_eth.data, 6);
     arp_close(a);
     return true;
@@ -1998,12 +2198,12 @@ bool getNextHopMAC(const char *iface, const u8 *srcmac, const struct sockaddr_st
      retransmissions if necessary) to determine the MAC */
   if (dstss->ss_family == AF_INET) {
     if (doArp(iface, srcmac, srcss, dstss, dstmac, PacketTrace::traceArp)) {
-      mac_cache_set(dstss, dstmac);
+      next_hop_mac_set(dstss, dstmac);
       return true;
     }
   } else if (dstss->ss_family == AF_INET6) {
     if (doND(iface, srcmac, srcss, dstss, dstmac, PacketTrace::traceND)) {
-      mac_cache_set(dstss, dstmac);
+      next_hop_mac_set(dstss, dstmac);
       return true;
     }
   }
@@ -2038,13 +2238,22 @@ pcap_if_t *getpcapinterfaces() {
 int nmap_route_dst(const struct sockaddr_storage *dst, struct route_nfo *rnfo) {
   struct sockaddr_storage spoofss;
   size_t spoofsslen;
+  int ret;
 
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock(&route_cache_lock);
+#endif
   if (o.spoofsource) {
     o.SourceSockAddr(&spoofss, &spoofsslen);
-    return route_dst(dst, rnfo, o.device, &spoofss);
+    ret = route_dst(dst, rnfo, o.device, &spoofss);
   } else {
-    return route_dst(dst, rnfo, o.device, NULL);
+    ret = route_dst(dst, rnfo, o.device, NULL);
   }
+#ifdef HAVE_PTHREAD
+  pthread_mutex_unlock(&route_cache_lock);
+#endif
+
+  return ret;
 }
 
 
@@ -221,6 +221,17 @@ int send_ip_packet(int sd, const struct eth_nfo *eth,
   const struct sockaddr_storage *dst,
   const u8 *packet, unsigned int packetlen);
 
+/* Between send_ip_packet_batch_begin() and send_ip_packet_batch_end(),
+   unfragmented IPv4 packets bound for a raw socket are queued by
+   send_ip_packet() and written out together (with sendmmsg() where
+   available) when the queue fills up or the batch ends. Packets sent over
+   ethernet, IPv6 packets, and fragments still go out immediately. Callers
+   should end the batch before waiting for replies, so that the send
+   timestamps they recorded stay accurate. A batch belongs to the thread that
+   began it; packets sent by other threads meanwhile are not queued. */
+void send_ip_packet_batch_begin();
+void send_ip_packet_batch_end();
+
 /* Builds an IP packet (including an IP header) by packing the fields
    with the given information.  It allocates a new buffer to store the
    packet contents, and then returns that buffer.  The packet is not
@@ -0,0 +1,214 @@
+/***************************************************************************
+ * addrset_bench.cc -- Measures how fast targets can be generated and      *
+ * checked against a large exclude list.                                   *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2016 Insecure.Com LLC. Nmap is    *
+ * also a registered trademark of Insecure.Com LLC.  This program is free  *
+ * software; you may redistribute and/or modify it under the terms of the  *
+ * GNU General Public License as published by the Free Software            *
+ * Foundation; Version 2 ("GPL"), BUT ONLY WITH ALL OF THE CLARIFICATIONS  *
+ * AND EXCEPTIONS DESCRIBED HEREIN.  This guarantees your right to use,    *
+ * modify, and redistribute this software under certain conditions.  If    *
+ * you wish to embed Nmap technology into proprietary software, we sell    *
+ * alternative licenses (contact sales@nmap.com).  Dozens of software      *
+ * vendors already license Nmap technology such as host discovery, port    *
+ * scanning, OS detection, version detection, and the Nmap Scripting       *
+ * Engine.                                                                 *
+ *                                                                         *
+ * Note that the GPL places important restrictions on "derivative works",  *
+ * yet it does not provide a detailed definition of that term.  To avoid   *
+ * misunderstandings, we interpret that term as broadly as copyright law   *
+ * allows.  For example, we consider an application to constitute a        *
+ * derivative work for the purpose of this license if it does any of the   *
+ * following with any software or content covered by this license          *
+ * ("Covered Software"):                                                   *
+ *                                                                         *
+ * o Integrates source code from Covered Software.                         *
+ *                                                                         *
+ * o Reads or includes copyrighted data files, such as Nmap's nmap-os-db   *
+ * or nmap-service-probes.                                                 *
+ *                                                                         *
+ * o Is designed specifically to execute Covered Software and parse the    *
+ * results (as opposed to typical shell or execution-menu apps, which will *
+ * execute anything you tell them to).                                     *
+ *                                                                         *
+ * o Includes Covered Software in a proprietary executable installer.  The *
+ * installers produced by InstallShield are an example of this.  Including *
+ * Nmap with other software in compressed or archival form does not        *
+ * trigger this provision, provided appropriate open source decompression  *
+ * or de-archiving software is widely available for no charge.  For the    *
+ * purposes of this license, an installer is considered to include Covered *
+ * Software even if it actually retrieves a copy of Covered Software from  *
+ * another source during runtime (such as by downloading it from the       *
+ * Internet).                                                              *
+ *                                                                         *
+ * o Links (statically or dynamically) to a library which does any of the  *
+ * above.                                                                  *
+ *                                                                         *
+ * o Executes a helper program, module, or script to do any of the above.  *
+ *                                                                         *
+ * This list is not exclusive, but is meant to clarify our interpretation  *
+ * of derived works with some common examples.  Other people may interpret *
+ * the plain GPL differently, so we consider this a special exception to   *
+ * the GPL that we apply to Covered Software.  Works which meet any of     *
+ * these conditions must conform to all of the terms of this license,      *
+ * particularly including the GPL Section 3 requirements of providing      *
+ * source code and allowing free redistribution of the work as a whole.    *
+ *                                                                         *
+ * As another special exception to the GPL terms, Insecure.Com LLC grants  *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two.                                  *
+ *                                                                         *
+ * Any redistribution of Covered Software, including any derived works,    *
+ * must obey and carry forward all of the terms of this license, including *
+ * obeying all GPL rules and restrictions.  For example, source code of    *
+ * the whole work must be provided and free redistribution must be         *
+ * allowed.  All GPL references to "this License", are to be treated as    *
+ * including the terms and conditions of this license text as well.        *
+ *                                                                         *
+ * Because this license imposes special exceptions to the GPL, Covered     *
+ * Work may not be combined (even as part of a larger work) with plain GPL *
+ * software.  The terms, conditions, and exceptions of this license must   *
+ * be included as well.  This license is incompatible with some other open *
+ * source licenses as well.  In some cases we can relicense portions of    *
+ * Nmap or grant special permissions to use it in other open source        *
+ * software.  Please contact fyodor@nmap.org with any such requests.       *
+ * Similarly, we don't incorporate incompatible open source software into  *
+ * Covered Software without special permission from the copyright holders. *
+ *                                                                         *
+ * If you have any questions about the licensing restrictions on using     *
+ * Nmap in other works, are happy to help.  As mentioned above, we also    *
+ * offer alternative license to integrate Nmap into proprietary            *
+ * applications and appliances.  These contracts have been sold to dozens  *
+ * of software vendors, and generally include a perpetual license as well  *
+ * as providing for priority support and updates.  They also fund the      *
+ * continued development of Nmap.  Please email sales@nmap.com for further *
+ * information.                                                            *
+ *                                                                         *
+ * If you have received a written license agreement or contract for        *
+ * Covered Software stating terms other than these, you may choose to use  *
+ * and redistribute Covered Software under those terms instead of these.   *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the Nmap      *
+ * license file for more details (it's in a COPYING file included with     *
+ * Nmap, and also available from https://svn.nmap.org/nmap/COPYING)        *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "../nmap.h"
+#include "../targets.h"
+#include "../NmapOps.h"
+#include "../nmap_error.h"
+
+#include <iostream>
+
+extern NmapOps o;
+
+/* Targets generated per exclude list size. */
+#define TARGET_EXPR "10.0.0.0/16"
+
+/* Writes an exclude file of n specifications in 10.0.0.0/8, a mix of single
+   addresses, /24 blocks and octet ranges like the ones in real block lists,
+   and loads it. Returns the seconds it took to load. */
+static double load_excludes(addrset *excludes, unsigned int n) {
+  struct timeval begin, end;
+  unsigned int i;
+  u32 r = 1;
+  FILE *fp;
+
+  fp = tmpfile();
+  if (fp == NULL)
+    pfatal("tmpfile");
+  for (i = 0; i < n; i++) {
+    r = r * 1103515245 + 12345;
+    switch (i % 3) {
+    case 0:
+      fprintf(fp, "10.%u.%u.%u\n", (r >> 8) & 0xFF, (r >> 16) & 0xFF, (r >> 24) & 0xFF);
+      break;
+    case 1:
+      fprintf(fp, "10.%u.%u.0/24\n", (r >> 8) & 0xFF, (r >> 16) & 0xFF);
+      break;
+    case 2:
+      fprintf(fp, "10.%u.%u.%u-%u\n", (r >> 8) & 0xFF, (r >> 16) & 0xFF,
+              (r >> 24) & 0x7F, ((r >> 24) & 0x7F) + 16);
+      break;
+    }
+  }
+  rewind(fp);
+
+  gettimeofday(&begin, NULL);
+  load_exclude_file(excludes, fp);
+  gettimeofday(&end, NULL);
+  fclose(fp);
+
+  return TIMEVAL_FSEC_SUBTRACT(end, begin);
+}
+
+/* Generates every address in TARGET_EXPR and checks it against the exclude
+   list, the way next_target does. Returns targets per second. */
+static double generate_targets(const addrset *excludes, unsigned int *excluded) {
+  struct sockaddr_storage ss;
+  struct timeval begin, end;
+  TargetGroup group;
+  unsigned int count;
+  size_t sslen;
+
+  if (group.parse_expr(TARGET_EXPR, AF_INET) != 0)
+    fatal("Can't parse %s", TARGET_EXPR);
+  count = *excluded = 0;
+  gettimeofday(&begin, NULL);
+  while (group.get_next_host(&ss, &sslen) == 0) {
+    if (addrset_contains(excludes, (struct sockaddr *) &ss))
+      (*excluded)++;
+    count++;
+  }
+  gettimeofday(&end, NULL);
+
+  return count / TIMEVAL_FSEC_SUBTRACT(end, begin);
+}
+
+int main()
+{
+  unsigned int n, excluded;
+  double loadtime, rate;
+
+  std::cout << "Benchmarking target generation with --excludefile" << std::endl;
+  for (n = 1000; n <= 200000; n = (n == 100000) ? 200000 : n * 10) {
+    addrset excludes;
+
+    addrset_init(&excludes);
+    loadtime = load_excludes(&excludes, n);
+    rate = generate_targets(&excludes, &excluded);
+    std::cout << "excludes " << n << ": loaded in " << loadtime << " s, "
+              << (unsigned long) rate << " targets/s (" << excluded
+              << " excluded)" << std::endl;
+    addrset_free(&excludes);
+  }
+
+  return 0;
+}
@@ -0,0 +1,302 @@
+/***************************************************************************
+ * dns_bench.cc -- Measures mass reverse DNS throughput against a local    *
+ * stub resolver.                                                          *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2016 Insecure.Com LLC. Nmap is    *
+ * also a registered trademark of Insecure.Com LLC.  This program is free  *
+ * software; you may redistribute and/or modify it under the terms of the  *
+ * GNU General Public License as published by the Free Software            *
+ * Foundation; Version 2 ("GPL"), BUT ONLY WITH ALL OF THE CLARIFICATIONS  *
+ * AND EXCEPTIONS DESCRIBED HEREIN.  This guarantees your right to use,    *
+ * modify, and redistribute this software under certain conditions.  If    *
+ * you wish to embed Nmap technology into proprietary software, we sell    *
+ * alternative licenses (contact sales@nmap.com).  Dozens of software      *
+ * vendors already license Nmap technology such as host discovery, port    *
+ * scanning, OS detection, version detection, and the Nmap Scripting       *
+ * Engine.                                                                 *
+ *                                                                         *
+ * Note that the GPL places important restrictions on "derivative works",  *
+ * yet it does not provide a detailed definition of that term.  To avoid   *
+ * misunderstandings, we interpret that term as broadly as copyright law   *
+ * allows.  For example, we consider an application to constitute a        *
+ * derivative work for the purpose of this license if it does any of the   *
+ * following with any software or content covered by this license          *
+ * ("Covered Software"):                                                   *
+ *                                                                         *
+ * o Integrates source code from Covered Software.                         *
+ *                                                                         *
+ * o Reads or includes copyrighted data files, such as Nmap's nmap-os-db   *
+ * or nmap-service-probes.                                                 *
+ *                                                                         *
+ * o Is designed specifically to execute Covered Software and parse the    *
+ * results (as opposed to typical shell or execution-menu apps, which will *
+ * execute anything you tell them to).                                     *
+ *                                                                         *
+ * o Includes Covered Software in a proprietary executable installer.  The *
+ * installers produced by InstallShield are an example of this.  Including *
+ * Nmap with other software in compressed or archival form does not        *
+ * trigger this provision, provided appropriate open source decompression  *
+ * or de-archiving software is widely available for no charge.  For the    *
+ * purposes of this license, an installer is considered to include Covered *
+ * Software even if it actually retrieves a copy of Covered Software from  *
+ * another source during runtime (such as by downloading it from the       *
+ * Internet).                                                              *
+ *                                                                         *
+ * o Links (statically or dynamically) to a library which does any of the  *
+ * above.                                                                  *
+ *                                                                         *
+ * o Executes a helper program, module, or script to do any of the above.  *
+ *                                                                         *
+ * This list is not exclusive, but is meant to clarify our interpretation  *
+ * of derived works with some common examples.  Other people may interpret *
+ * the plain GPL differently, so we consider this a special exception to   *
+ * the GPL that we apply to Covered Software.  Works which meet any of     *
+ * these conditions must conform to all of the terms of this license,      *
+ * particularly including the GPL Section 3 requirements of providing      *
+ * source code and allowing free redistribution of the work as a whole.    *
+ *                                                                         *
+ * As another special exception to the GPL terms, Insecure.Com LLC grants  *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two.                                  *
+ *                                                                         *
+ * Any redistribution of Covered Software, including any derived works,    *
+ * must obey and carry forward all of the terms of this license, including *
+ * obeying all GPL rules and restrictions.  For example, source code of    *
+ * the whole work must be provided and free redistribution must be         *
+ * allowed.  All GPL references to "this License", are to be treated as    *
+ * including the terms and conditions of this license text as well.        *
+ *                                                                         *
+ * Because this license imposes special exceptions to the GPL, Covered     *
+ * Work may not be combined (even as part of a larger work) with plain GPL *
+ * software.  The terms, conditions, and exceptions of this license must   *
+ * be included as well.  This license is incompatible with some other open *
+ * source licenses as well.  In some cases we can relicense portions of    *
+ * Nmap or grant special permissions to use it in other open source        *
+ * software.  Please contact fyodor@nmap.org with any such requests.       *
+ * Similarly, we don't incorporate incompatible open source software into  *
+ * Covered Software without special permission from the copyright holders. *
+ *                                                                         *
+ * If you have any questions about the licensing restrictions on using     *
+ * Nmap in other works, are happy to help.  As mentioned above, we also    *
+ * offer alternative license to integrate Nmap into proprietary            *
+ * applications and appliances.  These contracts have been sold to dozens  *
+ * of software vendors, and generally include a perpetual license as well  *
+ * as providing for priority support and updates.  They also fund the      *
+ * continued development of Nmap.  Please email sales@nmap.com for further *
+ * information.                                                            *
+ *                                                                         *
+ * If you have received a written license agreement or contract for        *
+ * Covered Software stating terms other than these, you may choose to use  *
+ * and redistribute Covered Software under those terms instead of these.   *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the Nmap      *
+ * license file for more details (it's in a COPYING file included with     *
+ * Nmap, and also available from https://svn.nmap.org/nmap/COPYING)        *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "../nmap_dns.h"
+
+#include "../nmap.h"
+#include "../Target.h"
+#include "../NmapOps.h"
+#include "../nmap_error.h"
+
+#include <iostream>
+#include <vector>
+
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+extern NmapOps o;
+
+/* The stub resolvers listen on these addresses. mass_rdns always talks to
+   port 53, so the benchmark has to run as root. */
+static const char *stub_addrs[] = { "127.0.0.1", "127.0.0.2", "127.0.0.3" };
+#define NUM_STUBS (sizeof(stub_addrs) / sizeof(stub_addrs[0]))
+
+/* Answers every query with a PTR record pointing at "host.bench", reusing
+   the question for the answer name. Queries whose id is a multiple of 7 get
+   NXDOMAIN instead, so both kinds of answer are matched. */
+static void stub_serve(int sd) {
+  static const u8 rdata[] = { 4, 'h', 'o', 's', 't', 5, 'b', 'e', 'n', 'c', 'h', 0 };
+  u8 buf[512];
+  struct sockaddr_storage from;
+  socklen_t fromlen = sizeof(from);
+  ssize_t n;
+  size_t qend;
+  u16 id;
+
+  n = recvfrom(sd, buf, sizeof(buf), 0, (struct sockaddr *) &from, &fromlen);
+  if (n < 12)
+    return;
+  /* Skip over the question name, then its type and class. */
+  for (qend = 12; qend < (size_t) n && buf[qend] != 0; qend += buf[qend] + 1)
+    ;
+  qend += 5;
+  if (qend > (size_t) n || qend + 12 + sizeof(rdata) > sizeof(buf))
+    return;
+
+  id = (buf[0] << 8) | buf[1];
+  buf[2] = 0x81;
+  buf[3] = (id % 7 == 0) ? 0x83 : 0x80;
+  if (id % 7 == 0) {
+    buf[7] = 0;
+  } else {
+    buf[7] = 1;
+    /* Name: pointer to the question. Type PTR, class IN, TTL 3600. */
+    u8 *p = buf + qend;
+    *p++ = 0xc0; *p++ = 12;
+    *p++ = 0; *p++ = 12;
+    *p++ = 0; *p++ = 1;
+    *p++ = 0; *p++ = 0; *p++ = 0x0e; *p++ = 0x10;
+    *p++ = 0; *p++ = sizeof(rdata);
+    memcpy(p, rdata, sizeof(rdata));
+    qend += 12 + sizeof(rdata);
+  }
+  buf[6] = 0;
+  buf[8] = buf[9] = buf[10] = buf[11] = 0;
+  sendto(sd, buf, qend, 0, (struct sockaddr *) &from, fromlen);
+}
+
+/* Forks a process serving all stub addresses. Returns its pid, or -1 if the
+   sockets could not be bound. */
+static pid_t start_stubs() {
+  int sds[NUM_STUBS];
+  struct sockaddr_in sin;
+  fd_set fds;
+  unsigned int i;
+  int maxsd = -1, bufsize = 1 << 22;
+  pid_t pid;
+
+  for (i = 0; i < NUM_STUBS; i++) {
+    sds[i] = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(53);
+    inet_pton(AF_INET, stub_addrs[i], &sin.sin_addr);
+    if (sds[i] == -1 || bind(sds[i], (struct sockaddr *) &sin, sizeof(sin)) == -1) {
+      std::cout << "Unable to bind " << stub_addrs[i] << ":53: " << strerror(errno) << std::endl;
+      return -1;
+    }
+    /* Dropped queries would be measured as retransmission timeouts. */
+    setsockopt(sds[i], SOL_SOCKET, SO_RCVBUF, (char *) &bufsize, sizeof(bufsize));
+    maxsd = MAX(maxsd, sds[i]);
+  }
+
+  pid = fork();
+  if (pid != 0) {
+    for (i = 0; i < NUM_STUBS; i++)
+      close(sds[i]);
+    return pid;
+  }
+
+  for (;;) {
+    FD_ZERO(&fds);
+    for (i = 0; i < NUM_STUBS; i++)
+      FD_SET(sds[i], &fds);
+    if (select(maxsd + 1, &fds, NULL, NULL, NULL) <= 0)
+      continue;
+    for (i = 0; i < NUM_STUBS; i++) {
+      if (FD_ISSET(sds[i], &fds))
+        stub_serve(sds[i]);
+    }
+  }
+}
+
+static double cpu_seconds() {
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+    + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000000.0;
+}
+
+/* Resolves n up targets starting at base. Every round uses fresh addresses so
+   that none are answered from the host cache. Wall-clock time includes any
+   retransmission timeouts after loopback drops, so CPU time per lookup is
+   reported as well. */
+static void bench_rdns(u32 base, unsigned int n) {
+  std::vector<Target *> targets;
+  struct sockaddr_storage ss;
+  struct sockaddr_in *sin = (struct sockaddr_in *) &ss;
+  struct timeval begin, end;
+  unsigned int i, named = 0;
+  double cpu;
+
+  for (i = 0; i < n; i++) {
+    Target *t = new Target();
+    memset(&ss, 0, sizeof(ss));
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = htonl(base + i);
+    t->setTargetSockAddr(&ss, sizeof(*sin));
+    t->flags = HOST_UP;
+    targets.push_back(t);
+  }
+
+  cpu = cpu_seconds();
+  gettimeofday(&begin, NULL);
+  nmap_mass_rdns(&targets[0], n);
+  gettimeofday(&end, NULL);
+  cpu = cpu_seconds() - cpu;
+
+  for (i = 0; i < n; i++) {
+    if (*targets[i]->HostName() != '\0')
+      named++;
+    delete targets[i];
+  }
+  std::cout << n << " targets (" << named << " named): "
+    << (unsigned long) (n / TIMEVAL_FSEC_SUBTRACT(end, begin)) << " lookups/s, "
+    << cpu * 1000000.0 / n << " us CPU per lookup" << std::endl;
+}
+
+int main()
+{
+  unsigned int n;
+  u32 base = 0x0a000000;
+  pid_t pid;
+
+  pid = start_stubs();
+  if (pid == -1)
+    return 0;
+
+  o.mass_dns = true;
+  o.dns_servers = strdup("127.0.0.1,127.0.0.2,127.0.0.3");
+
+  std::cout << "Benchmarking nmap_mass_rdns against " << NUM_STUBS << " local stub resolvers" << std::endl;
+  for (n = 256; n <= 65536; n <<= 2) {
+    bench_rdns(base, n);
+    base += n;
+  }
+
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+
+  return 0;
+}
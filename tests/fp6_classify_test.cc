@@ -0,0 +1,345 @@
+/***************************************************************************
+ * fp6_classify_test.cc -- Checks that the batched IPv6 OS model           *
+ * evaluation gives exactly liblinear's decision values and the            *
+ * per-class novelty of each feature vector.                               *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2016 Insecure.Com LLC. Nmap is    *
+ * also a registered trademark of Insecure.Com LLC.  This program is free  *
+ * software; you may redistribute and/or modify it under the terms of the  *
+ * GNU General Public License as published by the Free Software            *
+ * Foundation; Version 2 ("GPL"), BUT ONLY WITH ALL OF THE CLARIFICATIONS  *
+ * AND EXCEPTIONS DESCRIBED HEREIN.  This guarantees your right to use,    *
+ * modify, and redistribute this software under certain conditions.  If    *
+ * you wish to embed Nmap technology into proprietary software, we sell    *
+ * alternative licenses (contact sales@nmap.com).  Dozens of software      *
+ * vendors already license Nmap technology such as host discovery, port    *
+ * scanning, OS detection, version detection, and the Nmap Scripting       *
+ * Engine.                                                                 *
+ *                                                                         *
+ * Note that the GPL places important restrictions on "derivative works",  *
+ * yet it does not provide a detailed definition of that term.  To avoid   *
+ * misunderstandings, we interpret that term as broadly as copyright law   *
+ * allows.  For example, we consider an application to constitute a        *
+ * derivative work for the purpose of this license if it does any of the   *
+ * following with any software or content covered by this license          *
+ * ("Covered Software"):                                                   *
+ *                                                                         *
+ * o Integrates source code from Covered Software.                         *
+ *                                                                         *
+ * o Reads or includes copyrighted data files, such as Nmap's nmap-os-db   *
+ * or nmap-service-probes.                                                 *
+ *                                                                         *
+ * o Is designed specifically to execute Covered Software and parse the    *
+ * results (as opposed to typical shell or execution-menu apps, which will *
+ * execute anything you tell them to).                                     *
+ *                                                                         *
+ * o Includes Covered Software in a proprietary executable installer.  The *
+ * installers produced by InstallShield are an example of this.  Including *
+ * Nmap with other software in compressed or archival form does not        *
+ * trigger this provision, provided appropriate open source decompression  *
+ * or de-archiving software is widely available for no charge.  For the    *
+ * purposes of this license, an installer is considered to include Covered *
+ * Software even if it actually retrieves a copy of Covered Software from  *
+ * another source during runtime (such as by downloading it from the       *
+ * Internet).                                                              *
+ *                                                                         *
+ * o Links (statically or dynamically) to a library which does any of the  *
+ * above.                                                                  *
+ *                                                                         *
+ * o Executes a helper program, module, or script to do any of the above.  *
+ *                                                                         *
+ * This list is not exclusive, but is meant to clarify our interpretation  *
+ * of derived works with some common examples.  Other people may interpret *
+ * the plain GPL differently, so we consider this a special exception to   *
+ * the GPL that we apply to Covered Software.  Works which meet any of     *
+ * these conditions must conform to all of the terms of this license,      *
+ * particularly including the GPL Section 3 requirements of providing      *
+ * source code and allowing free redistribution of the work as a whole.    *
+ *                                                                         *
+ * As another special exception to the GPL terms, Insecure.Com LLC grants  *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two.                                  *
+ *                                                                         *
+ * Any redistribution of Covered Software, including any derived works,    *
+ * must obey and carry forward all of the terms of this license, including *
+ * obeying all GPL rules and restrictions.  For example, source code of    *
+ * the whole work must be provided and free redistribution must be         *
+ * allowed.  All GPL references to "this License", are to be treated as    *
+ * including the terms and conditions of this license text as well.        *
+ *                                                                         *
+ * Because this license imposes special exceptions to the GPL, Covered     *
+ * Work may not be combined (even as part of a larger work) with plain GPL *
+ * software.  The terms, conditions, and exceptions of this license must   *
+ * be included as well.  This license is incompatible with some other open *
+ * source licenses as well.  In some cases we can relicense portions of    *
+ * Nmap or grant special permissions to use it in other open source        *
+ * software.  Please contact fyodor@nmap.org with any such requests.       *
+ * Similarly, we don't incorporate incompatible open source software into  *
+ * Covered Software without special permission from the copyright holders. *
+ *                                                                         *
+ * If you have any questions about the licensing restrictions on using     *
+ * Nmap in other works, are happy to help.  As mentioned above, we also    *
+ * offer alternative license to integrate Nmap into proprietary            *
+ * applications and appliances.  These contracts have been sold to dozens  *
+ * of software vendors, and generally include a perpetual license as well  *
+ * as providing for priority support and updates.  They also fund the      *
+ * continued development of Nmap.  Please email sales@nmap.com for further *
+ * information.                                                            *
+ *                                                                         *
+ * If you have received a written license agreement or contract for        *
+ * Covered Software stating terms other than these, you may choose to use  *
+ * and redistribute Covered Software under those terms instead of these.   *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the Nmap      *
+ * license file for more details (it's in a COPYING file included with     *
+ * Nmap, and also available from https://svn.nmap.org/nmap/COPYING)        *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "../FPEngine.h"
+#include "../osscan.h"
+#include "../NmapOps.h"
+#include "linear.h"
+#include "../FPModel.h"
+#include "../libnetutil/npacket.h"
+
+#include <math.h>
+#include <iostream>
+#include <vector>
+
+extern NmapOps o;
+
+#define TEST_INCR(pred,acc) \
+if ( !(pred) ) \
+{ \
+  std::cout << "Test " << #pred << " failed at " << __FILE__ << ":" << __LINE__ << std::endl; \
+  ++acc; \
+}
+
+static unsigned int lcg_next(unsigned int *seed) {
+  *seed = *seed * 1103515245 + 12345;
+  return (*seed >> 16) & 0x7fff;
+}
+
+/* Novelty of x with respect to class label, computed one feature at a time as
+   classify used to. */
+static double reference_novelty(const double *x, int label) {
+  int i, nr_feature;
+  double sum;
+
+  nr_feature = get_nr_feature(&FPModel);
+  sum = 0.0;
+  for (i = 0; i < nr_feature; i++) {
+    double d, v;
+
+    d = x[i] - FPmean[label][i];
+    v = FPvariance[label][i];
+    if (v == 0.0)
+      v = 0.01;
+    sum += d * d / v;
+  }
+
+  return sqrt(sum);
+}
+
+/* Compares fp6_evaluate_model on the n vectors of X against predict_values and
+   reference_novelty on each vector alone. */
+static bool same_results(const double *X, unsigned int n) {
+  std::vector<struct feature_node> nodes;
+  std::vector<double> dec_values, novelty, values;
+  unsigned int nr_feature, nr_class, h, k, c;
+
+  nr_feature = get_nr_feature(&FPModel);
+  nr_class = get_nr_class(&FPModel);
+  dec_values.resize(n * nr_class);
+  novelty.resize(n * nr_class);
+  values.resize(nr_class);
+  nodes.resize(nr_feature + 1);
+
+  fp6_evaluate_model(X, n, &dec_values[0], &novelty[0]);
+  for (h = 0; h < n; h++) {
+    for (k = 0; k < nr_feature; k++) {
+      nodes[k].index = k + 1;
+      nodes[k].value = X[h * nr_feature + k];
+    }
+    nodes[k].index = -1;
+    predict_values(&FPModel, &nodes[0], &values[0]);
+    for (c = 0; c < nr_class; c++) {
+      if (dec_values[h * nr_class + c] != values[c])
+        return false;
+      if (novelty[h * nr_class + c] != reference_novelty(&X[h * nr_feature], c))
+        return false;
+    }
+  }
+
+  return true;
+}
+
+/* A response for one host of a parallel parse: an IPv6 packet whose transport
+   header type and length depend on the host. */
+struct ParsedHost {
+  u8 buf[128];
+  int len;
+  int proto;
+  int translen;
+  bool ok;
+};
+
+/* Builds host h's response into ph. */
+static void build_response(struct ParsedHost *ph, unsigned int h) {
+  static const u8 opts[12] = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 };
+  IPv6Header ip6;
+  TCPHeader tcp;
+  UDPHeader udp;
+  ICMPv6Header icmp6;
+  PacketElement *trans;
+
+  if (h % 3 == 0) {
+    tcp.setSourcePort(80);
+    tcp.setDestinationPort(h);
+    tcp.setOptions(opts, 4 * (h % 4));
+    tcp.setOffset();
+    trans = &tcp;
+    ph->proto = HEADER_TYPE_TCP;
+  } else if (h % 3 == 1) {
+    udp.setSourcePort(53);
+    udp.setDestinationPort(h);
+    udp.setTotalLength();
+    trans = &udp;
+    ph->proto = HEADER_TYPE_UDP;
+  } else {
+    icmp6.setType(ICMPv6_ECHO);
+    icmp6.setCode(0);
+    trans = &icmp6;
+    ph->proto = HEADER_TYPE_ICMPv6;
+  }
+  ip6.setNextHeader((u8) ph->proto);
+  ip6.setNextElement(trans);
+  ip6.setPayloadLength();
+  ph->translen = trans->getLen();
+  ph->len = ip6.dumpToBinaryBuffer(ph->buf, sizeof(ph->buf));
+  ph->ok = false;
+}
+
+/* osscan_parallel_for callback: splits the i'th response and checks that the
+   chain is what build_response put in it. */
+static void parse_host(void *arg, unsigned int i) {
+  struct ParsedHost *ph = (struct ParsedHost *) arg + i;
+  PacketElement *pe, *next;
+
+  pe = PacketParser::split(ph->buf, ph->len);
+  if (pe == NULL)
+    return;
+  next = pe->getNextElement();
+  ph->ok = pe->protocol_id() == HEADER_TYPE_IPv6 && pe->getLen() == ph->len
+    && next != NULL && next->protocol_id() == ph->proto
+    && next->getLen() == ph->translen && next->getNextElement() == NULL;
+  PacketParser::freePacketChain(pe);
+}
+
+/* Parses the responses of a group of IPv6 hosts on several threads, as
+   vectorizing a group with --osscan-threads used to. Returns how many were
+   parsed wrong. */
+static int parse_hosts_in_parallel(unsigned int n, int threads) {
+  std::vector<struct ParsedHost> hosts(n);
+  unsigned int h;
+  int errors;
+
+  for (h = 0; h < n; h++)
+    build_response(&hosts[h], h);
+  o.osscan_threads = threads;
+  osscan_parallel_for(parse_host, &hosts[0], n);
+  o.osscan_threads = 0;
+  errors = 0;
+  for (h = 0; h < n; h++) {
+    if (!hosts[h].ok)
+      errors++;
+  }
+
+  return errors;
+}
+
+int main(int argc, char *argv[])
+{
+  std::cout << "Testing IPv6 OS classification" << std::endl;
+
+  int ret = 0;
+  unsigned int nr_feature, nr_class, n, h, k;
+  unsigned int seed = 1;
+  std::vector<double> X;
+
+  nr_feature = get_nr_feature(&FPModel);
+  nr_class = get_nr_class(&FPModel);
+
+  /* Each class mean, the mean with some features perturbed or missing, and
+     random scaled vectors. The count is not a multiple of any block size. */
+  n = 3 * nr_class + 37;
+  X.resize(n * nr_feature);
+  for (h = 0; h < n; h++) {
+    double *x = &X[h * nr_feature];
+
+    for (k = 0; k < nr_feature; k++) {
+      if (h < nr_class) {
+        x[k] = FPmean[h][k];
+      } else if (h < 2 * nr_class) {
+        x[k] = FPmean[h - nr_class][k];
+        if (lcg_next(&seed) % 8 == 0)
+          x[k] += (lcg_next(&seed) % 1000) / 1000.0 - 0.5;
+        else if (lcg_next(&seed) % 16 == 0)
+          x[k] = -1;
+      } else if (lcg_next(&seed) % 4 == 0) {
+        x[k] = -1;
+      } else {
+        x[k] = lcg_next(&seed) / 32767.0;
+      }
+    }
+  }
+
+  TEST_INCR(same_results(&X[0], n), ret);
+  /* Odd-sized batches, and one vector at a time. */
+  TEST_INCR(same_results(&X[0], 1), ret);
+  TEST_INCR(same_results(&X[nr_feature], 17), ret);
+  TEST_INCR(same_results(&X[5 * nr_feature], n - 5), ret);
+
+  /* A vector at its class mean has no novelty for that class. */
+  for (h = 0; h < nr_class; h++) {
+    std::vector<double> dec_values(nr_class), novelty(nr_class);
+
+    fp6_evaluate_model(&X[h * nr_feature], 1, &dec_values[0], &novelty[0]);
+    TEST_INCR(novelty[h] == 0.0, ret);
+  }
+
+  /* Packets of many hosts parsed at once each get their own headers. */
+  for (k = 0; k < 20; k++)
+    TEST_INCR(parse_hosts_in_parallel(1024, 4) == 0, ret);
+
+  if(ret) std::cout << "Testing IPv6 OS classification finished with errors" << std::endl;
+  else std::cout << "Testing IPv6 OS classification finished without errors" << std::endl;
+
+  return ret; // 0 means ok
+}
@@ -121,9 +121,14 @@
  ***************************************************************************/
 
 #include "../nmap_dns.h"
+#include "../dnscache.h"
 
 #include <iostream>
 
+#ifndef WIN32
+#include <fcntl.h>
+#endif
+
 #define TEST_INCR(pred,acc) \
 if ( !(pred) ) \
 { \
@@ -131,6 +136,15 @@ if ( !(pred) ) \
   ++acc; \
 }
 
+#ifndef WIN32
+static std::string cache_test_name(u32 i)
+{
+  char buf[32];
+  Snprintf(buf, sizeof(buf), "host%u", i);
+  return buf;
+}
+#endif
+
 int main()
 {
   std::cout << "Testing nmap_dns" << std::endl;
@@ -256,6 +270,82 @@ int main()
   DNS::PTR_Record * r = static_cast<DNS::PTR_Record *>(a->record);
   TEST_INCR(r->value == target, ret);
 
+#ifndef WIN32
+  // The --dns-cache file: answers, NXDOMAIN, expiry, and growth across a
+  // reopen.
+  char cachefile[] = "/tmp/nmap-dns-cache-test.XXXXXX";
+  int fd = mkstemp(cachefile);
+  TEST_INCR(fd != -1, ret);
+  if (fd != -1) {
+    close(fd);
+    sockaddr_storage ip;
+    struct sockaddr_in *sin = (struct sockaddr_in *) &ip;
+    std::string name;
+    u32 i;
+
+    memset(&ip, 0, sizeof(ip));
+    sin->sin_family = AF_INET;
+    inet_pton(AF_INET, ipp, &sin->sin_addr);
+
+    DNSCacheFile cache;
+    TEST_INCR(cache.open(cachefile), ret);
+    TEST_INCR(cache.lookup(ip, name) == DNSCACHE_MISS, ret);
+    cache.add(ip, target, 3600);
+    TEST_INCR(cache.lookup(ip, name) == DNSCACHE_HIT && name == target, ret);
+    for (i = 0; i < 100000; i++) {
+      sin->sin_addr.s_addr = htonl(0x0a000000 + i);
+      cache.add(ip, (i % 3) ? cache_test_name(i) : "", (i % 5) ? 3600 : 0);
+    }
+    cache.close();
+
+    TEST_INCR(cache.open(cachefile), ret);
+    inet_pton(AF_INET, ipp, &sin->sin_addr);
+    TEST_INCR(cache.lookup(ip, name) == DNSCACHE_HIT && name == target, ret);
+    for (i = 0; i < 100000; i++) {
+      // Expired entries are dropped when the table grows, so they may be
+      // gone altogether.
+      int expect = (i % 5) == 0 ? DNSCACHE_EXPIRED : (i % 3) ? DNSCACHE_HIT : DNSCACHE_NXDOMAIN;
+      int found;
+      sin->sin_addr.s_addr = htonl(0x0a000000 + i);
+      found = cache.lookup(ip, name);
+      if (found == DNSCACHE_MISS && expect == DNSCACHE_EXPIRED)
+        found = DNSCACHE_EXPIRED;
+      if (found != expect
+          || (expect == DNSCACHE_HIT && name != cache_test_name(i))) {
+        TEST_INCR(false, ret);
+        break;
+      }
+    }
+    cache.close();
+
+    // A table with no empty slot, as a damaged file might have, must not
+    // make lookups spin; the file is started over instead. Slots follow a
+    // 32-byte header, are 28 bytes long and have their address family at
+    // offset 24.
+    unlink(cachefile);
+    TEST_INCR(cache.open(cachefile), ret);
+    cache.close();
+    fd = open(cachefile, O_RDWR);
+    TEST_INCR(fd != -1, ret);
+    if (fd != -1) {
+      u8 af = 4;
+      for (i = 0; i < 65536; i++) {
+        if (pwrite(fd, &af, 1, 32 + i * 28 + 24) != 1)
+          break;
+      }
+      TEST_INCR(i == 65536, ret);
+      close(fd);
+    }
+    TEST_INCR(cache.open(cachefile), ret);
+    inet_pton(AF_INET, ipp, &sin->sin_addr);
+    TEST_INCR(cache.lookup(ip, name) == DNSCACHE_MISS, ret);
+    cache.add(ip, target, 3600);
+    TEST_INCR(cache.lookup(ip, name) == DNSCACHE_HIT && name == target, ret);
+    cache.close();
+    unlink(cachefile);
+  }
+#endif
+
   if(ret) std::cout << "Testing nmap_dns finished with errors" << std::endl;
   else std::cout << "Testing nmap_dns finished without errors" << std::endl;
 
@@ -0,0 +1,279 @@
+/***************************************************************************
+ * osscan_match_test.cc -- Checks that the compiled OS fingerprint         *
+ * matcher scores fingerprints exactly like compare_fingerprints.          *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2016 Insecure.Com LLC. Nmap is    *
+ * also a registered trademark of Insecure.Com LLC.  This program is free  *
+ * software; you may redistribute and/or modify it under the terms of the  *
+ * GNU General Public License as published by the Free Software            *
+ * Foundation; Version 2 ("GPL"), BUT ONLY WITH ALL OF THE CLARIFICATIONS  *
+ * AND EXCEPTIONS DESCRIBED HEREIN.  This guarantees your right to use,    *
+ * modify, and redistribute this software under certain conditions.  If    *
+ * you wish to embed Nmap technology into proprietary software, we sell    *
+ * alternative licenses (contact sales@nmap.com).  Dozens of software      *
+ * vendors already license Nmap technology such as host discovery, port    *
+ * scanning, OS detection, version detection, and the Nmap Scripting       *
+ * Engine.                                                                 *
+ *                                                                         *
+ * Note that the GPL places important restrictions on "derivative works",  *
+ * yet it does not provide a detailed definition of that term.  To avoid   *
+ * misunderstandings, we interpret that term as broadly as copyright law   *
+ * allows.  For example, we consider an application to constitute a        *
+ * derivative work for the purpose of this license if it does any of the   *
+ * following with any software or content covered by this license          *
+ * ("Covered Software"):                                                   *
+ *                                                                         *
+ * o Integrates source code from Covered Software.                         *
+ *                                                                         *
+ * o Reads or includes copyrighted data files, such as Nmap's nmap-os-db   *
+ * or nmap-service-probes.                                                 *
+ *                                                                         *
+ * o Is designed specifically to execute Covered Software and parse the    *
+ * results (as opposed to typical shell or execution-menu apps, which will *
+ * execute anything you tell them to).                                     *
+ *                                                                         *
+ * o Includes Covered Software in a proprietary executable installer.  The *
+ * installers produced by InstallShield are an example of this.  Including *
+ * Nmap with other software in compressed or archival form does not        *
+ * trigger this provision, provided appropriate open source decompression  *
+ * or de-archiving software is widely available for no charge.  For the    *
+ * purposes of this license, an installer is considered to include Covered *
+ * Software even if it actually retrieves a copy of Covered Software from  *
+ * another source during runtime (such as by downloading it from the       *
+ * Internet).                                                              *
+ *                                                                         *
+ * o Links (statically or dynamically) to a library which does any of the  *
+ * above.                                                                  *
+ *                                                                         *
+ * o Executes a helper program, module, or script to do any of the above.  *
+ *                                                                         *
+ * This list is not exclusive, but is meant to clarify our interpretation  *
+ * of derived works with some common examples.  Other people may interpret *
+ * the plain GPL differently, so we consider this a special exception to   *
+ * the GPL that we apply to Covered Software.  Works which meet any of     *
+ * these conditions must conform to all of the terms of this license,      *
+ * particularly including the GPL Section 3 requirements of providing      *
+ * source code and allowing free redistribution of the work as a whole.    *
+ *                                                                         *
+ * As another special exception to the GPL terms, Insecure.Com LLC grants  *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two.                                  *
+ *                                                                         *
+ * Any redistribution of Covered Software, including any derived works,    *
+ * must obey and carry forward all of the terms of this license, including *
+ * obeying all GPL rules and restrictions.  For example, source code of    *
+ * the whole work must be provided and free redistribution must be         *
+ * allowed.  All GPL references to "this License", are to be treated as    *
+ * including the terms and conditions of this license text as well.        *
+ *                                                                         *
+ * Because this license imposes special exceptions to the GPL, Covered     *
+ * Work may not be combined (even as part of a larger work) with plain GPL *
+ * software.  The terms, conditions, and exceptions of this license must   *
+ * be included as well.  This license is incompatible with some other open *
+ * source licenses as well.  In some cases we can relicense portions of    *
+ * Nmap or grant special permissions to use it in other open source        *
+ * software.  Please contact fyodor@nmap.org with any such requests.       *
+ * Similarly, we don't incorporate incompatible open source software into  *
+ * Covered Software without special permission from the copyright holders. *
+ *                                                                         *
+ * If you have any questions about the licensing restrictions on using     *
+ * Nmap in other works, are happy to help.  As mentioned above, we also    *
+ * offer alternative license to integrate Nmap into proprietary            *
+ * applications and appliances.  These contracts have been sold to dozens  *
+ * of software vendors, and generally include a perpetual license as well  *
+ * as providing for priority support and updates.  They also fund the      *
+ * continued development of Nmap.  Please email sales@nmap.com for further *
+ * information.                                                            *
+ *                                                                         *
+ * If you have received a written license agreement or contract for        *
+ * Covered Software stating terms other than these, you may choose to use  *
+ * and redistribute Covered Software under those terms instead of these.   *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the Nmap      *
+ * license file for more details (it's in a COPYING file included with     *
+ * Nmap, and also available from https://svn.nmap.org/nmap/COPYING)        *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "../osscan.h"
+#include "../FingerPrintResults.h"
+#include "../NmapOps.h"
+#include "osscan_test_common.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+extern NmapOps o;
+
+#define TEST_INCR(pred,acc) \
+if ( !(pred) ) \
+{ \
+  std::cout << "Test " << #pred << " failed at " << __FILE__ << ":" << __LINE__ << std::endl; \
+  ++acc; \
+}
+
+/* Accuracies from score_fingerprint must be bit-for-bit those of
+   compare_fingerprints. */
+static bool same_scores(const FingerPrint *FP, const FingerPrintDB *DB) {
+  std::vector<double> accuracy(DB->prints.size());
+  FingerPrint FP_copy;
+  unsigned int i;
+
+  score_fingerprint(FP, DB, &accuracy[0]);
+  FP_copy = *FP;
+  FP_copy.sort();
+  for (i = 0; i < DB->prints.size(); i++) {
+    if (accuracy[i] != compare_fingerprints(DB->prints[i], &FP_copy, DB->MatchPoints, 0))
+      return false;
+  }
+
+  return true;
+}
+
+/* match_fingerprint with and without the compiled database. */
+static bool same_matches(const FingerPrint *FP, FingerPrintDB *DB) {
+  FingerPrintResultsIPv4 compiled, interpreted;
+  CompiledFingerPrintDB *C;
+
+  match_fingerprint(FP, &compiled, DB, OSSCAN_GUESS_THRESHOLD);
+  C = DB->compiled;
+  DB->compiled = NULL;
+  match_fingerprint(FP, &interpreted, DB, OSSCAN_GUESS_THRESHOLD);
+  DB->compiled = C;
+
+  return same_results(&compiled, &interpreted);
+}
+
+/* Values to put into mutated fingerprints: bounds of the ranges in the test
+   database, strings it matches literally, and things strtol treats oddly. */
+static const char *mutation_values[] = {
+  "", "0", "1", "3", "5", "6", "7", "8", "A", "B", "21", "22", "38", "3B",
+  "3F", "40", "41", "45", "46", "7F", "80", "FA", "FF", "100", "104", "105",
+  "10000", "2000", "7120", "FFFF", "Y", "N", "Z", "I", "RI", "RD", "S", "O",
+  "S+", "AR", "AS", "R", "U", "G", "M5B4", "M5B4ST11NW7", "xyz", "0x10",
+  " 5", "-1", "+",
+};
+
+static unsigned int lcg_next(unsigned int *seed) {
+  *seed = *seed * 1103515245 + 12345;
+  return (*seed >> 16) & 0x7fff;
+}
+
+/* Builds a fingerprint from a reference print, replacing values at random and
+   dropping some attributes and tests. */
+static FingerPrint *mutate(const FingerPrint *ref, unsigned int *seed) {
+  std::vector<FingerTest>::const_iterator test;
+  std::vector<struct AVal>::const_iterator av;
+  FingerPrint *FP;
+  unsigned int nvalues;
+
+  nvalues = sizeof(mutation_values) / sizeof(*mutation_values);
+  FP = new FingerPrint;
+  for (test = ref->tests.begin(); test != ref->tests.end(); test++) {
+    FingerTest t;
+
+    if (lcg_next(seed) % 16 == 0)
+      continue;
+    t.name = test->name;
+    for (av = test->results.begin(); av != test->results.end(); av++) {
+      struct AVal v;
+
+      if (lcg_next(seed) % 8 == 0)
+        continue;
+      v.attribute = av->attribute;
+      v.value = string_pool_insert(mutation_values[lcg_next(seed) % nvalues]);
+      t.results.push_back(v);
+    }
+    FP->tests.push_back(t);
+  }
+  /* A test the database does not know about. */
+  if (lcg_next(seed) % 2 == 0) {
+    FingerTest t;
+    struct AVal v;
+
+    t.name = string_pool_insert("XX");
+    v.attribute = string_pool_insert("Y");
+    v.value = string_pool_insert("1");
+    t.results.push_back(v);
+    FP->tests.push_back(t);
+  }
+
+  return FP;
+}
+
+int main(int argc, char *argv[])
+{
+  std::cout << "Testing OS fingerprint matching" << std::endl;
+
+  int ret = 0;
+  unsigned int i, j;
+  unsigned int seed = 1;
+
+  const char *dbfile = argc > 1 ? argv[1] : "tests/os_fingerprints.txt";
+  const char *observedfile = argc > 2 ? argv[2] : "tests/os_observed.txt";
+  FingerPrintDB *DB;
+  std::vector<Observed> observed;
+
+  DB = parse_fingerprint_file(dbfile);
+  TEST_INCR(DB->MatchPoints != NULL, ret);
+  TEST_INCR(DB->compiled != NULL, ret);
+  TEST_INCR(DB->prints.size() > 0, ret);
+
+  /* The saved fingerprints. */
+  TEST_INCR(load_observed(observedfile, &observed), ret);
+  TEST_INCR(!observed.empty(), ret);
+  for (i = 0; i < observed.size(); i++) {
+    FingerPrintResultsIPv4 FPR;
+
+    TEST_INCR(same_scores(observed[i].FP, DB), ret);
+    TEST_INCR(same_matches(observed[i].FP, DB), ret);
+    match_fingerprint(observed[i].FP, &FPR, DB, OSSCAN_GUESS_THRESHOLD);
+    TEST_INCR(FPR.num_matches > 0 && observed[i].expect == FPR.matches[0]->OS_name, ret);
+  }
+
+  /* Each reference print, and mutations of it. */
+  for (i = 0; i < DB->prints.size(); i++) {
+    TEST_INCR(same_scores(DB->prints[i], DB), ret);
+    for (j = 0; j < 100; j++) {
+      FingerPrint *FP = mutate(DB->prints[i], &seed);
+      TEST_INCR(same_scores(FP, DB), ret);
+      TEST_INCR(same_matches(FP, DB), ret);
+      delete FP;
+    }
+  }
+
+  for (i = 0; i < observed.size(); i++)
+    delete observed[i].FP;
+  delete DB;
+
+  if(ret) std::cout << "Testing OS fingerprint matching finished with errors" << std::endl;
+  else std::cout << "Testing OS fingerprint matching finished without errors" << std::endl;
+
+  return ret; // 0 means ok
+}
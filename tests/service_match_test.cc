@@ -0,0 +1,333 @@
+/***************************************************************************
+ * service_match_test.cc -- Checks that the nmap-service-probes match      *
+ * prefilter gives the same results as trying every regex.                 *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2016 Insecure.Com LLC. Nmap is    *
+ * also a registered trademark of Insecure.Com LLC.  This program is free  *
+ * software; you may redistribute and/or modify it under the terms of the  *
+ * GNU General Public License as published by the Free Software            *
+ * Foundation; Version 2 ("GPL"), BUT ONLY WITH ALL OF THE CLARIFICATIONS  *
+ * AND EXCEPTIONS DESCRIBED HEREIN.  This guarantees your right to use,    *
+ * modify, and redistribute this software under certain conditions.  If    *
+ * you wish to embed Nmap technology into proprietary software, we sell    *
+ * alternative licenses (contact sales@nmap.com).  Dozens of software      *
+ * vendors already license Nmap technology such as host discovery, port    *
+ * scanning, OS detection, version detection, and the Nmap Scripting       *
+ * Engine.                                                                 *
+ *                                                                         *
+ * Note that the GPL places important restrictions on "derivative works",  *
+ * yet it does not provide a detailed definition of that term.  To avoid   *
+ * misunderstandings, we interpret that term as broadly as copyright law   *
+ * allows.  For example, we consider an application to constitute a        *
+ * derivative work for the purpose of this license if it does any of the   *
+ * following with any software or content covered by this license          *
+ * ("Covered Software"):                                                   *
+ *                                                                         *
+ * o Integrates source code from Covered Software.                         *
+ *                                                                         *
+ * o Reads or includes copyrighted data files, such as Nmap's nmap-os-db   *
+ * or nmap-service-probes.                                                 *
+ *                                                                         *
+ * o Is designed specifically to execute Covered Software and parse the    *
+ * results (as opposed to typical shell or execution-menu apps, which will *
+ * execute anything you tell them to).                                     *
+ *                                                                         *
+ * o Includes Covered Software in a proprietary executable installer.  The *
+ * installers produced by InstallShield are an example of this.  Including *
+ * Nmap with other software in compressed or archival form does not        *
+ * trigger this provision, provided appropriate open source decompression  *
+ * or de-archiving software is widely available for no charge.  For the    *
+ * purposes of this license, an installer is considered to include Covered *
+ * Software even if it actually retrieves a copy of Covered Software from  *
+ * another source during runtime (such as by downloading it from the       *
+ * Internet).                                                              *
+ *                                                                         *
+ * o Links (statically or dynamically) to a library which does any of the  *
+ * above.                                                                  *
+ *                                                                         *
+ * o Executes a helper program, module, or script to do any of the above.  *
+ *                                                                         *
+ * This list is not exclusive, but is meant to clarify our interpretation  *
+ * of derived works with some common examples.  Other people may interpret *
+ * the plain GPL differently, so we consider this a special exception to   *
+ * the GPL that we apply to Covered Software.  Works which meet any of     *
+ * these conditions must conform to all of the terms of this license,      *
+ * particularly including the GPL Section 3 requirements of providing      *
+ * source code and allowing free redistribution of the work as a whole.    *
+ *                                                                         *
+ * As another special exception to the GPL terms, Insecure.Com LLC grants  *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two.                                  *
+ *                                                                         *
+ * Any redistribution of Covered Software, including any derived works,    *
+ * must obey and carry forward all of the terms of this license, including *
+ * obeying all GPL rules and restrictions.  For example, source code of    *
+ * the whole work must be provided and free redistribution must be         *
+ * allowed.  All GPL references to "this License", are to be treated as    *
+ * including the terms and conditions of this license text as well.        *
+ *                                                                         *
+ * Because this license imposes special exceptions to the GPL, Covered     *
+ * Work may not be combined (even as part of a larger work) with plain GPL *
+ * software.  The terms, conditions, and exceptions of this license must   *
+ * be included as well.  This license is incompatible with some other open *
+ * source licenses as well.  In some cases we can relicense portions of    *
+ * Nmap or grant special permissions to use it in other open source        *
+ * software.  Please contact fyodor@nmap.org with any such requests.       *
+ * Similarly, we don't incorporate incompatible open source software into  *
+ * Covered Software without special permission from the copyright holders. *
+ *                                                                         *
+ * If you have any questions about the licensing restrictions on using     *
+ * Nmap in other works, are happy to help.  As mentioned above, we also    *
+ * offer alternative license to integrate Nmap into proprietary            *
+ * applications and appliances.  These contracts have been sold to dozens  *
+ * of software vendors, and generally include a perpetual license as well  *
+ * as providing for priority support and updates.  They also fund the      *
+ * continued development of Nmap.  Please email sales@nmap.com for further *
+ * information.                                                            *
+ *                                                                         *
+ * If you have received a written license agreement or contract for        *
+ * Covered Software stating terms other than these, you may choose to use  *
+ * and redistribute Covered Software under those terms instead of these.   *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the Nmap      *
+ * license file for more details (it's in a COPYING file included with     *
+ * Nmap, and also available from https://svn.nmap.org/nmap/COPYING)        *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "../service_scan.h"
+#include "../NmapOps.h"
+#include "../utils.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+extern NmapOps o;
+
+#define TEST_INCR(pred,acc) \
+if ( !(pred) ) \
+{ \
+  std::cout << "Test " << #pred << " failed at " << __FILE__ << ":" << __LINE__ << std::endl; \
+  ++acc; \
+}
+
+struct Banner {
+  std::string probe;
+  std::string data;
+};
+
+/* Reads the response corpus. Each line is a probe name, a space, and a
+   C-escaped response. */
+static bool load_banners(const char *filename, std::vector<Banner> *banners) {
+  char line[4096];
+  FILE *fp;
+
+  fp = fopen(filename, "r");
+  if (fp == NULL)
+    return false;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    unsigned int len;
+    char *sp;
+    Banner b;
+
+    if (*line == '#' || *line == '\n')
+      continue;
+    line[strcspn(line, "\r\n")] = '\0';
+    sp = strchr(line, ' ');
+    if (sp == NULL)
+      continue;
+    *sp++ = '\0';
+    if (cstring_unescape(sp, &len) == NULL)
+      continue;
+    b.probe = line;
+    b.data.assign(sp, len);
+    banners->push_back(b);
+  }
+  fclose(fp);
+
+  return true;
+}
+
+/* Line numbers of all the matches of data, through the prefilter. */
+static std::vector<int> filtered_matches(ServiceProbe *probe, const std::string &data) {
+  std::vector<int> lines;
+  const struct MatchDetails *MD;
+  int n;
+
+  for (n = 0; ; n++) {
+    MD = probe->testMatch((const u8 *) data.data(), data.size(), n);
+    if (MD == NULL || MD->serviceName == NULL)
+      break;
+    lines.push_back(MD->lineno);
+  }
+
+  return lines;
+}
+
+/* Line numbers of all the matches of data, trying every regex. */
+static std::vector<int> unfiltered_matches(ServiceProbe *probe, const std::string &data) {
+  std::vector<int> lines;
+  const struct MatchDetails *MD;
+  unsigned int i;
+
+  for (i = 0; i < probe->getMatches().size(); i++) {
+    MD = probe->getMatches()[i]->testMatch((const u8 *) data.data(), data.size());
+    if (MD->serviceName != NULL)
+      lines.push_back(MD->lineno);
+  }
+
+  return lines;
+}
+
+/* Regexes that exercise the corners of literal extraction, and responses to
+   try them on. */
+static const char *tricky_matches[] = {
+  "match a m|^ab?c|",
+  "match b m|^x{0,2}yz|",
+  "match c m|a{2}b|",
+  "match d m/foo|^bar/",
+  "match e m|[]x]yz|",
+  "match f m|\\x41\\x42C|i",
+  "match g m|a{|",
+  "match h m|\\0\\x01abc|s",
+  "match i m|(?i)MiXeD|",
+  "match j m=^(?:GET|POST) /ok=",
+  "match k m|\\d+ items? left|",
+  "match l m|ab*c+d|",
+  "match m m|[[:digit:]]+[:x]q|",
+  "match n m|^\\r\\n$|",
+  "match o m/(a|b)c/",
+  "match p m/x|\\d/",
+};
+
+static const struct {
+  const char *data;
+  unsigned int len;
+} tricky_subjects[] = {
+  { "abc", 3 }, { "ac", 2 }, { "zac", 3 }, { "abbc", 4 }, { "xxyz", 4 },
+  { "yz", 2 }, { "xxxyz", 5 }, { "aab", 3 }, { "ab", 2 }, { "foo", 3 },
+  { "xbar", 4 }, { "bar", 3 }, { "]yz", 3 }, { "ABC", 3 }, { "abc", 3 },
+  { "a{", 2 }, { "\0\x01" "ABC", 5 }, { "\0\x01" "abc", 5 }, { "mixed", 5 },
+  { "GET /ok", 7 }, { "POST /ok", 8 }, { "PUT /ok", 7 },
+  { "3 items left", 12 }, { "1 item left", 11 }, { "abcd", 4 }, { "acd", 3 },
+  { "abbccd", 6 }, { "123:q", 5 }, { "12xq", 4 }, { "\r\n", 2 }, { "bc", 2 },
+  { "c", 1 }, { "", 0 },
+};
+
+int main(int argc, char *argv[])
+{
+  std::cout << "Testing service match prefilter" << std::endl;
+
+  int ret = 0;
+  unsigned int i, j;
+
+  /* Literal extraction on its own. */
+  ServiceProbe tricky;
+  std::vector<MatchLiteral> lits;
+  for (i = 0; i < sizeof(tricky_matches) / sizeof(*tricky_matches); i++)
+    tricky.addMatch(tricky_matches[i], i + 1);
+  tricky.compileMatchPrefilter();
+  const std::vector<ServiceProbeMatch *> &tm = tricky.getMatches();
+
+  TEST_INCR(tm[0]->getRequiredLiterals(&lits) && lits.size() == 1, ret);
+  TEST_INCR(lits[0].text == "a" && lits[0].anchored, ret);
+  TEST_INCR(tm[1]->getRequiredLiterals(&lits) && lits.size() == 1, ret);
+  TEST_INCR(lits[0].text == "yz" && !lits[0].anchored, ret);
+  TEST_INCR(tm[2]->getRequiredLiterals(&lits) && lits[0].text == "ab", ret);
+  TEST_INCR(tm[3]->getRequiredLiterals(&lits) && lits.size() == 2, ret);
+  TEST_INCR(lits[0].text == "foo" && !lits[0].anchored, ret);
+  TEST_INCR(lits[1].text == "bar" && lits[1].anchored, ret);
+  TEST_INCR(tm[5]->getRequiredLiterals(&lits) && lits[0].text == "abc", ret);
+  TEST_INCR(tm[6]->getRequiredLiterals(&lits) && lits[0].text == "a{", ret);
+  TEST_INCR(tm[7]->getRequiredLiterals(&lits) && lits[0].text == std::string("\0\x01" "abc", 5), ret);
+  TEST_INCR(tm[9]->getRequiredLiterals(&lits) && lits[0].text == " /ok", ret);
+  TEST_INCR(tm[14]->getRequiredLiterals(&lits) && lits[0].text == "c", ret);
+  TEST_INCR(!tm[15]->getRequiredLiterals(&lits), ret);
+  TEST_INCR(tricky.testMatch((const u8 *) "zzz", 3, 0) == NULL, ret);
+
+  for (i = 0; i < sizeof(tricky_subjects) / sizeof(*tricky_subjects); i++) {
+    std::string data(tricky_subjects[i].data, tricky_subjects[i].len);
+    TEST_INCR(filtered_matches(&tricky, data) == unfiltered_matches(&tricky, data), ret);
+  }
+
+  /* Every probe in nmap-service-probes against the recorded responses. */
+  const char *probefile = argc > 1 ? argv[1] : "nmap-service-probes";
+  const char *bannerfile = argc > 2 ? argv[2] : "tests/service_banners.txt";
+  std::vector<Banner> banners;
+  AllProbes AP;
+  std::vector<ServiceProbe *> probes;
+  unsigned int matched = 0;
+
+  TEST_INCR(load_banners(bannerfile, &banners), ret);
+  TEST_INCR(!banners.empty(), ret);
+  parse_nmap_service_probe_file(&AP, (char *) probefile);
+  probes = AP.probes;
+  probes.push_back(AP.nullProbe);
+
+  for (i = 0; i < banners.size(); i++) {
+    for (j = 0; j < probes.size(); j++) {
+      std::vector<int> filtered = filtered_matches(probes[j], banners[i].data);
+      std::vector<int> unfiltered = unfiltered_matches(probes[j], banners[i].data);
+      TEST_INCR(filtered == unfiltered, ret);
+      matched += filtered.size();
+    }
+  }
+  /* Make sure the corpus actually exercises the matches. */
+  TEST_INCR(matched >= banners.size(), ret);
+
+  /* A cached copy of the probes has to behave just like the parsed one. */
+  char cachefile[] = "/tmp/nmap-service-probes.cache.XXXXXX";
+  int fd = mkstemp(cachefile);
+  AllProbes cached;
+  std::vector<ServiceProbe *> cprobes;
+
+  TEST_INCR(fd != -1, ret);
+  if (fd != -1)
+    close(fd);
+  TEST_INCR(AP.saveToCache(cachefile, probefile), ret);
+  TEST_INCR(cached.loadFromCache(cachefile, probefile), ret);
+  unlink(cachefile);
+  cprobes = cached.probes;
+  cprobes.push_back(cached.nullProbe);
+  TEST_INCR(cprobes.size() == probes.size(), ret);
+  for (j = 0; j < probes.size() && j < cprobes.size(); j++) {
+    TEST_INCR(cprobes[j] != NULL && strcmp(cprobes[j]->getName(), probes[j]->getName()) == 0, ret);
+    if (cprobes[j] == NULL)
+      continue;
+    for (i = 0; i <= MAXFALLBACKS && probes[j]->fallbacks[i] != NULL; i++)
+      TEST_INCR(cprobes[j]->fallbacks[i] != NULL && strcmp(cprobes[j]->fallbacks[i]->getName(), probes[j]->fallbacks[i]->getName()) == 0, ret);
+    for (i = 0; i < banners.size(); i++)
+      TEST_INCR(filtered_matches(cprobes[j], banners[i].data) == filtered_matches(probes[j], banners[i].data), ret);
+  }
+
+  if(ret) std::cout << "Testing service match prefilter finished with errors" << std::endl;
+  else std::cout << "Testing service match prefilter finished without errors" << std::endl;
+
+  return ret; // 0 means ok
+}
@@ -178,6 +178,10 @@ given to these functions should be ASCII or UTF-8.
 
 All writing is done with log_write(LOG_XML), so if LOG_XML hasn't been
 opened, calling these functions has no effect.
+
+Every element below the root holds log_lock() from its start tag to its end
+tag, so that elements written by different threads don't nest inside each
+other.
 */
 
 #include "nmap.h"
@@ -363,6 +367,8 @@ int xml_close_pi() {
    xml_close_start_tag or xml_close_empty_tag. Usually the tag is closed
    after writing some attributes. */
 int xml_open_start_tag(const char *name) {
+  if (xml.root_written)
+    log_lock();
   assert(!xml.tag_open);
   log_write(LOG_XML, "<%s", name);
   xml.element_stack.push_back(name);
@@ -388,6 +394,8 @@ int xml_close_empty_tag() {
   xml.element_stack.pop_back();
   log_write(LOG_XML, "/>");
   xml.tag_open = false;
+  if (!xml.element_stack.empty())
+    log_unlock();
 
   return 0;
 }
@@ -411,6 +419,8 @@ int xml_end_tag() {
   xml.element_stack.pop_back();
 
   log_write(LOG_XML, "</%s>", name);
+  if (!xml.element_stack.empty())
+    log_unlock();
 
   return 0;
 }